@@ -0,0 +1,606 @@
+/*
+ *  aead.c
+ *  libsimplepgp
+ *
+ *  AEAD encrypted data, with its chunks decrypted on several threads.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "aead.h"
+#include "crypto.h"
+#include "secmem.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Header octets, then the chunk index for AEAD packets, then the total
+// plaintext length for the final tag
+#define SPGP_AEAD_MAX_AD (5 + 8 + 8)
+
+// One decrypted chunk waiting to be written out
+typedef struct {
+	uint8_t *data;
+  size_t len;
+  uint64_t ready;          // index + 1 of the chunk in |data|, once checked
+} spgp_aead_slot_t;
+
+// Chunks are handed out in order.  Chunk k goes to slot k % slotCount, so
+// a chunk is only handed out once the one that last used its slot has been
+// written.
+typedef struct {
+	const spgp_aead_params_t *params;
+  const spgp_aead_segment_t *segs;
+  uint32_t segCount;
+  uint8_t key[32];         // message key
+  size_t keylen;
+  uint8_t nonce[SPGP_CRYPTO_MAX_NONCE]; // before the chunk index goes in
+  uint8_t nonceLen;
+  uint8_t header[5];       // packet tag, version, algorithms, chunk size
+  size_t chunkSize;
+  uint64_t chunks;
+  size_t dataLen;          // chunks and their tags, without the final tag
+  size_t plainLen;
+  size_t slotSize;
+  spgp_aead_slot_t *slots;
+  uint32_t slotCount;
+  uint64_t next;           // next chunk to hand out
+  uint64_t written;        // chunks written out
+  uint32_t err;            // first exception raised on any thread
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+} spgp_aead_pool_t;
+
+// What each thread, including the decoding one, decrypts with
+typedef struct {
+	spgp_aead_pool_t *pool;
+  spgp_crypto_aead_t *aead;
+  uint8_t *scratch;        // a chunk split by length headers, put together
+  pthread_t tid;
+  uint8_t started;
+} spgp_aead_worker_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static uint64_t spgp_aead_chunks(const spgp_aead_params_t *params,
+                                 size_t cipherLen, size_t *plainLen);
+
+static void spgp_aead_setup(spgp_aead_pool_t *pool,
+                            const spgp_aead_params_t *params,
+                            const uint8_t *key, size_t keylen);
+
+static void spgp_aead_run(spgp_aead_pool_t *pool,
+                          spgp_aead_worker_t *workers, uint32_t threads,
+                          spgp_aead_emit_t emit, void *ctx);
+
+static void *spgp_aead_worker(void *arg);
+
+static uint8_t spgp_aead_claim(spgp_aead_pool_t *pool, uint64_t *k);
+
+static void spgp_aead_chunk(spgp_aead_worker_t *w, uint64_t k);
+
+static void spgp_aead_ready(spgp_aead_pool_t *pool, uint64_t k);
+
+static void spgp_aead_fail(spgp_aead_pool_t *pool, uint32_t err);
+
+static void spgp_aead_final_tag(spgp_aead_pool_t *pool,
+                                spgp_aead_worker_t *w);
+
+static const uint8_t *spgp_aead_gather(const spgp_aead_pool_t *pool,
+                                       size_t offset, size_t len,
+                                       uint8_t *scratch);
+
+static void spgp_aead_nonce(const spgp_aead_pool_t *pool, uint64_t k,
+                            uint8_t *nonce);
+
+static size_t spgp_aead_ad(const spgp_aead_pool_t *pool, uint64_t k,
+                           const uint64_t *total, uint8_t *ad);
+
+static void spgp_aead_cleanup(spgp_aead_pool_t *pool,
+                              spgp_aead_worker_t *workers, uint32_t threads);
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+/**
+ * Read the header of a version 2 SEIPD packet or an AEAD packet.
+ *
+ * @param msg Message holding the packet
+ * @param idx Index of the version byte.  Set to the first byte of the
+ *            first chunk.
+ * @param length Length of |msg|
+ * @param type PKT_TYPE_SYM_ENC_INT_DATA or PKT_TYPE_AEAD_DATA
+ * @param params Set to the header's fields
+ * @return 0.  Raises FORMAT_UNSUPPORTED for other versions, modes and
+ *         chunk sizes.
+ */
+uint8_t spgp_aead_read_params(uint8_t *msg, size_t *idx, size_t length,
+                              uint8_t type, spgp_aead_params_t *params) {
+	uint8_t ivLen;
+
+	if (NULL == msg || NULL == idx || NULL == params || *idx >= length)
+  	RAISE(INVALID_ARGS);
+
+	memset(params, 0, sizeof(*params));
+  params->type = type;
+  params->version = msg[*idx];
+  if ((type == PKT_TYPE_SYM_ENC_INT_DATA && params->version != 2) ||
+      (type == PKT_TYPE_AEAD_DATA && params->version != 1))
+  	RAISE(FORMAT_UNSUPPORTED);
+  SAFE_IDX_INCREMENT(*idx, length);
+  params->symAlgo = msg[*idx];
+  SAFE_IDX_INCREMENT(*idx, length);
+  params->aeadAlgo = msg[*idx];
+  SAFE_IDX_INCREMENT(*idx, length);
+  params->chunkBits = msg[*idx];
+  SAFE_IDX_INCREMENT(*idx, length);
+  Serial.printf("AEAD v%u: cipher %u, mode %u, chunk size octet %u\n",
+  	params->version, params->symAlgo, params->aeadAlgo, params->chunkBits);
+
+	if (params->chunkBits > SPGP_AEAD_MAX_CHUNK_BITS)
+  	RAISE(FORMAT_UNSUPPORTED);
+  if (type == PKT_TYPE_SYM_ENC_INT_DATA) ivLen = SPGP_AEAD_SALT_LEN;
+  else ivLen = spgp_crypto_aead_nonce_length(params->aeadAlgo);
+  if (0 == ivLen) RAISE(FORMAT_UNSUPPORTED);
+
+	// The final tag at least follows
+	if (length - *idx <= ivLen) RAISE(BUFFER_OVERFLOW);
+  memcpy(params->iv, msg + *idx, ivLen);
+  *idx += ivLen;
+  return 0;
+}
+
+/**
+ * Get the plaintext length of AEAD encrypted data.
+ *
+ * @param cipherLen Bytes of chunks and tags, including the final tag
+ * @return The length.  Raises INCOMPLETE_PACKET if the chunks and tags
+ *         can't add up to |cipherLen|.
+ */
+size_t spgp_aead_plain_length(const spgp_aead_params_t *params,
+                              size_t cipherLen) {
+	size_t plainLen;
+
+	spgp_aead_chunks(params, cipherLen, &plainLen);
+  return plainLen;
+}
+
+/**
+ * Decrypt AEAD encrypted data, handing each chunk to |emit| in order once
+ * its tag has been checked.
+ *
+ * Chunks are decrypted on |threads| threads, this one included, each
+ * staying at most SPGP_AEAD_SLOTS_PER_THREAD chunks ahead of the writing
+ * out, so memory use doesn't grow with the message.  The final tag, which
+ * covers the number of chunks, is checked after the last chunk.  Until
+ * then a caller writing chunks somewhere permanent can't tell a message
+ * truncated at a chunk boundary from a whole one, and must discard the
+ * output if this raises.
+ *
+ * @param params Packet header, from spgp_aead_read_params()
+ * @param key Session key
+ * @param keylen Length of |key|
+ * @param segs Runs of ciphertext, in order, from the first chunk to the
+ *             final tag
+ * @param segCount Number of runs
+ * @param threads Threads to decrypt on.  0 for one per CPU.
+ * @param emit Called on this thread with each chunk
+ * @param ctx Passed to |emit|
+ */
+void spgp_aead_decrypt(const spgp_aead_params_t *params,
+                       const uint8_t *key, size_t keylen,
+                       const spgp_aead_segment_t *segs, uint32_t segCount,
+                       uint32_t threads, spgp_aead_emit_t emit, void *ctx) {
+	spgp_aead_pool_t pool;
+  spgp_aead_worker_t workers[SPGP_AEAD_MAX_THREADS];
+  jmp_buf saved;
+  long cpus;
+
+	if (NULL == params || NULL == key || NULL == segs || 0 == segCount ||
+      NULL == emit)
+  	RAISE(INVALID_ARGS);
+
+	memset(&pool, 0, sizeof(pool));
+  memset(workers, 0, sizeof(workers));
+  pool.segs = segs;
+  pool.segCount = segCount;
+  pool.chunkSize = (size_t)1 << (params->chunkBits + 6);
+  pool.chunks = spgp_aead_chunks(params, segs[segCount - 1].offset +
+                                 segs[segCount - 1].len, &pool.plainLen);
+  pool.dataLen = segs[segCount - 1].offset + segs[segCount - 1].len -
+  	SPGP_CRYPTO_AEAD_TAG;
+  // No bigger than the whole message
+  pool.slotSize = pool.chunkSize;
+  if (pool.slotSize > pool.plainLen) pool.slotSize = pool.plainLen;
+
+	if (0 == threads) {
+  	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  if (threads > SPGP_AEAD_MAX_THREADS) threads = SPGP_AEAD_MAX_THREADS;
+  if (threads > pool.chunks) threads = pool.chunks ? pool.chunks : 1;
+  Serial.printf("%llu chunks of %lu bytes on %u threads\n",
+  	(unsigned long long)pool.chunks, (unsigned long)pool.chunkSize, threads);
+
+	if (pthread_mutex_init(&pool.mtx, NULL)) RAISE(GENERIC_ERROR);
+  if (pthread_cond_init(&pool.cond, NULL)) {
+  	pthread_mutex_destroy(&pool.mtx);
+    RAISE(GENERIC_ERROR);
+  }
+
+	// Threads catch their own exceptions, which replaces the caller's
+  // handler.  Everything is cleaned up before raising again with the
+  // caller's handler back.
+  memcpy(saved, exception, sizeof(jmp_buf));
+  if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+  	spgp_aead_fail(&pool, _spgp_err);
+  }
+  else {
+  	spgp_aead_setup(&pool, params, key, keylen);
+    spgp_aead_run(&pool, workers, threads, emit, ctx);
+  }
+  spgp_aead_cleanup(&pool, workers, threads);
+  memcpy(exception, saved, sizeof(jmp_buf));
+  if (pool.err) RAISE(pool.err);
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Count the chunks in |cipherLen| bytes of AEAD encrypted data.  Every
+ * chunk is full but the last, which holds at least one byte.
+ */
+static uint64_t spgp_aead_chunks(const spgp_aead_params_t *params,
+                                 size_t cipherLen, size_t *plainLen) {
+	size_t full = ((size_t)1 << (params->chunkBits + 6)) + SPGP_CRYPTO_AEAD_TAG;
+  size_t data;
+  uint64_t chunks;
+
+	if (cipherLen < SPGP_CRYPTO_AEAD_TAG) RAISE(INCOMPLETE_PACKET);
+  data = cipherLen - SPGP_CRYPTO_AEAD_TAG;
+  chunks = data / full + (data % full != 0);
+  if (chunks && data - (chunks - 1) * full <= SPGP_CRYPTO_AEAD_TAG)
+  	RAISE(INCOMPLETE_PACKET);
+  *plainLen = data - chunks * SPGP_CRYPTO_AEAD_TAG;
+  return chunks;
+}
+
+/**
+ * Work out the message key and starting nonce.
+ *
+ * AEAD packets use the session key and the IV from their header.  SEIPD
+ * v2 derives both from the session key, salt and header with HKDF (RFC
+ * 9580 5.13.2), the nonce being short of the 8 byte chunk index.
+ */
+static void spgp_aead_setup(spgp_aead_pool_t *pool,
+                            const spgp_aead_params_t *params,
+                            const uint8_t *key, size_t keylen) {
+	uint8_t okm[sizeof(pool->key) + SPGP_CRYPTO_MAX_NONCE];
+
+	pool->params = params;
+  pool->nonceLen = spgp_crypto_aead_nonce_length(params->aeadAlgo);
+  if (0 == pool->nonceLen ||
+      spgp_iv_length_for_symmetric_algo(params->symAlgo) != 16)
+  	RAISE(FORMAT_UNSUPPORTED);
+  // A session key for some other cipher
+  if (keylen != spgp_key_length_for_symmetric_algo(params->symAlgo))
+  	RAISE(DECRYPT_FAILED);
+
+	pool->header[0] = 0xC0 | params->type;
+  pool->header[1] = params->version;
+  pool->header[2] = params->symAlgo;
+  pool->header[3] = params->aeadAlgo;
+  pool->header[4] = params->chunkBits;
+  pool->keylen = keylen;
+
+	if (params->type == PKT_TYPE_AEAD_DATA) {
+  	memcpy(pool->key, key, keylen);
+    memcpy(pool->nonce, params->iv, pool->nonceLen);
+    return;
+  }
+  spgp_crypto_hkdf(HASH_ALGO_SHA256, key, keylen,
+                   params->iv, SPGP_AEAD_SALT_LEN,
+                   pool->header, sizeof(pool->header),
+                   okm, keylen + pool->nonceLen - 8);
+  memcpy(pool->key, okm, keylen);
+  memcpy(pool->nonce, okm + keylen, pool->nonceLen - 8);
+  spgp_secure_wipe(okm, sizeof(okm));
+}
+
+/**
+ * Start the threads, write out every chunk as it is ready and check the
+ * final tag.
+ */
+static void spgp_aead_run(spgp_aead_pool_t *pool,
+                          spgp_aead_worker_t *workers, uint32_t threads,
+                          spgp_aead_emit_t emit, void *ctx) {
+	spgp_aead_slot_t *slot;
+  uint32_t i, err;
+  uint64_t k;
+
+	pool->slotCount = threads * SPGP_AEAD_SLOTS_PER_THREAD;
+  if (pool->slotCount > pool->chunks) pool->slotCount = pool->chunks;
+  if (0 == pool->slotCount) pool->slotCount = 1;
+  pool->slots = malloc(sizeof(*pool->slots) * pool->slotCount);
+  if (NULL == pool->slots) RAISE(OUT_OF_MEMORY);
+  memset(pool->slots, 0, sizeof(*pool->slots) * pool->slotCount);
+  for (i = 0; i < pool->slotCount; i++) {
+  	pool->slots[i].data = malloc(pool->slotSize ? pool->slotSize : 1);
+    if (NULL == pool->slots[i].data) RAISE(OUT_OF_MEMORY);
+  }
+
+	// Everything that might raise happens here, before threads start
+	for (i = 0; i < threads; i++) {
+  	workers[i].pool = pool;
+    workers[i].aead = spgp_crypto_aead_open(pool->params->symAlgo,
+                                            pool->params->aeadAlgo,
+                                            pool->key, pool->keylen);
+    if (pool->segCount > 1) {
+    	workers[i].scratch = malloc(pool->slotSize + SPGP_CRYPTO_AEAD_TAG);
+      if (NULL == workers[i].scratch) RAISE(OUT_OF_MEMORY);
+    }
+  }
+  // Fewer threads than asked for is fine, since this one keeps going
+  for (i = 1; i < threads; i++) {
+  	if (pthread_create(&workers[i].tid, NULL, spgp_aead_worker,
+                       &workers[i]) == 0)
+    	workers[i].started = 1;
+  }
+
+	// This thread decrypts too while it waits for the next chunk to write
+	while (pool->written < pool->chunks) {
+  	slot = &pool->slots[pool->written % pool->slotCount];
+    pthread_mutex_lock(&pool->mtx);
+    while (!pool->err && slot->ready != pool->written + 1) {
+    	if (pool->next < pool->chunks &&
+          pool->next - pool->written < pool->slotCount) {
+      	k = pool->next++;
+        pthread_mutex_unlock(&pool->mtx);
+        spgp_aead_chunk(&workers[0], k);
+        spgp_aead_ready(pool, k);
+        pthread_mutex_lock(&pool->mtx);
+        continue;
+      }
+      pthread_cond_wait(&pool->cond, &pool->mtx);
+    }
+    err = pool->err;
+    pthread_mutex_unlock(&pool->mtx);
+    if (err) RAISE(err);
+
+		emit(ctx, slot->data, slot->len);
+    pthread_mutex_lock(&pool->mtx);
+    pool->written++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mtx);
+  }
+
+	spgp_aead_final_tag(pool, &workers[0]);
+}
+
+/**
+ * Decrypt chunks until there are none left, catching exceptions on this
+ * thread.
+ */
+static void *spgp_aead_worker(void *arg) {
+	spgp_aead_worker_t *w = arg;
+  uint64_t k;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    spgp_aead_fail(w->pool, _spgp_err);
+    return NULL;
+  }
+  while (spgp_aead_claim(w->pool, &k)) {
+  	spgp_aead_chunk(w, k);
+    spgp_aead_ready(w->pool, k);
+  }
+  return NULL;
+}
+
+/**
+ * Take the next chunk, waiting for its slot to be written out first.
+ *
+ * @return 1 with |k| set, or 0 if there are none left or a thread failed
+ */
+static uint8_t spgp_aead_claim(spgp_aead_pool_t *pool, uint64_t *k) {
+	uint8_t got = 0;
+
+	pthread_mutex_lock(&pool->mtx);
+  while (!pool->err && pool->next < pool->chunks &&
+         pool->next - pool->written >= pool->slotCount)
+  	pthread_cond_wait(&pool->cond, &pool->mtx);
+  if (!pool->err && pool->next < pool->chunks) {
+  	*k = pool->next++;
+    got = 1;
+  }
+  pthread_mutex_unlock(&pool->mtx);
+  return got;
+}
+
+/**
+ * Decrypt chunk |k| into its slot.  Raises DECRYPT_FAILED if its tag
+ * doesn't match.
+ */
+static void spgp_aead_chunk(spgp_aead_worker_t *w, uint64_t k) {
+	spgp_aead_pool_t *pool = w->pool;
+  spgp_aead_slot_t *slot = &pool->slots[k % pool->slotCount];
+  uint8_t nonce[SPGP_CRYPTO_MAX_NONCE], ad[SPGP_AEAD_MAX_AD];
+  const uint8_t *in;
+  size_t offset = k * (pool->chunkSize + SPGP_CRYPTO_AEAD_TAG);
+  size_t len = pool->chunkSize;
+  size_t adLen;
+
+	if (k == pool->chunks - 1) len = pool->dataLen - offset - SPGP_CRYPTO_AEAD_TAG;
+  in = spgp_aead_gather(pool, offset, len + SPGP_CRYPTO_AEAD_TAG, w->scratch);
+  spgp_aead_nonce(pool, k, nonce);
+  adLen = spgp_aead_ad(pool, k, NULL, ad);
+  spgp_crypto_aead_decrypt(w->aead, nonce, ad, adLen, slot->data, in, len,
+                           in + len);
+  slot->len = len;
+}
+
+static void spgp_aead_ready(spgp_aead_pool_t *pool, uint64_t k) {
+	pthread_mutex_lock(&pool->mtx);
+  pool->slots[k % pool->slotCount].ready = k + 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mtx);
+}
+
+/**
+ * Record the first failure and wake every thread, so they all stop.
+ */
+static void spgp_aead_fail(spgp_aead_pool_t *pool, uint32_t err) {
+	pthread_mutex_lock(&pool->mtx);
+  if (!pool->err) pool->err = err ? err : GENERIC_ERROR;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mtx);
+}
+
+/**
+ * Check the final tag, over no data, which authenticates the number of
+ * chunks and the plaintext length.
+ */
+static void spgp_aead_final_tag(spgp_aead_pool_t *pool,
+                                spgp_aead_worker_t *w) {
+	uint8_t nonce[SPGP_CRYPTO_MAX_NONCE], ad[SPGP_AEAD_MAX_AD];
+  uint8_t scratch[SPGP_CRYPTO_AEAD_TAG];
+  const uint8_t *tag;
+  uint64_t total = pool->plainLen;
+  size_t adLen;
+
+	tag = spgp_aead_gather(pool, pool->dataLen, SPGP_CRYPTO_AEAD_TAG, scratch);
+  spgp_aead_nonce(pool, pool->chunks, nonce);
+  adLen = spgp_aead_ad(pool, pool->chunks, &total, ad);
+  spgp_crypto_aead_decrypt(w->aead, nonce, ad, adLen, NULL, NULL, 0, tag);
+  Serial.printf("Final tag good, %llu bytes\n", (unsigned long long)total);
+}
+
+/**
+ * Find |len| bytes of ciphertext from |offset|.  They are copied to
+ * |scratch| only if a length header splits them.
+ */
+static const uint8_t *spgp_aead_gather(const spgp_aead_pool_t *pool,
+                                       size_t offset, size_t len,
+                                       uint8_t *scratch) {
+	const spgp_aead_segment_t *seg;
+  uint32_t lo = 0, hi = pool->segCount - 1, mid;
+  size_t n, done;
+
+	// Last segment starting at or before |offset|
+	while (lo < hi) {
+  	mid = lo + (hi - lo + 1) / 2;
+    if (pool->segs[mid].offset <= offset) lo = mid;
+    else hi = mid - 1;
+  }
+  seg = &pool->segs[lo];
+  if (offset - seg->offset + len <= seg->len)
+  	return seg->data + (offset - seg->offset);
+
+	for (done = 0; done < len; seg++) {
+  	n = seg->len - (offset + done - seg->offset);
+    if (n > len - done) n = len - done;
+    memcpy(scratch + done, seg->data + (offset + done - seg->offset), n);
+    done += n;
+  }
+  return scratch;
+}
+
+/**
+ * Nonce for chunk |k|: the starting nonce with the index, big-endian,
+ * XORed into its last 8 bytes.  For SEIPD v2 those bytes start as 0.
+ */
+static void spgp_aead_nonce(const spgp_aead_pool_t *pool, uint64_t k,
+                            uint8_t *nonce) {
+	uint32_t i;
+
+	memcpy(nonce, pool->nonce, pool->nonceLen);
+  for (i = 0; i < 8; i++)
+  	nonce[pool->nonceLen - 1 - i] ^= (uint8_t)(k >> (8 * i));
+}
+
+/**
+ * Associated data for chunk |k|, or for the final tag if |total| is set.
+ * AEAD packets add the chunk index to the header; SEIPD v2 doesn't.
+ *
+ * @return Its length
+ */
+static size_t spgp_aead_ad(const spgp_aead_pool_t *pool, uint64_t k,
+                           const uint64_t *total, uint8_t *ad) {
+	uint8_t *p = ad + sizeof(pool->header);
+
+	memcpy(ad, pool->header, sizeof(pool->header));
+  if (pool->params->type == PKT_TYPE_AEAD_DATA) p = spgp_put_be64(p, k);
+  if (total) p = spgp_put_be64(p, *total);
+  return p - ad;
+}
+
+/**
+ * Stop and wait for the threads, then free everything.  Decrypted chunks
+ * are wiped.
+ */
+static void spgp_aead_cleanup(spgp_aead_pool_t *pool,
+                              spgp_aead_worker_t *workers, uint32_t threads) {
+	uint32_t i;
+
+	if (pool->err) spgp_aead_fail(pool, pool->err);
+  for (i = 1; i < threads; i++)
+  	if (workers[i].started) pthread_join(workers[i].tid, NULL);
+
+	for (i = 0; i < threads; i++) {
+  	spgp_crypto_aead_close(workers[i].aead);
+    free(workers[i].scratch);
+  }
+  if (pool->slots) {
+  	for (i = 0; i < pool->slotCount; i++) {
+    	if (NULL == pool->slots[i].data) continue;
+      memset(pool->slots[i].data, 0, pool->slotSize);
+      free(pool->slots[i].data);
+    }
+    free(pool->slots);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mtx);
+  spgp_secure_wipe(pool->key, sizeof(pool->key));
+}
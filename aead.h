@@ -0,0 +1,70 @@
+/*
+ *  aead.h
+ *  libsimplepgp
+ *
+ *  AEAD encrypted data, with its chunks decrypted on several threads.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _AEAD_H
+
+#include "packet_private.h"
+
+#define SPGP_AEAD_MAX_THREADS      64
+// Chunks decrypted ahead of the one being written out, per thread.  This
+// and the chunk size bound the memory a decode uses.
+#define SPGP_AEAD_SLOTS_PER_THREAD 2
+// Largest chunk size octet, for 4 MiB chunks.  RFC 9580 allows no more.
+#define SPGP_AEAD_MAX_CHUNK_BITS   16
+// SEIPD v2 salt, the longest of the starting values
+#define SPGP_AEAD_SALT_LEN         32
+
+/* Header of a version 2 SEIPD packet (RFC 9580 5.13.2) or an AEAD
+   encrypted data packet (LibrePGP 5.16) */
+typedef struct spgp_aead_params_struct {
+	uint8_t type;          // PKT_TYPE_SYM_ENC_INT_DATA or PKT_TYPE_AEAD_DATA
+  uint8_t version;       // 2 or 1
+  uint8_t symAlgo;
+  uint8_t aeadAlgo;
+  uint8_t chunkBits;     // chunks are 2^(chunkBits + 6) bytes
+  uint8_t iv[SPGP_AEAD_SALT_LEN]; // salt for SEIPD, starting IV otherwise
+} spgp_aead_params_t;
+
+/* One run of ciphertext between partial length headers */
+typedef struct spgp_aead_segment_struct {
+	const uint8_t *data;
+  size_t offset;         // of its first byte, counting from the first chunk
+  size_t len;
+} spgp_aead_segment_t;
+
+/* Called on the decoding thread with each chunk once it is authenticated,
+   in order.  May raise. */
+typedef void (*spgp_aead_emit_t)(void *ctx, const uint8_t *data, size_t len);
+
+uint8_t spgp_aead_read_params(uint8_t *msg, size_t *idx, size_t length,
+                              uint8_t type, spgp_aead_params_t *params);
+
+size_t spgp_aead_plain_length(const spgp_aead_params_t *params,
+                              size_t cipherLen);
+
+void spgp_aead_decrypt(const spgp_aead_params_t *params,
+                       const uint8_t *key, size_t keylen,
+                       const spgp_aead_segment_t *segs, uint32_t segCount,
+                       uint32_t threads, spgp_aead_emit_t emit, void *ctx);
+
+#define _AEAD_H
+#endif
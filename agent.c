@@ -0,0 +1,489 @@
+/*
+ *  agent.c
+ *  libsimplepgp
+ *
+ *  Key agent protocol: the client, for session keys the keychain can't
+ *  open, and the request parser spgp-agent answers clients with.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "agent.h"
+#include "mpi.h"
+#include "secmem.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// How long a message waits on the agent before it fails to decrypt
+#define SPGP_AGENT_TIMEOUT_SEC 10
+
+// Recipients asked for in one exchange
+#define SPGP_AGENT_MAX_BATCH 64
+
+// Longest session key, AES-256
+#define SPGP_AGENT_MAX_KEY 32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// One connection per process, shared by its threads one exchange at a time
+static pthread_mutex_t agent_mtx = PTHREAD_MUTEX_INITIALIZER;
+static char *agent_path;
+static int agent_fd = -1;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static int spgp_agent_open(const char *path);
+
+static uint8_t spgp_agent_exchange(spgp_session_pkt_t **sessions,
+                                   uint32_t count, uint32_t *decrypted);
+
+static size_t spgp_agent_request_length(spgp_session_pkt_t *session);
+
+static uint8_t spgp_agent_write(int fd, const uint8_t *buf, size_t len);
+
+static uint8_t spgp_agent_read(int fd, uint8_t *buf, size_t len);
+
+static uint8_t spgp_agent_answer_request(const uint8_t *frame, uint32_t len,
+                                         spgp_agent_replies_t *out);
+
+static uint8_t spgp_agent_request_mpi(const uint8_t **p, const uint8_t *end,
+                                      spgp_mpi_t *mpi);
+
+static uint16_t spgp_agent_unlock(spgp_session_pkt_t *session);
+
+static uint8_t *spgp_agent_reserve(spgp_agent_replies_t *out, size_t len);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_agent_connect(const char *path) {
+	struct sockaddr_un addr;
+	char *copy;
+  int fd;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == path || strlen(path) >= sizeof(addr.sun_path))
+  	RAISE(INVALID_ARGS);
+
+	fd = spgp_agent_open(path);
+  if (fd < 0) RAISE(IO_ERROR);
+  copy = strdup(path);
+  if (NULL == copy) {
+  	close(fd);
+    RAISE(OUT_OF_MEMORY);
+  }
+
+	pthread_mutex_lock(&agent_mtx);
+  if (agent_fd >= 0) close(agent_fd);
+  free(agent_path);
+  agent_fd = fd;
+  agent_path = copy;
+  pthread_mutex_unlock(&agent_mtx);
+  return 0;
+}
+
+void spgp_agent_disconnect(void) {
+	pthread_mutex_lock(&agent_mtx);
+  if (agent_fd >= 0) close(agent_fd);
+  agent_fd = -1;
+  free(agent_path);
+  agent_path = NULL;
+  pthread_mutex_unlock(&agent_mtx);
+}
+
+/**
+ * Ask the agent for every session key in |chain| that isn't decrypted yet.
+ *
+ * All of the requests are written at once, and the replies read after, so
+ * a message for several recipients costs one round trip.  A connection
+ * that failed is opened again for the next message.
+ *
+ * Nothing is raised, so callers can free what they hold and fail the
+ * message as having no session key.
+ *
+ * @param chain Any packet of the chain holding the session packets
+ * @return Number of session keys decrypted, 0 if the agent can't be reached
+ */
+uint32_t spgp_agent_decrypt_sessions(spgp_packet_t *chain) {
+	spgp_session_pkt_t *sessions[SPGP_AGENT_MAX_BATCH];
+  spgp_session_pkt_t *session;
+  spgp_packet_t *cur;
+  uint32_t count = 0;
+  uint32_t decrypted = 0;
+
+	if (NULL == chain) return 0;
+  while (chain->prev) chain = chain->prev;
+
+	for (cur = chain; cur && count < SPGP_AGENT_MAX_BATCH; cur = cur->next) {
+  	if (NULL == cur->header || cur->header->type != PKT_TYPE_SESSION)
+    	continue;
+    session = cur->c.session;
+    if (NULL == session || session->key || NULL == session->mpi1) continue;
+    if (spgp_session_mpi_count(session->algo) > 1 && NULL == session->mpi2)
+    	continue;
+    // The agent unwraps frames with the algorithm in them, which version 6
+    // sessions leave out
+    if (session->version == 6) continue;
+    if (spgp_agent_request_length(session) > SPGP_AGENT_MAX_FRAME) continue;
+    sessions[count++] = session;
+  }
+  if (0 == count) return 0;
+
+	pthread_mutex_lock(&agent_mtx);
+  if (NULL == agent_path) {
+  	pthread_mutex_unlock(&agent_mtx);
+    return 0;
+  }
+  if (agent_fd < 0) agent_fd = spgp_agent_open(agent_path);
+  if (agent_fd < 0 || spgp_agent_exchange(sessions, count, &decrypted)) {
+  	// Replies can't be matched up after a short read, so start over
+  	Serial.printf("Key agent exchange failed\n");
+  	if (agent_fd >= 0) close(agent_fd);
+    agent_fd = -1;
+  }
+  pthread_mutex_unlock(&agent_mtx);
+
+  Serial.printf("Agent decrypted %u of %u session keys\n", decrypted, count);
+  return decrypted;
+}
+
+/**
+ * Answer every whole request at the start of |in|, for spgp-agent.
+ *
+ * A request that can't be parsed gets an error reply.  A frame length out
+ * of range can't be skipped, so the client should then be dropped.
+ *
+ * @param in Bytes read from a client
+ * @param len Length of |in|
+ * @param used Set to the length of the requests answered.  What follows is
+ *             a request still being sent.
+ * @param out Replies are added here
+ * @param requests Incremented for each request answered
+ * @return 0 for success, -1 for a bad frame length or if the replies can't
+ *         be held
+ */
+uint8_t spgp_agent_answer(const uint8_t *in, size_t len, size_t *used,
+                          spgp_agent_replies_t *out, unsigned long *requests) {
+	size_t off = 0;
+  uint32_t frame;
+  uint8_t err = 0;
+
+	while (len - off >= 4) {
+  	frame = spgp_get_be32(in + off);
+    if (frame < SPGP_AGENT_REQUEST_LEN - 4 ||
+        frame > SPGP_AGENT_MAX_FRAME - 4) {
+    	err = -1;
+      break;
+    }
+    if (len - off - 4 < frame) break;
+    if (spgp_agent_answer_request(in + off + 4, frame, out) != 0) {
+    	err = -1;
+      break;
+    }
+    (*requests)++;
+    off += 4 + frame;
+  }
+  *used = off;
+  return err;
+}
+
+/**
+ * Drop the first |len| bytes of |out|, once they are written.
+ */
+void spgp_agent_replies_sent(spgp_agent_replies_t *out, size_t len) {
+	memmove(out->data, out->data + len, out->len - len);
+  spgp_secure_wipe(out->data + out->len - len, len);
+  out->len -= len;
+}
+
+void spgp_agent_replies_free(spgp_agent_replies_t *out) {
+	spgp_secure_free(out->data, out->cap);
+  out->data = NULL;
+  out->len = out->cap = 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static int spgp_agent_open(const char *path) {
+	struct sockaddr_un addr;
+  struct timeval tv;
+  int fd;
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  tv.tv_sec = SPGP_AGENT_TIMEOUT_SEC;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+  	Serial.printf("Can't reach agent at %s\n", path);
+  	close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Send one request per session and read the replies.  Called with the
+ * agent locked.
+ *
+ * @return 0 for success, -1 if the connection failed
+ */
+static uint8_t spgp_agent_exchange(spgp_session_pkt_t **sessions,
+                                   uint32_t count, uint32_t *decrypted) {
+	uint8_t reply[SPGP_AGENT_REPLY_LEN + 1 + SPGP_AGENT_MAX_KEY];
+  spgp_session_pkt_t *session;
+  uint8_t *req, *p;
+  size_t len = 0;
+  uint32_t i, frame, tag, keylen;
+  uint16_t status;
+  uint8_t err = 0;
+
+	for (i = 0; i < count; i++) len += spgp_agent_request_length(sessions[i]);
+  req = malloc(len);
+  if (NULL == req) return -1;
+
+	// Request tags are the sessions' places in this batch
+	for (p = req, i = 0; i < count; i++) {
+  	session = sessions[i];
+  	p = spgp_put_be32(p, spgp_agent_request_length(session) - 4);
+    p = spgp_put_be32(p, i);
+    *p++ = SPGP_AGENT_OP_DECRYPT_SESSION;
+    memcpy(p, session->keyid, 8);
+    p += 8;
+    *p++ = session->algo;
+    memcpy(p, session->mpi1->data, session->mpi1->count + 2);
+    p += session->mpi1->count + 2;
+    if (session->mpi2) {
+    	memcpy(p, session->mpi2->data, session->mpi2->count + 2);
+      p += session->mpi2->count + 2;
+    }
+  }
+  err = spgp_agent_write(agent_fd, req, len);
+  free(req);
+  if (err) return -1;
+
+	for (i = 0; i < count; i++) {
+  	if (spgp_agent_read(agent_fd, reply, 4)) {
+    	err = -1;
+      break;
+    }
+    frame = spgp_get_be32(reply);
+    if (frame < SPGP_AGENT_REPLY_LEN - 4 || frame > sizeof(reply) - 4 ||
+        spgp_agent_read(agent_fd, reply + 4, frame)) {
+    	err = -1;
+      break;
+    }
+    tag = spgp_get_be32(reply + 4);
+    status = (reply[8] << 8) | reply[9];
+    if (tag >= count) {
+    	err = -1;
+      break;
+    }
+    session = sessions[tag];
+    if (status != 0) {
+    	Serial.printf("Agent refused session %u (0x%x)\n", tag, status);
+      continue;
+    }
+    if (frame < SPGP_AGENT_REPLY_LEN - 4 + 2 || session->key) continue;
+    keylen = frame + 4 - SPGP_AGENT_REPLY_LEN - 1;
+    session->key = spgp_secure_alloc(keylen);
+    if (NULL == session->key) {
+    	err = -1;
+      break;
+    }
+    session->symAlgo = reply[SPGP_AGENT_REPLY_LEN];
+    session->keylen = keylen;
+    memcpy(session->key, reply + SPGP_AGENT_REPLY_LEN + 1, keylen);
+    (*decrypted)++;
+  }
+  spgp_secure_wipe(reply, sizeof(reply));
+  return err;
+}
+
+static size_t spgp_agent_request_length(spgp_session_pkt_t *session) {
+	size_t len = SPGP_AGENT_REQUEST_LEN + 8 + 1;
+
+	len += session->mpi1->count + 2;
+  if (session->mpi2) len += session->mpi2->count + 2;
+  return len;
+}
+
+static uint8_t spgp_agent_write(int fd, const uint8_t *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+  	n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint8_t spgp_agent_read(int fd, uint8_t *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+  	n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Answer one request.  |frame| starts at the tag.
+ */
+static uint8_t spgp_agent_answer_request(const uint8_t *frame, uint32_t len,
+                                         spgp_agent_replies_t *out) {
+	spgp_session_pkt_t session;
+  spgp_mpi_t mpi1, mpi2;
+  const uint8_t *p = frame + SPGP_AGENT_REQUEST_LEN - 4;
+  const uint8_t *end = frame + len;
+  uint8_t *reply;
+  uint16_t status = FORMAT_UNSUPPORTED;
+  size_t keylen = 0;
+
+	memset(&session, 0, sizeof(session));
+	if (frame[4] == SPGP_AGENT_OP_DECRYPT_SESSION) {
+  	status = INVALID_HEADER;
+  	if (end - p > 9) {
+    	memcpy(session.keyid, p, 8);
+      session.algo = p[8];
+      p += 9;
+      if (spgp_agent_request_mpi(&p, end, &mpi1) == 0 &&
+          (spgp_session_mpi_count(session.algo) < 2 ||
+           spgp_agent_request_mpi(&p, end, &mpi2) == 0) &&
+          p == end) {
+      	session.mpi1 = &mpi1;
+        if (spgp_session_mpi_count(session.algo) > 1) session.mpi2 = &mpi2;
+        status = spgp_agent_unlock(&session);
+        if (0 == status) keylen = 1 + session.keylen;
+      }
+    }
+  }
+
+	reply = spgp_agent_reserve(out, SPGP_AGENT_REPLY_LEN + keylen);
+  if (reply) {
+  	reply = spgp_put_be32(reply, SPGP_AGENT_REPLY_LEN - 4 + keylen);
+    memcpy(reply, frame, 4);
+    reply[4] = status >> 8;
+    reply[5] = status;
+    if (keylen) {
+    	reply[6] = session.symAlgo;
+      memcpy(reply + 7, session.key, session.keylen);
+    }
+    out->len += SPGP_AGENT_REPLY_LEN + keylen;
+  }
+  spgp_secure_free(session.key, session.keylen);
+  return reply ? 0 : -1;
+}
+
+static uint8_t spgp_agent_request_mpi(const uint8_t **p, const uint8_t *end,
+                                      spgp_mpi_t *mpi) {
+	if (end - *p < 2) return -1;
+  memset(mpi, 0, sizeof(*mpi));
+  mpi->bits = ((*p)[0] << 8) | (*p)[1];
+  mpi->count = (mpi->bits + 7) / 8;
+  if ((size_t)(end - *p) < mpi->count + 2) return -1;
+  mpi->data = (uint8_t *)*p;
+  *p += mpi->count + 2;
+  return 0;
+}
+
+/**
+ * @return 0 if decrypted, otherwise the error for the reply
+ */
+static uint16_t spgp_agent_unlock(spgp_session_pkt_t *session) {
+	if (setjmp(exception)) return _spgp_err;
+  if (spgp_decrypt_session_key(session) != 0) return KEY_NOT_FOUND;
+  return 0;
+}
+
+/**
+ * Make room for |len| more bytes of replies.
+ */
+static uint8_t *spgp_agent_reserve(spgp_agent_replies_t *out, size_t len) {
+	uint8_t *grown;
+  size_t cap;
+
+	if (out->cap - out->len < len) {
+  	cap = out->cap ? out->cap * 2 : 4096;
+    while (cap - out->len < len) cap *= 2;
+    grown = spgp_secure_alloc(cap);
+    if (NULL == grown) return NULL;
+    memcpy(grown, out->data, out->len);
+    spgp_secure_free(out->data, out->cap);
+    out->data = grown;
+    out->cap = cap;
+  }
+  return out->data + out->len;
+}
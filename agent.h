@@ -0,0 +1,68 @@
+/*
+ *  agent.h
+ *  libsimplepgp
+ *
+ *  Wire format shared by the key agent and its clients.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _AGENT_H
+
+#include "packet_private.h"
+
+/* Frames are sent over a UNIX stream socket, with big-endian integers.
+   A client may send any number of requests before reading the replies,
+   and the agent answers everything it has read with one write.
+
+   Request:
+     0  length of the rest of the frame (4)
+     4  tag, echoed in the reply (4)
+     8  operation (1)
+     9  operation data
+
+   Reply:
+     0  length of the rest of the frame (4)
+     4  tag of the request (4)
+     8  status: 0, or an spgp_error_t such as KEY_NOT_FOUND (2)
+    10  operation data, when the status is 0
+
+   SPGP_AGENT_OP_DECRYPT_SESSION sends the key ID (8), the public key
+   algorithm (1) and the session packet's MPIs as they appear in the packet.
+   The reply is the symmetric algorithm (1) and the session key. */
+#define SPGP_AGENT_OP_DECRYPT_SESSION 1
+
+#define SPGP_AGENT_REQUEST_LEN  9
+#define SPGP_AGENT_REPLY_LEN    10
+#define SPGP_AGENT_MAX_FRAME    (16 << 10)
+
+// Replies the agent has yet to write.  They hold session keys, so they
+// are kept in secure memory.
+typedef struct {
+	uint8_t *data;
+  size_t len;
+  size_t cap;
+} spgp_agent_replies_t;
+
+uint32_t spgp_agent_decrypt_sessions(spgp_packet_t *chain);
+
+uint8_t spgp_agent_answer(const uint8_t *in, size_t len, size_t *used,
+                          spgp_agent_replies_t *out, unsigned long *requests);
+void spgp_agent_replies_sent(spgp_agent_replies_t *out, size_t len);
+void spgp_agent_replies_free(spgp_agent_replies_t *out);
+
+#define _AGENT_H
+#endif
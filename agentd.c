@@ -0,0 +1,431 @@
+/*
+ *  agentd.c
+ *  libsimplepgp
+ *
+ *  spgp-agent: holds unlocked secret keys for other processes, and opens
+ *  their session keys over a UNIX socket.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "agent.h"
+#include "secmem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Connections per thread
+#define SPGP_AGENTD_MAX_CLIENTS 256
+#define SPGP_AGENTD_MAX_THREADS 64
+
+// Requests read at once.  Always holds a whole frame.
+#define SPGP_AGENTD_IN_LEN      (64 << 10)
+
+// A client that doesn't read its replies isn't read from past this
+#define SPGP_AGENTD_OUT_MAX     (256 << 10)
+
+#define SPGP_AGENTD_PASS_LEN    1024
+
+typedef struct {
+	int fd;
+  uint8_t *in;
+  size_t inLen;
+  spgp_agent_replies_t out;
+} spgp_agentd_client_t;
+
+// Each thread accepts its own clients from the shared socket and answers
+// them, so private key operations run on as many cores as there are
+// threads.
+typedef struct {
+	pthread_t thread;
+  int lfd;
+  spgp_agentd_client_t clients[SPGP_AGENTD_MAX_CLIENTS];
+  struct pollfd fds[SPGP_AGENTD_MAX_CLIENTS + 2];
+  uint32_t nclients;
+  unsigned long requests;
+} spgp_agentd_loop_t;
+
+static volatile sig_atomic_t agentd_stop;
+static int agentd_wake[2] = { -1, -1 };  // readable once signalled
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static void spgp_agentd_usage(void);
+
+static uint8_t spgp_agentd_load_keys(char **paths, int count);
+
+static int spgp_agentd_listen(const char *path);
+
+static void *spgp_agentd_serve(void *arg);
+
+static void spgp_agentd_accept(spgp_agentd_loop_t *loop);
+
+static uint8_t spgp_agentd_read(spgp_agentd_loop_t *loop,
+                                spgp_agentd_client_t *c);
+
+static uint8_t spgp_agentd_flush(spgp_agentd_client_t *c);
+
+static void spgp_agentd_drop(spgp_agentd_client_t *c);
+
+static void spgp_agentd_signal(int sig);
+
+
+/**********************************************************************
+**
+** Main
+**
+***********************************************************************/
+#pragma mark Main
+
+int main(int argc, char **argv) {
+	const char *snapshot = NULL;
+  const char *snapkey = NULL;
+  const char *path;
+  uint8_t key[SPGP_SNAPSHOT_KEY_LEN];
+  spgp_agentd_loop_t *loops;
+  struct sigaction sa;
+  unsigned long requests = 0;
+  long threads;
+  int opt, lfd, i;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "S:K:t:")) != -1) {
+  	switch (opt) {
+    	case 'S': snapshot = optarg; break;
+      case 'K': snapkey = optarg; break;
+      case 't': threads = atol(optarg); break;
+      default: spgp_agentd_usage(); return 1;
+    }
+  }
+  if (threads < 1) threads = 1;
+  if (threads > SPGP_AGENTD_MAX_THREADS) threads = SPGP_AGENTD_MAX_THREADS;
+  if (optind >= argc || (snapshot && !snapkey) ||
+      (!snapshot && optind + 1 >= argc)) {
+  	spgp_agentd_usage();
+    return 1;
+  }
+  path = argv[optind++];
+
+	if (spgp_init() != 0) {
+  	fprintf(stderr, "spgp-agent: %s\n", spgp_err_str(spgp_err()));
+    return 1;
+  }
+
+	// A snapshot restores keys without running S2K
+	if (snapshot) {
+  	if (spgp_snapshot_key_read(snapkey, key) != 0 ||
+        spgp_keychain_import(snapshot, key, sizeof(key)) != 0) {
+    	spgp_secure_wipe(key, sizeof(key));
+    	fprintf(stderr, "spgp-agent: %s: %s\n", snapshot,
+              spgp_err_str(spgp_err()));
+      spgp_close();
+      return 1;
+    }
+    spgp_secure_wipe(key, sizeof(key));
+  }
+  if (spgp_agentd_load_keys(argv + optind, argc - optind) != 0) {
+  	spgp_close();
+    return 1;
+  }
+
+	lfd = spgp_agentd_listen(path);
+  loops = calloc(threads, sizeof(*loops));
+  if (lfd < 0 || NULL == loops || pipe(agentd_wake) != 0) {
+  	spgp_close();
+    return 1;
+  }
+
+	memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = spgp_agentd_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "spgp-agent: listening on %s with %ld threads\n",
+          path, threads);
+  for (i = 0; i < threads; i++) {
+  	loops[i].lfd = lfd;
+    if (pthread_create(&loops[i].thread, NULL, spgp_agentd_serve, &loops[i])) {
+    	perror("spgp-agent: pthread_create");
+      threads = i;
+      spgp_agentd_signal(SIGTERM);
+    }
+  }
+  for (i = 0; i < threads; i++) {
+  	pthread_join(loops[i].thread, NULL);
+    requests += loops[i].requests;
+  }
+  fprintf(stderr, "spgp-agent: %lu requests served\n", requests);
+
+	free(loops);
+	close(lfd);
+  unlink(path);
+  spgp_close();
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static void spgp_agentd_usage(void) {
+	fprintf(stderr,
+    "usage: spgp-agent [-t threads] [-S snapshot -K snapshot-key] socket\n"
+    "                  [secret-key ...]\n"
+    "\n"
+    "Secret key files are unlocked with a passphrase read from stdin.\n"
+    "The agent runs in the foreground until SIGINT or SIGTERM, with one\n"
+    "thread per CPU unless -t is given.\n");
+}
+
+/**
+ * Unlock the secret keys in each file with one passphrase from stdin.
+ */
+static uint8_t spgp_agentd_load_keys(char **paths, int count) {
+	char pass[SPGP_AGENTD_PASS_LEN];
+  spgp_packet_t *pkt;
+  size_t len;
+  uint8_t err = 0;
+  int i;
+
+	if (0 == count) return 0;
+  if (isatty(STDIN_FILENO)) fprintf(stderr, "Passphrase: ");
+  if (NULL == fgets(pass, sizeof(pass), stdin)) {
+  	fprintf(stderr, "spgp-agent: no passphrase\n");
+    return -1;
+  }
+  len = strcspn(pass, "\r\n");
+
+	for (i = 0; i < count && !err; i++) {
+  	pkt = spgp_decode_file(paths[i]);
+    if (NULL == pkt ||
+        spgp_decrypt_all_secret_keys(pkt, (uint8_t *)pass, len) != 0) {
+    	fprintf(stderr, "spgp-agent: %s: %s\n", paths[i],
+              spgp_err_str(spgp_err()));
+      err = -1;
+    }
+    spgp_free_packet(&pkt);
+  }
+  spgp_secure_wipe(pass, sizeof(pass));
+  return err;
+}
+
+/**
+ * Listen on |path|, replacing a socket left by an earlier agent.  Only the
+ * agent's user may connect.
+ */
+static int spgp_agentd_listen(const char *path) {
+	struct sockaddr_un addr;
+  struct stat st;
+  mode_t mask;
+  int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+  	fprintf(stderr, "spgp-agent: socket path too long\n");
+    return -1;
+  }
+  if (lstat(path, &st) == 0) {
+  	if (!S_ISSOCK(st.st_mode)) {
+    	fprintf(stderr, "spgp-agent: %s exists\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+	memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+  	perror("spgp-agent: socket");
+    return -1;
+  }
+  mask = umask(0077);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 128) != 0) {
+  	perror("spgp-agent: bind");
+    umask(mask);
+    close(fd);
+    return -1;
+  }
+  umask(mask);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+/**
+ * Answer clients until signalled.
+ *
+ * Everything a client has sent is read at once, every whole request in it
+ * answered, and the replies written together, so a batch of requests
+ * costs one read and one write.
+ */
+static void *spgp_agentd_serve(void *arg) {
+	spgp_agentd_loop_t *loop = arg;
+	spgp_agentd_client_t *c;
+  uint32_t i, j;
+  short ev;
+
+	while (!agentd_stop) {
+  	loop->fds[0].fd = loop->lfd;
+    loop->fds[0].events =
+    	loop->nclients < SPGP_AGENTD_MAX_CLIENTS ? POLLIN : 0;
+    loop->fds[1].fd = agentd_wake[0];
+    loop->fds[1].events = POLLIN;
+    for (i = 0; i < loop->nclients; i++) {
+    	c = &loop->clients[i];
+      loop->fds[i + 2].fd = c->fd;
+      loop->fds[i + 2].events =
+      	(c->out.len < SPGP_AGENTD_OUT_MAX ? POLLIN : 0) |
+        (c->out.len ? POLLOUT : 0);
+      loop->fds[i + 2].revents = 0;
+    }
+    if (poll(loop->fds, loop->nclients + 2, -1) < 0) {
+    	if (errno == EINTR) continue;
+      perror("spgp-agent: poll");
+      break;
+    }
+    if (loop->fds[1].revents) break;
+
+		for (i = 0; i < loop->nclients; i++) {
+    	c = &loop->clients[i];
+      ev = loop->fds[i + 2].revents;
+      if ((ev & (POLLIN | POLLHUP | POLLERR)) &&
+          spgp_agentd_read(loop, c) != 0)
+      	spgp_agentd_drop(c);
+      else if (c->out.len && spgp_agentd_flush(c) != 0)
+      	spgp_agentd_drop(c);
+    }
+
+		// Close up the gaps left by dropped clients
+		for (i = 0, j = 0; i < loop->nclients; i++)
+    	if (loop->clients[i].fd >= 0) loop->clients[j++] = loop->clients[i];
+    loop->nclients = j;
+
+		if (loop->fds[0].revents & POLLIN) spgp_agentd_accept(loop);
+  }
+
+	for (i = 0; i < loop->nclients; i++) spgp_agentd_drop(&loop->clients[i]);
+  loop->nclients = 0;
+  return NULL;
+}
+
+static void spgp_agentd_accept(spgp_agentd_loop_t *loop) {
+	spgp_agentd_client_t *c;
+  int fd;
+
+	// Other threads may take the connection first
+	while (loop->nclients < SPGP_AGENTD_MAX_CLIENTS) {
+  	fd = accept(loop->lfd, NULL, NULL);
+    if (fd < 0) return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    c = &loop->clients[loop->nclients];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->in = malloc(SPGP_AGENTD_IN_LEN);
+    if (NULL == c->in) {
+    	close(fd);
+      return;
+    }
+    loop->nclients++;
+  }
+}
+
+/**
+ * Read what the client has sent and answer every whole request in it.
+ *
+ * @return 0 for success, -1 if the client should be dropped
+ */
+static uint8_t spgp_agentd_read(spgp_agentd_loop_t *loop,
+                                spgp_agentd_client_t *c) {
+	ssize_t n;
+  size_t used;
+
+	n = read(c->fd, c->in + c->inLen, SPGP_AGENTD_IN_LEN - c->inLen);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  	return 0;
+  if (n <= 0) return -1;
+  c->inLen += n;
+
+	if (spgp_agent_answer(c->in, c->inLen, &used, &c->out,
+                        &loop->requests) != 0)
+  	return -1;
+  memmove(c->in, c->in + used, c->inLen - used);
+  c->inLen -= used;
+
+	return spgp_agentd_flush(c);
+}
+
+/**
+ * Write as many replies as the socket takes, clearing what was sent.
+ */
+static uint8_t spgp_agentd_flush(spgp_agentd_client_t *c) {
+	ssize_t n;
+
+	if (0 == c->out.len) return 0;
+  n = write(c->fd, c->out.data, c->out.len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  	return 0;
+  if (n <= 0) return -1;
+  spgp_agent_replies_sent(&c->out, n);
+  return 0;
+}
+
+static void spgp_agentd_drop(spgp_agentd_client_t *c) {
+	close(c->fd);
+  c->fd = -1;
+  free(c->in);
+  c->in = NULL;
+  c->inLen = 0;
+  spgp_agent_replies_free(&c->out);
+}
+
+static void spgp_agentd_signal(int sig) {
+	(void)sig;
+	agentd_stop = 1;
+  if (agentd_wake[1] >= 0 && write(agentd_wake[1], "", 1) < 0) return;
+}
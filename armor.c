@@ -0,0 +1,341 @@
+/*
+ *  armor.c
+ *  libsimplepgp
+ *
+ *  ASCII armor (RFC 4880 section 6) decoding.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "armor.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_ARMOR_BEGIN     "-----BEGIN PGP "
+#define SPGP_ARMOR_END       "-----END PGP "
+#define SPGP_ARMOR_CLEARTEXT "-----BEGIN PGP SIGNED MESSAGE-----"
+#define SPGP_CRC24_POLY      0x864CFBUL
+
+#define B64_SPACE   0xFE
+#define B64_INVALID 0xFF
+
+// Base64 character -> 6-bit value.  Whitespace maps to B64_SPACE and
+// everything else to B64_INVALID, so one OR of four lookups tests a quad.
+static const uint8_t b64_decode_table[256] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+// Slicing-by-8 tables for CRC-24.  The CRC is kept in the top 24 bits of
+// a 32-bit register so every table lookup lines up on a byte boundary.
+static uint32_t crc24_table[8][256];
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+
+static uint8_t spgp_armor_starts_with(uint8_t *p, uint8_t *end,
+                                      const char *marker);
+
+static uint8_t *spgp_armor_next_line(uint8_t *p, uint8_t *end);
+
+static uint8_t *spgp_armor_skip_space(uint8_t *p, uint8_t *end);
+
+static uint8_t *spgp_armor_find_line(uint8_t *p, uint8_t *end,
+                                     const char *marker);
+
+static uint8_t spgp_base64_decode_quad(const uint8_t *in, uint8_t *out);
+
+static uint8_t spgp_base64_decode(uint8_t **src, uint8_t *end,
+                                  uint8_t *out, size_t *outlen,
+                                  uint32_t *crc);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_dearmor(uint8_t *armored, size_t length,
+                     uint8_t **binary, size_t *binlen) {
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	return spgp_armor_decode(armored, length, binary, binlen);
+}
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+uint8_t spgp_armor_init(void) {
+	uint32_t crc;
+  int i, j;
+
+	for (i = 0; i < 256; i++) {
+  	crc = (uint32_t)i << 24;
+    for (j = 0; j < 8; j++)
+    	crc = (crc & 0x80000000UL) ? (crc << 1) ^ (SPGP_CRC24_POLY << 8)
+      	                         : (crc << 1);
+    crc24_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+  	for (j = 1; j < 8; j++)
+    	crc24_table[j][i] = (crc24_table[j-1][i] << 8) ^
+      	crc24_table[0][crc24_table[j-1][i] >> 24];
+  }
+  return 0;
+}
+
+uint8_t spgp_is_armored(uint8_t *message, size_t length) {
+	// Every binary packet tag has its top bit set; armor is plain ASCII.
+	return length > 0 && !(message[0] & 0x80);
+}
+
+uint32_t spgp_crc24(uint32_t crc, const uint8_t *buf, size_t len) {
+	uint32_t c = crc << 8;
+  uint32_t a, b;
+
+	while (len >= 8) {
+  	a = c ^ spgp_get_be32(buf);
+    b = spgp_get_be32(buf + 4);
+    c = crc24_table[7][a >> 24] ^ crc24_table[6][(a >> 16) & 0xFF] ^
+        crc24_table[5][(a >> 8) & 0xFF] ^ crc24_table[4][a & 0xFF] ^
+        crc24_table[3][b >> 24] ^ crc24_table[2][(b >> 16) & 0xFF] ^
+        crc24_table[1][(b >> 8) & 0xFF] ^ crc24_table[0][b & 0xFF];
+    buf += 8;
+    len -= 8;
+  }
+  while (len--)
+  	c = (c << 8) ^ crc24_table[0][(c >> 24) ^ *buf++];
+
+	return (c >> 8) & 0xFFFFFF;
+}
+
+uint8_t spgp_armor_decode(uint8_t *armor, size_t length,
+                          uint8_t **binary, size_t *binlen) {
+	uint8_t *p, *end, *eol;
+  uint8_t *out = NULL;
+  uint8_t sum[3];
+  uint8_t hasChecksum = 0;
+  uint32_t crc = SPGP_CRC24_INIT;
+  size_t outlen = 0;
+
+	if (NULL == armor || 0 == length || NULL == binary || NULL == binlen)
+  	RAISE(INVALID_ARGS);
+
+	end = armor + length;
+  p = spgp_armor_find_line(armor, end, SPGP_ARMOR_BEGIN);
+  if (NULL == p) RAISE(FORMAT_UNSUPPORTED);
+  // Cleartext signatures keep their text outside of the armor
+  if (spgp_armor_starts_with(p, end, SPGP_ARMOR_CLEARTEXT))
+  	RAISE(FORMAT_UNSUPPORTED);
+  p = spgp_armor_next_line(p, end);
+
+	// Skip armor headers ("Version: ...") up to the blank line.  Base64
+  // never contains a colon, so a missing blank line is tolerated.
+  while (p < end) {
+  	eol = spgp_armor_next_line(p, end);
+    if (spgp_armor_skip_space(p, eol) == eol) {
+    	p = eol;
+      break;
+    }
+    if (NULL == memchr(p, ':', eol - p)) break;
+    p = eol;
+  }
+
+	// Base64 never expands, so the binary form fits in 3/4 of what's left
+	out = malloc((end - p) / 4 * 3 + 3);
+  if (NULL == out) RAISE(OUT_OF_MEMORY);
+  if (spgp_base64_decode(&p, end, out, &outlen, &crc) != 0) goto bad;
+
+	// Optional checksum line: '=' and four base64 characters
+	p = spgp_armor_skip_space(p, end);
+  if (p < end && *p == '=') {
+  	p++;
+    if (end - p < 4 || spgp_base64_decode_quad(p, sum) != 0) goto bad;
+    hasChecksum = 1;
+    p = spgp_armor_skip_space(p + 4, end);
+  }
+
+	// A missing tail line means the armor was truncated
+	if (!spgp_armor_starts_with(p, end, SPGP_ARMOR_END)) goto bad;
+  if (hasChecksum &&
+      crc != (((uint32_t)sum[0] << 16) | ((uint32_t)sum[1] << 8) | sum[2])) {
+  	Serial.printf("CRC-24 mismatch: computed 0x%06X\n", crc);
+    goto bad;
+  }
+
+	Serial.printf("Dearmored %lu bytes\n", (unsigned long)outlen);
+  *binary = out;
+  *binlen = outlen;
+  return 0;
+
+  bad:
+  free(out);
+  RAISE(ARMOR_ERROR);
+  return -1;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static uint8_t spgp_armor_starts_with(uint8_t *p, uint8_t *end,
+                                      const char *marker) {
+	size_t len = strlen(marker);
+  return (size_t)(end - p) >= len && memcmp(p, marker, len) == 0;
+}
+
+static uint8_t *spgp_armor_next_line(uint8_t *p, uint8_t *end) {
+	uint8_t *nl = memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+static uint8_t *spgp_armor_skip_space(uint8_t *p, uint8_t *end) {
+	while (p < end && b64_decode_table[*p] == B64_SPACE) p++;
+  return p;
+}
+
+static uint8_t *spgp_armor_find_line(uint8_t *p, uint8_t *end,
+                                     const char *marker) {
+	while (p < end) {
+  	if (spgp_armor_starts_with(p, end, marker)) return p;
+    p = spgp_armor_next_line(p, end);
+  }
+  return NULL;
+}
+
+static uint8_t spgp_base64_decode_quad(const uint8_t *in, uint8_t *out) {
+	uint32_t a = b64_decode_table[in[0]];
+  uint32_t b = b64_decode_table[in[1]];
+  uint32_t c = b64_decode_table[in[2]];
+  uint32_t d = b64_decode_table[in[3]];
+  uint32_t v;
+
+	if ((a | b | c | d) & 0x80) return -1;
+  v = (a << 18) | (b << 12) | (c << 6) | d;
+  out[0] = v >> 16;
+  out[1] = v >> 8;
+  out[2] = v;
+  return 0;
+}
+
+static uint8_t spgp_base64_decode(uint8_t **src, uint8_t *end,
+                                  uint8_t *out, size_t *outlen,
+                                  uint32_t *crc) {
+	uint8_t *p = *src;
+  uint8_t *o = out;
+  uint8_t *mark = out;
+  uint32_t acc = 0;
+  uint8_t n = 0;
+  uint8_t v;
+
+	while (p < end) {
+  	// Fast path: whole quads, which is every line of a normal armor body
+    // but its line ending.
+    if (n == 0) {
+    	while (end - p >= 4 && spgp_base64_decode_quad(p, o) == 0) {
+      	p += 4;
+        o += 3;
+      }
+      // Checksum the line just written while it is still in cache
+      *crc = spgp_crc24(*crc, mark, o - mark);
+      mark = o;
+      if (p >= end) break;
+    }
+
+		// Slow path: line endings, and quads split across lines
+		v = b64_decode_table[*p];
+    if (v < 64) {
+    	acc = (acc << 6) | v;
+      if (++n == 4) {
+      	o[0] = acc >> 16;
+        o[1] = acc >> 8;
+        o[2] = acc;
+        o += 3;
+        acc = 0;
+        n = 0;
+      }
+    }
+    else if (v != B64_SPACE) {
+    	break; // padding, checksum or tail line
+    }
+    p++;
+  }
+
+	// Padding finishes a partial quad: "xx==" or "xxx="
+	if (p < end && *p == '=' && n >= 2) {
+  	p++;
+    if (n == 2 && p < end && *p == '=') p++;
+  }
+  switch (n) {
+  	case 1:
+    	return -1;
+    case 2:
+    	*o++ = acc >> 4;
+      break;
+    case 3:
+    	*o++ = acc >> 10;
+      *o++ = acc >> 2;
+      break;
+  }
+  *crc = spgp_crc24(*crc, mark, o - mark);
+
+	*src = p;
+  *outlen = o - out;
+  return 0;
+}
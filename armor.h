@@ -0,0 +1,39 @@
+/*
+ *  armor.h
+ *  simplepgp
+ *
+ *  ASCII armor decoding.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _ARMOR_H
+
+#include "packet_private.h"
+
+#define SPGP_CRC24_INIT 0xB704CEUL
+
+uint8_t spgp_armor_init(void);
+
+uint8_t spgp_is_armored(uint8_t *message, size_t length);
+
+uint32_t spgp_crc24(uint32_t crc, const uint8_t *buf, size_t len);
+
+uint8_t spgp_armor_decode(uint8_t *armor, size_t length,
+                          uint8_t **binary, size_t *binlen);
+
+#define _ARMOR_H
+#endif
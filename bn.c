@@ -0,0 +1,737 @@
+/*
+ *  bn.c
+ *  libsimplepgp
+ *
+ *  Fixed-size big numbers and Montgomery arithmetic for RSA and Elgamal.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "bn.h"
+#include "secmem.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Lane kernels for x86-64 vector units, picked when the CPU has them
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SPGP_BN_X86
+#include <immintrin.h>
+#endif
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Exponents are walked 4 bits at a time
+#define SPGP_BN_WINDOW 4
+
+/* The multiply and reduce passes of a lane Montgomery product, leaving
+   t = a * b / R + (0 or n) in every lane, limbs + 1 rows long.  |t| starts
+   zeroed with limbs + 2 rows. */
+typedef void (*spgp_bn_lanes_fn)(uint64_t *t, const uint64_t *a,
+                                 const uint64_t *b, const spgp_bn_mont_t *m);
+
+static pthread_once_t lanes_once = PTHREAD_ONCE_INIT;
+static spgp_bn_lanes_fn lanes_kernel;   // NULL for one lane at a time
+static const char *lanes_unit = "generic";
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static void spgp_bn_select(uint32_t *r, uint32_t table[][SPGP_BN_MAX_LIMBS],
+                           uint32_t count, uint32_t index, uint32_t limbs);
+
+static void spgp_bn_lanes_setup(void);
+static void spgp_bn_mont_mul_vector(uint64_t *r, const uint64_t *a,
+                                    const uint64_t *b,
+                                    const spgp_bn_mont_t *m);
+#ifdef SPGP_BN_X86
+static void spgp_bn_lanes_avx2(uint64_t *t, const uint64_t *a,
+                               const uint64_t *b, const spgp_bn_mont_t *m);
+static void spgp_bn_lanes_avx512(uint64_t *t, const uint64_t *a,
+                                 const uint64_t *b, const spgp_bn_mont_t *m);
+#endif
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+/**
+ * Read a big-endian number.
+ *
+ * @param r Set to the number, |limbs| long
+ * @param limbs Length of |r|
+ * @param buf Big-endian bytes
+ * @param len Length of |buf|
+ * @return 0 for success, -1 if the number doesn't fit in |limbs|
+ */
+uint8_t spgp_bn_read(uint32_t *r, uint32_t limbs,
+                     const uint8_t *buf, size_t len) {
+	size_t i;
+
+	// Leading zeros don't count against the length
+	while (len && 0 == *buf) {
+  	buf++;
+    len--;
+  }
+  if (len > (size_t)limbs * 4) return -1;
+
+	memset(r, 0, limbs * sizeof(*r));
+  for (i = 0; i < len; i++)
+  	r[i / 4] |= (uint32_t)buf[len - 1 - i] << (8 * (i % 4));
+  return 0;
+}
+
+/**
+ * Write |a| as |len| big-endian bytes, zero padded or cut from the top.
+ */
+void spgp_bn_write(uint8_t *buf, size_t len,
+                   const uint32_t *a, uint32_t limbs) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+  	buf[len - 1 - i] = (i / 4 < limbs) ? a[i / 4] >> (8 * (i % 4)) : 0;
+  }
+}
+
+/**
+ * Copy |a| into secure memory as big-endian bytes without leading zeros.
+ *
+ * @param len Set to the number of bytes
+ * @return The bytes, or NULL if out of memory.  Free with
+ *         spgp_secure_free().
+ */
+uint8_t *spgp_bn_export(const uint32_t *a, uint32_t limbs, size_t *len) {
+	uint8_t buf[SPGP_BN_MAX_BITS / 8];
+  uint8_t *out;
+  size_t skip;
+
+	spgp_bn_write(buf, limbs * 4, a, limbs);
+  for (skip = 0; skip < limbs * 4 && 0 == buf[skip]; skip++) ;
+  *len = limbs * 4 - skip;
+  out = spgp_secure_alloc(*len);
+  if (out) memcpy(out, buf + skip, *len);
+  spgp_secure_wipe(buf, limbs * 4);
+  return out;
+}
+
+/**
+ * r = a - b.  |r| may be |a| or |b|.
+ *
+ * @return The borrow, 1 if b > a
+ */
+uint32_t spgp_bn_sub(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     uint32_t limbs) {
+	uint64_t t;
+  uint32_t borrow = 0;
+  uint32_t i;
+
+	for (i = 0; i < limbs; i++) {
+  	t = (uint64_t)a[i] - b[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (uint32_t)(t >> 63);
+  }
+  return borrow;
+}
+
+/**
+ * r = a + b.  |r| may be |a| or |b|.
+ *
+ * @return The carry
+ */
+uint32_t spgp_bn_add(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     uint32_t limbs) {
+	uint64_t t = 0;
+  uint32_t i;
+
+	for (i = 0; i < limbs; i++) {
+  	t += (uint64_t)a[i] + b[i];
+    r[i] = (uint32_t)t;
+    t >>= 32;
+  }
+  return (uint32_t)t;
+}
+
+/**
+ * r = a * b.  |r| is |aLimbs| + |bLimbs| long, and may not overlap either.
+ */
+void spgp_bn_mul(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                 const uint32_t *b, uint32_t bLimbs) {
+	uint64_t c;
+  uint32_t i, j;
+
+	memset(r, 0, (aLimbs + bLimbs) * sizeof(*r));
+  for (i = 0; i < bLimbs; i++) {
+  	c = 0;
+    for (j = 0; j < aLimbs; j++) {
+    	c += (uint64_t)a[j] * b[i] + r[i + j];
+      r[i + j] = (uint32_t)c;
+      c >>= 32;
+    }
+    r[i + aLimbs] = (uint32_t)c;
+  }
+}
+
+/**
+ * r = a mod m, for any nonzero |m|, by shifting |a| in a bit at a time.
+ * Slow, but the same for every value, so it suits one-off work on secrets
+ * such as d mod (p - 1).
+ *
+ * @param r Set to the remainder, |mLimbs| long
+ * @param a Dividend, |aLimbs| long
+ * @param m Divisor, |mLimbs| long
+ */
+void spgp_bn_mod(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                 const uint32_t *m, uint32_t mLimbs) {
+	uint32_t rem[SPGP_BN_MAX_LIMBS + 1], sub[SPGP_BN_MAX_LIMBS + 1];
+  uint32_t mm[SPGP_BN_MAX_LIMBS + 1];
+  uint32_t i, j, bit, top, mask;
+
+	memset(rem, 0, (mLimbs + 1) * sizeof(*rem));
+  memcpy(mm, m, mLimbs * sizeof(*mm));
+  mm[mLimbs] = 0;
+  for (i = aLimbs * 32; i; i--) {
+  	bit = (a[(i - 1) / 32] >> ((i - 1) % 32)) & 1;
+    for (j = mLimbs + 1; j; j--) {
+    	top = (j > 1) ? rem[j - 2] >> 31 : bit;
+      rem[j - 1] = (rem[j - 1] << 1) | top;
+    }
+    // rem < 2m, so one subtraction is enough
+    mask = spgp_bn_sub(sub, rem, mm, mLimbs + 1) - 1;
+    for (j = 0; j <= mLimbs; j++) rem[j] = (sub[j] & mask) | (rem[j] & ~mask);
+  }
+  memcpy(r, rem, mLimbs * sizeof(*r));
+  spgp_secure_wipe(rem, sizeof(rem));
+  spgp_secure_wipe(sub, sizeof(sub));
+}
+
+/**
+ * Set up Montgomery arithmetic modulo |n|.
+ *
+ * @param m Set up for |n|
+ * @param n Big-endian odd modulus, up to SPGP_BN_MAX_BITS bits
+ * @param len Length of |n|
+ * @return 0 for success, -1 if |n| is even or too long
+ */
+uint8_t spgp_bn_mont_init(spgp_bn_mont_t *m, const uint8_t *n, size_t len) {
+	uint32_t tmp[SPGP_BN_MAX_LIMBS];
+  uint32_t inv, carry, borrow, mask;
+  uint32_t i, j, limbs;
+
+	while (len && 0 == *n) {
+  	n++;
+    len--;
+  }
+  if (0 == len || len > SPGP_BN_MAX_BITS / 8 || !(n[len - 1] & 1)) return -1;
+  limbs = (len + 3) / 4;
+  m->limbs = limbs;
+  spgp_bn_read(m->n, limbs, n, len);
+
+	// Newton's iteration doubles the correct low bits each round
+	inv = m->n[0];
+  for (i = 0; i < 5; i++) inv *= 2 - m->n[0] * inv;
+  m->n0inv = -inv;
+
+	// R^2 mod n, by doubling 1 that many times.  Everything it depends on
+  // is public.
+  memset(m->rr, 0, sizeof(m->rr));
+  m->rr[0] = 1;
+  for (i = 0; i < 64 * limbs; i++) {
+  	carry = 0;
+    for (j = 0; j < limbs; j++) {
+    	uint32_t top = m->rr[j] >> 31;
+      m->rr[j] = (m->rr[j] << 1) | carry;
+      carry = top;
+    }
+    borrow = spgp_bn_sub(tmp, m->rr, m->n, limbs);
+    mask = -(uint32_t)(carry | !borrow);
+    for (j = 0; j < limbs; j++)
+    	m->rr[j] = (tmp[j] & mask) | (m->rr[j] & ~mask);
+  }
+  return 0;
+}
+
+/**
+ * r = a * b / R mod n.  |r| may be |a| or |b|.  |b| must be below n, and
+ * |a| below R.
+ */
+void spgp_bn_mont_mul(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                      const spgp_bn_mont_t *m) {
+	uint32_t t[SPGP_BN_MAX_LIMBS + 2];
+  uint32_t sub[SPGP_BN_MAX_LIMBS];
+  uint32_t limbs = m->limbs;
+  uint32_t i, j, q, borrow, mask;
+  uint64_t c;
+
+	memset(t, 0, (limbs + 2) * sizeof(*t));
+  for (i = 0; i < limbs; i++) {
+  	// t += a * b[i]
+  	c = 0;
+    for (j = 0; j < limbs; j++) {
+    	c += (uint64_t)a[j] * b[i] + t[j];
+      t[j] = (uint32_t)c;
+      c >>= 32;
+    }
+    c += t[limbs];
+    t[limbs] = (uint32_t)c;
+    t[limbs + 1] = (uint32_t)(c >> 32);
+
+		// t = (t + q * n) / 2^32, with q making the low limb 0
+		q = t[0] * m->n0inv;
+    c = (uint64_t)q * m->n[0] + t[0];
+    c >>= 32;
+    for (j = 1; j < limbs; j++) {
+    	c += (uint64_t)q * m->n[j] + t[j];
+      t[j - 1] = (uint32_t)c;
+      c >>= 32;
+    }
+    c += t[limbs];
+    t[limbs - 1] = (uint32_t)c;
+    t[limbs] = t[limbs + 1] + (uint32_t)(c >> 32);
+  }
+
+	// t < 2n, so at most one subtraction, done either way
+	borrow = spgp_bn_sub(sub, t, m->n, limbs);
+  mask = -(uint32_t)(t[limbs] | !borrow);
+  for (j = 0; j < limbs; j++) r[j] = (sub[j] & mask) | (t[j] & ~mask);
+
+	spgp_secure_wipe(t, (limbs + 2) * sizeof(*t));
+  spgp_secure_wipe(sub, limbs * sizeof(*sub));
+}
+
+/**
+ * r = a mod n, for |a| up to twice the modulus' length.
+ *
+ * @param r Set to the result, below n
+ * @param a Number to reduce
+ * @param aLimbs Length of |a|, at most 2 * m->limbs
+ * @param m Modulus
+ */
+void spgp_bn_mont_reduce(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                         const spgp_bn_mont_t *m) {
+	uint32_t hi[SPGP_BN_MAX_LIMBS], lo[SPGP_BN_MAX_LIMBS];
+  uint32_t limbs = m->limbs;
+
+	// a = hi * R + lo, so a * R = hi * R^2 + lo * R, and each of those is
+  // a Montgomery product with R^2.
+	memset(lo, 0, limbs * sizeof(*lo));
+  memset(hi, 0, limbs * sizeof(*hi));
+  memcpy(lo, a, (aLimbs < limbs ? aLimbs : limbs) * sizeof(*lo));
+  if (aLimbs > limbs) memcpy(hi, a + limbs, (aLimbs - limbs) * sizeof(*hi));
+
+	spgp_bn_mont_mul(hi, hi, m->rr, m);
+  spgp_bn_mont_mul(hi, hi, m->rr, m);
+  spgp_bn_mont_mul(lo, lo, m->rr, m);
+  spgp_bn_mod_add(lo, lo, hi, m);
+
+	// Out of Montgomery form
+	memset(hi, 0, limbs * sizeof(*hi));
+  hi[0] = 1;
+  spgp_bn_mont_mul(r, lo, hi, m);
+
+	spgp_secure_wipe(lo, limbs * sizeof(*lo));
+  spgp_secure_wipe(hi, limbs * sizeof(*hi));
+}
+
+/**
+ * r = a + b mod n, for |a| and |b| below n.  |r| may be |a| or |b|.
+ */
+void spgp_bn_mod_add(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     const spgp_bn_mont_t *m) {
+	uint32_t sum[SPGP_BN_MAX_LIMBS], sub[SPGP_BN_MAX_LIMBS];
+  uint32_t limbs = m->limbs;
+  uint32_t carry, borrow, mask, j;
+
+	carry = spgp_bn_add(sum, a, b, limbs);
+  borrow = spgp_bn_sub(sub, sum, m->n, limbs);
+  mask = -(uint32_t)(carry | !borrow);
+  for (j = 0; j < limbs; j++) r[j] = (sub[j] & mask) | (sum[j] & ~mask);
+  spgp_secure_wipe(sum, limbs * sizeof(*sum));
+  spgp_secure_wipe(sub, limbs * sizeof(*sub));
+}
+
+/**
+ * r = base^exp mod n.
+ *
+ * Every window of the exponent costs the same, and the table is read in
+ * full each time, so secret exponents don't show in the timing.
+ *
+ * @param r Set to the result, below n
+ * @param base Number below R
+ * @param exp Exponent, |expLimbs| long
+ * @param expLimbs Length of |exp|
+ * @param m Modulus
+ */
+void spgp_bn_mod_exp(uint32_t *r, const uint32_t *base,
+                     const uint32_t *exp, uint32_t expLimbs,
+                     const spgp_bn_mont_t *m) {
+	uint32_t table[1 << SPGP_BN_WINDOW][SPGP_BN_MAX_LIMBS];
+  uint32_t acc[SPGP_BN_MAX_LIMBS];
+  uint32_t tmp[SPGP_BN_MAX_LIMBS];
+  uint32_t limbs = m->limbs;
+  uint32_t i, w, bits;
+
+	// Montgomery forms of base^0 to base^15
+	memset(tmp, 0, limbs * sizeof(*tmp));
+  tmp[0] = 1;
+  spgp_bn_mont_mul(table[0], tmp, m->rr, m);
+  spgp_bn_mont_mul(table[1], base, m->rr, m);
+  for (i = 2; i < (1 << SPGP_BN_WINDOW); i++)
+  	spgp_bn_mont_mul(table[i], table[i - 1], table[1], m);
+
+	memcpy(acc, table[0], limbs * sizeof(*acc));
+  for (bits = expLimbs * 32; bits; bits -= SPGP_BN_WINDOW) {
+  	for (i = 0; i < SPGP_BN_WINDOW; i++) spgp_bn_mont_mul(acc, acc, acc, m);
+    w = (exp[(bits - 1) / 32] >> ((bits - SPGP_BN_WINDOW) % 32)) &
+    	((1 << SPGP_BN_WINDOW) - 1);
+    spgp_bn_select(tmp, table, 1 << SPGP_BN_WINDOW, w, limbs);
+    spgp_bn_mont_mul(acc, acc, tmp, m);
+  }
+
+	// Back out of Montgomery form
+	memset(tmp, 0, limbs * sizeof(*tmp));
+  tmp[0] = 1;
+  spgp_bn_mont_mul(r, acc, tmp, m);
+
+	spgp_secure_wipe(table, sizeof(table));
+  spgp_secure_wipe(acc, sizeof(acc));
+  spgp_secure_wipe(tmp, sizeof(tmp));
+}
+
+/**
+ * Name the vector unit lane products run on: "avx512f", "avx2", or
+ * "generic" for one lane at a time.
+ */
+const char *spgp_bn_lanes_unit(void) {
+	pthread_once(&lanes_once, spgp_bn_lanes_setup);
+  return lanes_unit;
+}
+
+/**
+ * Run lane products on |unit| instead of the one picked for this CPU, so
+ * each unit can be checked against the others.  Not safe while another
+ * thread is in a lane product.
+ *
+ * @param unit "avx512f", "avx2" or "generic"
+ * @return 0 on success, -1 if this CPU or build has no such unit
+ */
+uint8_t spgp_bn_lanes_select(const char *unit) {
+	pthread_once(&lanes_once, spgp_bn_lanes_setup);
+  if (strcmp(unit, "generic") == 0) {
+  	lanes_kernel = NULL;
+    lanes_unit = "generic";
+    return 0;
+  }
+#ifdef SPGP_BN_X86
+  if (strcmp(unit, "avx512f") == 0 && __builtin_cpu_supports("avx512f")) {
+  	lanes_kernel = spgp_bn_lanes_avx512;
+    lanes_unit = "avx512f";
+    return 0;
+  }
+  if (strcmp(unit, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+  	lanes_kernel = spgp_bn_lanes_avx2;
+    lanes_unit = "avx2";
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+/**
+ * spgp_bn_mont_mul() in every lane at once.  Any of the arrays may be the
+ * same.
+ *
+ * @param r Set to a * b / R mod n in each lane
+ * @param a Lane array below n
+ * @param b Lane array below n
+ * @param m Modulus shared by the lanes
+ */
+void spgp_bn_mont_mul_lanes(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                            const spgp_bn_mont_t *m) {
+	uint32_t x[SPGP_BN_MAX_LIMBS], y[SPGP_BN_MAX_LIMBS];
+  uint32_t limbs = m->limbs;
+  uint32_t j, l;
+
+	pthread_once(&lanes_once, spgp_bn_lanes_setup);
+  if (lanes_kernel) {
+  	spgp_bn_mont_mul_vector(r, a, b, m);
+    return;
+  }
+
+	for (l = 0; l < SPGP_BN_LANES; l++) {
+  	for (j = 0; j < limbs; j++) {
+    	x[j] = (uint32_t)a[j * SPGP_BN_LANES + l];
+      y[j] = (uint32_t)b[j * SPGP_BN_LANES + l];
+    }
+    spgp_bn_mont_mul(x, x, y, m);
+    for (j = 0; j < limbs; j++) r[j * SPGP_BN_LANES + l] = x[j];
+  }
+  spgp_secure_wipe(x, limbs * sizeof(*x));
+  spgp_secure_wipe(y, limbs * sizeof(*y));
+}
+
+/**
+ * spgp_bn_mod_exp() in every lane at once, with one exponent.  Windows
+ * cost the same and the table is read in full, as there.
+ *
+ * @param r Set to base^exp mod n in each lane
+ * @param base Lane array below R
+ * @param exp Exponent, |expLimbs| long
+ * @param expLimbs Length of |exp|
+ * @param m Modulus shared by the lanes
+ * @return 0 on success, -1 if out of memory
+ */
+uint8_t spgp_bn_mod_exp_lanes(uint64_t *r, const uint64_t *base,
+                              const uint32_t *exp, uint32_t expLimbs,
+                              const spgp_bn_mont_t *m) {
+	size_t row = (size_t)m->limbs * SPGP_BN_LANES;
+  size_t size = ((1 << SPGP_BN_WINDOW) + 3) * row * sizeof(uint64_t);
+  uint64_t *table, *acc, *tmp, *rr, mask;
+  uint32_t i, j, w, bits;
+  size_t k;
+
+	// Too big for the stack at 8 lanes, so kept in secure memory
+	table = spgp_secure_alloc(size);
+  if (NULL == table) return -1;
+  acc = table + (1 << SPGP_BN_WINDOW) * row;
+  tmp = acc + row;
+  rr = tmp + row;
+  for (j = 0; j < m->limbs; j++)
+  	for (i = 0; i < SPGP_BN_LANES; i++) rr[j * SPGP_BN_LANES + i] = m->rr[j];
+
+	// Montgomery forms of base^0 to base^15
+	memset(tmp, 0, row * sizeof(*tmp));
+  for (i = 0; i < SPGP_BN_LANES; i++) tmp[i] = 1;
+  spgp_bn_mont_mul_lanes(table, tmp, rr, m);
+  spgp_bn_mont_mul_lanes(table + row, base, rr, m);
+  for (i = 2; i < (1 << SPGP_BN_WINDOW); i++)
+  	spgp_bn_mont_mul_lanes(table + i * row, table + (i - 1) * row,
+                           table + row, m);
+
+	memcpy(acc, table, row * sizeof(*acc));
+  for (bits = expLimbs * 32; bits; bits -= SPGP_BN_WINDOW) {
+  	for (i = 0; i < SPGP_BN_WINDOW; i++)
+    	spgp_bn_mont_mul_lanes(acc, acc, acc, m);
+    w = (exp[(bits - 1) / 32] >> ((bits - SPGP_BN_WINDOW) % 32)) &
+    	((1 << SPGP_BN_WINDOW) - 1);
+    memset(tmp, 0, row * sizeof(*tmp));
+    for (i = 0; i < (1 << SPGP_BN_WINDOW); i++) {
+    	mask = -(uint64_t)(i == w);
+      for (k = 0; k < row; k++) tmp[k] |= table[i * row + k] & mask;
+    }
+    spgp_bn_mont_mul_lanes(acc, acc, tmp, m);
+  }
+
+	// Back out of Montgomery form
+	memset(tmp, 0, row * sizeof(*tmp));
+  for (i = 0; i < SPGP_BN_LANES; i++) tmp[i] = 1;
+  spgp_bn_mont_mul_lanes(r, acc, tmp, m);
+
+	spgp_secure_free(table, size);
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Copy table[index] to |r|, reading every entry.
+ */
+static void spgp_bn_select(uint32_t *r, uint32_t table[][SPGP_BN_MAX_LIMBS],
+                           uint32_t count, uint32_t index, uint32_t limbs) {
+	uint32_t i, j, mask;
+
+	memset(r, 0, limbs * sizeof(*r));
+  for (i = 0; i < count; i++) {
+  	mask = -(uint32_t)(i == index);
+    for (j = 0; j < limbs; j++) r[j] |= table[i][j] & mask;
+  }
+}
+
+static void spgp_bn_lanes_setup(void) {
+#ifdef SPGP_BN_X86
+	__builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+  	lanes_kernel = spgp_bn_lanes_avx512;
+    lanes_unit = "avx512f";
+  }
+  else if (__builtin_cpu_supports("avx2")) {
+  	lanes_kernel = spgp_bn_lanes_avx2;
+    lanes_unit = "avx2";
+  }
+#endif
+}
+
+/**
+ * Lane Montgomery product with the vector kernel, then the final
+ * subtraction of n in every lane.
+ */
+static void spgp_bn_mont_mul_vector(uint64_t *r, const uint64_t *a,
+                                    const uint64_t *b,
+                                    const spgp_bn_mont_t *m) {
+	uint64_t t[(SPGP_BN_MAX_LIMBS + 2) * SPGP_BN_LANES];
+  uint64_t borrow[SPGP_BN_LANES], mask[SPGP_BN_LANES], d;
+  uint32_t limbs = m->limbs;
+  uint32_t j, l;
+
+	memset(t, 0, (limbs + 2) * SPGP_BN_LANES * sizeof(*t));
+  lanes_kernel(t, a, b, m);
+
+	// t < 2n, so at most one subtraction, done either way.  A limb
+  // difference wraps to the top bit when it borrows.
+	memset(borrow, 0, sizeof(borrow));
+  for (j = 0; j < limbs; j++) {
+  	for (l = 0; l < SPGP_BN_LANES; l++) {
+    	d = t[j * SPGP_BN_LANES + l] - m->n[j] - borrow[l];
+      borrow[l] = d >> 63;
+    }
+  }
+  for (l = 0; l < SPGP_BN_LANES; l++)
+  	mask[l] = -(t[limbs * SPGP_BN_LANES + l] | (borrow[l] ^ 1));
+	memset(borrow, 0, sizeof(borrow));
+  for (j = 0; j < limbs; j++) {
+  	for (l = 0; l < SPGP_BN_LANES; l++) {
+    	d = t[j * SPGP_BN_LANES + l] - m->n[j] - borrow[l];
+      borrow[l] = d >> 63;
+      r[j * SPGP_BN_LANES + l] = (d & 0xFFFFFFFF & mask[l]) |
+      	(t[j * SPGP_BN_LANES + l] & ~mask[l]);
+    }
+  }
+  spgp_secure_wipe(t, (limbs + 2) * SPGP_BN_LANES * sizeof(*t));
+}
+
+#ifdef SPGP_BN_X86
+/* The passes of spgp_bn_mont_mul() with a vector register per row of
+   lanes.  vpmuludq multiplies the low 32 bits of each 64-bit word, and the
+   carry is kept in the high half until it is shifted down. */
+#define LOAD(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+
+__attribute__((target("avx2")))
+static void spgp_bn_lanes_avx2(uint64_t *t, const uint64_t *a,
+                               const uint64_t *b, const spgp_bn_mont_t *m) {
+	const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+  const __m256i n0inv = _mm256_set1_epi64x(m->n0inv);
+  const uint32_t limbs = m->limbs;
+  __m256i c, bi, q;
+  uint32_t h, i, j;
+
+	// Two registers hold the 8 lanes, done one after the other
+	for (h = 0; h < SPGP_BN_LANES; h += 4, a += 4, b += 4, t += 4) {
+  	for (i = 0; i < limbs; i++) {
+    	// t += a * b[i]
+    	c = _mm256_setzero_si256();
+      bi = LOAD(b + i * SPGP_BN_LANES);
+      for (j = 0; j < limbs; j++) {
+      	c = _mm256_add_epi64(c, _mm256_add_epi64(
+        	_mm256_mul_epu32(LOAD(a + j * SPGP_BN_LANES), bi),
+          LOAD(t + j * SPGP_BN_LANES)));
+        STORE(t + j * SPGP_BN_LANES, _mm256_and_si256(c, low));
+        c = _mm256_srli_epi64(c, 32);
+      }
+      c = _mm256_add_epi64(c, LOAD(t + limbs * SPGP_BN_LANES));
+      STORE(t + limbs * SPGP_BN_LANES, _mm256_and_si256(c, low));
+      STORE(t + (limbs + 1) * SPGP_BN_LANES, _mm256_srli_epi64(c, 32));
+
+			// t = (t + q * n) / 2^32
+			q = _mm256_and_si256(_mm256_mul_epu32(LOAD(t), n0inv), low);
+      c = _mm256_srli_epi64(_mm256_add_epi64(
+      	_mm256_mul_epu32(q, _mm256_set1_epi64x(m->n[0])), LOAD(t)), 32);
+      for (j = 1; j < limbs; j++) {
+      	c = _mm256_add_epi64(c, _mm256_add_epi64(
+        	_mm256_mul_epu32(q, _mm256_set1_epi64x(m->n[j])),
+          LOAD(t + j * SPGP_BN_LANES)));
+        STORE(t + (j - 1) * SPGP_BN_LANES, _mm256_and_si256(c, low));
+        c = _mm256_srli_epi64(c, 32);
+      }
+      c = _mm256_add_epi64(c, LOAD(t + limbs * SPGP_BN_LANES));
+      STORE(t + (limbs - 1) * SPGP_BN_LANES, _mm256_and_si256(c, low));
+      STORE(t + limbs * SPGP_BN_LANES,
+            _mm256_add_epi64(LOAD(t + (limbs + 1) * SPGP_BN_LANES),
+                             _mm256_srli_epi64(c, 32)));
+    }
+  }
+}
+
+#undef LOAD
+#undef STORE
+#define LOAD(p)     _mm512_loadu_si512((const void *)(p))
+#define STORE(p, v) _mm512_storeu_si512((void *)(p), (v))
+
+__attribute__((target("avx512f")))
+static void spgp_bn_lanes_avx512(uint64_t *t, const uint64_t *a,
+                                 const uint64_t *b, const spgp_bn_mont_t *m) {
+	const __m512i low = _mm512_set1_epi64(0xFFFFFFFF);
+  const __m512i n0inv = _mm512_set1_epi64(m->n0inv);
+  const uint32_t limbs = m->limbs;
+  __m512i c, bi, q;
+  uint32_t i, j;
+
+	for (i = 0; i < limbs; i++) {
+  	// t += a * b[i]
+  	c = _mm512_setzero_si512();
+    bi = LOAD(b + i * SPGP_BN_LANES);
+    for (j = 0; j < limbs; j++) {
+    	c = _mm512_add_epi64(c, _mm512_add_epi64(
+      	_mm512_mul_epu32(LOAD(a + j * SPGP_BN_LANES), bi),
+        LOAD(t + j * SPGP_BN_LANES)));
+      STORE(t + j * SPGP_BN_LANES, _mm512_and_si512(c, low));
+      c = _mm512_srli_epi64(c, 32);
+    }
+    c = _mm512_add_epi64(c, LOAD(t + limbs * SPGP_BN_LANES));
+    STORE(t + limbs * SPGP_BN_LANES, _mm512_and_si512(c, low));
+    STORE(t + (limbs + 1) * SPGP_BN_LANES, _mm512_srli_epi64(c, 32));
+
+		// t = (t + q * n) / 2^32
+		q = _mm512_and_si512(_mm512_mul_epu32(LOAD(t), n0inv), low);
+    c = _mm512_srli_epi64(_mm512_add_epi64(
+    	_mm512_mul_epu32(q, _mm512_set1_epi64(m->n[0])), LOAD(t)), 32);
+    for (j = 1; j < limbs; j++) {
+    	c = _mm512_add_epi64(c, _mm512_add_epi64(
+      	_mm512_mul_epu32(q, _mm512_set1_epi64(m->n[j])),
+        LOAD(t + j * SPGP_BN_LANES)));
+      STORE(t + (j - 1) * SPGP_BN_LANES, _mm512_and_si512(c, low));
+      c = _mm512_srli_epi64(c, 32);
+    }
+    c = _mm512_add_epi64(c, LOAD(t + limbs * SPGP_BN_LANES));
+    STORE(t + (limbs - 1) * SPGP_BN_LANES, _mm512_and_si512(c, low));
+    STORE(t + limbs * SPGP_BN_LANES,
+          _mm512_add_epi64(LOAD(t + (limbs + 1) * SPGP_BN_LANES),
+                           _mm512_srli_epi64(c, 32)));
+  }
+}
+
+#undef LOAD
+#undef STORE
+#endif
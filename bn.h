@@ -0,0 +1,79 @@
+/*
+ *  bn.h
+ *  libsimplepgp
+ *
+ *  Fixed-size big numbers and Montgomery arithmetic for RSA and Elgamal.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _BN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Numbers are arrays of 32-bit limbs, least significant first, all the
+   length of the modulus they are used with. */
+#define SPGP_BN_MAX_BITS  8192
+#define SPGP_BN_MAX_LIMBS (SPGP_BN_MAX_BITS / 32)
+
+/* Lane arrays hold SPGP_BN_LANES numbers worked on together with one
+   modulus.  Limb i of lane l is at [i * SPGP_BN_LANES + l], and each 32-bit
+   limb has a 64-bit word so vector units can multiply limbs in place. */
+#define SPGP_BN_LANES 8
+
+typedef struct spgp_bn_mont_struct {
+	uint32_t n[SPGP_BN_MAX_LIMBS];   // odd modulus
+  uint32_t rr[SPGP_BN_MAX_LIMBS];  // R^2 mod n, with R = 2^(32 * limbs)
+  uint32_t n0inv;                  // -1/n mod 2^32
+  uint32_t limbs;
+} spgp_bn_mont_t;
+
+uint8_t spgp_bn_read(uint32_t *r, uint32_t limbs,
+                     const uint8_t *buf, size_t len);
+void spgp_bn_write(uint8_t *buf, size_t len,
+                   const uint32_t *a, uint32_t limbs);
+uint8_t *spgp_bn_export(const uint32_t *a, uint32_t limbs, size_t *len);
+uint32_t spgp_bn_sub(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     uint32_t limbs);
+uint32_t spgp_bn_add(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     uint32_t limbs);
+void spgp_bn_mul(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                 const uint32_t *b, uint32_t bLimbs);
+void spgp_bn_mod(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                 const uint32_t *m, uint32_t mLimbs);
+
+uint8_t spgp_bn_mont_init(spgp_bn_mont_t *m, const uint8_t *n, size_t len);
+void spgp_bn_mont_mul(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                      const spgp_bn_mont_t *m);
+void spgp_bn_mont_reduce(uint32_t *r, const uint32_t *a, uint32_t aLimbs,
+                         const spgp_bn_mont_t *m);
+void spgp_bn_mod_add(uint32_t *r, const uint32_t *a, const uint32_t *b,
+                     const spgp_bn_mont_t *m);
+void spgp_bn_mod_exp(uint32_t *r, const uint32_t *base,
+                     const uint32_t *exp, uint32_t expLimbs,
+                     const spgp_bn_mont_t *m);
+
+const char *spgp_bn_lanes_unit(void);
+uint8_t spgp_bn_lanes_select(const char *unit);
+void spgp_bn_mont_mul_lanes(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                            const spgp_bn_mont_t *m);
+uint8_t spgp_bn_mod_exp_lanes(uint64_t *r, const uint64_t *base,
+                              const uint32_t *exp, uint32_t expLimbs,
+                              const spgp_bn_mont_t *m);
+
+#define _BN_H
+#endif
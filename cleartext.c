@@ -0,0 +1,268 @@
+/*
+ *  cleartext.c
+ *  libsimplepgp
+ *
+ *  Cleartext signed messages, canonicalized while they are hashed.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "armor.h"
+#include "verify.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_CLEARTEXT_BEGIN "-----BEGIN PGP SIGNED MESSAGE-----"
+#define SPGP_CLEARTEXT_SIG   "-----BEGIN PGP SIGNATURE-----"
+
+// Short pieces, like the lines of LF text and their new CR LFs, are
+// gathered here so the hashes aren't called a few times per line.  Longer
+// pieces go to the hashes directly.
+#define SPGP_CLEARTEXT_STAGE  4096
+#define SPGP_CLEARTEXT_DIRECT 256
+
+typedef struct {
+	spgp_sig_md_t *md;        // binary, canonical text
+  size_t len;
+  uint8_t buf[SPGP_CLEARTEXT_STAGE];
+} spgp_cleartext_out_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static uint8_t *spgp_cleartext_find_line(uint8_t *p, uint8_t *end,
+                                         const char *marker);
+
+static void spgp_cleartext_hash(spgp_sig_md_t md[2],
+                                const uint8_t *text, const uint8_t *end);
+
+static void spgp_cleartext_write(spgp_cleartext_out_t *out,
+                                 const uint8_t *data, size_t len);
+
+static void spgp_cleartext_flush(spgp_cleartext_out_t *out);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_verify_cleartext(uint8_t *message, size_t length,
+                              spgp_packet_t *keys) {
+	spgp_packet_t * volatile head = NULL;
+  spgp_packet_t *cur;
+  spgp_packet_t *key;
+  spgp_signature_pkt_t *sig;
+  spgp_sig_md_t md[2] = { NULL, NULL }; // binary, canonical text
+  spgp_sig_md_t copy;
+  uint8_t *dearmored = NULL;
+  uint8_t * volatile binary = NULL;
+  uint8_t *p, *end, *text, *sigline, *eol;
+  size_t binlen = 0;
+  size_t idx = 0;
+  uint32_t count = 0;
+  spgp_sig_status_t status = SPGP_SIG_GOOD;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    if (md[0]) spgp_sig_hash_close(md[0]);
+    if (md[1]) spgp_sig_hash_close(md[1]);
+    spgp_free_packet((spgp_packet_t **)&head);
+    free(binary);
+    return -1;
+  }
+
+	if (NULL == message || 0 == length) RAISE(INVALID_ARGS);
+  end = message + length;
+
+	/* RFC 4880 - 7
+   The cleartext signed message consists of:
+   - The cleartext header '-----BEGIN PGP SIGNED MESSAGE-----' on a
+     single line,
+   - One or more "Hash" Armor Headers,
+   - Exactly one empty line not included into the message digest,
+   - The dash-escaped cleartext that is included into the message digest,
+   - The ASCII armored signature(s) including the '-----BEGIN PGP
+     SIGNATURE-----' Armor Header and Armor Tail Lines. */
+  p = spgp_cleartext_find_line(message, end, SPGP_CLEARTEXT_BEGIN);
+  if (NULL == p) RAISE(FORMAT_UNSUPPORTED);
+
+	// The hash headers only name the algorithms; the signatures say which
+  // one was used, so the headers are skipped up to the empty line.
+  text = NULL;
+  while (p < end) {
+  	eol = memchr(p, '\n', end - p);
+    p = eol ? eol + 1 : end;
+    eol = p;
+    while (eol < end && (*eol == ' ' || *eol == '\t' || *eol == '\r')) eol++;
+    if (eol < end && *eol == '\n') {
+    	text = eol + 1;
+      break;
+    }
+  }
+  if (NULL == text) RAISE(ARMOR_ERROR);
+
+	// The line ending before the signature belongs to the signature
+	sigline = spgp_cleartext_find_line(text, end, SPGP_CLEARTEXT_SIG);
+  if (NULL == sigline) RAISE(ARMOR_ERROR);
+
+	spgp_armor_decode(sigline, end - sigline, &dearmored, &binlen);
+  binary = dearmored;
+  if (0 == binlen) RAISE(INVALID_HEADER);
+  head = spgp_packet_decode_loop(binary, &idx, binlen);
+  free(binary);
+  binary = NULL;
+
+	// Every algorithm in use is enabled on one handle per form, so the text
+  // is canonicalized and hashed once for all of the signatures.
+  for (cur = head; cur; cur = cur->next) {
+  	if (cur->header->type != PKT_TYPE_SIGNATURE || NULL == cur->c.signature)
+    	continue;
+    spgp_sig_hash_share(md, cur);
+    count++;
+  }
+  if (0 == count) RAISE(INVALID_ARGS);
+  spgp_cleartext_hash(md, text, sigline > text ? sigline - 1 : text);
+
+	// Every signature must be good
+	for (cur = head; cur; cur = cur->next) {
+  	if (cur->header->type != PKT_TYPE_SIGNATURE || NULL == cur->c.signature)
+    	continue;
+    sig = cur->c.signature;
+    if (sig->status != SPGP_SIG_UNSUPPORTED &&
+        (key = spgp_sig_prepare(cur, keys)) != NULL) {
+    	copy = spgp_sig_hash_copy(md[sig->type == SIG_TYPE_TEXT]);
+      spgp_sig_finish(cur, key, copy);
+      spgp_sig_hash_close(copy);
+    }
+    if (sig->status != SPGP_SIG_GOOD && status == SPGP_SIG_GOOD)
+    	status = sig->status;
+    Serial.printf("Signature status: %u\n", sig->status);
+  }
+
+	if (md[0]) spgp_sig_hash_close(md[0]);
+  if (md[1]) spgp_sig_hash_close(md[1]);
+  md[0] = md[1] = NULL;
+  spgp_free_packet((spgp_packet_t **)&head);
+
+	if (status != SPGP_SIG_GOOD) RAISE(spgp_sig_status_error(status));
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Find the first line from |p| that starts with |marker|.
+ */
+static uint8_t *spgp_cleartext_find_line(uint8_t *p, uint8_t *end,
+                                         const char *marker) {
+	size_t len = strlen(marker);
+  uint8_t *nl;
+
+	while ((size_t)(end - p) >= len) {
+  	if (memcmp(p, marker, len) == 0) return p;
+    nl = memchr(p, '\n', end - p);
+    if (NULL == nl) break;
+    p = nl + 1;
+  }
+  return NULL;
+}
+
+/**
+ * Hash the cleartext from |text| to |end| as signed: dash escapes removed,
+ * trailing spaces and tabs removed, and lines ended with CR LF.
+ *
+ * Line ends are found with memchr(), which the C library vectorizes, and
+ * the other rules only look at the two ends of each line.  Lines that are
+ * already canonical, as in CR LF mail, are hashed in one run straight from
+ * the message, so only short pieces are ever copied.
+ */
+static void spgp_cleartext_hash(spgp_sig_md_t md[2],
+                                const uint8_t *text, const uint8_t *end) {
+	spgp_cleartext_out_t out;
+	const uint8_t *p = text;
+  const uint8_t *run = text;    // start of lines that need no changes
+  const uint8_t *nl, *start, *stop;
+
+	out.md = md;
+  out.len = 0;
+	while (p < end) {
+  	nl = memchr(p, '\n', end - p);
+    stop = nl ? nl : end;
+    start = p;
+    if (stop - start >= 2 && start[0] == '-' && start[1] == ' ') start += 2;
+    while (stop > start &&
+           (stop[-1] == ' ' || stop[-1] == '\t' || stop[-1] == '\r'))
+    	stop--;
+
+		// Already "content CR LF" in the message
+		if (start == p && nl && stop == nl - 1 && *stop == '\r') {
+    	p = nl + 1;
+      continue;
+    }
+
+		spgp_cleartext_write(&out, run, p - run);
+    spgp_cleartext_write(&out, start, stop - start);
+    if (nl) spgp_cleartext_write(&out, (const uint8_t *)"\r\n", 2);
+    p = nl ? nl + 1 : end;
+    run = p;
+  }
+  spgp_cleartext_write(&out, run, p - run);
+  spgp_cleartext_flush(&out);
+}
+
+static void spgp_cleartext_write(spgp_cleartext_out_t *out,
+                                 const uint8_t *data, size_t len) {
+	if (len >= SPGP_CLEARTEXT_DIRECT) {
+  	spgp_cleartext_flush(out);
+    if (out->md[0]) spgp_sig_hash_write(out->md[0], data, len);
+    if (out->md[1]) spgp_sig_hash_write(out->md[1], data, len);
+    return;
+  }
+  if (len > sizeof(out->buf) - out->len) spgp_cleartext_flush(out);
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+}
+
+static void spgp_cleartext_flush(spgp_cleartext_out_t *out) {
+	if (0 == out->len) return;
+	if (out->md[0]) spgp_sig_hash_write(out->md[0], out->buf, out->len);
+  if (out->md[1]) spgp_sig_hash_write(out->md[1], out->buf, out->len);
+  out->len = 0;
+}
@@ -0,0 +1,367 @@
+/*
+ *  crypto.c
+ *  libsimplepgp
+ *
+ *  Hashes, ciphers and public key operations behind a choice of backends.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "crypto.h"
+#include "secmem.h"
+
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Tried in order after the selected one, for algorithms it lacks
+static const spgp_crypto_backend_t *backends[] = {
+#ifdef HAVE_GCRYPT
+	&spgp_crypto_gcrypt,
+#endif
+  &spgp_crypto_builtin,
+};
+#define SPGP_CRYPTO_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+// Built with SPGP_CRYPTO_BUILTIN, the library doesn't call libgcrypt for
+// anything the built-in backend has.  Without HAVE_GCRYPT it is the only
+// backend.
+#if defined(SPGP_CRYPTO_BUILTIN) || !defined(HAVE_GCRYPT)
+static const spgp_crypto_backend_t *selected = &spgp_crypto_builtin;
+#else
+static const spgp_crypto_backend_t *selected = &spgp_crypto_gcrypt;
+#endif
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_crypto_backend_select(const char *name) {
+	const spgp_crypto_backend_t *backend;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	backend = spgp_crypto_backend_find(name);
+  if (NULL == backend) RAISE(INVALID_ARGS);
+  selected = backend;
+  return 0;
+}
+
+const char *spgp_crypto_backend_name(void) {
+	return selected->name;
+}
+
+const spgp_crypto_backend_t *spgp_crypto_backend(void) {
+	return selected;
+}
+
+/**
+ * Find a backend by name.
+ *
+ * @param name "gcrypt" or "builtin"
+ * @return The backend, or NULL if there is none by that name
+ */
+const spgp_crypto_backend_t *spgp_crypto_backend_find(const char *name) {
+	uint32_t i;
+
+	if (NULL == name) return NULL;
+  for (i = 0; i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (strcmp(backends[i]->name, name) == 0) return backends[i];
+  return NULL;
+}
+
+/**
+ * Get the digest length of a hash algorithm.
+ *
+ * @return Length in bytes, or 0 if it isn't supported
+ */
+uint8_t spgp_crypto_hash_length(uint8_t algo) {
+	switch (algo) {
+  	case HASH_ALGO_MD5: return 16;
+    case HASH_ALGO_SHA1: return 20;
+    case HASH_ALGO_RIPEMD160: return 20;
+    case HASH_ALGO_SHA256: return 32;
+    case HASH_ALGO_SHA384: return 48;
+    case HASH_ALGO_SHA512: return 64;
+    case HASH_ALGO_SHA224: return 28;
+    default: return 0;
+  }
+}
+
+/**
+ * Start a hash.  Raises FORMAT_UNSUPPORTED if no backend has |algo|.
+ */
+spgp_crypto_hash_t *spgp_crypto_hash_open(uint8_t algo) {
+	spgp_crypto_hash_t *hash;
+  uint32_t i;
+
+	hash = selected->hash_open(algo);
+  for (i = 0; NULL == hash && i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (backends[i] != selected) hash = backends[i]->hash_open(algo);
+  if (NULL == hash) RAISE(FORMAT_UNSUPPORTED);
+  return hash;
+}
+
+void spgp_crypto_hash_write(spgp_crypto_hash_t *hash,
+                            const void *data, size_t len) {
+	hash->backend->hash_write(hash, data, len);
+}
+
+const uint8_t *spgp_crypto_hash_read(spgp_crypto_hash_t *hash) {
+	return hash->backend->hash_read(hash);
+}
+
+void spgp_crypto_hash_reset(spgp_crypto_hash_t *hash) {
+	hash->backend->hash_reset(hash);
+}
+
+void spgp_crypto_hash_close(spgp_crypto_hash_t *hash) {
+	if (hash) hash->backend->hash_close(hash);
+}
+
+/**
+ * Start CFB decryption with a zero IV.  Raises FORMAT_UNSUPPORTED if no
+ * backend has |algo|.
+ */
+spgp_crypto_cipher_t *spgp_crypto_cipher_open(uint8_t algo,
+                                              const uint8_t *key,
+                                              size_t keylen) {
+	spgp_crypto_cipher_t *cipher;
+  uint32_t i;
+
+	cipher = selected->cipher_open(algo, key, keylen);
+  for (i = 0; NULL == cipher && i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (backends[i] != selected)
+    	cipher = backends[i]->cipher_open(algo, key, keylen);
+  if (NULL == cipher) RAISE(FORMAT_UNSUPPORTED);
+  return cipher;
+}
+
+/**
+ * Restart |cipher| with |iv|, one block long, or zeros if NULL.
+ */
+void spgp_crypto_cipher_setiv(spgp_crypto_cipher_t *cipher,
+                              const uint8_t *iv) {
+	cipher->backend->cipher_setiv(cipher, iv);
+}
+
+/**
+ * Decrypt |len| bytes from |in| to |out|, which may be the same.
+ *
+ * @return 0 for success, -1 for failure
+ */
+uint8_t spgp_crypto_cipher_decrypt(spgp_crypto_cipher_t *cipher,
+                                   uint8_t *out, const uint8_t *in,
+                                   size_t len) {
+	return cipher->backend->cipher_decrypt(cipher, out, in, len);
+}
+
+void spgp_crypto_cipher_close(spgp_crypto_cipher_t *cipher) {
+	if (cipher) cipher->backend->cipher_close(cipher);
+}
+
+/**
+ * Decrypt a session key with a secret key.
+ *
+ * @param algo ASYM_ALGO_RSA, ASYM_ALGO_ELGAMAL or ASYM_ALGO_ECDH
+ * @param key Keychain key the session is encrypted to
+ * @param c1 First MPI of the session key packet
+ * @param c2 Second MPI for Elgamal, otherwise NULL
+ * @param len Set to the length of the result
+ * @return The result without leading zeros, in secure memory.  For ECDH
+ *         it is the shared X coordinate with its leading zeros, for
+ *         spgp_ecdh_decrypt().  Free with spgp_secure_free().
+ */
+uint8_t *spgp_crypto_pk_decrypt(uint8_t algo,
+                                const spgp_keychain_key_t *key,
+                                const spgp_mpi_t *c1, const spgp_mpi_t *c2,
+                                size_t *len) {
+	uint8_t *frame;
+  uint32_t i;
+
+	frame = selected->pk_decrypt(algo, key, c1, c2, len);
+  for (i = 0; NULL == frame && i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (backends[i] != selected)
+    	frame = backends[i]->pk_decrypt(algo, key, c1, c2, len);
+  if (NULL == frame) RAISE(FORMAT_UNSUPPORTED);
+  return frame;
+}
+
+/**
+ * Unwrap a key wrapped with RFC 3394 AES key wrap.
+ *
+ * @param algo SYM_ALGO_AES128, SYM_ALGO_AES192 or SYM_ALGO_AES256
+ * @param kek Key encryption key, the size |algo| takes
+ * @param in Wrapped key, a multiple of 8 bytes and at least 24
+ * @param len Length of |in|
+ * @param outLen Set to the length of the result, 8 less than |len|
+ * @return The key in secure memory.  Free with spgp_secure_free().
+ */
+uint8_t *spgp_crypto_key_unwrap(uint8_t algo, const uint8_t *kek,
+                                const uint8_t *in, size_t len,
+                                size_t *outLen) {
+	uint8_t *out;
+  uint32_t i;
+
+	if (NULL == kek || NULL == in || NULL == outLen) RAISE(INVALID_ARGS);
+  if (len < 24 || len % 8) RAISE(DECRYPT_FAILED);
+	out = selected->key_unwrap(algo, kek, in, len, outLen);
+  for (i = 0; NULL == out && i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (backends[i] != selected)
+    	out = backends[i]->key_unwrap(algo, kek, in, len, outLen);
+  if (NULL == out) RAISE(FORMAT_UNSUPPORTED);
+  return out;
+}
+
+/**
+ * HMAC of the |count| pieces in |data| with a key no longer than a block.
+ * |inner| and |outer| are open hashes of the same algorithm.
+ */
+static void spgp_crypto_hmac(spgp_crypto_hash_t *inner,
+                             spgp_crypto_hash_t *outer, uint8_t dlen,
+                             const uint8_t *key, size_t keyLen,
+                             const uint8_t **data, const size_t *len,
+                             uint32_t count, uint8_t *out) {
+	uint8_t pad[128];
+  size_t block = dlen > 32 ? 128 : 64;
+  size_t i;
+
+	memset(pad, 0x36, block);
+  for (i = 0; i < keyLen; i++) pad[i] ^= key[i];
+  spgp_crypto_hash_reset(inner);
+  spgp_crypto_hash_write(inner, pad, block);
+  for (i = 0; i < count; i++) spgp_crypto_hash_write(inner, data[i], len[i]);
+  for (i = 0; i < block; i++) pad[i] ^= 0x36 ^ 0x5c;
+  spgp_crypto_hash_reset(outer);
+  spgp_crypto_hash_write(outer, pad, block);
+  spgp_crypto_hash_write(outer, spgp_crypto_hash_read(inner), dlen);
+  memcpy(out, spgp_crypto_hash_read(outer), dlen);
+  spgp_secure_wipe(pad, sizeof(pad));
+}
+
+/**
+ * HKDF (RFC 5869) with HMAC over hash |algo|.
+ *
+ * @param salt At most one hash block long
+ * @param out Set to |outLen| bytes of key material, at most 255 digests
+ */
+void spgp_crypto_hkdf(uint8_t algo, const uint8_t *ikm, size_t ikmLen,
+                      const uint8_t *salt, size_t saltLen,
+                      const uint8_t *info, size_t infoLen,
+                      uint8_t *out, size_t outLen) {
+	spgp_crypto_hash_t *inner, *outer;
+  uint8_t prk[SPGP_CRYPTO_MAX_DIGEST], t[SPGP_CRYPTO_MAX_DIGEST];
+  uint8_t dlen = spgp_crypto_hash_length(algo);
+  const uint8_t *data[3];
+  size_t len[3];
+  uint8_t counter;
+  size_t n, step;
+
+	if (0 == dlen || outLen > 255 * (size_t)dlen) RAISE(INVALID_ARGS);
+  if (saltLen > (dlen > 32 ? 128U : 64U)) RAISE(INVALID_ARGS);
+
+	inner = spgp_crypto_hash_open(algo);
+  outer = spgp_crypto_hash_open(algo);
+
+	// Extract: PRK = HMAC(salt, IKM)
+	data[0] = ikm;
+  len[0] = ikmLen;
+  spgp_crypto_hmac(inner, outer, dlen, salt, saltLen, data, len, 1, prk);
+
+	// Expand: T(n) = HMAC(PRK, T(n - 1) | info | n), with T(0) empty
+	data[0] = t;
+  len[0] = 0;
+  data[1] = info;
+  len[1] = infoLen;
+  data[2] = &counter;
+  len[2] = 1;
+  for (counter = 1, n = 0; n < outLen; counter++) {
+  	spgp_crypto_hmac(inner, outer, dlen, prk, dlen, data, len, 3, t);
+    len[0] = dlen;
+    step = outLen - n < dlen ? outLen - n : dlen;
+    memcpy(out + n, t, step);
+    n += step;
+  }
+  spgp_crypto_hash_close(inner);
+  spgp_crypto_hash_close(outer);
+  spgp_secure_wipe(prk, sizeof(prk));
+  spgp_secure_wipe(t, sizeof(t));
+}
+
+/**
+ * Get the nonce length of an AEAD mode.
+ *
+ * @return Length in bytes, or 0 if it isn't supported
+ */
+uint8_t spgp_crypto_aead_nonce_length(uint8_t mode) {
+	switch (mode) {
+  	case AEAD_ALGO_EAX: return 16;
+    case AEAD_ALGO_OCB: return 15;
+    case AEAD_ALGO_GCM: return 12;
+    default: return 0;
+  }
+}
+
+/**
+ * Prepare AEAD decryption.  Raises FORMAT_UNSUPPORTED if no backend has
+ * |algo| in |mode|.
+ */
+spgp_crypto_aead_t *spgp_crypto_aead_open(uint8_t algo, uint8_t mode,
+                                          const uint8_t *key,
+                                          size_t keylen) {
+	spgp_crypto_aead_t *aead;
+  uint32_t i;
+
+	if (0 == spgp_crypto_aead_nonce_length(mode)) RAISE(FORMAT_UNSUPPORTED);
+	aead = selected->aead_open(algo, mode, key, keylen);
+  for (i = 0; NULL == aead && i < SPGP_CRYPTO_BACKENDS; i++)
+  	if (backends[i] != selected)
+    	aead = backends[i]->aead_open(algo, mode, key, keylen);
+  if (NULL == aead) RAISE(FORMAT_UNSUPPORTED);
+  return aead;
+}
+
+/**
+ * Decrypt |len| bytes from |in| to |out| and check them against |tag|.
+ *
+ * @param nonce The mode's nonce length of bytes
+ * @param tag SPGP_CRYPTO_AEAD_TAG bytes following the ciphertext
+ */
+void spgp_crypto_aead_decrypt(spgp_crypto_aead_t *aead,
+                              const uint8_t *nonce,
+                              const uint8_t *ad, size_t adLen,
+                              uint8_t *out, const uint8_t *in, size_t len,
+                              const uint8_t *tag) {
+	aead->backend->aead_decrypt(aead, nonce, ad, adLen, out, in, len, tag);
+}
+
+void spgp_crypto_aead_close(spgp_crypto_aead_t *aead) {
+	if (aead) aead->backend->aead_close(aead);
+}
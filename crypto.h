@@ -0,0 +1,150 @@
+/*
+ *  crypto.h
+ *  libsimplepgp
+ *
+ *  Hashes, ciphers and public key operations behind a choice of backends.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _CRYPTO_H
+
+#include "packet_private.h"
+#include "keychain.h"
+
+// Longest digest a backend returns, SHA-512
+#define SPGP_CRYPTO_MAX_DIGEST 64
+// Every AEAD mode OpenPGP uses has a 16 byte tag
+#define SPGP_CRYPTO_AEAD_TAG   16
+// Longest AEAD nonce, EAX's
+#define SPGP_CRYPTO_MAX_NONCE  16
+
+typedef struct spgp_crypto_backend_struct spgp_crypto_backend_t;
+
+/* Every backend's handles start with the backend that made them, so they
+   keep working if another backend is selected while they are open. */
+typedef struct spgp_crypto_hash_struct {
+	const spgp_crypto_backend_t *backend;
+} spgp_crypto_hash_t;
+
+typedef struct spgp_crypto_cipher_struct {
+	const spgp_crypto_backend_t *backend;
+  uint8_t blksize;
+} spgp_crypto_cipher_t;
+
+typedef struct spgp_crypto_aead_struct {
+	const spgp_crypto_backend_t *backend;
+  uint8_t nonceLen;
+} spgp_crypto_aead_t;
+
+/* Algorithms are RFC 4880 IDs.  Opening one the backend lacks returns
+   NULL, and the call goes to the other backend if there is one.  Other
+   failures raise. */
+struct spgp_crypto_backend_struct {
+	const char *name;
+
+	spgp_crypto_hash_t *(*hash_open)(uint8_t algo);
+  void (*hash_write)(spgp_crypto_hash_t *hash, const void *data, size_t len);
+  // Finishes the hash.  The digest lasts until it is reset or closed.
+  const uint8_t *(*hash_read)(spgp_crypto_hash_t *hash);
+  void (*hash_reset)(spgp_crypto_hash_t *hash);
+  void (*hash_close)(spgp_crypto_hash_t *hash);
+
+	// CFB mode, without OpenPGP's resync.  Calls may be any length.
+	spgp_crypto_cipher_t *(*cipher_open)(uint8_t algo, const uint8_t *key,
+                                       size_t keylen);
+  void (*cipher_setiv)(spgp_crypto_cipher_t *cipher, const uint8_t *iv);
+  uint8_t (*cipher_decrypt)(spgp_crypto_cipher_t *cipher, uint8_t *out,
+                            const uint8_t *in, size_t len);
+  void (*cipher_close)(spgp_crypto_cipher_t *cipher);
+
+	// Raw RSA or Elgamal decryption with a keychain key, which may hold
+  // state a backend works out once per key.  For ECDH, c1 is the sender's
+  // ephemeral point and the result is the shared point's X coordinate, at
+  // the curve's full size.
+	uint8_t *(*pk_decrypt)(uint8_t algo, const spgp_keychain_key_t *key,
+                         const spgp_mpi_t *c1, const spgp_mpi_t *c2,
+                         size_t *len);
+
+	// RFC 3394 AES key unwrap, with a key the size |algo| takes.  Raises
+  // DECRYPT_FAILED if the integrity check fails.
+  uint8_t *(*key_unwrap)(uint8_t algo, const uint8_t *kek,
+                         const uint8_t *in, size_t len, size_t *outLen);
+
+	// AEAD decryption in mode |mode| (AEAD_ALGO_*) with a 128-bit block
+  // cipher.  A handle may be used for any number of chunks, by one thread
+  // at a time.  aead_decrypt raises DECRYPT_FAILED if the tag doesn't
+  // match, and |out| must then be thrown away.
+	spgp_crypto_aead_t *(*aead_open)(uint8_t algo, uint8_t mode,
+                                   const uint8_t *key, size_t keylen);
+  void (*aead_decrypt)(spgp_crypto_aead_t *aead, const uint8_t *nonce,
+                       const uint8_t *ad, size_t adLen, uint8_t *out,
+                       const uint8_t *in, size_t len, const uint8_t *tag);
+  void (*aead_close)(spgp_crypto_aead_t *aead);
+};
+
+#ifdef HAVE_GCRYPT
+extern const spgp_crypto_backend_t spgp_crypto_gcrypt;
+#endif
+extern const spgp_crypto_backend_t spgp_crypto_builtin;
+
+const spgp_crypto_backend_t *spgp_crypto_backend(void);
+const spgp_crypto_backend_t *spgp_crypto_backend_find(const char *name);
+
+uint8_t spgp_crypto_hash_length(uint8_t algo);
+spgp_crypto_hash_t *spgp_crypto_hash_open(uint8_t algo);
+void spgp_crypto_hash_write(spgp_crypto_hash_t *hash,
+                            const void *data, size_t len);
+const uint8_t *spgp_crypto_hash_read(spgp_crypto_hash_t *hash);
+void spgp_crypto_hash_reset(spgp_crypto_hash_t *hash);
+void spgp_crypto_hash_close(spgp_crypto_hash_t *hash);
+
+spgp_crypto_cipher_t *spgp_crypto_cipher_open(uint8_t algo,
+                                              const uint8_t *key,
+                                              size_t keylen);
+void spgp_crypto_cipher_setiv(spgp_crypto_cipher_t *cipher,
+                              const uint8_t *iv);
+uint8_t spgp_crypto_cipher_decrypt(spgp_crypto_cipher_t *cipher,
+                                   uint8_t *out, const uint8_t *in,
+                                   size_t len);
+void spgp_crypto_cipher_close(spgp_crypto_cipher_t *cipher);
+
+uint8_t *spgp_crypto_pk_decrypt(uint8_t algo,
+                                const spgp_keychain_key_t *key,
+                                const spgp_mpi_t *c1, const spgp_mpi_t *c2,
+                                size_t *len);
+uint8_t *spgp_crypto_key_unwrap(uint8_t algo, const uint8_t *kek,
+                                const uint8_t *in, size_t len,
+                                size_t *outLen);
+
+void spgp_crypto_hkdf(uint8_t algo, const uint8_t *ikm, size_t ikmLen,
+                      const uint8_t *salt, size_t saltLen,
+                      const uint8_t *info, size_t infoLen,
+                      uint8_t *out, size_t outLen);
+
+uint8_t spgp_crypto_aead_nonce_length(uint8_t mode);
+spgp_crypto_aead_t *spgp_crypto_aead_open(uint8_t algo, uint8_t mode,
+                                          const uint8_t *key,
+                                          size_t keylen);
+void spgp_crypto_aead_decrypt(spgp_crypto_aead_t *aead,
+                              const uint8_t *nonce,
+                              const uint8_t *ad, size_t adLen,
+                              uint8_t *out, const uint8_t *in, size_t len,
+                              const uint8_t *tag);
+void spgp_crypto_aead_close(spgp_crypto_aead_t *aead);
+
+#define _CRYPTO_H
+#endif
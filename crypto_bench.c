@@ -0,0 +1,736 @@
+/*
+ *  crypto_bench.c
+ *  libsimplepgp
+ *
+ *  spgp-crypto-bench: compares the crypto backends on the same inputs,
+ *  and times armor decoding and packet scanning.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "crypto.h"
+#include "bn.h"
+#include "keychain.h"
+#include "mpi.h"
+#include "rsa.h"
+#include "ecc.h"
+#include "secmem.h"
+#include "aead.h"
+#include "armor.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Bulk data hashed and decrypted per run
+#define SPGP_BENCH_BULK   (64 << 20)
+#define SPGP_BENCH_CHUNK  (64 << 10)
+
+// Private key operations per key, and keys timed
+#define SPGP_BENCH_PK_OPS  50
+#define SPGP_BENCH_PK_KEYS 16
+
+// Batches of SPGP_BN_LANES ciphertexts timed per RSA key
+#define SPGP_BENCH_LANE_BATCHES 8
+
+// AEAD chunk size octet, for 256 KiB chunks, and the most threads timed
+#define SPGP_BENCH_AEAD_CHUNK_BITS 12
+#define SPGP_BENCH_AEAD_THREADS    8
+
+// Base64 characters per armor line, as written by GnuPG
+#define SPGP_BENCH_ARMOR_LINE 64
+
+// Size of the synthetic keyring walked by the packet scanner
+#define SPGP_BENCH_KEYRING ((size_t)1 << 30)
+
+static const spgp_crypto_backend_t *bench_backends[] = {
+#ifdef HAVE_GCRYPT
+	&spgp_crypto_gcrypt,
+#endif
+  &spgp_crypto_builtin,
+};
+#define SPGP_BENCH_BACKENDS \
+	(sizeof(bench_backends) / sizeof(bench_backends[0]))
+
+static const struct {
+	const char *name;
+  uint8_t algo;
+  uint8_t keylen;
+} bench_ciphers[] = {
+	{ "CAST5-CFB", SYM_ALGO_CAST5, 16 },
+  { "AES128-CFB", SYM_ALGO_AES128, 16 },
+  { "AES256-CFB", SYM_ALGO_AES256, 32 },
+};
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static void spgp_bench_usage(void);
+static double spgp_bench_now(void);
+static uint8_t spgp_bench_hash(uint8_t *data);
+static uint8_t spgp_bench_cipher(uint8_t *data, uint8_t *out);
+static uint8_t spgp_bench_pk(void);
+static uint8_t spgp_bench_lanes(const spgp_keychain_key_t *key,
+                                const uint8_t *cdata, uint32_t mlen);
+static uint8_t spgp_bench_ecdh(const spgp_keychain_key_t *key);
+#ifdef HAVE_GCRYPT
+static uint8_t spgp_bench_aead(uint8_t *data, uint8_t *out);
+static void spgp_bench_aead_emit(void *ctx, const uint8_t *data, size_t len);
+#endif
+static uint8_t spgp_bench_armor(uint8_t *data);
+static uint8_t *spgp_bench_base64(uint8_t *p, const uint8_t *in, size_t len);
+static uint8_t spgp_bench_scan(void);
+static uint8_t *spgp_bench_packet(uint8_t *p, uint8_t type, uint32_t len,
+                                  uint8_t newFormat);
+static int spgp_bench_scan_count(const spgp_span_t *span, void *ctx);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+int main(int argc, char **argv) {
+	uint8_t *data, *out;
+  uint8_t err = 0;
+  size_t i;
+  int arg;
+
+	if (argc % 2 == 0) {
+  	spgp_bench_usage();
+    return 1;
+  }
+	if (spgp_init() != 0) {
+  	fprintf(stderr, "spgp-crypto-bench: %s\n", spgp_err_str(spgp_err()));
+    return 1;
+  }
+  for (arg = 1; arg < argc; arg += 2) {
+  	spgp_packet_t *pkt = spgp_decode_file(argv[arg]);
+    if (NULL == pkt ||
+        spgp_decrypt_all_secret_keys(pkt, (uint8_t *)argv[arg + 1],
+                                     strlen(argv[arg + 1])) != 0) {
+    	fprintf(stderr, "spgp-crypto-bench: %s: %s\n", argv[arg],
+              spgp_err_str(spgp_err()));
+      spgp_free_packet(&pkt);
+      spgp_close();
+      return 1;
+    }
+    spgp_free_packet(&pkt);
+  }
+
+	data = malloc(SPGP_BENCH_BULK);
+  out = malloc(SPGP_BENCH_BULK);
+  if (NULL == data || NULL == out) {
+  	fprintf(stderr, "spgp-crypto-bench: out of memory\n");
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < SPGP_BENCH_BULK; i++) data[i] = rand();
+
+	if (setjmp(exception)) {
+  	fprintf(stderr, "spgp-crypto-bench: %s\n", spgp_err_str(_spgp_err));
+    err = -1;
+  }
+  else {
+  	err |= spgp_bench_hash(data);
+    err |= spgp_bench_cipher(data, out);
+#ifdef HAVE_GCRYPT
+    // The AEAD input is made with libgcrypt
+    err |= spgp_bench_aead(data, out);
+#endif
+    err |= spgp_bench_armor(data);
+    err |= spgp_bench_scan();
+    if (argc > 1) err |= spgp_bench_pk();
+  }
+
+	free(data);
+  free(out);
+  spgp_close();
+  return err ? 1 : 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static void spgp_bench_usage(void) {
+	fprintf(stderr,
+    "usage: spgp-crypto-bench [secret-key passphrase]...\n"
+    "\n"
+    "Times SHA-1, CFB decryption, AEAD decryption on 1 to 8 threads and,\n"
+    "given secret key files, their RSA or Elgamal private key operations on\n"
+    "each backend.  Dearmoring 64 MB and scanning a 1 GB synthetic keyring\n"
+    "are timed too.  The first operation\n"
+    "with a key is shown apart, as it includes any per-key setup.  RSA keys\n"
+    "are also timed in batches across vector lanes against one at a time.\n"
+    "Results that differ are reported and fail the run.\n");
+}
+
+static double spgp_bench_now(void) {
+	struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t spgp_bench_hash(uint8_t *data) {
+	uint8_t digest[SPGP_BENCH_BACKENDS][SPGP_CRYPTO_MAX_DIGEST];
+	const spgp_crypto_backend_t *be;
+  spgp_crypto_hash_t *md;
+  double start, secs;
+  size_t off;
+  uint32_t i;
+
+	for (i = 0; i < SPGP_BENCH_BACKENDS; i++) {
+  	be = bench_backends[i];
+    start = spgp_bench_now();
+    md = be->hash_open(HASH_ALGO_SHA1);
+    for (off = 0; off < SPGP_BENCH_BULK; off += SPGP_BENCH_CHUNK)
+    	be->hash_write(md, data + off, SPGP_BENCH_CHUNK);
+    memcpy(digest[i], be->hash_read(md), 20);
+    be->hash_close(md);
+    secs = spgp_bench_now() - start;
+    printf("%-12s %-8s %8.1f MB/s\n", "SHA1", be->name,
+           SPGP_BENCH_BULK / secs / 1e6);
+  }
+  for (i = 1; i < SPGP_BENCH_BACKENDS; i++) {
+  	if (memcmp(digest[0], digest[i], 20) != 0) {
+    	printf("SHA1: %s differs\n", bench_backends[i]->name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static uint8_t spgp_bench_cipher(uint8_t *data, uint8_t *out) {
+	uint8_t key[32], iv[16], check[SPGP_BENCH_BACKENDS][20];
+	const spgp_crypto_backend_t *be;
+  spgp_crypto_cipher_t *cipher;
+  spgp_crypto_hash_t *md;
+  double start, secs;
+  uint8_t err = 0;
+  size_t off;
+  uint32_t c, i;
+
+	for (i = 0; i < sizeof(key); i++) key[i] = rand();
+  for (i = 0; i < sizeof(iv); i++) iv[i] = rand();
+
+	for (c = 0; c < sizeof(bench_ciphers) / sizeof(bench_ciphers[0]); c++) {
+  	for (i = 0; i < SPGP_BENCH_BACKENDS; i++) {
+    	be = bench_backends[i];
+      cipher = be->cipher_open(bench_ciphers[c].algo, key,
+                               bench_ciphers[c].keylen);
+      if (NULL == cipher) {
+      	printf("%-12s %-8s unsupported\n", bench_ciphers[c].name, be->name);
+        continue;
+      }
+      be->cipher_setiv(cipher, iv);
+      start = spgp_bench_now();
+      for (off = 0; off < SPGP_BENCH_BULK; off += SPGP_BENCH_CHUNK)
+      	be->cipher_decrypt(cipher, out + off, data + off, SPGP_BENCH_CHUNK);
+      secs = spgp_bench_now() - start;
+      be->cipher_close(cipher);
+      printf("%-12s %-8s %8.1f MB/s\n", bench_ciphers[c].name, be->name,
+             SPGP_BENCH_BULK / secs / 1e6);
+
+			// Outputs are compared by their hash
+			md = spgp_crypto_hash_open(HASH_ALGO_SHA1);
+      spgp_crypto_hash_write(md, out, SPGP_BENCH_BULK);
+      memcpy(check[i], spgp_crypto_hash_read(md), 20);
+      spgp_crypto_hash_close(md);
+      if (i && memcmp(check[0], check[i], 20) != 0) {
+      	printf("%s: %s differs\n", bench_ciphers[c].name, be->name);
+        err = -1;
+      }
+    }
+  }
+  return err;
+}
+
+/**
+ * Decrypt a ciphertext just under each key's modulus with every backend.
+ */
+static uint8_t spgp_bench_pk(void) {
+	const spgp_keychain_key_t *keys[SPGP_BENCH_PK_KEYS], *key;
+  const spgp_crypto_backend_t *be;
+  uint8_t *result[SPGP_BENCH_BACKENDS];
+  size_t len[SPGP_BENCH_BACKENDS];
+  uint8_t cdata[2 + SPGP_BN_MAX_BITS / 8];
+  spgp_mpi_t c;
+  double start, first, secs;
+  uint8_t err = 0;
+  uint32_t i, k, count = 0, op, mlen;
+
+	// Records never move, so they can be used after the iteration's lock is
+	// dropped, as backends building per-key state take it
+	spgp_keychain_iter_start();
+  while (count < SPGP_BENCH_PK_KEYS &&
+         (key = spgp_keychain_iter_next()) != NULL) {
+  	if (key->asymAlgo == ASYM_ALGO_RSA || key->asymAlgo == ASYM_ALGO_ELGAMAL ||
+        key->asymAlgo == ASYM_ALGO_ECDH)
+    	keys[count++] = key;
+  }
+  spgp_keychain_iter_end();
+
+	for (k = 0; k < count; k++) {
+  	key = keys[k];
+    if (key->asymAlgo == ASYM_ALGO_ECDH) {
+    	err |= spgp_bench_ecdh(key);
+      continue;
+    }
+    // The modulus with its top byte halved, for both MPIs of Elgamal
+    mlen = spgp_mpi_length((uint8_t *)key->mpis);
+    if (mlen > SPGP_BN_MAX_BITS / 8) continue;
+    memcpy(cdata, key->mpis, mlen + 2);
+    cdata[2] >>= 1;
+    c.data = cdata;
+    c.count = mlen;
+    c.bits = 0;
+    c.next = NULL;
+
+		for (i = 0; i < SPGP_BENCH_BACKENDS; i++) {
+    	be = bench_backends[i];
+      result[i] = NULL;
+      start = spgp_bench_now();
+      first = 0;
+      for (op = 0; op <= SPGP_BENCH_PK_OPS; op++) {
+      	if (result[i]) spgp_secure_free(result[i], len[i]);
+        result[i] = be->pk_decrypt(key->asymAlgo, key, &c,
+                                   key->asymAlgo == ASYM_ALGO_RSA ?
+                                   NULL : &c, &len[i]);
+        if (0 == op) {
+        	first = spgp_bench_now() - start;
+          start += first;
+        }
+      }
+      secs = spgp_bench_now() - start;
+      printf("%s-%u %-8s %8.2f ms/op (first %.2f ms)\n",
+             key->asymAlgo == ASYM_ALGO_RSA ? "RSA" : "ELG",
+             mlen * 8, be->name, secs * 1000 / SPGP_BENCH_PK_OPS,
+             first * 1000);
+    }
+    for (i = 1; i < SPGP_BENCH_BACKENDS; i++) {
+    	if (len[0] != len[i] || memcmp(result[0], result[i], len[0]) != 0) {
+      	printf("%s: %s differs\n",
+               key->asymAlgo == ASYM_ALGO_RSA ? "RSA" : "ELG",
+               bench_backends[i]->name);
+        err = -1;
+      }
+    }
+    for (i = 0; i < SPGP_BENCH_BACKENDS; i++)
+    	spgp_secure_free(result[i], len[i]);
+    if (key->asymAlgo == ASYM_ALGO_RSA) err |= spgp_bench_lanes(key, cdata, mlen);
+  }
+  return err;
+}
+
+/**
+ * Decrypt batches of ciphertexts near |cdata| with the builtin RSA engine,
+ * one at a time and then across the vector lanes.
+ */
+static uint8_t spgp_bench_lanes(const spgp_keychain_key_t *key,
+                                const uint8_t *cdata, uint32_t mlen) {
+	static uint8_t cbuf[SPGP_BN_LANES][2 + SPGP_BN_MAX_BITS / 8];
+	const spgp_rsa_key_t *rsa = spgp_keychain_rsa_key(key);
+  spgp_mpi_t c[SPGP_BN_LANES];
+  const spgp_mpi_t *cp[SPGP_BN_LANES];
+  uint8_t *single[SPGP_BN_LANES], *frames[SPGP_BN_LANES];
+  size_t slen[SPGP_BN_LANES], lens[SPGP_BN_LANES];
+  double start, scalar, lanes;
+  uint8_t err = 0;
+  uint32_t b, i;
+
+	for (i = 0; i < SPGP_BN_LANES; i++) {
+  	memcpy(cbuf[i], cdata, mlen + 2);
+    cbuf[i][mlen + 1] ^= i;
+    c[i].data = cbuf[i];
+    c[i].count = mlen;
+    c[i].bits = 0;
+    c[i].next = NULL;
+    cp[i] = &c[i];
+    single[i] = frames[i] = NULL;
+  }
+
+	start = spgp_bench_now();
+  for (b = 0; b < SPGP_BENCH_LANE_BATCHES; b++) {
+  	for (i = 0; i < SPGP_BN_LANES; i++) {
+    	spgp_secure_free(single[i], slen[i]);
+      single[i] = spgp_rsa_decrypt(rsa, &c[i], &slen[i]);
+    }
+  }
+  scalar = spgp_bench_now() - start;
+
+	start = spgp_bench_now();
+  for (b = 0; b < SPGP_BENCH_LANE_BATCHES; b++) {
+  	for (i = 0; b && i < SPGP_BN_LANES; i++)
+    	spgp_secure_free(frames[i], lens[i]);
+    spgp_rsa_decrypt_lanes(rsa, cp, SPGP_BN_LANES, frames, lens);
+  }
+  lanes = spgp_bench_now() - start;
+
+	printf("RSA-%u %-8s %8.2f ms/op\n", mlen * 8, "scalar",
+         scalar * 1000 / (SPGP_BENCH_LANE_BATCHES * SPGP_BN_LANES));
+	printf("RSA-%u %-8s %8.2f ms/op (%u lanes, %s)\n", mlen * 8, "lanes",
+         lanes * 1000 / (SPGP_BENCH_LANE_BATCHES * SPGP_BN_LANES),
+         SPGP_BN_LANES, spgp_bn_lanes_unit());
+
+	for (i = 0; i < SPGP_BN_LANES; i++) {
+  	if (NULL == single[i] || NULL == frames[i] || slen[i] != lens[i] ||
+        memcmp(single[i], frames[i], lens[i]) != 0) {
+    	printf("RSA lanes: lane %u differs\n", i);
+      err = -1;
+    }
+    spgp_secure_free(single[i], slen[i]);
+    spgp_secure_free(frames[i], lens[i]);
+  }
+  return err;
+}
+
+/**
+ * Work out the shared point for an ECDH key with every backend that has
+ * its curve.  The key's own public point stands in for the sender's.
+ */
+static uint8_t spgp_bench_ecdh(const spgp_keychain_key_t *key) {
+	const spgp_ecc_curve_t *curve = spgp_ecc_curve(key->mpis);
+  const spgp_crypto_backend_t *be;
+  uint8_t *result[SPGP_BENCH_BACKENDS];
+  size_t len[SPGP_BENCH_BACKENDS];
+  uint8_t *point;
+  spgp_mpi_t c;
+  double start, first, secs;
+  uint8_t err = 0;
+  uint32_t i, op, have = 0;
+
+	if (NULL == curve) return 0;
+  point = (uint8_t *)key->mpis + spgp_mpi_length((uint8_t *)key->mpis) + 2;
+  c.data = point;
+  c.count = spgp_mpi_length(point);
+  c.bits = 0;
+  c.next = NULL;
+
+	for (i = 0; i < SPGP_BENCH_BACKENDS; i++) {
+  	be = bench_backends[i];
+    result[i] = NULL;
+    start = spgp_bench_now();
+    first = 0;
+    for (op = 0; op <= SPGP_BENCH_PK_OPS; op++) {
+    	if (result[i]) spgp_secure_free(result[i], len[i]);
+      result[i] = be->pk_decrypt(ASYM_ALGO_ECDH, key, &c, NULL, &len[i]);
+      if (NULL == result[i]) break;
+      if (0 == op) {
+      	first = spgp_bench_now() - start;
+        start += first;
+      }
+    }
+    if (NULL == result[i]) {
+    	printf("ECDH-%s %-8s unsupported\n", curve->name, be->name);
+      continue;
+    }
+    secs = spgp_bench_now() - start;
+    printf("ECDH-%s %-8s %8.3f ms/op (first %.3f ms)\n", curve->name,
+           be->name, secs * 1000 / SPGP_BENCH_PK_OPS, first * 1000);
+    if (have++ && (len[0] != len[i] ||
+                   memcmp(result[0], result[i], len[0]) != 0)) {
+    	printf("ECDH: %s differs\n", be->name);
+      err = -1;
+    }
+  }
+  for (i = 0; i < SPGP_BENCH_BACKENDS; i++)
+  	if (result[i]) spgp_secure_free(result[i], len[i]);
+  return err;
+}
+
+#ifdef HAVE_GCRYPT
+/**
+ * Decrypt an AES-128 OCB AEAD packet body on more and more threads with
+ * every backend that has OCB.  The body is made with libgcrypt, as the
+ * library only decrypts.
+ */
+static uint8_t spgp_bench_aead(uint8_t *data, uint8_t *out) {
+	const size_t chunkSize = (size_t)1 << (SPGP_BENCH_AEAD_CHUNK_BITS + 6);
+  const uint64_t chunks = SPGP_BENCH_BULK / chunkSize;
+  const size_t cipherLen = SPGP_BENCH_BULK +
+  	(chunks + 1) * SPGP_CRYPTO_AEAD_TAG;
+  spgp_aead_params_t params;
+  spgp_aead_segment_t seg;
+  const spgp_crypto_backend_t *be;
+  spgp_crypto_aead_t *aead;
+  gcry_cipher_hd_t hd;
+  uint8_t key[16], nonce[SPGP_CRYPTO_MAX_NONCE], ad[5 + 8 + 8];
+  uint8_t *cipher, *p, *cursor;
+  char previous[16];
+  double start, secs;
+  uint8_t err = 0;
+  uint64_t k;
+  uint32_t i, threads, n;
+
+	memset(&params, 0, sizeof(params));
+  params.type = PKT_TYPE_AEAD_DATA;
+  params.version = 1;
+  params.symAlgo = SYM_ALGO_AES128;
+  params.aeadAlgo = AEAD_ALGO_OCB;
+  params.chunkBits = SPGP_BENCH_AEAD_CHUNK_BITS;
+  for (i = 0; i < sizeof(key); i++) key[i] = rand();
+  for (i = 0; i < 15; i++) params.iv[i] = rand();
+
+	cipher = malloc(cipherLen);
+  if (NULL == cipher) RAISE(OUT_OF_MEMORY);
+  if (gcry_cipher_open(&hd, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_OCB, 0) ||
+      gcry_cipher_setkey(hd, key, sizeof(key))) {
+  	free(cipher);
+    RAISE(GCRY_ERROR);
+  }
+  ad[0] = 0xC0 | params.type;
+  ad[1] = params.version;
+  ad[2] = params.symAlgo;
+  ad[3] = params.aeadAlgo;
+  ad[4] = params.chunkBits;
+  // The last pass is the final tag, over no data
+  for (k = 0, p = cipher; k <= chunks; k++) {
+  	n = k < chunks ? chunkSize : 0;
+    memcpy(nonce, params.iv, 15);
+    for (i = 0; i < 8; i++) nonce[14 - i] ^= (uint8_t)(k >> (8 * i));
+    spgp_put_be64(ad + 5, k);
+    if (k == chunks) spgp_put_be64(ad + 13, SPGP_BENCH_BULK);
+    gcry_cipher_reset(hd);
+    gcry_cipher_setiv(hd, nonce, 15);
+    gcry_cipher_authenticate(hd, ad, k == chunks ? 21 : 13);
+    gcry_cipher_final(hd);
+    gcry_cipher_encrypt(hd, p, n, n ? data + k * chunkSize : p, n);
+    p += n;
+    gcry_cipher_gettag(hd, p, SPGP_CRYPTO_AEAD_TAG);
+    p += SPGP_CRYPTO_AEAD_TAG;
+  }
+  gcry_cipher_close(hd);
+  seg.data = cipher;
+  seg.offset = 0;
+  seg.len = cipherLen;
+
+	strncpy(previous, spgp_crypto_backend_name(), sizeof(previous) - 1);
+  previous[sizeof(previous) - 1] = 0;
+	for (i = 0; i < SPGP_BENCH_BACKENDS; i++) {
+  	be = bench_backends[i];
+    aead = be->aead_open(params.symAlgo, params.aeadAlgo, key, sizeof(key));
+    if (NULL == aead) {
+    	printf("%-12s %-8s unsupported\n", "AES128-OCB", be->name);
+      continue;
+    }
+    be->aead_close(aead);
+    spgp_crypto_backend_select(be->name);
+    for (threads = 1; threads <= SPGP_BENCH_AEAD_THREADS; threads *= 2) {
+    	memset(out, 0, SPGP_BENCH_BULK);
+      cursor = out;
+      start = spgp_bench_now();
+      spgp_aead_decrypt(&params, key, sizeof(key), &seg, 1, threads,
+                        spgp_bench_aead_emit, &cursor);
+      secs = spgp_bench_now() - start;
+      printf("%-12s %-8s %8.1f MB/s (%u threads)\n", "AES128-OCB",
+             be->name, SPGP_BENCH_BULK / secs / 1e6, threads);
+      if (memcmp(out, data, SPGP_BENCH_BULK) != 0) {
+      	printf("AES128-OCB: %s on %u threads differs\n", be->name, threads);
+        err = -1;
+      }
+    }
+  }
+  spgp_crypto_backend_select(previous);
+  free(cipher);
+  return err;
+}
+
+static void spgp_bench_aead_emit(void *ctx, const uint8_t *data, size_t len) {
+	uint8_t **cursor = ctx;
+
+	memcpy(*cursor, data, len);
+  *cursor += len;
+}
+#endif /* HAVE_GCRYPT */
+
+/**
+ * Armor the bulk data the way GnuPG does and time converting it back.  The
+ * rate is of armored text read.
+ */
+static uint8_t spgp_bench_armor(uint8_t *data) {
+	const char *head = "-----BEGIN PGP MESSAGE-----\n\n";
+  const char *tail = "-----END PGP MESSAGE-----\n";
+  const size_t line = SPGP_BENCH_ARMOR_LINE / 4 * 3;
+  uint8_t *armored, *p, *binary = NULL;
+  uint8_t sum[3];
+  uint32_t crc;
+  size_t armorLen, binlen = 0, off;
+  double start, secs;
+  uint8_t err = 0;
+
+	armored = malloc(SPGP_BENCH_BULK / line * (SPGP_BENCH_ARMOR_LINE + 1) +
+                   SPGP_BENCH_ARMOR_LINE + 64);
+  if (NULL == armored) RAISE(OUT_OF_MEMORY);
+  p = armored;
+  memcpy(p, head, strlen(head));
+  p += strlen(head);
+  for (off = 0; off < SPGP_BENCH_BULK; off += line) {
+  	p = spgp_bench_base64(p, data + off,
+                          SPGP_BENCH_BULK - off < line ?
+                          SPGP_BENCH_BULK - off : line);
+    *p++ = '\n';
+  }
+  crc = spgp_crc24(SPGP_CRC24_INIT, data, SPGP_BENCH_BULK);
+  sum[0] = crc >> 16;
+  sum[1] = crc >> 8;
+  sum[2] = crc;
+  *p++ = '=';
+  p = spgp_bench_base64(p, sum, 3);
+  *p++ = '\n';
+  memcpy(p, tail, strlen(tail));
+  p += strlen(tail);
+  armorLen = p - armored;
+
+	start = spgp_bench_now();
+  if (spgp_dearmor(armored, armorLen, &binary, &binlen) != 0) {
+  	printf("Dearmor: %s\n", spgp_err_str(spgp_err()));
+    free(armored);
+    return -1;
+  }
+  secs = spgp_bench_now() - start;
+  printf("%-12s %-8s %8.2f GB/s\n", "Dearmor", "", armorLen / secs / 1e9);
+
+	if (binlen != SPGP_BENCH_BULK || memcmp(binary, data, binlen) != 0) {
+  	printf("Dearmor: output differs\n");
+    err = -1;
+  }
+  free(binary);
+  free(armored);
+  return err;
+}
+
+static uint8_t *spgp_bench_base64(uint8_t *p, const uint8_t *in, size_t len) {
+	static const char alphabet[] =
+  	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t v;
+
+	for (; len >= 3; in += 3, len -= 3) {
+  	v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+    *p++ = alphabet[v >> 18];
+    *p++ = alphabet[(v >> 12) & 0x3F];
+    *p++ = alphabet[(v >> 6) & 0x3F];
+    *p++ = alphabet[v & 0x3F];
+  }
+  if (len) {
+  	v = (uint32_t)in[0] << 16;
+    if (len == 2) v |= (uint32_t)in[1] << 8;
+    *p++ = alphabet[v >> 18];
+    *p++ = alphabet[(v >> 12) & 0x3F];
+    *p++ = len == 2 ? alphabet[(v >> 6) & 0x3F] : '=';
+    *p++ = '=';
+  }
+  return p;
+}
+
+/**
+ * Fill a keyring with copies of one certificate -- primary key, user ID,
+ * self-signature, subkey and binding signature, in both header formats --
+ * and time finding every packet boundary in it.
+ */
+static uint8_t spgp_bench_scan(void) {
+	uint8_t cert[2048];
+  uint8_t *keyring, *p;
+  size_t certLen, keyringLen, i;
+  uint64_t count = 0;
+  double start, secs;
+
+	p = cert;
+  p = spgp_bench_packet(p, PKT_TYPE_PUBLIC_KEY, 269, 0);
+  p = spgp_bench_packet(p, PKT_TYPE_USER_ID, 30, 1);
+  p = spgp_bench_packet(p, PKT_TYPE_SIGNATURE, 312, 0);
+  p = spgp_bench_packet(p, PKT_TYPE_PUBLIC_SUBKEY, 269, 1);
+  p = spgp_bench_packet(p, PKT_TYPE_SIGNATURE, 287, 1);
+  certLen = p - cert;
+
+	keyringLen = SPGP_BENCH_KEYRING / certLen * certLen;
+	keyring = malloc(keyringLen);
+  if (NULL == keyring) RAISE(OUT_OF_MEMORY);
+  for (i = 0; i < keyringLen; i += certLen)
+  	memcpy(keyring + i, cert, certLen);
+
+	start = spgp_bench_now();
+  if (spgp_scan(keyring, keyringLen, spgp_bench_scan_count, &count) != 0) {
+  	printf("Scan: %s\n", spgp_err_str(spgp_err()));
+    free(keyring);
+    return -1;
+  }
+  secs = spgp_bench_now() - start;
+  free(keyring);
+  printf("%-12s %-8s %8.2f GB/s (%.1fM packets/s)\n", "Scan", "",
+         keyringLen / secs / 1e9, count / secs / 1e6);
+
+	if (count != keyringLen / certLen * 5) {
+  	printf("Scan: found %llu packets\n", (unsigned long long)count);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write a packet header for a |len| byte body, then random body bytes.
+ */
+static uint8_t *spgp_bench_packet(uint8_t *p, uint8_t type, uint32_t len,
+                                  uint8_t newFormat) {
+	uint32_t i;
+
+	if (newFormat) {
+  	*p++ = 0xC0 | type;
+    if (len < 192) {
+    	*p++ = len;
+    }
+    else {
+    	*p++ = ((len - 192) >> 8) + 192;
+      *p++ = len - 192;
+    }
+  }
+  else {
+  	// Old format, 2-octet length
+  	*p++ = 0x80 | (type << 2) | 1;
+    *p++ = len >> 8;
+    *p++ = len;
+  }
+  for (i = 0; i < len; i++) *p++ = rand();
+  return p;
+}
+
+static int spgp_bench_scan_count(const spgp_span_t *span, void *ctx) {
+	(void)span;
+  (*(uint64_t *)ctx)++;
+  return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ *  crypto_gcrypt.c
+ *  libsimplepgp
+ *
+ *  Crypto backend using libgcrypt.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "crypto.h"
+#include "ecc.h"
+#include "mpi.h"
+#include "secmem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Only built when configure finds libgcrypt
+#ifdef HAVE_GCRYPT
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+typedef struct spgp_gcrypt_hash_struct {
+	spgp_crypto_hash_t base;
+  gcry_md_hd_t md;
+} spgp_gcrypt_hash_t;
+
+typedef struct spgp_gcrypt_cipher_struct {
+	spgp_crypto_cipher_t base;
+  gcry_cipher_hd_t hd;
+} spgp_gcrypt_cipher_t;
+
+typedef struct spgp_gcrypt_aead_struct {
+	spgp_crypto_aead_t base;
+  gcry_cipher_hd_t hd;
+} spgp_gcrypt_aead_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static int spgp_gcrypt_hash_algo(uint8_t algo);
+static int spgp_gcrypt_cipher_algo(uint8_t algo);
+
+static spgp_crypto_hash_t *spgp_gcrypt_hash_open(uint8_t algo);
+static void spgp_gcrypt_hash_write(spgp_crypto_hash_t *hash,
+                                   const void *data, size_t len);
+static const uint8_t *spgp_gcrypt_hash_read(spgp_crypto_hash_t *hash);
+static void spgp_gcrypt_hash_reset(spgp_crypto_hash_t *hash);
+static void spgp_gcrypt_hash_close(spgp_crypto_hash_t *hash);
+
+static spgp_crypto_cipher_t *spgp_gcrypt_cipher_open(uint8_t algo,
+                                                     const uint8_t *key,
+                                                     size_t keylen);
+static void spgp_gcrypt_cipher_setiv(spgp_crypto_cipher_t *cipher,
+                                     const uint8_t *iv);
+static uint8_t spgp_gcrypt_cipher_decrypt(spgp_crypto_cipher_t *cipher,
+                                          uint8_t *out, const uint8_t *in,
+                                          size_t len);
+static void spgp_gcrypt_cipher_close(spgp_crypto_cipher_t *cipher);
+
+static uint8_t *spgp_gcrypt_pk_decrypt(uint8_t algo,
+                                       const spgp_keychain_key_t *key,
+                                       const spgp_mpi_t *c1,
+                                       const spgp_mpi_t *c2, size_t *len);
+static uint8_t *spgp_gcrypt_ecdh_decrypt(const spgp_keychain_key_t *key,
+                                         const spgp_mpi_t *c1, size_t *len);
+static uint8_t *spgp_gcrypt_key_unwrap(uint8_t algo, const uint8_t *kek,
+                                       const uint8_t *in, size_t len,
+                                       size_t *outLen);
+
+static spgp_crypto_aead_t *spgp_gcrypt_aead_open(uint8_t algo, uint8_t mode,
+                                                 const uint8_t *key,
+                                                 size_t keylen);
+static void spgp_gcrypt_aead_decrypt(spgp_crypto_aead_t *aead,
+                                     const uint8_t *nonce,
+                                     const uint8_t *ad, size_t adLen,
+                                     uint8_t *out, const uint8_t *in,
+                                     size_t len, const uint8_t *tag);
+static void spgp_gcrypt_aead_close(spgp_crypto_aead_t *aead);
+
+const spgp_crypto_backend_t spgp_crypto_gcrypt = {
+	"gcrypt",
+  spgp_gcrypt_hash_open,
+  spgp_gcrypt_hash_write,
+  spgp_gcrypt_hash_read,
+  spgp_gcrypt_hash_reset,
+  spgp_gcrypt_hash_close,
+  spgp_gcrypt_cipher_open,
+  spgp_gcrypt_cipher_setiv,
+  spgp_gcrypt_cipher_decrypt,
+  spgp_gcrypt_cipher_close,
+  spgp_gcrypt_pk_decrypt,
+  spgp_gcrypt_key_unwrap,
+  spgp_gcrypt_aead_open,
+  spgp_gcrypt_aead_decrypt,
+  spgp_gcrypt_aead_close,
+};
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static int spgp_gcrypt_hash_algo(uint8_t algo) {
+	switch (algo) {
+  	case HASH_ALGO_MD5:       return GCRY_MD_MD5;
+  	case HASH_ALGO_SHA1:      return GCRY_MD_SHA1;
+    case HASH_ALGO_RIPEMD160: return GCRY_MD_RMD160;
+    case HASH_ALGO_SHA224:    return GCRY_MD_SHA224;
+    case HASH_ALGO_SHA256:    return GCRY_MD_SHA256;
+    case HASH_ALGO_SHA384:    return GCRY_MD_SHA384;
+    case HASH_ALGO_SHA512:    return GCRY_MD_SHA512;
+    default:                  return 0;
+  }
+}
+
+static int spgp_gcrypt_cipher_algo(uint8_t algo) {
+	switch (algo) {
+  	case SYM_ALGO_IDEA:     return GCRY_CIPHER_IDEA;
+    case SYM_ALGO_3DES:     return GCRY_CIPHER_3DES;
+    case SYM_ALGO_CAST5:    return GCRY_CIPHER_CAST5;
+    case SYM_ALGO_BLOWFISH: return GCRY_CIPHER_BLOWFISH;
+    case SYM_ALGO_AES128:   return GCRY_CIPHER_AES128;
+    case SYM_ALGO_AES192:   return GCRY_CIPHER_AES192;
+    case SYM_ALGO_AES256:   return GCRY_CIPHER_AES256;
+    case SYM_ALGO_TWOFISH:  return GCRY_CIPHER_TWOFISH;
+    default:                return 0;
+  }
+}
+
+static spgp_crypto_hash_t *spgp_gcrypt_hash_open(uint8_t algo) {
+	spgp_gcrypt_hash_t *hash;
+  int md_algo = spgp_gcrypt_hash_algo(algo);
+
+	if (0 == md_algo) return NULL;
+  hash = malloc(sizeof(*hash));
+  if (NULL == hash) RAISE(OUT_OF_MEMORY);
+  if (gcry_md_open(&hash->md, md_algo, 0) != 0) {
+  	free(hash);
+    RAISE(GCRY_ERROR);
+  }
+  hash->base.backend = &spgp_crypto_gcrypt;
+  return &hash->base;
+}
+
+static void spgp_gcrypt_hash_write(spgp_crypto_hash_t *hash,
+                                   const void *data, size_t len) {
+	gcry_md_write(((spgp_gcrypt_hash_t *)hash)->md, data, len);
+}
+
+static const uint8_t *spgp_gcrypt_hash_read(spgp_crypto_hash_t *hash) {
+	gcry_md_hd_t md = ((spgp_gcrypt_hash_t *)hash)->md;
+
+	gcry_md_final(md);
+  return gcry_md_read(md, 0);
+}
+
+static void spgp_gcrypt_hash_reset(spgp_crypto_hash_t *hash) {
+	gcry_md_reset(((spgp_gcrypt_hash_t *)hash)->md);
+}
+
+static void spgp_gcrypt_hash_close(spgp_crypto_hash_t *hash) {
+	gcry_md_close(((spgp_gcrypt_hash_t *)hash)->md);
+  free(hash);
+}
+
+static spgp_crypto_cipher_t *spgp_gcrypt_cipher_open(uint8_t algo,
+                                                     const uint8_t *key,
+                                                     size_t keylen) {
+	spgp_gcrypt_cipher_t *cipher;
+  int cipher_algo = spgp_gcrypt_cipher_algo(algo);
+  size_t blksize = 0;
+
+	if (0 == cipher_algo) return NULL;
+  if (gcry_cipher_algo_info(cipher_algo, GCRYCTL_GET_BLKLEN, NULL,
+                            &blksize) != 0)
+  	return NULL;
+  cipher = malloc(sizeof(*cipher));
+  if (NULL == cipher) RAISE(OUT_OF_MEMORY);
+  if (gcry_cipher_open(&cipher->hd, cipher_algo, GCRY_CIPHER_MODE_CFB,
+                       GCRY_CIPHER_SECURE) != 0) {
+  	free(cipher);
+    RAISE(GCRY_ERROR);
+  }
+  if (gcry_cipher_setkey(cipher->hd, key, keylen) != 0 ||
+      gcry_cipher_setiv(cipher->hd, NULL, 0) != 0) {
+  	gcry_cipher_close(cipher->hd);
+    free(cipher);
+    RAISE(GCRY_ERROR);
+  }
+  cipher->base.backend = &spgp_crypto_gcrypt;
+  cipher->base.blksize = blksize;
+  return &cipher->base;
+}
+
+static void spgp_gcrypt_cipher_setiv(spgp_crypto_cipher_t *cipher,
+                                     const uint8_t *iv) {
+	gcry_cipher_setiv(((spgp_gcrypt_cipher_t *)cipher)->hd,
+                    iv, iv ? cipher->blksize : 0);
+}
+
+static uint8_t spgp_gcrypt_cipher_decrypt(spgp_crypto_cipher_t *cipher,
+                                          uint8_t *out, const uint8_t *in,
+                                          size_t len) {
+	gcry_cipher_hd_t hd = ((spgp_gcrypt_cipher_t *)cipher)->hd;
+
+	if (in == out) return gcry_cipher_decrypt(hd, out, len, NULL, 0) ? -1 : 0;
+  return gcry_cipher_decrypt(hd, out, len, in, len) ? -1 : 0;
+}
+
+static void spgp_gcrypt_cipher_close(spgp_crypto_cipher_t *cipher) {
+	gcry_cipher_close(((spgp_gcrypt_cipher_t *)cipher)->hd);
+  free(cipher);
+}
+
+static uint8_t *spgp_gcrypt_pk_decrypt(uint8_t algo,
+                                       const spgp_keychain_key_t *key,
+                                       const spgp_mpi_t *c1,
+                                       const spgp_mpi_t *c2, size_t *len) {
+  const uint8_t *data;
+  size_t mpilen;
+  gcry_sexp_t sexp_key = NULL, sexp_data = NULL, sexp_result = NULL;
+  gcry_mpi_t mpi[10], mpi_result = NULL;
+  int i,mpi_count;
+  uint8_t *frame;
+
+	if (algo == ASYM_ALGO_ECDH) return spgp_gcrypt_ecdh_decrypt(key, c1, len);
+	if (algo != ASYM_ALGO_RSA && algo != ASYM_ALGO_ELGAMAL) return NULL;
+	// Room for the key's MPIs and two from the session
+  if (key->mpiCount > 8) RAISE(FORMAT_UNSUPPORTED);
+  if (key->mpiCount < (algo == ASYM_ALGO_RSA ? 6 : 4) ||
+      (algo == ASYM_ALGO_ELGAMAL && NULL == c2))
+  	RAISE(INVALID_ARGS);
+
+  for (data = key->mpis, i = 0; i < key->mpiCount; i++) {
+  	mpilen = spgp_mpi_length((uint8_t *)data) + 2;
+	  gcry_mpi_scan (&(mpi[i]), GCRYMPI_FMT_PGP, data, mpilen, NULL);
+    data += mpilen;
+  }
+  gcry_mpi_scan (&(mpi[i++]), GCRYMPI_FMT_PGP, c1->data, c1->count+2, NULL);
+  if (c2) {
+  	gcry_mpi_scan (&(mpi[i++]), GCRYMPI_FMT_PGP, c2->data, c2->count+2, NULL);
+  }
+  mpi_count = i;
+
+  switch (algo) {
+  	case ASYM_ALGO_RSA:
+		  gcry_sexp_build(&sexp_key, NULL,
+				"(private-key(rsa(n%m)(e%m)(d%m)(p%m)(q%m)(u%m)))",
+				mpi[0], mpi[1], mpi[2], mpi[3], mpi[4], mpi[5]);
+		  gcry_sexp_build (&sexp_data, NULL,
+			   "(enc-val(rsa(a%m)))", mpi[6]);
+    	break;
+  	case ASYM_ALGO_ELGAMAL:
+		  gcry_sexp_build(&sexp_key, NULL,
+				"(private-key(elg(p%m)(g%m)(y%m)(x%m)))",
+				mpi[0], mpi[1], mpi[2], mpi[3]);
+		  gcry_sexp_build (&sexp_data, NULL,
+			   "(enc-val(elg(a%m)(b%m)))", mpi[4], mpi[5]);
+    	break;
+  }
+  gcry_pk_decrypt (&sexp_result, sexp_data, sexp_key);
+  mpi_result = gcry_sexp_nth_mpi (sexp_result, 0, GCRYMPI_FMT_STD);
+
+  // Released before the result is checked so failures don't leak the key
+  if (sexp_key) {gcry_sexp_release(sexp_key);}
+  if (sexp_data) {gcry_sexp_release(sexp_data);}
+  if (sexp_result) {gcry_sexp_release(sexp_result);}
+
+	for (i = 0; i < mpi_count; i++) {
+  	gcry_mpi_release(mpi[i]);
+  }
+
+	if (!mpi_result) RAISE(GCRY_ERROR);
+
+	// Unsigned, without the MPI length, as a token would return it
+  gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &mpilen, mpi_result);
+  frame = spgp_secure_alloc(mpilen);
+  if (NULL == frame) {
+  	gcry_mpi_release(mpi_result);
+  	RAISE(OUT_OF_MEMORY);
+  }
+  gcry_mpi_print(GCRYMPI_FMT_USG, frame, mpilen, NULL, mpi_result);
+	gcry_mpi_release(mpi_result);
+  *len = mpilen;
+  return frame;
+}
+
+/**
+ * ECDH with the key's secret scalar and the sender's ephemeral point.
+ * gcrypt gives back the whole shared point, 04 || X || Y for the NIST
+ * curves or 40 || X for Curve25519, and only X is kept.
+ */
+static uint8_t *spgp_gcrypt_ecdh_decrypt(const spgp_keychain_key_t *key,
+                                         const spgp_mpi_t *c1, size_t *len) {
+	const spgp_ecc_curve_t *curve;
+  const uint8_t *oid, *q, *d;
+  const char *point;
+  gcry_sexp_t sexp_key = NULL, sexp_data = NULL, sexp_result = NULL;
+  gcry_mpi_t mpi_d = NULL;
+  size_t qlen, dlen, plen = 0;
+  uint8_t *x = NULL;
+  gcry_error_t rc;
+
+	if (key->mpiCount < 4) RAISE(INVALID_ARGS);
+  // OID, point, KDF parameters, then the secret scalar
+	oid = key->mpis;
+  q = oid + spgp_mpi_length((uint8_t *)oid) + 2;
+  qlen = spgp_mpi_length((uint8_t *)q);
+  d = q + qlen + 2;
+  d += spgp_mpi_length((uint8_t *)d) + 2;
+  dlen = spgp_mpi_length((uint8_t *)d);
+  curve = spgp_ecc_curve(oid);
+  if (NULL == curve || curve->id == SPGP_CURVE_ED25519) return NULL;
+
+	if (gcry_mpi_scan(&mpi_d, GCRYMPI_FMT_USG, d + 2, dlen, NULL) != 0)
+  	RAISE(GCRY_ERROR);
+  rc = gcry_sexp_build(&sexp_key, NULL,
+  	curve->id == SPGP_CURVE_25519 ?
+    "(private-key(ecc(curve %s)(flags djb-tweak)(q%b)(d%m)))" :
+    "(private-key(ecc(curve %s)(q%b)(d%m)))",
+    curve->name, (int)qlen, q + 2, mpi_d);
+  if (0 == rc)
+  	rc = gcry_sexp_build(&sexp_data, NULL, "(enc-val(ecdh(e%b)))",
+                         (int)c1->count, c1->data + 2);
+  if (0 == rc) rc = gcry_pk_decrypt(&sexp_result, sexp_data, sexp_key);
+
+	// The result is (value point), with a prefix byte before X
+  point = sexp_result ? gcry_sexp_nth_data(sexp_result, 1, &plen) : NULL;
+  if (point && plen >= 1 + (size_t)curve->bytes) {
+  	x = spgp_secure_alloc(curve->bytes);
+    if (x) memcpy(x, point + 1, curve->bytes);
+  }
+
+  if (sexp_key) {gcry_sexp_release(sexp_key);}
+  if (sexp_data) {gcry_sexp_release(sexp_data);}
+  if (sexp_result) {gcry_sexp_release(sexp_result);}
+  gcry_mpi_release(mpi_d);
+
+	if (rc) RAISE(gcry_err_code(rc) == GPG_ERR_INV_DATA ?
+                DECRYPT_FAILED : GCRY_ERROR);
+  if (NULL == point || plen < 1 + (size_t)curve->bytes) RAISE(DECRYPT_FAILED);
+  if (NULL == x) RAISE(OUT_OF_MEMORY);
+  *len = curve->bytes;
+  return x;
+}
+
+static uint8_t *spgp_gcrypt_key_unwrap(uint8_t algo, const uint8_t *kek,
+                                       const uint8_t *in, size_t len,
+                                       size_t *outLen) {
+	gcry_cipher_hd_t hd;
+  int cipher_algo;
+  gcry_error_t rc;
+  uint8_t *out;
+
+	switch (algo) {
+  	case SYM_ALGO_AES128:
+    case SYM_ALGO_AES192:
+    case SYM_ALGO_AES256:
+    	cipher_algo = spgp_gcrypt_cipher_algo(algo);
+      break;
+    default:
+    	return NULL;
+  }
+  if (gcry_cipher_open(&hd, cipher_algo, GCRY_CIPHER_MODE_AESWRAP,
+                       GCRY_CIPHER_SECURE) != 0)
+  	RAISE(GCRY_ERROR);
+  out = spgp_secure_alloc(len - 8);
+  if (NULL == out) {
+  	gcry_cipher_close(hd);
+    RAISE(OUT_OF_MEMORY);
+  }
+  rc = gcry_cipher_setkey(hd, kek, 16 + 8 * (algo - SYM_ALGO_AES128));
+  if (0 == rc) rc = gcry_cipher_decrypt(hd, out, len - 8, in, len);
+  gcry_cipher_close(hd);
+  if (rc) {
+  	spgp_secure_free(out, len - 8);
+    RAISE(gcry_err_code(rc) == GPG_ERR_CHECKSUM ? DECRYPT_FAILED : GCRY_ERROR);
+  }
+  *outLen = len - 8;
+  return out;
+}
+
+static spgp_crypto_aead_t *spgp_gcrypt_aead_open(uint8_t algo, uint8_t mode,
+                                                 const uint8_t *key,
+                                                 size_t keylen) {
+	spgp_gcrypt_aead_t *aead;
+  int cipher_algo = spgp_gcrypt_cipher_algo(algo);
+  int cipher_mode;
+  size_t blksize = 0;
+
+	switch (mode) {
+  	case AEAD_ALGO_EAX: cipher_mode = GCRY_CIPHER_MODE_EAX; break;
+    case AEAD_ALGO_OCB: cipher_mode = GCRY_CIPHER_MODE_OCB; break;
+    case AEAD_ALGO_GCM: cipher_mode = GCRY_CIPHER_MODE_GCM; break;
+    default: return NULL;
+  }
+	if (0 == cipher_algo) return NULL;
+  if (gcry_cipher_algo_info(cipher_algo, GCRYCTL_GET_BLKLEN, NULL,
+                            &blksize) != 0 || blksize != 16)
+  	return NULL;
+  aead = malloc(sizeof(*aead));
+  if (NULL == aead) RAISE(OUT_OF_MEMORY);
+  if (gcry_cipher_open(&aead->hd, cipher_algo, cipher_mode,
+                       GCRY_CIPHER_SECURE) != 0) {
+  	free(aead);
+    RAISE(GCRY_ERROR);
+  }
+  if (gcry_cipher_setkey(aead->hd, key, keylen) != 0) {
+  	gcry_cipher_close(aead->hd);
+    free(aead);
+    RAISE(GCRY_ERROR);
+  }
+  aead->base.backend = &spgp_crypto_gcrypt;
+  aead->base.nonceLen = spgp_crypto_aead_nonce_length(mode);
+  return &aead->base;
+}
+
+static void spgp_gcrypt_aead_decrypt(spgp_crypto_aead_t *aead,
+                                     const uint8_t *nonce,
+                                     const uint8_t *ad, size_t adLen,
+                                     uint8_t *out, const uint8_t *in,
+                                     size_t len, const uint8_t *tag) {
+	gcry_cipher_hd_t hd = ((spgp_gcrypt_aead_t *)aead)->hd;
+  gcry_error_t rc;
+  uint8_t none = 0;
+
+	gcry_cipher_reset(hd);
+	rc = gcry_cipher_setiv(hd, nonce, aead->nonceLen);
+  if (0 == rc) rc = gcry_cipher_authenticate(hd, ad, adLen);
+  // OCB has to be told which call is the last, and needs that call even
+  // for a final tag over no data
+  if (0 == rc) rc = gcry_cipher_final(hd);
+  if (0 == rc) rc = gcry_cipher_decrypt(hd, len ? out : &none, len,
+                                        len ? in : &none, len);
+  if (0 == rc) rc = gcry_cipher_checktag(hd, tag, SPGP_CRYPTO_AEAD_TAG);
+  if (rc) {
+  	if (len) spgp_secure_wipe(out, len);
+    RAISE(gcry_err_code(rc) == GPG_ERR_CHECKSUM ? DECRYPT_FAILED : GCRY_ERROR);
+  }
+}
+
+static void spgp_gcrypt_aead_close(spgp_crypto_aead_t *aead) {
+	gcry_cipher_close(((spgp_gcrypt_aead_t *)aead)->hd);
+  free(aead);
+}
+
+#endif /* HAVE_GCRYPT */
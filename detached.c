@@ -0,0 +1,391 @@
+/*
+ *  detached.c
+ *  libsimplepgp
+ *
+ *  Detached signature checks over files, hashed straight from the file.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "armor.h"
+#include "verify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_DETACHED_MAX_THREADS 64
+// Bytes of the file mapped at once, so files larger than the address
+// space can still be hashed.  A multiple of any page size.
+#define SPGP_DETACHED_WINDOW      (64UL << 20)
+// Read size for files that can't be mapped, such as pipes
+#define SPGP_DETACHED_BLOCK       (1UL << 20)
+
+// One signature packet of a file, and the key that checks it
+typedef struct {
+	spgp_packet_t *sig;
+  spgp_packet_t *key;
+} spgp_detached_sig_t;
+
+// One file, with its decoded signatures, checked by a single thread
+typedef struct {
+	spgp_detached_t *file;
+  spgp_packet_t *head;
+  spgp_detached_sig_t *sigs;
+  uint32_t sigCount;
+  spgp_sig_md_t md[2];      // binary, canonical text
+  uint8_t last;            // last byte hashed, for text canonicalization
+} spgp_detached_job_t;
+
+typedef struct {
+	spgp_detached_job_t *jobs;
+  uint32_t count;
+  uint32_t next;
+  pthread_mutex_t mtx;
+} spgp_detached_pool_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static void spgp_detached_prepare(spgp_detached_job_t *job,
+                                  spgp_packet_t *keys);
+
+static void *spgp_detached_worker(void *arg);
+
+static void spgp_detached_run_job(spgp_detached_job_t *job);
+
+static void spgp_detached_hash_fd(spgp_detached_job_t *job, int fd);
+
+static void spgp_detached_hash(spgp_detached_job_t *job,
+                               const uint8_t *data, size_t len);
+
+static void spgp_detached_free_job(spgp_detached_job_t *job);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_verify_detached(uint8_t *sig, size_t sigLength,
+                             spgp_packet_t *keys, const char *path) {
+	spgp_detached_t file;
+
+	memset(&file, 0, sizeof(file));
+  file.sig = sig;
+  file.sigLength = sigLength;
+  file.path = path;
+  file.fd = -1;
+  return spgp_verify_detached_files(&file, 1, keys, 1);
+}
+
+uint8_t spgp_verify_detached_fd(uint8_t *sig, size_t sigLength,
+                                spgp_packet_t *keys, int fd) {
+	spgp_detached_t file;
+
+	memset(&file, 0, sizeof(file));
+  file.sig = sig;
+  file.sigLength = sigLength;
+  file.fd = fd;
+  return spgp_verify_detached_files(&file, 1, keys, 1);
+}
+
+uint8_t spgp_verify_detached_files(spgp_detached_t *files, uint32_t count,
+                                   spgp_packet_t *keys, uint32_t threads) {
+	spgp_detached_pool_t pool;
+  pthread_t tids[SPGP_DETACHED_MAX_THREADS];
+  uint32_t err = 0;
+  uint32_t started = 0;
+  uint32_t i;
+  long cpus;
+
+	memset(&pool, 0, sizeof(pool));
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == files || 0 == count) RAISE(INVALID_ARGS);
+  for (i = 0; i < count; i++) {
+  	if (NULL == files[i].sig || 0 == files[i].sigLength ||
+        (NULL == files[i].path && files[i].fd < 0))
+    	RAISE(INVALID_ARGS);
+  }
+
+	pool.jobs = malloc(sizeof(*pool.jobs) * count);
+  if (NULL == pool.jobs) RAISE(OUT_OF_MEMORY);
+  memset(pool.jobs, 0, sizeof(*pool.jobs) * count);
+  pool.count = count;
+  if (pthread_mutex_init(&pool.mtx, NULL)) {
+  	free(pool.jobs);
+  	RAISE(GENERIC_ERROR);
+  }
+
+	// Signatures are decoded, and their keys looked up and prepared, before
+  // any threads start, so the threads only read the shared keys.  Each
+  // file catches its own exceptions from here on, which replaces our
+  // handler, so nothing below may RAISE().
+  for (i = 0; i < count; i++) {
+  	pool.jobs[i].file = &files[i];
+    spgp_detached_prepare(&pool.jobs[i], keys);
+  }
+
+	if (0 == threads) {
+  	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  if (threads > SPGP_DETACHED_MAX_THREADS) threads = SPGP_DETACHED_MAX_THREADS;
+  if (threads > count) threads = count;
+
+	// This thread hashes alongside the ones started here
+  for (i = 1; i < threads; i++) {
+  	if (pthread_create(&tids[started], NULL, spgp_detached_worker, &pool))
+    	break;
+    started++;
+  }
+  spgp_detached_worker(&pool);
+  for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&pool.mtx);
+
+	for (i = 0; i < count; i++) {
+  	if (files[i].err && !err) err = files[i].err;
+    spgp_detached_free_job(&pool.jobs[i]);
+  }
+  free(pool.jobs);
+
+	if (err) {
+  	pthread_mutex_lock(&spgp_mtx);
+    _spgp_err = err;
+    pthread_mutex_unlock(&spgp_mtx);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Decode the signatures of one file and find their keys.
+ *
+ * Problems are recorded in the file's error, and the file is then skipped.
+ */
+static void spgp_detached_prepare(spgp_detached_job_t *job,
+                                  spgp_packet_t *keys) {
+	spgp_detached_t *file = job->file;
+  spgp_detached_sig_t *dsig;
+  spgp_packet_t *cur;
+  uint8_t *dearmored = NULL;
+  uint8_t * volatile binary = NULL;
+  uint8_t *msg = file->sig;
+  size_t length = file->sigLength;
+  size_t idx = 0;
+
+	file->status = SPGP_SIG_UNCHECKED;
+  file->err = 0;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    file->err = _spgp_err;
+    free(binary);
+    return;
+  }
+
+	if (spgp_is_armored(msg, length)) {
+  	spgp_armor_decode(msg, length, &dearmored, &length);
+    binary = msg = dearmored;
+    if (0 == length) RAISE(INVALID_HEADER);
+  }
+  job->head = spgp_packet_decode_loop(msg, &idx, length);
+  free(binary);
+  binary = NULL;
+
+	for (cur = job->head; cur; cur = cur->next) {
+  	if (cur->header->type == PKT_TYPE_SIGNATURE && cur->c.signature)
+    	job->sigCount++;
+  }
+  if (0 == job->sigCount) RAISE(INVALID_ARGS);
+  job->sigs = malloc(sizeof(*job->sigs) * job->sigCount);
+  if (NULL == job->sigs) RAISE(OUT_OF_MEMORY);
+  memset(job->sigs, 0, sizeof(*job->sigs) * job->sigCount);
+
+	dsig = job->sigs;
+  for (cur = job->head; cur; cur = cur->next) {
+  	if (cur->header->type != PKT_TYPE_SIGNATURE || NULL == cur->c.signature)
+    	continue;
+    dsig->sig = cur;
+    if (spgp_sig_hash_share(job->md, cur) == 0)
+    	dsig->key = spgp_sig_prepare(cur, keys);
+    dsig++;
+  }
+}
+
+/**
+ * Check files from |arg|'s pool until none are left.
+ */
+static void *spgp_detached_worker(void *arg) {
+	spgp_detached_pool_t *pool = arg;
+  spgp_detached_job_t *job;
+
+	while (1) {
+  	pthread_mutex_lock(&pool->mtx);
+    job = pool->next < pool->count ? &pool->jobs[pool->next++] : NULL;
+    pthread_mutex_unlock(&pool->mtx);
+    if (NULL == job) break;
+    if (job->file->err) continue;
+    spgp_detached_run_job(job);
+  }
+  return NULL;
+}
+
+/**
+ * Hash one file and check its signatures, catching exceptions on this
+ * thread.
+ *
+ * The file's status is good only if every signature is; otherwise it is
+ * that of the first signature that isn't.
+ */
+static void spgp_detached_run_job(spgp_detached_job_t *job) {
+	spgp_detached_t *file = job->file;
+  spgp_signature_pkt_t *sig;
+  spgp_sig_md_t copy;
+  volatile int fd = -1;
+  uint32_t i;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    if (fd >= 0 && file->path) close(fd);
+    file->err = _spgp_err;
+    return;
+  }
+
+	// Nothing to hash if no signature can be checked
+	for (i = 0; i < job->sigCount && NULL == job->sigs[i].key; i++);
+  if (i < job->sigCount) {
+  	if (file->path) {
+    	fd = open(file->path, O_RDONLY);
+      if (fd < 0) RAISE(IO_ERROR);
+    }
+    spgp_detached_hash_fd(job, file->path ? fd : file->fd);
+    if (file->path) close(fd);
+    fd = -1;
+  }
+
+	file->status = SPGP_SIG_GOOD;
+  for (i = 0; i < job->sigCount; i++) {
+  	sig = job->sigs[i].sig->c.signature;
+  	if (job->sigs[i].key) {
+    	copy = spgp_sig_hash_copy(job->md[sig->type == SIG_TYPE_TEXT]);
+      spgp_sig_finish(job->sigs[i].sig, job->sigs[i].key, copy);
+      spgp_sig_hash_close(copy);
+    }
+    if (sig->status != SPGP_SIG_GOOD && file->status == SPGP_SIG_GOOD)
+    	file->status = sig->status;
+  }
+  if (file->status != SPGP_SIG_GOOD)
+  	file->err = spgp_sig_status_error(file->status);
+}
+
+/**
+ * Hash everything in |fd|.
+ *
+ * Regular files are hashed from their start through a sliding read-only
+ * mapping, so only page cache is touched and nothing is copied.  Anything
+ * that can't be mapped is read from its current position in large blocks.
+ */
+static void spgp_detached_hash_fd(spgp_detached_job_t *job, int fd) {
+	struct stat st;
+  uint8_t *buf;
+  void *map;
+  off_t off = 0;
+  size_t n;
+  ssize_t got;
+
+	if (fstat(fd, &st) != 0) RAISE(IO_ERROR);
+
+	if (S_ISREG(st.st_mode)) {
+  	while (off < st.st_size) {
+    	n = (uint64_t)(st.st_size - off) < SPGP_DETACHED_WINDOW ?
+        (size_t)(st.st_size - off) : SPGP_DETACHED_WINDOW;
+      map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, off);
+      if (MAP_FAILED == map) break;
+      posix_madvise(map, n, POSIX_MADV_SEQUENTIAL);
+      spgp_detached_hash(job, map, n);
+      munmap(map, n);
+      off += n;
+    }
+    if (off == st.st_size) return;
+    Serial.printf("Mapping failed at %lu, reading instead\n",
+    	(unsigned long)off);
+    if (lseek(fd, off, SEEK_SET) < 0) RAISE(IO_ERROR);
+  }
+
+	buf = malloc(SPGP_DETACHED_BLOCK);
+  if (NULL == buf) RAISE(OUT_OF_MEMORY);
+  while ((got = read(fd, buf, SPGP_DETACHED_BLOCK)) != 0) {
+  	if (got < 0) {
+    	if (errno == EINTR) continue;
+      free(buf);
+      RAISE(IO_ERROR);
+    }
+    spgp_detached_hash(job, buf, got);
+  }
+  free(buf);
+}
+
+/**
+ * Feed the next piece of the file to the binary and text hashes.
+ */
+static void spgp_detached_hash(spgp_detached_job_t *job,
+                               const uint8_t *data, size_t len) {
+	if (job->md[0]) spgp_sig_hash_write(job->md[0], data, len);
+  if (job->md[1])
+  	spgp_sig_hash_update(job->md[1], SIG_TYPE_TEXT, data, len, &job->last);
+}
+
+static void spgp_detached_free_job(spgp_detached_job_t *job) {
+	if (job->md[0]) spgp_sig_hash_close(job->md[0]);
+  if (job->md[1]) spgp_sig_hash_close(job->md[1]);
+  free(job->sigs);
+  spgp_free_packet(&job->head);
+  memset(job, 0, sizeof(*job));
+}
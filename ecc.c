@@ -0,0 +1,460 @@
+/*
+ *  ecc.c
+ *  libsimplepgp
+ *
+ *  Elliptic curve keys: curve OIDs, X25519 and the ECDH key wrapping.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "ecc.h"
+#include "crypto.h"
+#include "mpi.h"
+#include "secmem.h"
+
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+static const spgp_ecc_curve_t ecc_curves[] = {
+	{SPGP_CURVE_ED25519, "Ed25519", 32, 9,
+   {0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01}},
+  {SPGP_CURVE_25519, "Curve25519", 32, 10,
+   {0x2B, 0x06, 0x01, 0x04, 0x01, 0x97, 0x55, 0x01, 0x05, 0x01}},
+  {SPGP_CURVE_NISTP256, "NIST P-256", 32, 8,
+   {0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07}},
+};
+#define SPGP_ECC_CURVES (sizeof(ecc_curves) / sizeof(ecc_curves[0]))
+
+// Sender name in the KDF parameters, RFC 6637 8
+static const uint8_t ecdh_anonymous[20] = "Anonymous Sender    ";
+
+#ifdef SPGP_ECC_X25519
+/* Field elements mod 2^255 - 19, as five 51-bit limbs, least significant
+   first.  Limbs may run a few bits over between operations. */
+typedef uint64_t spgp_fe_t[5];
+typedef unsigned __int128 spgp_u128_t;
+
+#define FE_MASK ((1ULL << 51) - 1)
+#endif
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+#ifdef SPGP_ECC_X25519
+static void spgp_fe_frombytes(spgp_fe_t r, const uint8_t *s);
+static void spgp_fe_tobytes(uint8_t *s, const spgp_fe_t a);
+static void spgp_fe_add(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b);
+static void spgp_fe_sub(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b);
+static void spgp_fe_mul(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b);
+static void spgp_fe_sq(spgp_fe_t r, const spgp_fe_t a, uint32_t times);
+static void spgp_fe_mul_small(spgp_fe_t r, const spgp_fe_t a, uint32_t b);
+static void spgp_fe_cswap(spgp_fe_t a, spgp_fe_t b, uint64_t swap);
+static void spgp_fe_invert(spgp_fe_t r, const spgp_fe_t z);
+#endif
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+/**
+ * Look up a curve by its OID, as read by spgp_read_field().
+ *
+ * @return The curve, or NULL if it isn't supported
+ */
+const spgp_ecc_curve_t *spgp_ecc_curve(const uint8_t *oid) {
+	uint32_t len, i;
+
+	if (NULL == oid) return NULL;
+  len = (((oid[0] << 8) | oid[1]) + 7) / 8;
+  for (i = 0; i < SPGP_ECC_CURVES; i++) {
+  	if (ecc_curves[i].oidLen == len &&
+        memcmp(ecc_curves[i].oid, oid + 2, len) == 0)
+    	return &ecc_curves[i];
+  }
+  return NULL;
+}
+
+/**
+ * X25519 from RFC 7748 5: the u coordinate of |scalar| times |point|.
+ *
+ * The ladder runs the same steps and memory accesses whatever the scalar
+ * is.  Only built where SPGP_ECC_X25519 is defined.
+ *
+ * @param out 32 bytes for the result, little-endian
+ * @param scalar 32 byte secret scalar, little-endian.  It is clamped here.
+ * @param point 32 byte u coordinate, little-endian
+ * @return 0 for success, -1 if the result is zero, which only a point of
+ *         small order gives
+ */
+uint8_t spgp_ecc_x25519(uint8_t *out, const uint8_t *scalar,
+                        const uint8_t *point) {
+#ifdef SPGP_ECC_X25519
+	spgp_fe_t x1, x2, z2, x3, z3;
+  spgp_fe_t a, aa, b, bb, e, c, d, da, cb;
+  uint8_t k[32];
+  uint64_t swap = 0, bit;
+  uint8_t zero = 0;
+  int t;
+
+	memcpy(k, scalar, 32);
+  k[0] &= 248;
+  k[31] &= 127;
+  k[31] |= 64;
+
+	spgp_fe_frombytes(x1, point);
+  memset(x2, 0, sizeof(x2));
+  x2[0] = 1;
+  memset(z2, 0, sizeof(z2));
+  memcpy(x3, x1, sizeof(x3));
+  memset(z3, 0, sizeof(z3));
+  z3[0] = 1;
+
+	for (t = 254; t >= 0; t--) {
+  	bit = (k[t >> 3] >> (t & 7)) & 1;
+    swap ^= bit;
+    spgp_fe_cswap(x2, x3, swap);
+    spgp_fe_cswap(z2, z3, swap);
+    swap = bit;
+
+		spgp_fe_add(a, x2, z2);
+    spgp_fe_sq(aa, a, 1);
+    spgp_fe_sub(b, x2, z2);
+    spgp_fe_sq(bb, b, 1);
+    spgp_fe_sub(e, aa, bb);
+    spgp_fe_add(c, x3, z3);
+    spgp_fe_sub(d, x3, z3);
+    spgp_fe_mul(da, d, a);
+    spgp_fe_mul(cb, c, b);
+    spgp_fe_add(x3, da, cb);
+    spgp_fe_sq(x3, x3, 1);
+    spgp_fe_sub(z3, da, cb);
+    spgp_fe_sq(z3, z3, 1);
+    spgp_fe_mul(z3, z3, x1);
+    spgp_fe_mul(x2, aa, bb);
+    spgp_fe_mul_small(z2, e, 121665);
+    spgp_fe_add(z2, z2, aa);
+    spgp_fe_mul(z2, z2, e);
+  }
+  spgp_fe_cswap(x2, x3, swap);
+  spgp_fe_cswap(z2, z3, swap);
+
+	spgp_fe_invert(z2, z2);
+  spgp_fe_mul(x2, x2, z2);
+  spgp_fe_tobytes(out, x2);
+
+	spgp_secure_wipe(k, sizeof(k));
+  spgp_secure_wipe(x2, sizeof(x2));
+  spgp_secure_wipe(z2, sizeof(z2));
+  spgp_secure_wipe(x3, sizeof(x3));
+  spgp_secure_wipe(z3, sizeof(z3));
+
+	for (t = 0; t < 32; t++) zero |= out[t];
+  return zero ? 0 : -1;
+#else
+	(void)out;
+  (void)scalar;
+  (void)point;
+	return -1;
+#endif
+}
+
+/**
+ * Unwrap the session key of an ECDH session packet (RFC 6637 8).
+ *
+ * The shared point comes from the crypto backend, and goes through the KDF
+ * named in the key's parameters to make the key that unwraps the session
+ * key.
+ *
+ * @param key Keychain ECDH key the session is encrypted to
+ * @param ephemeral Sender's ephemeral public point, the session's first MPI
+ * @param wrapped Wrapped session key, the session's second MPI
+ * @param len Set to the length of the result
+ * @return The symmetric algorithm, key and checksum with their PKCS#5
+ *         padding, for spgp_session_unwrap().  In secure memory; free with
+ *         spgp_secure_free().
+ */
+uint8_t *spgp_ecdh_decrypt(const spgp_keychain_key_t *key,
+                           const spgp_mpi_t *ephemeral,
+                           const spgp_mpi_t *wrapped, size_t *len) {
+	const spgp_ecc_curve_t *curve;
+  const uint8_t *oid, *kdf;
+  spgp_crypto_hash_t *md;
+  uint8_t param[4];
+  uint8_t kek[32];
+  uint8_t *shared, *frame;
+  size_t sharedLen, keklen;
+
+	if (NULL == key || NULL == ephemeral || NULL == wrapped || NULL == len)
+  	RAISE(INVALID_ARGS);
+  if (key->asymAlgo != ASYM_ALGO_ECDH || key->mpiCount < 4)
+  	RAISE(INVALID_ARGS);
+
+	// OID, point, then KDF parameters: 1 reserved, hash, key wrap cipher
+  oid = key->mpis;
+  kdf = oid + spgp_mpi_length((uint8_t *)oid) + 2;
+  kdf += spgp_mpi_length((uint8_t *)kdf) + 2;
+  curve = spgp_ecc_curve(oid);
+  if (NULL == curve || spgp_mpi_length((uint8_t *)kdf) != 3 || kdf[2] != 1)
+  	RAISE(FORMAT_UNSUPPORTED);
+  switch (kdf[4]) {
+  	case SYM_ALGO_AES128: keklen = 16; break;
+    case SYM_ALGO_AES192: keklen = 24; break;
+    case SYM_ALGO_AES256: keklen = 32; break;
+    default: RAISE(FORMAT_UNSUPPORTED);
+  }
+  if (spgp_crypto_hash_length(kdf[3]) < keklen) RAISE(FORMAT_UNSUPPORTED);
+
+	md = spgp_crypto_hash_open(kdf[3]);
+  shared = spgp_crypto_pk_decrypt(ASYM_ALGO_ECDH, key, ephemeral, NULL,
+                                  &sharedLen);
+
+	// Hash(00 00 00 01 || shared X || param), where param is the curve OID,
+  // algorithm, KDF parameters, sender name and recipient fingerprint
+	param[0] = param[1] = param[2] = 0;
+  param[3] = 1;
+  spgp_crypto_hash_write(md, param, 4);
+  spgp_crypto_hash_write(md, shared, sharedLen);
+  spgp_secure_free(shared, sharedLen);
+  param[0] = curve->oidLen;
+  spgp_crypto_hash_write(md, param, 1);
+  spgp_crypto_hash_write(md, curve->oid, curve->oidLen);
+  param[0] = ASYM_ALGO_ECDH;
+  param[1] = 3;
+  spgp_crypto_hash_write(md, param, 2);
+  spgp_crypto_hash_write(md, kdf + 2, 3);
+  spgp_crypto_hash_write(md, ecdh_anonymous, sizeof(ecdh_anonymous));
+  spgp_crypto_hash_write(md, key->fingerprint, SPGP_FINGERPRINT_LEN);
+  memcpy(kek, spgp_crypto_hash_read(md), keklen);
+  spgp_crypto_hash_close(md);
+
+	frame = spgp_crypto_key_unwrap(kdf[4], kek, wrapped->data + 2,
+                                 wrapped->count, len);
+  spgp_secure_wipe(kek, sizeof(kek));
+  return frame;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+#ifdef SPGP_ECC_X25519
+static uint64_t spgp_fe_load64(const uint8_t *s) {
+	uint64_t r = 0;
+  int i;
+
+	for (i = 7; i >= 0; i--) r = (r << 8) | s[i];
+  return r;
+}
+
+/**
+ * Read a little-endian u coordinate.  The top bit is ignored.
+ */
+static void spgp_fe_frombytes(spgp_fe_t r, const uint8_t *s) {
+	r[0] = spgp_fe_load64(s) & FE_MASK;
+  r[1] = (spgp_fe_load64(s + 6) >> 3) & FE_MASK;
+  r[2] = (spgp_fe_load64(s + 12) >> 6) & FE_MASK;
+  r[3] = (spgp_fe_load64(s + 19) >> 1) & FE_MASK;
+  r[4] = (spgp_fe_load64(s + 24) >> 12) & FE_MASK;
+}
+
+/**
+ * Carry every limb into the next, with the top limb's carry times 19
+ * going back into the bottom one.
+ */
+static void spgp_fe_carry(spgp_fe_t a) {
+	a[1] += a[0] >> 51; a[0] &= FE_MASK;
+  a[2] += a[1] >> 51; a[1] &= FE_MASK;
+  a[3] += a[2] >> 51; a[2] &= FE_MASK;
+  a[4] += a[3] >> 51; a[3] &= FE_MASK;
+  a[0] += 19 * (a[4] >> 51); a[4] &= FE_MASK;
+}
+
+/**
+ * Write |a| fully reduced, as 32 little-endian bytes.
+ */
+static void spgp_fe_tobytes(uint8_t *s, const spgp_fe_t a) {
+	spgp_fe_t t;
+  uint64_t w[4];
+  int i;
+
+	memcpy(t, a, sizeof(t));
+  spgp_fe_carry(t);
+  spgp_fe_carry(t);
+  // t is now below 2^255.  Adding 19 only carries out of bit 255 when
+  // t >= p, and the carry comes back as 19, so either way this leaves
+  // (t mod p) + 19.
+  t[0] += 19;
+  spgp_fe_carry(t);
+  // Add 2^255 - 19 and drop bit 255, leaving t mod p
+  t[0] += (1ULL << 51) - 19;
+  t[1] += (1ULL << 51) - 1;
+  t[2] += (1ULL << 51) - 1;
+  t[3] += (1ULL << 51) - 1;
+  t[4] += (1ULL << 51) - 1;
+  t[1] += t[0] >> 51; t[0] &= FE_MASK;
+  t[2] += t[1] >> 51; t[1] &= FE_MASK;
+  t[3] += t[2] >> 51; t[2] &= FE_MASK;
+  t[4] += t[3] >> 51; t[3] &= FE_MASK;
+  t[4] &= FE_MASK;
+
+	w[0] = t[0] | (t[1] << 51);
+  w[1] = (t[1] >> 13) | (t[2] << 38);
+  w[2] = (t[2] >> 26) | (t[3] << 25);
+  w[3] = (t[3] >> 39) | (t[4] << 12);
+  for (i = 0; i < 32; i++) s[i] = w[i >> 3] >> (8 * (i & 7));
+}
+
+static void spgp_fe_add(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b) {
+	int i;
+
+	for (i = 0; i < 5; i++) r[i] = a[i] + b[i];
+}
+
+/**
+ * a - b, with 2p added first so no limb goes below zero.  |b| must be
+ * carried.
+ */
+static void spgp_fe_sub(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b) {
+	r[0] = a[0] + 0xFFFFFFFFFFFDAULL - b[0];
+  r[1] = a[1] + 0xFFFFFFFFFFFFEULL - b[1];
+  r[2] = a[2] + 0xFFFFFFFFFFFFEULL - b[2];
+  r[3] = a[3] + 0xFFFFFFFFFFFFEULL - b[3];
+  r[4] = a[4] + 0xFFFFFFFFFFFFEULL - b[4];
+  spgp_fe_carry(r);
+}
+
+/**
+ * Product of the limbs, with the parts at 2^255 and above folded back in
+ * as times 19.  The result is carried.
+ */
+static void spgp_fe_mul(spgp_fe_t r, const spgp_fe_t a, const spgp_fe_t b) {
+	spgp_u128_t t0, t1, t2, t3, t4;
+  uint64_t b1 = b[1] * 19, b2 = b[2] * 19, b3 = b[3] * 19, b4 = b[4] * 19;
+  uint64_t c;
+
+	t0 = (spgp_u128_t)a[0] * b[0] + (spgp_u128_t)a[1] * b4 +
+  	(spgp_u128_t)a[2] * b3 + (spgp_u128_t)a[3] * b2 +
+    (spgp_u128_t)a[4] * b1;
+  t1 = (spgp_u128_t)a[0] * b[1] + (spgp_u128_t)a[1] * b[0] +
+  	(spgp_u128_t)a[2] * b4 + (spgp_u128_t)a[3] * b3 +
+    (spgp_u128_t)a[4] * b2;
+  t2 = (spgp_u128_t)a[0] * b[2] + (spgp_u128_t)a[1] * b[1] +
+  	(spgp_u128_t)a[2] * b[0] + (spgp_u128_t)a[3] * b4 +
+    (spgp_u128_t)a[4] * b3;
+  t3 = (spgp_u128_t)a[0] * b[3] + (spgp_u128_t)a[1] * b[2] +
+  	(spgp_u128_t)a[2] * b[1] + (spgp_u128_t)a[3] * b[0] +
+    (spgp_u128_t)a[4] * b4;
+  t4 = (spgp_u128_t)a[0] * b[4] + (spgp_u128_t)a[1] * b[3] +
+  	(spgp_u128_t)a[2] * b[2] + (spgp_u128_t)a[3] * b[1] +
+    (spgp_u128_t)a[4] * b[0];
+
+	t1 += (uint64_t)(t0 >> 51); r[0] = (uint64_t)t0 & FE_MASK;
+  t2 += (uint64_t)(t1 >> 51); r[1] = (uint64_t)t1 & FE_MASK;
+  t3 += (uint64_t)(t2 >> 51); r[2] = (uint64_t)t2 & FE_MASK;
+  t4 += (uint64_t)(t3 >> 51); r[3] = (uint64_t)t3 & FE_MASK;
+  c = (uint64_t)(t4 >> 51); r[4] = (uint64_t)t4 & FE_MASK;
+  r[0] += c * 19;
+  r[1] += r[0] >> 51;
+  r[0] &= FE_MASK;
+}
+
+/**
+ * Square |a| |times| times over.
+ */
+static void spgp_fe_sq(spgp_fe_t r, const spgp_fe_t a, uint32_t times) {
+	spgp_fe_mul(r, a, a);
+  while (--times) spgp_fe_mul(r, r, r);
+}
+
+static void spgp_fe_mul_small(spgp_fe_t r, const spgp_fe_t a, uint32_t b) {
+	spgp_u128_t t;
+  uint64_t c = 0;
+  int i;
+
+	for (i = 0; i < 5; i++) {
+  	t = (spgp_u128_t)a[i] * b + c;
+    r[i] = (uint64_t)t & FE_MASK;
+    c = (uint64_t)(t >> 51);
+  }
+  r[0] += c * 19;
+  r[1] += r[0] >> 51;
+  r[0] &= FE_MASK;
+}
+
+/**
+ * Swap |a| and |b| if |swap| is 1, without a branch.
+ */
+static void spgp_fe_cswap(spgp_fe_t a, spgp_fe_t b, uint64_t swap) {
+	uint64_t mask = 0 - swap, x;
+  int i;
+
+	for (i = 0; i < 5; i++) {
+  	x = mask & (a[i] ^ b[i]);
+    a[i] ^= x;
+    b[i] ^= x;
+  }
+}
+
+/**
+ * z^(p - 2), the inverse of z.  The chain of squarings and products is
+ * the usual one for 2^255 - 21.
+ */
+static void spgp_fe_invert(spgp_fe_t r, const spgp_fe_t z) {
+	spgp_fe_t z2, z9, z11, z5_0, z10_0, z20_0, z50_0, z100_0, t;
+
+	spgp_fe_sq(z2, z, 1);
+  spgp_fe_sq(t, z2, 2);
+  spgp_fe_mul(z9, t, z);
+  spgp_fe_mul(z11, z9, z2);
+  spgp_fe_sq(t, z11, 1);
+  spgp_fe_mul(z5_0, t, z9);             // 2^5 - 1
+  spgp_fe_sq(t, z5_0, 5);
+  spgp_fe_mul(z10_0, t, z5_0);          // 2^10 - 1
+  spgp_fe_sq(t, z10_0, 10);
+  spgp_fe_mul(z20_0, t, z10_0);         // 2^20 - 1
+  spgp_fe_sq(t, z20_0, 20);
+  spgp_fe_mul(t, t, z20_0);             // 2^40 - 1
+  spgp_fe_sq(t, t, 10);
+  spgp_fe_mul(z50_0, t, z10_0);         // 2^50 - 1
+  spgp_fe_sq(t, z50_0, 50);
+  spgp_fe_mul(z100_0, t, z50_0);        // 2^100 - 1
+  spgp_fe_sq(t, z100_0, 100);
+  spgp_fe_mul(t, t, z100_0);            // 2^200 - 1
+  spgp_fe_sq(t, t, 50);
+  spgp_fe_mul(t, t, z50_0);             // 2^250 - 1
+  spgp_fe_sq(t, t, 5);
+  spgp_fe_mul(r, t, z11);               // 2^255 - 21
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+ *  ecc.h
+ *  libsimplepgp
+ *
+ *  Elliptic curve keys: curve OIDs, X25519 and the ECDH key wrapping.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _ECC_H
+
+#include "packet_private.h"
+#include "keychain.h"
+
+// X25519 is built with 128-bit products, so only where the compiler has
+// them.  Elsewhere the gcrypt backend does Curve25519.
+#ifdef __SIZEOF_INT128__
+#define SPGP_ECC_X25519
+#endif
+
+typedef enum {
+	SPGP_CURVE_ED25519         = 1,
+  SPGP_CURVE_25519,
+  SPGP_CURVE_NISTP256,
+} spgp_curve_id_t;
+
+typedef struct spgp_ecc_curve_struct {
+	uint8_t id;
+  const char *name;       // as libgcrypt knows it
+  uint8_t bytes;          // size of a coordinate or scalar
+  uint8_t oidLen;
+  uint8_t oid[10];
+} spgp_ecc_curve_t;
+
+const spgp_ecc_curve_t *spgp_ecc_curve(const uint8_t *oid);
+
+uint8_t spgp_ecc_x25519(uint8_t *out, const uint8_t *scalar,
+                        const uint8_t *point);
+
+uint8_t *spgp_ecdh_decrypt(const spgp_keychain_key_t *key,
+                           const spgp_mpi_t *ephemeral,
+                           const spgp_mpi_t *wrapped, size_t *len);
+
+#define _ECC_H
+#endif
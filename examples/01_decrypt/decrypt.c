@@ -18,7 +18,8 @@ int main(int argc, char **argv) {
   int seckey_len, ctext_len;
   spgp_packet_t *pkt;
   char *data, *filename;
-  uint32_t datalen, filenamelen;
+  size_t datalen;
+  uint32_t filenamelen;
 
   printf("simplepgp decrypt example.\n");
 
@@ -53,6 +54,7 @@ int main(int argc, char **argv) {
     fprintf(stderr, "error: %s\n", spgp_err_str(spgp_err()));
     return 1;
   }
+  spgp_free_packet(&pkt);
 
   pkt = spgp_decode_message(ctext, ctext_len);
   if (NULL == pkt) {
@@ -67,7 +69,7 @@ int main(int argc, char **argv) {
     return 1;
   }
   printf("Filename length: %u\n", filenamelen);
-  printf("Data length: %u\n", datalen);
+  printf("Data length: %lu\n", (unsigned long)datalen);
   write(STDOUT_FILENO, filename, filenamelen);
   printf(": ");
   fflush(stdout);
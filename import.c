@@ -0,0 +1,276 @@
+/*
+ *  import.c
+ *  libsimplepgp
+ *
+ *  Keyring decoding split across threads at key boundaries.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "armor.h"
+#include "scan.h"
+#include "verify.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// More runs than threads, so a run of unusually large keys doesn't leave
+// the other threads idle at the end.
+#define SPGP_IMPORT_JOBS_PER_THREAD 4
+#define SPGP_IMPORT_MAX_THREADS     64
+
+// Offsets of the packets that start a transferable key
+typedef struct {
+	size_t *starts;
+  uint32_t count;
+  uint32_t size;
+} spgp_key_starts_t;
+
+// One run of whole keys, decoded by a single thread
+typedef struct {
+	size_t start;
+  size_t end;
+  spgp_packet_t *head;
+  uint32_t err;
+} spgp_import_job_t;
+
+typedef struct {
+	uint8_t *keyring;
+  spgp_import_job_t *jobs;
+  uint32_t jobCount;
+  uint32_t nextJob;
+  pthread_mutex_t mtx;
+} spgp_import_pool_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static int spgp_import_find_key(const spgp_span_t *span, void *ctx);
+
+static uint32_t spgp_import_plan(spgp_key_starts_t *keys, size_t length,
+                                 spgp_import_job_t *jobs, uint32_t jobCount);
+
+static void *spgp_import_worker(void *arg);
+
+static void spgp_import_run_job(uint8_t *keyring, spgp_import_job_t *job);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+spgp_packet_t *spgp_import_keyring(uint8_t *keyring, size_t length,
+                                   uint32_t threads) {
+	spgp_packet_t *head = NULL;
+  spgp_packet_t *tail = NULL;
+  spgp_key_starts_t keys;
+  spgp_import_pool_t pool;
+  pthread_t tids[SPGP_IMPORT_MAX_THREADS];
+  uint8_t *dearmored = NULL;
+  uint8_t * volatile binary = NULL;
+  uint32_t err = 0;
+  uint32_t started = 0;
+  uint32_t i;
+  long cpus;
+
+	Serial.printf("begin\n");
+
+	memset(&keys, 0, sizeof(keys));
+  memset(&pool, 0, sizeof(pool));
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    free(keys.starts);
+    free(pool.jobs);
+    free(binary);
+    return NULL;
+  }
+
+	if (NULL == keyring || 0 == length) RAISE(INVALID_ARGS);
+
+	if (spgp_is_armored(keyring, length)) {
+  	spgp_armor_decode(keyring, length, &dearmored, &length);
+    binary = keyring = dearmored;
+    if (0 == length) RAISE(INVALID_HEADER);
+  }
+
+	if (0 == threads) {
+  	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  if (threads > SPGP_IMPORT_MAX_THREADS) threads = SPGP_IMPORT_MAX_THREADS;
+
+	// Find where each key starts.  This only reads packet headers.
+  spgp_scan_packets(keyring, length, spgp_import_find_key, &keys);
+
+	pool.jobs = malloc(sizeof(*pool.jobs) * threads * SPGP_IMPORT_JOBS_PER_THREAD);
+  if (NULL == pool.jobs) RAISE(OUT_OF_MEMORY);
+  pool.jobCount = spgp_import_plan(&keys, length, pool.jobs,
+                                   threads * SPGP_IMPORT_JOBS_PER_THREAD);
+  pool.keyring = keyring;
+  free(keys.starts);
+  keys.starts = NULL;
+  if (pthread_mutex_init(&pool.mtx, NULL)) RAISE(GENERIC_ERROR);
+
+	Serial.printf("%u keys in %u runs on %u threads\n",
+  	keys.count, pool.jobCount, threads);
+
+	// This thread works through the runs alongside the ones started here.
+  // That replaces our exception handler, so nothing below may RAISE().
+  if (threads > pool.jobCount) threads = pool.jobCount;
+  for (i = 1; i < threads; i++) {
+  	if (pthread_create(&tids[started], NULL, spgp_import_worker, &pool))
+    	break;
+    started++;
+  }
+  spgp_import_worker(&pool);
+  for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&pool.mtx);
+
+	// Join the runs back together in keyring order
+	for (i = 0; i < pool.jobCount; i++) {
+  	if (pool.jobs[i].err && !err) err = pool.jobs[i].err;
+  	if (NULL == pool.jobs[i].head) continue;
+    if (tail) {
+    	tail->next = pool.jobs[i].head;
+      pool.jobs[i].head->prev = tail;
+    }
+    else {
+    	head = pool.jobs[i].head;
+    }
+    tail = pool.jobs[i].head;
+    while (tail->next) tail = tail->next;
+  }
+
+	if (err) {
+  	Serial.printf("Import failed (0x%x)\n", err);
+  	spgp_free_packet(&head);
+    pthread_mutex_lock(&spgp_mtx);
+    _spgp_err = err;
+    pthread_mutex_unlock(&spgp_mtx);
+  }
+
+	free(pool.jobs);
+  free(binary);
+  Serial.printf("done\n");
+  return head;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Scanner callback recording the offset of every key packet.
+ */
+static int spgp_import_find_key(const spgp_span_t *span, void *ctx) {
+	spgp_key_starts_t *keys = ctx;
+  size_t *starts;
+
+	if (span->type != PKT_TYPE_PUBLIC_KEY && span->type != PKT_TYPE_SECRET_KEY)
+  	return 0;
+
+	if (keys->count == keys->size) {
+  	keys->size = keys->size ? keys->size * 2 : 1024;
+    starts = realloc(keys->starts, sizeof(*starts) * keys->size);
+    if (NULL == starts) RAISE(OUT_OF_MEMORY);
+    keys->starts = starts;
+  }
+  keys->starts[keys->count++] = span->offset;
+  return 0;
+}
+
+/**
+ * Split the keyring into at most |jobCount| runs of about equal size.
+ *
+ * Runs only break at the start of a key, so signatures and subkeys always
+ * stay with their key.  Anything before the first key goes in the first run.
+ *
+ * @return Number of runs filled in
+ */
+static uint32_t spgp_import_plan(spgp_key_starts_t *keys, size_t length,
+                                 spgp_import_job_t *jobs, uint32_t jobCount) {
+	size_t target = length / jobCount;
+  uint32_t n = 1;
+  uint32_t i;
+
+	memset(jobs, 0, sizeof(*jobs) * jobCount);
+  for (i = 0; i < keys->count && n < jobCount; i++) {
+  	if (keys->starts[i] - jobs[n-1].start < target) continue;
+    jobs[n-1].end = keys->starts[i];
+    jobs[n].start = keys->starts[i];
+    n++;
+  }
+  jobs[n-1].end = length;
+  return n;
+}
+
+/**
+ * Decode runs from |arg|'s pool until none are left.
+ */
+static void *spgp_import_worker(void *arg) {
+	spgp_import_pool_t *pool = arg;
+  spgp_import_job_t *job;
+
+	while (1) {
+  	pthread_mutex_lock(&pool->mtx);
+    job = pool->nextJob < pool->jobCount ? &pool->jobs[pool->nextJob++] : NULL;
+    pthread_mutex_unlock(&pool->mtx);
+    if (NULL == job) break;
+    spgp_import_run_job(pool->keyring, job);
+  }
+  return NULL;
+}
+
+/**
+ * Decode one run of keys, catching its exceptions on this thread.
+ */
+static void spgp_import_run_job(uint8_t *keyring, spgp_import_job_t *job) {
+	size_t idx = 0;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    job->err = _spgp_err;
+    spgp_onepass_reset();
+    return;
+  }
+
+	job->head = spgp_packet_decode_loop(keyring + job->start, &idx,
+                                      job->end - job->start);
+  spgp_onepass_reset();
+}
@@ -0,0 +1,146 @@
+/*
+ *  inspect.c
+ *  libsimplepgp
+ *
+ *  Summarize a message's recipients and sizes without decrypting it.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "keychain.h"
+#include "armor.h"
+#include "scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+typedef struct {
+	uint8_t *msg;
+  spgp_inspect_t *info;
+} spgp_inspect_ctx_t;
+
+static int spgp_inspect_packet(const spgp_span_t *span, void *ctx);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_inspect(uint8_t *message, size_t length, spgp_inspect_t *info) {
+	spgp_inspect_ctx_t ctx;
+  uint8_t *dearmored = NULL;
+  uint8_t * volatile binary = NULL;
+  volatile uint8_t err = 0;
+  uint32_t i;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    err = -1;
+    goto end;
+  }
+
+	if (NULL == message || 0 == length || NULL == info) RAISE(INVALID_ARGS);
+  memset(info, 0, sizeof(*info));
+
+  if (spgp_is_armored(message, length)) {
+  	spgp_armor_decode(message, length, &dearmored, &length);
+    binary = message = dearmored;
+    if (0 == length) RAISE(INVALID_HEADER);
+  }
+
+	ctx.msg = message;
+  ctx.info = info;
+  spgp_scan_packets(message, length, spgp_inspect_packet, &ctx);
+
+	if (info->isEncrypted) {
+  	for (i = 0; i < info->recipientCount &&
+         i < SPGP_INSPECT_MAX_RECIPIENTS; i++) {
+    	if (info->recipients[i].hasKey) info->isDecryptable = 1;
+    }
+  }
+
+	end:
+  free(binary);
+	return err;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Add one packet found by the scanner to the summary.
+ *
+ * For session key packets only the key ID and algorithm are read.  The
+ * encrypted session key that follows is left alone.
+ */
+static int spgp_inspect_packet(const spgp_span_t *span, void *ctx) {
+	spgp_inspect_ctx_t *ictx = ctx;
+  spgp_inspect_t *info = ictx->info;
+  uint8_t *body = ictx->msg + span->bodyOffset;
+	spgp_recipient_t *rcpt;
+  uint8_t fprlen;
+
+	info->packetTypes |= SPGP_PACKET_MASK(span->type);
+
+	switch (span->type) {
+  	case PKT_TYPE_SESSION:
+    	// version (1) + key ID (8) + algorithm (1), all in the first chunk
+      if (span->bodyLength < 10 || span->isPartial) RAISE(INCOMPLETE_PACKET);
+    	if (info->recipientCount++ >= SPGP_INSPECT_MAX_RECIPIENTS) break;
+      rcpt = &info->recipients[info->recipientCount - 1];
+      if (body[0] == 6) {
+      	// Version 6 has a fingerprint instead, whose end is a V4 key's ID
+      	fprlen = body[1];
+        if (span->bodyLength < 3U + fprlen) RAISE(INCOMPLETE_PACKET);
+        memset(rcpt->keyid, 0, 8);
+        if (fprlen == 1 + SPGP_FINGERPRINT_LEN && body[2] == 4)
+        	memcpy(rcpt->keyid, body+2+fprlen-8, 8);
+        rcpt->algo = body[2+fprlen];
+      }
+      else {
+	      memcpy(rcpt->keyid, body+1, 8);
+  	    rcpt->algo = body[9];
+      }
+      rcpt->hasKey = spgp_keychain_key_with_id(rcpt->keyid) != NULL;
+      break;
+    case PKT_TYPE_AEAD_DATA:
+    case PKT_TYPE_SYM_ENC_INT_DATA:
+    	info->encryptedLength += span->bodyLength;
+      info->isEncrypted = 1;
+      break;
+    default:
+    	break;
+  }
+  return 0;
+}
@@ -22,71 +22,148 @@
 
 #include "keychain.h"
 #include "packet_private.h"
+#include "mpi.h"
+#include "secmem.h"
+#include "rsa.h"
 
-#define SPGP_KEYCHAIN_DEFAULT_SIZE 5
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Address space set aside for keys.  Pages are only made usable (and
+// locked) as keys are added, so records never move once added.
+#define SPGP_KEYCHAIN_RESERVE ((size_t)64 << 20)
+#define SPGP_KEYCHAIN_LINE    64
+#define SPGP_KEYCHAIN_INDEX_DEFAULT_SIZE 16
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Key IDs aren't secret, so they are indexed in ordinary memory where a
+// lookup reads four of them per cache line.
+typedef struct {
+	uint8_t keyid[8];
+  spgp_keychain_key_t *key;
+} spgp_keychain_index_t;
 
 static pthread_mutex_t keychain_mtx;
-static spgp_packet_t **keychain;
+static uint8_t *region;
+static size_t region_used;
+static size_t region_committed;
+static uint8_t region_locked;
+static spgp_keychain_index_t *kc_index;
 static uint32_t kc_count;
 static uint32_t kc_used;
 
 static uint32_t iter_idx;
 
+static const spgp_keychain_key_t *spgp_keychain_store(
+	const spgp_keychain_key_t *tmpl, const uint8_t *mpis, spgp_mpi_t *list);
+static uint8_t spgp_keychain_commit(size_t need);
+static spgp_keychain_key_t *spgp_keychain_find(const uint8_t *keyid);
+
 uint8_t spgp_keychain_init(void) {
 	if (pthread_mutex_init(&keychain_mtx, NULL)) return -1;
 
-	keychain = malloc(sizeof(spgp_packet_t*) * SPGP_KEYCHAIN_DEFAULT_SIZE);
-  if (NULL == keychain) return -1;
-  kc_count = SPGP_KEYCHAIN_DEFAULT_SIZE;
+	region = mmap(NULL, SPGP_KEYCHAIN_RESERVE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == region) {
+  	region = NULL;
+  	return -1;
+  }
+#ifdef MADV_DONTDUMP
+	// Keep secret keys out of core dumps
+	madvise(region, SPGP_KEYCHAIN_RESERVE, MADV_DONTDUMP);
+#endif
+  region_used = 0;
+  region_committed = 0;
+  region_locked = 1;
+
+	kc_index = malloc(sizeof(*kc_index) * SPGP_KEYCHAIN_INDEX_DEFAULT_SIZE);
+  if (NULL == kc_index) return -1;
+  kc_count = SPGP_KEYCHAIN_INDEX_DEFAULT_SIZE;
 	kc_used = 0;
   
 	return 0;
 }
 
 uint8_t spgp_keychain_free(void) {
+  uint32_t i;
+
+	for (i = 0; i < kc_used; i++) {
+  	spgp_free_packet(&kc_index[i].key->pub);
+    spgp_rsa_key_free(kc_index[i].key->rsa);
+    kc_index[i].key->rsa = NULL;
+  }
+  if (region) {
+		// Clear the keys before the pages go back to the system
+		spgp_secure_wipe(region, region_used);
+  	if (region_committed) munlock(region, region_committed);
+  	munmap(region, SPGP_KEYCHAIN_RESERVE);
+  }
+  region = NULL;
+  region_used = 0;
+  region_committed = 0;
+
 	kc_count = 0;
   kc_used = 0;
-  free(keychain);
-  keychain = NULL;
+  free(kc_index);
+  kc_index = NULL;
 	pthread_mutex_destroy(&keychain_mtx);
 	return 0;
 }
 
 uint8_t spgp_keychain_is_valid(void) {
-	if (keychain) return 1;
+	if (region && kc_index) return 1;
   return 0;
 }
 
-uint8_t spgp_keychain_add_packet(spgp_packet_t *pkt) {
-	if (NULL == pkt) return -1;
-  
-  pthread_mutex_lock(&keychain_mtx);
-  
-  if (kc_used == kc_count) {
-  	// Need to allocate more space
-    return -1; // for now, unsupported
-  }
-  
-  keychain[kc_used] = pkt;
-  kc_used++;
-
-	// Potential feature:
-  // If we wanted to be really fuckin' fancy, we could use 'secure memory'
-  // to store secret keys.  Use mlock() to get a page that will never be
-  // swapped to disk, and clear it when we exit.
+/**
+ * Copy a decrypted secret key packet into the keychain.
+ *
+ * Only the key ID, fingerprint, algorithm and MPIs are kept.  Adding a key
+ * that is already in the keychain returns the existing record.
+ *
+ * @param pkt Decrypted secret key or secret subkey packet
+ * @return The keychain's record, or NULL on failure
+ */
+const spgp_keychain_key_t *spgp_keychain_add_key(spgp_packet_t *pkt) {
+	spgp_keychain_key_t tmpl;
+  spgp_public_pkt_t *pub;
+  spgp_mpi_t *mpi;
 
-	Serial.printf("Added packet to keychain.");
+	if (NULL == pkt || NULL == pkt->header || NULL == pkt->c.secret ||
+      !pkt->c.secret->isDecrypted ||
+      (pkt->header->type != PKT_TYPE_SECRET_KEY &&
+       pkt->header->type != PKT_TYPE_SECRET_SUBKEY))
+  	return NULL;
 
-  pthread_mutex_unlock(&keychain_mtx);
-  
-	return 0;
+	pub = pkt->c.pub;
+  memset(&tmpl, 0, sizeof(tmpl));
+  memcpy(tmpl.fingerprint, spgp_key_fingerprint(pkt), SPGP_FINGERPRINT_LEN);
+  memcpy(tmpl.keyid, tmpl.fingerprint + 12, 8);
+  tmpl.creationTime = pub->creationTime;
+  tmpl.type = pkt->header->type;
+  tmpl.version = pub->version;
+  tmpl.asymAlgo = pub->asymAlgo;
+  for (mpi = pub->mpiHead; mpi; mpi = mpi->next) {
+  	tmpl.mpiCount++;
+    tmpl.mpiLength += mpi->count + 2;
+  }
+  return spgp_keychain_store(&tmpl, NULL, pub->mpiHead);
 }
 
-uint8_t spgp_keychain_del_packet(spgp_packet_t *pkt) {
-  pthread_mutex_lock(&keychain_mtx);
-  pthread_mutex_unlock(&keychain_mtx);
-  Serial.printf("PACKET DELETE UNIMPLEMENTED\n");
-	return -1;
+/**
+ * Add a key to the keychain from its record fields and MPIs.
+ *
+ * @param key Record to copy.  |pub| and |rsa| are ignored.
+ * @param mpis The key's |mpiLength| bytes of MPIs
+ * @return The keychain's record, or NULL on failure
+ */
+const spgp_keychain_key_t *spgp_keychain_add(const spgp_keychain_key_t *key,
+                                             const uint8_t *mpis) {
+	if (NULL == key || NULL == mpis) return NULL;
+  return spgp_keychain_store(key, mpis, NULL);
 }
 
 uint8_t spgp_keychain_iter_start(void) {
@@ -98,15 +175,218 @@ uint8_t spgp_keychain_iter_end(void) {
   pthread_mutex_unlock(&keychain_mtx);
   return 0;
 }
-spgp_packet_t *spgp_keychain_iter_next(void) {
+const spgp_keychain_key_t *spgp_keychain_iter_next(void) {
 	if (iter_idx < kc_used)
-  	return keychain[iter_idx++];
+  	return kc_index[iter_idx++].key;
   return NULL;
 }
 
-spgp_packet_t *spgp_keychain_secret_key_with_id(uint8_t *keyid) {
+const spgp_keychain_key_t *spgp_keychain_key_with_id(const uint8_t *keyid) {
+	spgp_keychain_key_t *key;
+
+	if (NULL == keyid || !spgp_keychain_is_valid()) return NULL;
+
+  pthread_mutex_lock(&keychain_mtx);
+  key = spgp_keychain_find(keyid);
+  pthread_mutex_unlock(&keychain_mtx);
+	return key;
+}
+
+/**
+ * Get the public part of a keychain key as a packet, for signature checks.
+ *
+ * The packet is built the first time it is asked for and kept with the
+ * key until the keychain is freed.
+ *
+ * @param keyid 8-octet key ID
+ * @return Public key or public subkey packet, or NULL if not found
+ */
+spgp_packet_t *spgp_keychain_public_key_with_id(const uint8_t *keyid) {
+	spgp_keychain_key_t *key;
+  spgp_packet_t *pkt;
+  spgp_public_pkt_t *pub;
+  spgp_mpi_t *mpi, *last = NULL;
+  size_t idx = 0;
+  uint8_t count, i;
+
+	if (NULL == keyid || !spgp_keychain_is_valid()) return NULL;
+
+  pthread_mutex_lock(&keychain_mtx);
+  key = spgp_keychain_find(keyid);
+  pkt = key ? key->pub : NULL;
+  pthread_mutex_unlock(&keychain_mtx);
+  if (NULL == key || pkt) return pkt;
+
+	// Curve OIDs and KDF parameters were stored like MPIs, so they come
+  // back the same way
+	count = spgp_public_mpi_count(key->asymAlgo);
+  if (0 == count) RAISE(FORMAT_UNSUPPORTED);
+
+	pkt = calloc(1, sizeof(*pkt));
+  if (NULL == pkt) RAISE(OUT_OF_MEMORY);
+  pkt->header = calloc(1, sizeof(*pkt->header));
+  pkt->c.pub = pub = calloc(1, sizeof(*pub));
+  if (NULL == pkt->header || NULL == pub) {
+  	free(pkt->header);
+    free(pub);
+    free(pkt);
+    RAISE(OUT_OF_MEMORY);
+  }
+  pkt->header->parent = pkt;
+  pkt->header->type = key->type == PKT_TYPE_SECRET_KEY ?
+  	PKT_TYPE_PUBLIC_KEY : PKT_TYPE_PUBLIC_SUBKEY;
+  pub->version = key->version;
+  pub->creationTime = key->creationTime;
+  pub->asymAlgo = key->asymAlgo;
+  memcpy(pub->fingerprint, key->fingerprint, SPGP_FINGERPRINT_LEN);
+  pub->hasFingerprint = 1;
+  for (i = 0; i < count && i < key->mpiCount; i++) {
+  	mpi = spgp_read_mpi(key->mpis, &idx, key->mpiLength);
+    if (last) last->next = mpi;
+    else pub->mpiHead = mpi;
+    last = mpi;
+    pub->mpiCount++;
+    idx++;
+  }
+
+	// Another thread may have built it meanwhile; keep the first
+  pthread_mutex_lock(&keychain_mtx);
+  if (key->pub) spgp_free_packet(&pkt);
+  else key->pub = pkt;
+  pkt = key->pub;
+  pthread_mutex_unlock(&keychain_mtx);
+  return pkt;
+}
+
+/**
+ * Get the CRT parameters of a keychain RSA key.
+ *
+ * Like the public key packet, they are worked out the first time they are
+ * asked for and kept with the key until the keychain is freed.  This takes
+ * the keychain's lock, so it can't be called while iterating.
+ *
+ * @param key Keychain RSA key
+ * @return Parameters for spgp_rsa_decrypt()
+ */
+const spgp_rsa_key_t *spgp_keychain_rsa_key(const spgp_keychain_key_t *key) {
+	// Records are only ever written under the lock
+	spgp_keychain_key_t *rec = (spgp_keychain_key_t *)key;
+  spgp_rsa_key_t *rsa;
+
+	if (NULL == key || key->asymAlgo != ASYM_ALGO_RSA) RAISE(INVALID_ARGS);
+
   pthread_mutex_lock(&keychain_mtx);
+  rsa = rec->rsa;
   pthread_mutex_unlock(&keychain_mtx);
-	Serial.printf("SECRET KEY SEARCH UNIMPLEMENTED\n");
-	return NULL;
+  if (rsa) return rsa;
+
+	rsa = spgp_rsa_key_new(key->mpis, key->mpiCount);
+
+	// Another thread may have built it meanwhile; keep the first
+  pthread_mutex_lock(&keychain_mtx);
+  if (rec->rsa) spgp_rsa_key_free(rsa);
+  else rec->rsa = rsa;
+  rsa = rec->rsa;
+  pthread_mutex_unlock(&keychain_mtx);
+  return rsa;
+}
+
+/**
+ * Copy a key into the next records of the locked region and index it.
+ *
+ * The MPIs come from |mpis|, or from |list| if |mpis| is NULL.
+ */
+static const spgp_keychain_key_t *spgp_keychain_store(
+	const spgp_keychain_key_t *tmpl, const uint8_t *mpis, spgp_mpi_t *list) {
+	spgp_keychain_key_t *key;
+  spgp_keychain_index_t *grown;
+  size_t size;
+  uint32_t off;
+
+	if (!spgp_keychain_is_valid()) return NULL;
+  size = (sizeof(*key) + tmpl->mpiLength + SPGP_KEYCHAIN_LINE - 1) &
+  	~(size_t)(SPGP_KEYCHAIN_LINE - 1);
+
+  pthread_mutex_lock(&keychain_mtx);
+  if ((key = spgp_keychain_find(tmpl->keyid)) != NULL &&
+      memcmp(key->fingerprint, tmpl->fingerprint, SPGP_FINGERPRINT_LEN) == 0) {
+  	pthread_mutex_unlock(&keychain_mtx);
+    return key;
+  }
+  if (kc_used == kc_count) {
+  	grown = realloc(kc_index, sizeof(*kc_index) * kc_count * 2);
+    if (NULL == grown) {
+    	pthread_mutex_unlock(&keychain_mtx);
+      return NULL;
+    }
+    kc_index = grown;
+    kc_count *= 2;
+  }
+  if (spgp_keychain_commit(size) != 0) {
+  	pthread_mutex_unlock(&keychain_mtx);
+    return NULL;
+  }
+
+	key = (spgp_keychain_key_t *)(region + region_used);
+  memcpy(key, tmpl, sizeof(*key));
+  key->pub = NULL;
+  key->rsa = NULL;
+  if (mpis) {
+  	memcpy(key->mpis, mpis, tmpl->mpiLength);
+  }
+  else {
+  	for (off = 0; list; list = list->next) {
+    	memcpy(key->mpis + off, list->data, list->count + 2);
+      off += list->count + 2;
+    }
+  }
+  region_used += size;
+
+	memcpy(kc_index[kc_used].keyid, key->keyid, 8);
+  kc_index[kc_used].key = key;
+  kc_used++;
+
+	Serial.printf("Added key to keychain.\n");
+  pthread_mutex_unlock(&keychain_mtx);
+  return key;
+}
+
+/**
+ * Make sure |need| more bytes of the region are usable.  Called with the
+ * keychain locked.
+ */
+static uint8_t spgp_keychain_commit(size_t need) {
+	size_t page = sysconf(_SC_PAGESIZE);
+  size_t want;
+
+	if (need > SPGP_KEYCHAIN_RESERVE - region_used) return -1;
+  if (region_used + need <= region_committed) return 0;
+
+	// Grow by whole pages, and by at least 16 at a time
+	want = (region_used + need + page - 1) & ~(page - 1);
+  if (want < region_committed + 16 * page) want = region_committed + 16 * page;
+  if (want > SPGP_KEYCHAIN_RESERVE) want = SPGP_KEYCHAIN_RESERVE;
+  if (mprotect(region + region_committed, want - region_committed,
+               PROT_READ | PROT_WRITE) != 0)
+  	return -1;
+  // Locking is limited by RLIMIT_MEMLOCK.  The keys are still kept
+  // together if it fails, just not pinned.
+  if (region_locked &&
+      mlock(region + region_committed, want - region_committed) != 0) {
+  	Serial.printf("Keychain memory can't be locked\n");
+    region_locked = 0;
+  }
+  region_committed = want;
+  return 0;
+}
+
+/**
+ * Find a key in the index.  Called with the keychain locked.
+ */
+static spgp_keychain_key_t *spgp_keychain_find(const uint8_t *keyid) {
+	uint32_t i;
+
+	for (i = 0; i < kc_used; i++)
+  	if (memcmp(kc_index[i].keyid, keyid, 8) == 0) return kc_index[i].key;
+  return NULL;
 }
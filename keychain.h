@@ -25,19 +25,41 @@
 #include <stdint.h>
 #include "simplepgp.h"
 
+struct spgp_rsa_key_struct;
+
+/* One decrypted secret key, as kept in the keychain's locked region.
+   Records start on a cache line, with the key ID first, and the key's
+   public then secret MPIs follow the record as they appear in packets. */
+typedef struct spgp_keychain_key_struct {
+	uint8_t keyid[8];
+  uint8_t fingerprint[SPGP_FINGERPRINT_LEN];
+  uint32_t creationTime;  // still in packet byte order
+  uint8_t type;           // PKT_TYPE_SECRET_KEY or PKT_TYPE_SECRET_SUBKEY
+  uint8_t version;
+  uint8_t asymAlgo;
+  uint8_t mpiCount;
+  uint32_t mpiLength;
+  spgp_packet_t *pub;     // public key packet for signature checks
+  struct spgp_rsa_key_struct *rsa;  // CRT parameters for RSA keys
+  uint8_t mpis[];
+} spgp_keychain_key_t;
 
 uint8_t spgp_keychain_init(void);
 uint8_t spgp_keychain_free(void);
 uint8_t spgp_keychain_is_valid(void);
 
-uint8_t spgp_keychain_add_packet(spgp_packet_t *pkt);
-uint8_t spgp_keychain_del_packet(spgp_packet_t *pkt);
+const spgp_keychain_key_t *spgp_keychain_add_key(spgp_packet_t *pkt);
+const spgp_keychain_key_t *spgp_keychain_add(const spgp_keychain_key_t *key,
+                                             const uint8_t *mpis);
 
 uint8_t spgp_keychain_iter_start(void);
 uint8_t spgp_keychain_iter_end(void);
-spgp_packet_t *spgp_keychain_iter_next(void);
+const spgp_keychain_key_t *spgp_keychain_iter_next(void);
 
-spgp_packet_t *spgp_keychain_secret_key_with_id(uint8_t *keyid);
+const spgp_keychain_key_t *spgp_keychain_key_with_id(const uint8_t *keyid);
+spgp_packet_t *spgp_keychain_public_key_with_id(const uint8_t *keyid);
+const struct spgp_rsa_key_struct *spgp_keychain_rsa_key(
+	const spgp_keychain_key_t *key);
 
 #define _KEYCHAIN_H
 #endif
@@ -0,0 +1,524 @@
+/*
+ *  keystore.c
+ *  libsimplepgp
+ *
+ *  On-disk public keyring with a mapped key ID and fingerprint index.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "keystore.h"
+#include "armor.h"
+#include "scan.h"
+#include "util.h"
+#include "crypto.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+/* Store layout.  All integers are big-endian, offsets are from the start
+   of the file.
+
+     0  magic "SPGPKS01"
+     8  key count (4)
+    12  reserved, 0 (4)
+    16  data offset (8)          raw binary keyring, as imported
+    24  data length (8)
+    32  key ID index offset (8)  entries sorted by key ID
+    40  fingerprint index offset (8)
+                                 entry numbers (4 each) sorted by
+                                 fingerprint
+    48  reserved, 0, to 64
+
+   Each entry is the key ID (8), the fingerprint (20), the key packet's
+   length (4) and its offset in the data (8). */
+#define SPGP_KEYSTORE_MAGIC       "SPGPKS01"
+#define SPGP_KEYSTORE_HEADER_LEN  64
+#define SPGP_KEYSTORE_ENTRY_LEN   40
+#define SPGP_KEYSTORE_FPR_LEN     4
+
+#define ENTRY_KEYID(e)   (e)
+#define ENTRY_FPR(e)     ((e) + 8)
+#define ENTRY_LENGTH(e)  spgp_get_be32((e) + 28)
+#define ENTRY_OFFSET(e)  spgp_get_be64((e) + 32)
+
+struct spgp_keystore_struct {
+	uint8_t *map;
+  size_t mapLength;
+  const uint8_t *data;
+  uint64_t dataLength;
+  const uint8_t *ids;      // key ID index
+  const uint8_t *fprs;     // fingerprint index
+  uint32_t count;
+  spgp_packet_t **cache;   // packets parsed so far, by entry number
+  pthread_mutex_t mtx;
+};
+
+// Index entry being built, before it is sorted and written out
+typedef struct {
+	uint8_t entry[SPGP_KEYSTORE_ENTRY_LEN];
+} spgp_keystore_entry_t;
+
+typedef struct {
+	uint8_t *keyring;
+  spgp_keystore_entry_t *entries;
+  uint32_t count;
+  uint32_t size;
+} spgp_keystore_build_t;
+
+// Fingerprint order is sorted on a copy of each fingerprint
+typedef struct {
+	uint8_t fpr[SPGP_FINGERPRINT_LEN];
+  uint32_t n;
+} spgp_keystore_fpr_t;
+
+static spgp_keystore_t *attached_store;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static int spgp_keystore_add_key(const spgp_span_t *span, void *ctx);
+
+static int spgp_keystore_cmp_entry(const void *a, const void *b);
+
+static int spgp_keystore_cmp_fpr(const void *a, const void *b);
+
+static void spgp_keystore_write(int fd, const void *buf, size_t len);
+
+static spgp_packet_t *spgp_keystore_load(spgp_keystore_t *ks, uint32_t n);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_keystore_create(const char *path, uint8_t *keyring,
+                             size_t length) {
+	spgp_keystore_build_t build;
+  spgp_keystore_fpr_t * volatile fprs = NULL;
+  uint8_t header[SPGP_KEYSTORE_HEADER_LEN];
+  uint8_t be[SPGP_KEYSTORE_FPR_LEN];
+  uint8_t *dearmored = NULL;
+  uint8_t * volatile binary = NULL;
+  char * volatile tmp = NULL;
+  volatile int fd = -1;
+  uint64_t off;
+  uint32_t i;
+
+	memset(&build, 0, sizeof(build));
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    if (fd >= 0) {
+    	close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    free(build.entries);
+    free(fprs);
+    free(binary);
+    return -1;
+  }
+
+	if (NULL == path || NULL == keyring || 0 == length) RAISE(INVALID_ARGS);
+
+	if (spgp_is_armored(keyring, length)) {
+  	spgp_armor_decode(keyring, length, &dearmored, &length);
+    binary = keyring = dearmored;
+    if (0 == length) RAISE(INVALID_HEADER);
+  }
+
+	// Only packet headers are walked; each key's fingerprint is hashed
+  // straight from its packet body.
+	build.keyring = keyring;
+  spgp_scan_packets(keyring, length, spgp_keystore_add_key, &build);
+  qsort(build.entries, build.count, sizeof(*build.entries),
+        spgp_keystore_cmp_entry);
+
+	fprs = malloc(sizeof(*fprs) * (build.count ? build.count : 1));
+  if (NULL == fprs) RAISE(OUT_OF_MEMORY);
+  for (i = 0; i < build.count; i++) {
+  	memcpy(fprs[i].fpr, ENTRY_FPR(build.entries[i].entry),
+           SPGP_FINGERPRINT_LEN);
+    fprs[i].n = i;
+  }
+  qsort(fprs, build.count, sizeof(*fprs), spgp_keystore_cmp_fpr);
+
+	memset(header, 0, sizeof(header));
+  memcpy(header, SPGP_KEYSTORE_MAGIC, 8);
+  spgp_put_be32(header + 8, build.count);
+  off = SPGP_KEYSTORE_HEADER_LEN;
+  spgp_put_be64(header + 16, off);
+  spgp_put_be64(header + 24, length);
+  off += length;
+  spgp_put_be64(header + 32, off);
+  off += (uint64_t)build.count * SPGP_KEYSTORE_ENTRY_LEN;
+  spgp_put_be64(header + 40, off);
+
+	// Written beside the old store and renamed over it, so readers only
+  // ever map a complete store.
+	tmp = malloc(strlen(path) + 5);
+  if (NULL == tmp) RAISE(OUT_OF_MEMORY);
+  sprintf(tmp, "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) RAISE(IO_ERROR);
+  spgp_keystore_write(fd, header, sizeof(header));
+  spgp_keystore_write(fd, keyring, length);
+  spgp_keystore_write(fd, build.entries,
+                      (size_t)build.count * SPGP_KEYSTORE_ENTRY_LEN);
+  for (i = 0; i < build.count; i++) {
+  	spgp_put_be32(be, fprs[i].n);
+    spgp_keystore_write(fd, be, sizeof(be));
+  }
+  if (fsync(fd) != 0 || close(fd) != 0) {
+  	fd = -1;
+    unlink(tmp);
+    RAISE(IO_ERROR);
+  }
+  fd = -1;
+  if (rename(tmp, path) != 0) {
+  	unlink(tmp);
+    RAISE(IO_ERROR);
+  }
+
+	Serial.printf("Stored %u keys in %s\n", build.count, path);
+  free(tmp);
+  free(build.entries);
+  free(fprs);
+  free(binary);
+  return 0;
+}
+
+spgp_keystore_t *spgp_keystore_open(const char *path) {
+	spgp_keystore_t *ks = NULL;
+  struct stat st;
+  uint8_t *map;
+  uint64_t dataOff, dataLen, idOff, fprOff, count;
+  int fd;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == path) RAISE(INVALID_ARGS);
+
+	fd = open(path, O_RDONLY);
+  if (fd < 0) RAISE(IO_ERROR);
+  if (fstat(fd, &st) != 0) {
+  	close(fd);
+    RAISE(IO_ERROR);
+  }
+  if (st.st_size < SPGP_KEYSTORE_HEADER_LEN ||
+      (uint64_t)st.st_size > SIZE_MAX) {
+  	close(fd);
+    RAISE(FORMAT_UNSUPPORTED);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) RAISE(IO_ERROR);
+
+	// Only the header is checked here.  The index and the keys are paged in
+  // as lookups touch them.
+	count = spgp_get_be32(map + 8);
+  dataOff = spgp_get_be64(map + 16);
+  dataLen = spgp_get_be64(map + 24);
+  idOff = spgp_get_be64(map + 32);
+  fprOff = spgp_get_be64(map + 40);
+  if (memcmp(map, SPGP_KEYSTORE_MAGIC, 8) != 0 ||
+      dataOff > (uint64_t)st.st_size ||
+      dataLen > (uint64_t)st.st_size - dataOff ||
+      idOff > (uint64_t)st.st_size ||
+      count * SPGP_KEYSTORE_ENTRY_LEN > (uint64_t)st.st_size - idOff ||
+      fprOff > (uint64_t)st.st_size ||
+      count * SPGP_KEYSTORE_FPR_LEN > (uint64_t)st.st_size - fprOff) {
+  	munmap(map, st.st_size);
+    RAISE(FORMAT_UNSUPPORTED);
+  }
+
+	ks = malloc(sizeof(*ks));
+  if (NULL == ks || pthread_mutex_init(&ks->mtx, NULL) != 0) {
+  	free(ks);
+  	munmap(map, st.st_size);
+    RAISE(OUT_OF_MEMORY);
+  }
+  ks->map = map;
+  ks->mapLength = st.st_size;
+  ks->data = map + dataOff;
+  ks->dataLength = dataLen;
+  ks->ids = map + idOff;
+  ks->fprs = map + fprOff;
+  ks->count = count;
+  ks->cache = NULL;
+
+	Serial.printf("Opened %u keys from %s\n", ks->count, path);
+  return ks;
+}
+
+void spgp_keystore_close(spgp_keystore_t **ks) {
+	uint32_t i;
+
+	if (NULL == ks || NULL == *ks) return;
+  if (attached_store == *ks) attached_store = NULL;
+  if ((*ks)->cache) {
+  	for (i = 0; i < (*ks)->count; i++) spgp_free_packet(&(*ks)->cache[i]);
+    free((*ks)->cache);
+  }
+  munmap((*ks)->map, (*ks)->mapLength);
+  pthread_mutex_destroy(&(*ks)->mtx);
+  free(*ks);
+  *ks = NULL;
+}
+
+uint32_t spgp_keystore_count(spgp_keystore_t *ks) {
+	if (NULL == ks) return 0;
+  return ks->count;
+}
+
+spgp_packet_t *spgp_keystore_find(spgp_keystore_t *ks, const uint8_t *keyid) {
+	uint32_t lo = 0, hi, mid;
+  int cmp;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == ks || NULL == keyid) RAISE(INVALID_ARGS);
+
+	// First entry with this key ID
+	hi = ks->count;
+  while (lo < hi) {
+  	mid = lo + (hi - lo) / 2;
+    cmp = memcmp(ENTRY_KEYID(ks->ids + (size_t)mid * SPGP_KEYSTORE_ENTRY_LEN),
+                 keyid, 8);
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == ks->count ||
+      memcmp(ENTRY_KEYID(ks->ids + (size_t)lo * SPGP_KEYSTORE_ENTRY_LEN),
+             keyid, 8) != 0)
+  	return NULL;
+  return spgp_keystore_load(ks, lo);
+}
+
+spgp_packet_t *spgp_keystore_find_fingerprint(spgp_keystore_t *ks,
+                                              const uint8_t *fpr) {
+	const uint8_t *entry;
+	uint32_t lo = 0, hi, mid, n;
+  int cmp;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == ks || NULL == fpr) RAISE(INVALID_ARGS);
+
+	hi = ks->count;
+  while (lo < hi) {
+  	mid = lo + (hi - lo) / 2;
+    n = spgp_get_be32(ks->fprs + (size_t)mid * SPGP_KEYSTORE_FPR_LEN);
+    if (n >= ks->count) RAISE(FORMAT_UNSUPPORTED);
+    entry = ks->ids + (size_t)n * SPGP_KEYSTORE_ENTRY_LEN;
+    cmp = memcmp(ENTRY_FPR(entry), fpr, SPGP_FINGERPRINT_LEN);
+    if (cmp == 0) return spgp_keystore_load(ks, n);
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return NULL;
+}
+
+uint8_t spgp_keystore_attach(spgp_keystore_t *ks) {
+	attached_store = ks;
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+/**
+ * Look up |keyid| in the store attached with spgp_keystore_attach().
+ *
+ * @return Key packet, or NULL if there is no store or no such key
+ */
+spgp_packet_t *spgp_keystore_attached_key(const uint8_t *keyid) {
+	spgp_packet_t *key;
+  jmp_buf saved;
+
+	if (NULL == attached_store) return NULL;
+  // The lookup catches its own exceptions, which replaces the caller's
+  // handler.  Keep a copy to put back.
+  memcpy(saved, exception, sizeof(jmp_buf));
+  key = spgp_keystore_find(attached_store, keyid);
+  memcpy(exception, saved, sizeof(jmp_buf));
+  return key;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Scanner callback adding every V4 public key and subkey to the index.
+ */
+static int spgp_keystore_add_key(const spgp_span_t *span, void *ctx) {
+	spgp_keystore_build_t *build = ctx;
+  spgp_keystore_entry_t *entries;
+  uint8_t *body = build->keyring + span->bodyOffset;
+  uint8_t *entry;
+  uint8_t prefix[3];
+  spgp_crypto_hash_t *md;
+
+	if (span->type != PKT_TYPE_PUBLIC_KEY &&
+      span->type != PKT_TYPE_PUBLIC_SUBKEY)
+  	return 0;
+  if (span->isPartial || span->bodyLength < 6 || span->bodyLength > 0xFFFF ||
+      body[0] != 4) {
+  	Serial.printf("Skipping key at %lu\n", (unsigned long)span->offset);
+  	return 0;
+  }
+
+	if (build->count == build->size) {
+  	build->size = build->size ? build->size * 2 : 1024;
+    entries = realloc(build->entries, sizeof(*entries) * build->size);
+    if (NULL == entries) RAISE(OUT_OF_MEMORY);
+    build->entries = entries;
+  }
+  entry = build->entries[build->count++].entry;
+
+	/* RFC 4880 - 12.2
+   A V4 fingerprint is the 160-bit SHA-1 hash of the octet 0x99,
+   followed by the two-octet packet length, followed by the entire
+   Public-Key packet starting with the version field.  The Key ID is the
+   low-order 64 bits of the fingerprint. */
+  prefix[0] = 0x99;
+  prefix[1] = span->bodyLength >> 8;
+  prefix[2] = span->bodyLength;
+  md = spgp_crypto_hash_open(HASH_ALGO_SHA1);
+  spgp_crypto_hash_write(md, prefix, sizeof(prefix));
+  spgp_crypto_hash_write(md, body, span->bodyLength);
+  memcpy(ENTRY_FPR(entry), spgp_crypto_hash_read(md), SPGP_FINGERPRINT_LEN);
+  spgp_crypto_hash_close(md);
+  memcpy(ENTRY_KEYID(entry), ENTRY_FPR(entry) + 12, 8);
+  spgp_put_be32(entry + 28, span->length);
+  spgp_put_be64(entry + 32, span->offset);
+  return 0;
+}
+
+static int spgp_keystore_cmp_entry(const void *a, const void *b) {
+	return memcmp(a, b, 8 + SPGP_FINGERPRINT_LEN);
+}
+
+static int spgp_keystore_cmp_fpr(const void *a, const void *b) {
+	return memcmp(a, b, SPGP_FINGERPRINT_LEN);
+}
+
+static void spgp_keystore_write(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+  ssize_t n;
+
+	while (len) {
+  	n = write(fd, p, len);
+    if (n < 0) {
+    	if (errno == EINTR) continue;
+      RAISE(IO_ERROR);
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+/**
+ * Parse the key packet of entry |n|, the first time it is asked for.
+ *
+ * The packet is kept in the store, so later lookups return the same
+ * packet along with anything cached in it, such as its gcrypt key.
+ */
+static spgp_packet_t *spgp_keystore_load(spgp_keystore_t *ks, uint32_t n) {
+	const uint8_t *entry = ks->ids + (size_t)n * SPGP_KEYSTORE_ENTRY_LEN;
+  spgp_packet_t *pkt;
+  uint64_t off = ENTRY_OFFSET(entry);
+  uint32_t len = ENTRY_LENGTH(entry);
+  size_t idx = 0;
+
+	pthread_mutex_lock(&ks->mtx);
+  if (NULL == ks->cache) {
+  	ks->cache = calloc(ks->count, sizeof(*ks->cache));
+    if (NULL == ks->cache) {
+    	pthread_mutex_unlock(&ks->mtx);
+      RAISE(OUT_OF_MEMORY);
+    }
+  }
+  pkt = ks->cache[n];
+  pthread_mutex_unlock(&ks->mtx);
+  if (pkt) return pkt;
+
+	if (off > ks->dataLength || len > ks->dataLength - off || 0 == len)
+  	RAISE(FORMAT_UNSUPPORTED);
+  pkt = spgp_packet_decode_loop((uint8_t *)ks->data + off, &idx, len);
+  if (NULL == pkt || NULL == pkt->c.pub) {
+  	spgp_free_packet(&pkt);
+  	RAISE(FORMAT_UNSUPPORTED);
+  }
+  // The index already has the fingerprint
+  memcpy(pkt->c.pub->fingerprint, ENTRY_FPR(entry), SPGP_FINGERPRINT_LEN);
+  pkt->c.pub->hasFingerprint = 1;
+
+	// Another thread may have parsed it meanwhile; keep the first
+	pthread_mutex_lock(&ks->mtx);
+  if (ks->cache[n]) {
+  	spgp_free_packet(&pkt);
+    pkt = ks->cache[n];
+  }
+  else {
+  	ks->cache[n] = pkt;
+  }
+  pthread_mutex_unlock(&ks->mtx);
+  return pkt;
+}
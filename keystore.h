@@ -0,0 +1,30 @@
+/*
+ *  keystore.h
+ *  libsimplepgp
+ *
+ *  On-disk public keyring with a mapped key ID and fingerprint index.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _KEYSTORE_H
+
+#include "packet_private.h"
+
+spgp_packet_t *spgp_keystore_attached_key(const uint8_t *keyid);
+
+#define _KEYSTORE_H
+#endif
@@ -21,10 +21,71 @@
  */
 
 #include "mpi.h"
+#include "secmem.h"
+
+static spgp_mpi_t *spgp_read_mpi_in(uint8_t *msg, size_t *idx,
+                                    size_t length, uint8_t secure);
+
+/**
+ * Number of MPIs in the public part of a key.  Curve keys count their OID
+ * and, for ECDH, KDF parameters.
+ *
+ * @return The count, or 0 for algorithms that aren't supported
+ */
+uint8_t spgp_public_mpi_count(uint8_t algo) {
+	switch (algo) {
+  	case ASYM_ALGO_RSA: return 2;
+  	case ASYM_ALGO_DSA: return 4;
+    case ASYM_ALGO_ELGAMAL: return 3;
+    case ASYM_ALGO_ECDH: return 3;     // OID, point, KDF parameters
+    case ASYM_ALGO_EDDSA: return 2;    // OID, point
+    default: return 0;
+  }
+}
+
+/**
+ * Number of MPIs in the secret part of a key, or 0 if not supported.
+ */
+uint8_t spgp_secret_mpi_count(uint8_t algo) {
+	switch (algo) {
+  	case ASYM_ALGO_RSA: return 4;
+  	case ASYM_ALGO_DSA:
+    case ASYM_ALGO_ELGAMAL:
+    case ASYM_ALGO_ECDH:
+    case ASYM_ALGO_EDDSA:
+    	return 1;
+    default: return 0;
+  }
+}
+
+/**
+ * Number of MPIs in a session key packet.  Elgamal has two, and ECDH has
+ * its ephemeral point and the wrapped key.
+ */
+uint8_t spgp_session_mpi_count(uint8_t algo) {
+	switch (algo) {
+  	case ASYM_ALGO_ELGAMAL:
+    case ASYM_ALGO_ECDH:
+    	return 2;
+    default: return 1;
+  }
+}
+
+/**
+ * Whether public key MPI |index| is really an RFC 6637 field, with a one
+ * byte length, for spgp_read_field().
+ */
+uint8_t spgp_mpi_is_field(uint8_t algo, uint8_t index) {
+	switch (algo) {
+  	case ASYM_ALGO_ECDH: return index == 0 || index == 2;
+    case ASYM_ALGO_EDDSA: return index == 0;
+    default: return 0;
+  }
+}
 
 uint8_t spgp_read_all_public_mpis(uint8_t *msg, 
-                                         uint32_t *idx,
-														 						 uint32_t length, 
+                                         size_t *idx,
+														 						 size_t length, 
                                          spgp_public_pkt_t *pub) {
   spgp_mpi_t *curMpi, *newMpi;
   uint32_t i;
@@ -33,19 +94,18 @@ uint8_t spgp_read_all_public_mpis(uint8_t *msg,
   if (NULL == msg || NULL == idx || 0 == length || NULL == pub)
   	RAISE(INVALID_ARGS);
 
-	switch (pub->asymAlgo) {
-  	case ASYM_ALGO_RSA: mpiCount = 2; break;
-  	case ASYM_ALGO_DSA: mpiCount = 4; break;
-    case ASYM_ALGO_ELGAMAL: mpiCount = 3; break;
-    default: RAISE(FORMAT_UNSUPPORTED);
-  }
+	mpiCount = spgp_public_mpi_count(pub->asymAlgo);
+  if (0 == mpiCount) RAISE(FORMAT_UNSUPPORTED);
 
   // Read all the MPIs
   for (i = 0; i < mpiCount; i++) {
   	// spgp_read_mpi() doesn't increment past the end of the MPI, so if this
     // isn't the first pass we need to increment once more
   	if (i) SAFE_IDX_INCREMENT(*idx, length);    
-    newMpi = spgp_read_mpi(msg, idx, length);
+    if (spgp_mpi_is_field(pub->asymAlgo, i))
+    	newMpi = spgp_read_field(msg, idx, length);
+    else
+    	newMpi = spgp_read_mpi(msg, idx, length);
     if (i == 0) {
       pub->mpiHead = newMpi;
       curMpi = pub->mpiHead;
@@ -61,28 +121,30 @@ uint8_t spgp_read_all_public_mpis(uint8_t *msg,
 }
 
 uint8_t spgp_read_all_secret_mpis(uint8_t *msg, 
-                                         uint32_t *idx,
-														 						 uint32_t length, 
+                                         size_t *idx,
+														 						 size_t length, 
                                          spgp_secret_pkt_t *secret) {
   spgp_mpi_t *curMpi;
   spgp_public_pkt_t *pub = (spgp_public_pkt_t*)secret;
+  uint8_t i, mpiCount;
   
   if (NULL == msg || NULL == idx || 0 == length || NULL == secret)
   	RAISE(INVALID_ARGS);
 
+	mpiCount = spgp_secret_mpi_count(pub->asymAlgo);
+  if (0 == mpiCount) RAISE(FORMAT_UNSUPPORTED);
+
 	// Set curMpi to last valid Mpi in linked list
 	curMpi = pub->mpiHead;
   while (curMpi->next) curMpi = curMpi->next;
 
   // Read all the MPIs
-	if (pub->asymAlgo == ASYM_ALGO_DSA) {
-  	// DSA secte MPIs: exponent x
-    curMpi->next = spgp_read_mpi(msg, idx, length);
+  for (i = 0; i < mpiCount; i++) {
+  	if (i) SAFE_IDX_INCREMENT(*idx, length);
+    curMpi->next = spgp_read_secret_mpi(msg, idx, length);
+    curMpi = curMpi->next;
     pub->mpiCount++;
 	}
-  else {
-  	RAISE(FORMAT_UNSUPPORTED);
-  }
   
 	return pub->mpiCount;
 }
@@ -94,8 +156,57 @@ uint32_t spgp_mpi_length(uint8_t *mpi) {
   return (bits+7)/8;  
 }
 
-spgp_mpi_t *spgp_read_mpi(uint8_t *msg, uint32_t *idx,
-														 uint32_t length) {
+spgp_mpi_t *spgp_read_mpi(uint8_t *msg, size_t *idx,
+														 size_t length) {
+	return spgp_read_mpi_in(msg, idx, length, 0);
+}
+
+/**
+ * Like spgp_read_mpi(), but the MPI's data is kept in secure memory and
+ * must be released with spgp_secure_free().
+ */
+spgp_mpi_t *spgp_read_secret_mpi(uint8_t *msg, size_t *idx,
+                                 size_t length) {
+	return spgp_read_mpi_in(msg, idx, length, 1);
+}
+
+/**
+ * Read a field with a one byte length, like a curve OID or the wrapped key
+ * of an ECDH session (RFC 6637 9 and 10).
+ *
+ * It is kept the way an MPI of the same bytes would be, with a two byte
+ * bit count in front, so keys and sessions hold it like their other MPIs.
+ * Code that writes the packet back out must use the one byte length
+ * instead.
+ */
+spgp_mpi_t *spgp_read_field(uint8_t *msg, size_t *idx, size_t length) {
+	spgp_mpi_t *mpi = NULL;
+  
+  if (NULL == msg || NULL == idx || 0 == length) RAISE(INVALID_ARGS);
+
+	// 0 and 0xFF are reserved for future extensions
+	if (length - *idx < 1) RAISE(BUFFER_OVERFLOW);
+  if (msg[*idx] == 0 || msg[*idx] == 0xFF) RAISE(FORMAT_UNSUPPORTED);
+
+	mpi = malloc(sizeof(*mpi));
+  if (NULL == mpi) RAISE(OUT_OF_MEMORY);
+  memset(mpi, 0, sizeof(*mpi));
+  mpi->count = msg[*idx];
+  mpi->bits = mpi->count * 8;
+  if (length - *idx < mpi->count + 1) RAISE(BUFFER_OVERFLOW);
+
+	mpi->data = malloc(mpi->count + 2);
+  if (NULL == mpi->data) RAISE(OUT_OF_MEMORY);
+  mpi->data[0] = mpi->bits >> 8;
+  mpi->data[1] = mpi->bits;
+  memcpy(mpi->data + 2, msg + *idx + 1, mpi->count);
+  *idx += mpi->count;
+  
+  return mpi;
+}
+
+static spgp_mpi_t *spgp_read_mpi_in(uint8_t *msg, size_t *idx,
+                                    size_t length, uint8_t secure) {
 	spgp_mpi_t *mpi = NULL;
   
   if (NULL == msg || NULL == idx || 0 == length) RAISE(INVALID_ARGS);
@@ -110,9 +221,11 @@ spgp_mpi_t *spgp_read_mpi(uint8_t *msg, uint32_t *idx,
   
   mpi->count = (mpi->bits+7)/8;
   Serial.printf("MPI Bits: %u\n", mpi->bits);
+  if (length - *idx < mpi->count + 2) RAISE(BUFFER_OVERFLOW);
   
   // Allocate space for MPI data
-  mpi->data = malloc(mpi->count + 2);
+  if (secure) mpi->data = spgp_secure_alloc(mpi->count + 2);
+  else mpi->data = malloc(mpi->count + 2);
   if (NULL == mpi->data) RAISE(OUT_OF_MEMORY);
   
   // Copy data from input buffer to mpi buffer
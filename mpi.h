@@ -25,18 +25,25 @@
 #include "packet_private.h"
 
 uint32_t spgp_mpi_length(uint8_t *mpi);
+uint8_t spgp_public_mpi_count(uint8_t algo);
+uint8_t spgp_secret_mpi_count(uint8_t algo);
+uint8_t spgp_session_mpi_count(uint8_t algo);
+uint8_t spgp_mpi_is_field(uint8_t algo, uint8_t index);
                                                 
-spgp_mpi_t *spgp_read_mpi(uint8_t *msg, uint32_t *idx,
-														 uint32_t length);
+spgp_mpi_t *spgp_read_mpi(uint8_t *msg, size_t *idx,
+														 size_t length);
+spgp_mpi_t *spgp_read_secret_mpi(uint8_t *msg, size_t *idx,
+                                 size_t length);
+spgp_mpi_t *spgp_read_field(uint8_t *msg, size_t *idx, size_t length);
                              
 uint8_t spgp_read_all_public_mpis(uint8_t *msg, 
-                                         uint32_t *idx,
-														 						 uint32_t length, 
+                                         size_t *idx,
+														 						 size_t length, 
                                          spgp_public_pkt_t *pub);
                                          
 uint8_t spgp_read_all_secret_mpis(uint8_t *msg, 
-                                         uint32_t *idx,
-														 						 uint32_t length, 
+                                         size_t *idx,
+														 						 size_t length, 
                                          spgp_secret_pkt_t *secret);
  
 
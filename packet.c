@@ -25,12 +25,27 @@
 #include "keychain.h"
 #include "util.h"
 #include "mpi.h"
+#include "secmem.h"
+#include "armor.h"
+#include "scan.h"
+#include "sink.h"
+#include "verify.h"
+#include "agent.h"
+#include "pkbackend.h"
+#include "crypto.h"
+#include "ecc.h"
+#include "aead.h"
 
 //#include "gcrypt.h"
 
 #include <wchar.h>
 #include <locale.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 
@@ -40,6 +55,17 @@
 **
 ***********************************************************************/
 
+// Decode state is per thread, so messages can be decoded concurrently.
+
+// Set while decoding to a sink: literal data goes there instead of memory
+static __thread spgp_sink_t *literal_sink = NULL;
+
+// Set while decoding with options: packet filter and visitors
+static __thread const spgp_decode_opts_t *decode_opts = NULL;
+
+// Set when a visitor asks for decoding to stop
+static __thread uint8_t decode_stopped = 0;
+
 
 
 /**********************************************************************
@@ -49,8 +75,10 @@
 ***********************************************************************/
 
 pthread_mutex_t spgp_mtx;
-uint32_t _spgp_err;
-jmp_buf exception;
+// Per thread: a RAISE() unwinds to the setjmp() of its own thread, and
+// spgp_err() reports the calling thread's last error.
+__thread uint32_t _spgp_err;
+__thread jmp_buf exception;
 
 #ifdef DEBUG_LOG_ENABLED
 uint8_t debug_log_enabled = 1;
@@ -65,75 +93,102 @@ uint8_t debug_log_enabled = 0;
 **
 ***********************************************************************/
 
-static spgp_packet_t* spgp_packet_decode_loop(uint8_t *message, 
-																							uint32_t *idx, 
-                                              uint32_t length);
-                                              
-static uint8_t spgp_parse_header(uint8_t *msg, uint32_t *idx, 
-														uint32_t length, spgp_packet_t *pkt);
 
-static uint32_t spgp_new_header_length(uint8_t *header, 
-																			uint8_t *header_len,
-                                      uint8_t *is_partial);
+static uint8_t spgp_stream_packet(uint8_t *msg, size_t *idx,
+                                  size_t length, spgp_packet_t *pkt);
 
-static uint8_t spgp_parse_user_id(uint8_t *msg, uint32_t *idx, 
-          												uint32_t length, spgp_packet_t *pkt);
+static void spgp_parse_packet_body(uint8_t *message, size_t *idx,
+                                   size_t length, spgp_packet_t *pkt);
+
+static uint8_t spgp_packet_is_wanted(spgp_packet_t *pkt);
+
+static spgp_visit_t spgp_visit_packet(spgp_packet_t *pkt);
+
+static uint8_t spgp_parse_user_id(uint8_t *msg, size_t *idx, 
+          												size_t length, spgp_packet_t *pkt);
                                       
-static uint8_t spgp_generate_fingerprint(spgp_packet_t *pkt);
                                
-static uint8_t spgp_verify_decrypted_data(uint8_t *data, uint32_t length);
+static uint8_t spgp_verify_decrypted_data(uint8_t *data, size_t length);
 
 static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
 																			  uint8_t *passphrase, uint32_t length);
 
-static uint8_t spgp_parse_public_key(uint8_t *msg, uint32_t *idx, 
-          													 uint32_t length, spgp_packet_t *pkt);
+static uint8_t spgp_parse_public_key(uint8_t *msg, size_t *idx, 
+          													 size_t length, spgp_packet_t *pkt);
                                      
-static uint8_t spgp_parse_secret_key(uint8_t *msg, uint32_t *idx, 
-          													 uint32_t length, spgp_packet_t *pkt);
+static uint8_t spgp_parse_secret_key(uint8_t *msg, size_t *idx, 
+          													 size_t length, spgp_packet_t *pkt);
                 
 static spgp_packet_t *spgp_next_secret_key_packet(spgp_packet_t *msg);
+
+static void spgp_forget_secret_mpis(spgp_packet_t *pkt);
                 
 static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt, 
                                 			 uint8_t *passphrase, uint32_t length);
 
 static uint8_t spgp_parse_compressed_packet(uint8_t *msg, 
-                                            uint32_t *idx, 
-          													 	      uint32_t length, 
+                                            size_t *idx, 
+          													 	      size_t length, 
                                             spgp_packet_t *pkt);
                               
 static uint8_t spgp_parse_encrypted_packet(uint8_t *msg, 
-                                           uint32_t *idx, 
-          														 		 uint32_t *length, 
+                                           size_t *idx, 
+          														 		 size_t length, 
                                            spgp_packet_t *pkt);
+
+static spgp_crypto_cipher_t *spgp_open_session_cipher(
+                                                 spgp_session_pkt_t *session,
+                                                 unsigned long blksize);
+
+static uint8_t spgp_decrypt_to_sink(uint8_t *msg, size_t *idx, size_t length,
+                                    spgp_packet_t *pkt,
+                                    spgp_session_pkt_t *session,
+                                    unsigned long blksize);
+
+static uint8_t spgp_parse_aead_packet(uint8_t *msg, size_t *idx,
+                                      size_t length, spgp_packet_t *pkt);
+
+static spgp_aead_segment_t *spgp_aead_segments(uint8_t *msg, size_t *idx,
+                                               size_t length,
+                                               spgp_packet_t *pkt,
+                                               size_t first,
+                                               uint32_t *count);
+
+static void spgp_aead_to_stream(void *ctx, const uint8_t *data, size_t len);
+
+static void spgp_aead_to_buffer(void *ctx, const uint8_t *data, size_t len);
              
 static uint8_t spgp_parse_literal_packet(uint8_t *msg, 
-                                         uint32_t *idx, 
-          													 		 uint32_t length, 
+                                         size_t *idx, 
+          													 		 size_t length, 
                                          spgp_packet_t *pkt);
                                          
 static uint8_t spgp_parse_signature_packet(uint8_t *msg, 
-                                           uint32_t *idx, 
-          													 		   uint32_t length, 
+                                           size_t *idx, 
+          													 		   size_t length, 
                                            spgp_packet_t *pkt);
                                                      
+static void spgp_parse_sig_subpackets(uint8_t *sub, size_t length,
+                                      spgp_signature_pkt_t *sig);
+
+static uint8_t spgp_parse_onepass_packet(uint8_t *msg, size_t *idx,
+                                         size_t length, spgp_packet_t *pkt);
+
 static spgp_packet_t *spgp_find_session_packet(spgp_packet_t *chain);
          
-static uint8_t spgp_parse_session_packet(uint8_t *msg, uint32_t *idx, 
-          													 		 uint32_t length, spgp_packet_t *pkt);
+static uint8_t spgp_parse_session_packet(uint8_t *msg, size_t *idx, 
+          													 		 size_t length, spgp_packet_t *pkt);
                                
-static spgp_packet_t *spgp_secret_key_matching_id(spgp_packet_t *chain,
-																									uint8_t *keyid);
                                          
                                         
 static uint8_t spgp_read_salt(uint8_t *msg, 
-                              uint32_t *idx,
-                              uint32_t length, 
+                              size_t *idx,
+                              size_t length, 
                               spgp_secret_pkt_t *secret);
                               
 static uint8_t spgp_read_iv(uint8_t *msg, 
-                            uint32_t *idx,
-                            uint32_t length, 
+                            size_t *idx,
+                            size_t length, 
                             spgp_secret_pkt_t *secret);
                             
 
@@ -148,28 +203,26 @@ static uint8_t spgp_read_iv(uint8_t *msg,
 uint8_t spgp_init(void) {
 	if (pthread_mutex_init(&spgp_mtx, NULL)) return -1;
   if (spgp_keychain_init()) return -1;
+  // Without the pool, secrets are still cleared but not locked
+  spgp_secmem_init();
+  if (spgp_armor_init()) return -1;
+  if (spgp_scan_init()) return -1;
   return 0;
 }
 
 uint8_t spgp_close(void) {
-	spgp_packet_t *chain = NULL;
-  if (spgp_keychain_is_valid()) {
-    spgp_keychain_iter_start();
-    while ((chain = spgp_keychain_iter_next()) != NULL) {
-    	spgp_free_packet(&chain);
-    }
-    spgp_keychain_iter_end();
-    spgp_keychain_free();
-	}
+  if (spgp_keychain_is_valid()) spgp_keychain_free();
 
 	pthread_mutex_destroy(&spgp_mtx);
   return 0;
 }
 
-spgp_packet_t *spgp_decode_message(uint8_t *message, uint32_t length) {
+spgp_packet_t *spgp_decode_message(uint8_t *message, size_t length) {
 	spgp_packet_t *head = NULL;
 //  spgp_packet_t *pkt = NULL;
-  uint32_t idx = 0;
+  uint8_t * volatile binary = NULL;
+  uint8_t *dearmored = NULL;
+  size_t idx = 0;
   
 	Serial.printf("begin\n");
   
@@ -180,9 +233,13 @@ spgp_packet_t *spgp_decode_message(uint8_t *message, uint32_t length) {
     default:
     	Serial.printf("Exception (0x%x)\n",_spgp_err);
       spgp_free_packet(&head);
+      if (literal_sink) spgp_sink_abort(literal_sink);
   	  goto end;
   }
 
+	// One-pass hashes only live for one message
+	spgp_onepass_reset();
+
 	if (NULL == message || 0 == length) {
   	RAISE(INVALID_ARGS);
   }
@@ -248,14 +305,129 @@ spgp_packet_t *spgp_decode_message(uint8_t *message, uint32_t length) {
 	}
 #endif
 
+	// Armored input is decoded to binary in one pass, then parsed as usual
+	if (spgp_is_armored(message, length)) {
+  	spgp_armor_decode(message, length, &dearmored, &length);
+    binary = message = dearmored;
+  }
+
 	head = spgp_packet_decode_loop(message, &idx, length);
 
   end:
+  spgp_onepass_reset();
+  free(binary);
   Serial.printf("done\n");
   return head;
 }
 
-char *spgp_get_literal_data(spgp_packet_t *msg, uint32_t *datalen,
+spgp_packet_t *spgp_decode_file(const char *path) {
+	spgp_packet_t *head = NULL;
+  struct stat st;
+  void *map;
+  int fd;
+
+	if (setjmp(exception)) {
+    	Serial.printf("Exception (0x%x)\n",_spgp_err);
+  	  return NULL;
+  }
+
+	if (NULL == path) RAISE(INVALID_ARGS);
+
+	fd = open(path, O_RDONLY);
+  if (fd < 0) RAISE(IO_ERROR);
+  if (fstat(fd, &st) != 0) {
+  	close(fd);
+    RAISE(IO_ERROR);
+  }
+  if (st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX) {
+  	close(fd);
+    RAISE(st.st_size ? FORMAT_UNSUPPORTED : INVALID_ARGS);
+  }
+
+	// The decoder never writes to its input, so a read-only private mapping
+  // is enough.  The mapping outlives the descriptor.
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) RAISE(IO_ERROR);
+  posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	Serial.printf("Mapped %lu bytes from %s\n", (unsigned long)st.st_size, path);
+	head = spgp_decode_message(map, st.st_size);
+
+	munmap(map, st.st_size);
+  return head;
+}
+
+spgp_packet_t *spgp_decode_message_to_sink(uint8_t *message, size_t length,
+                                           spgp_sink_t *sink) {
+	spgp_packet_t *head;
+
+	literal_sink = sink;
+  head = spgp_decode_message(message, length);
+  literal_sink = NULL;
+  return head;
+}
+
+spgp_packet_t *spgp_decode_file_to_sink(const char *path, spgp_sink_t *sink) {
+	spgp_packet_t *head;
+
+	literal_sink = sink;
+  head = spgp_decode_file(path);
+  literal_sink = NULL;
+  return head;
+}
+
+spgp_packet_t *spgp_decode_message_with_opts(uint8_t *message, size_t length,
+                                             const spgp_decode_opts_t *opts) {
+	spgp_packet_t *head;
+
+	decode_opts = opts;
+  decode_stopped = 0;
+  head = spgp_decode_message(message, length);
+  decode_opts = NULL;
+  decode_stopped = 0;
+  return head;
+}
+
+spgp_packet_t *spgp_decode_file_with_opts(const char *path,
+                                          const spgp_decode_opts_t *opts) {
+	spgp_packet_t *head;
+
+	decode_opts = opts;
+  decode_stopped = 0;
+  head = spgp_decode_file(path);
+  decode_opts = NULL;
+  decode_stopped = 0;
+  return head;
+}
+
+uint8_t spgp_packet_type(spgp_packet_t *pkt) {
+	if (NULL == pkt || NULL == pkt->header) return 0;
+  return pkt->header->type;
+}
+
+const uint8_t *spgp_fingerprint(spgp_packet_t *pkt) {
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == pkt) RAISE(INVALID_ARGS);
+  return spgp_key_fingerprint(pkt);
+}
+
+uint8_t spgp_fingerprint_all(spgp_packet_t *msg) {
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == msg) RAISE(INVALID_ARGS);
+  spgp_fingerprint_keys(msg);
+  return 0;
+}
+
+char *spgp_get_literal_data(spgp_packet_t *msg, size_t *datalen,
 														char **filename, uint32_t *filenamelen) {
 	spgp_packet_t *cur = msg;
   
@@ -286,10 +458,10 @@ uint8_t spgp_decrypt_all_secret_keys(spgp_packet_t *msg,
                                 		 uint8_t *passphrase, uint32_t length) {
 	spgp_packet_t *cur = msg;
   uint8_t err = 0;
-  uint8_t haskey = 0;
   
 	if (setjmp(exception)) {
     	Serial.printf("Exception (0x%x)\n",_spgp_err);
+      err = -1;
   	  goto end;
   }
 
@@ -298,14 +470,13 @@ uint8_t spgp_decrypt_all_secret_keys(spgp_packet_t *msg,
 	while ((cur = spgp_next_secret_key_packet(cur)) != NULL) {
   	Serial.printf("Decrypting secret key\n");
   	spgp_decrypt_secret_key(cur, passphrase, length);
+    // The keychain keeps its own copy in locked memory, so the secret
+    // MPIs aren't left in |msg|.
+    if (NULL == spgp_keychain_add_key(cur)) RAISE(KEYCHAIN_ERROR);
+    spgp_forget_secret_mpis(cur);
   	cur = cur->next;
-    haskey = 1;
   }
   
-  // Add decrypted keys to keychain
-  if (haskey)
-  	if (spgp_keychain_add_packet(msg) != 0) RAISE(KEYCHAIN_ERROR);
-  
   end:
   return err;
 }
@@ -332,16 +503,14 @@ void spgp_free_packet(spgp_packet_t **pkt) {
     	curMpi = (*pkt)->c.secret->pub.mpiHead;
       while (curMpi) {
       	nextMpi = curMpi->next;
-        if (curMpi->data) free(curMpi->data);
+        spgp_secure_free(curMpi->data, curMpi->count + 2);
         free(curMpi);
         curMpi = nextMpi;
       }
       (*pkt)->c.secret->pub.mpiHead = NULL;
       (*pkt)->c.secret->pub.mpiCount = 0;
     }
-    if ((*pkt)->c.secret->pub.fingerprint) {
-    	free((*pkt)->c.secret->pub.fingerprint);
-    }
+    spgp_sig_key_release(&(*pkt)->c.secret->pub);
     if ((*pkt)->c.secret->encryptedData) {
     	free((*pkt)->c.secret->encryptedData);
     }
@@ -350,7 +519,7 @@ void spgp_free_packet(spgp_packet_t **pkt) {
       (*pkt)->c.secret->s2kSalt = NULL;
     }
     if ((*pkt)->c.secret->key) {
-    	free((*pkt)->c.secret->key);
+    	spgp_secure_free((*pkt)->c.secret->key, (*pkt)->c.secret->keyLength);
       (*pkt)->c.secret->key = NULL;
     }
     if ((*pkt)->c.secret->iv) {
@@ -366,7 +535,7 @@ void spgp_free_packet(spgp_packet_t **pkt) {
             (*pkt)->c.pub != NULL) {
   	if ((*pkt)->c.pub->mpiCount > 0) {
     	curMpi = (*pkt)->c.pub->mpiHead;
-      while (curMpi->next) {
+      while (curMpi) {
       	nextMpi = curMpi->next;
         if (curMpi->data) free(curMpi->data);
         free(curMpi);
@@ -375,12 +544,13 @@ void spgp_free_packet(spgp_packet_t **pkt) {
       (*pkt)->c.pub->mpiHead = NULL;
       (*pkt)->c.pub->mpiCount = 0;
     }      
-    if ((*pkt)->c.pub->fingerprint) {
-    	free((*pkt)->c.pub->fingerprint);
-    }      
+    spgp_sig_key_release((*pkt)->c.pub);
+    free((*pkt)->c.pub);
+    (*pkt)->c.pub = NULL;
   }
   
   else if ((*pkt)->header->type == PKT_TYPE_USER_ID &&
+  				 (*pkt)->c.userid != NULL &&
   				 (*pkt)->c.userid->data != NULL) {
   	free((*pkt)->c.userid->data);
     (*pkt)->c.userid->data = NULL;
@@ -392,7 +562,7 @@ void spgp_free_packet(spgp_packet_t **pkt) {
   else if ((*pkt)->header->type == PKT_TYPE_SESSION &&
   				 (*pkt)->c.session != NULL) {
   	if ((*pkt)->c.session->key) {
-    	free((*pkt)->c.session->key);
+    	spgp_secure_free((*pkt)->c.session->key, (*pkt)->c.session->keylen);
       (*pkt)->c.session->key = NULL;
     }
   	if ((*pkt)->c.session->mpi1) {
@@ -408,6 +578,28 @@ void spgp_free_packet(spgp_packet_t **pkt) {
     free((*pkt)->c.session);
   }
   
+  else if ((*pkt)->header->type == PKT_TYPE_SIGNATURE &&
+  				 (*pkt)->c.signature != NULL) {
+  	curMpi = (*pkt)->c.signature->mpiHead;
+    while (curMpi) {
+    	nextMpi = curMpi->next;
+      if (curMpi->data) free(curMpi->data);
+      free(curMpi);
+      curMpi = nextMpi;
+    }
+    if ((*pkt)->c.signature->hashed) {
+    	free((*pkt)->c.signature->hashed);
+    }
+    free((*pkt)->c.signature);
+    (*pkt)->c.signature = NULL;
+  }
+
+  else if ((*pkt)->header->type == PKT_TYPE_ONE_PASS_SIG &&
+  				 (*pkt)->c.onepass != NULL) {
+  	free((*pkt)->c.onepass);
+    (*pkt)->c.onepass = NULL;
+  }
+  
   else if ((*pkt)->header->type == PKT_TYPE_LITERAL_DATA &&
   				 (*pkt)->c.literal != NULL) {
   	if ((*pkt)->c.literal->filename) {
@@ -450,6 +642,14 @@ const char *spgp_err_str(uint32_t err) {
   	case BUFFER_OVERFLOW:
     	return "Index into buffer exceeded the maximum "
       	"bound of the buffer.";
+    case IO_ERROR:
+    	return "Failed to read or write a file.";
+    case ARMOR_ERROR:
+    	return "Malformed ASCII armor or armor checksum mismatch.";
+    case BAD_SIGNATURE:
+    	return "Signature does not match the signed data.";
+    case KEY_NOT_FOUND:
+    	return "No public key found for the signature's issuer.";
     default:
     	return "Unknown/undocumented error.";
   }
@@ -474,75 +674,57 @@ void spgp_debug_log_set(uint8_t enable) {
 #pragma mark Static Function Definitions
 
 
-static spgp_packet_t* spgp_packet_decode_loop(uint8_t *message, 
-																							uint32_t *idx, 
-                                              uint32_t length) {
+spgp_packet_t* spgp_packet_decode_loop(uint8_t *message, 
+                                       size_t *idx, 
+                                       size_t length) {
 	spgp_packet_t *head = NULL;
+  spgp_packet_t *last = NULL;
   spgp_packet_t *pkt = NULL;
-
-  // There must be at least one packet, yeah?
-  head = malloc(sizeof(*head));
-  if (NULL == head) RAISE(OUT_OF_MEMORY);
-  memset(head, 0, sizeof(*head));
-  pkt = head;
+  spgp_visit_t action;
   
   // Loop to decode every packet in message
-  while (*idx < length-1) {
+  while (*idx < length-1 && !decode_stopped) {
+    // Allocate space for another packet.  It is linked in before parsing,
+    // since parsers look back through the chain (e.g. for session keys).
+    pkt = malloc(sizeof(*pkt));
+    if (NULL == pkt) RAISE(OUT_OF_MEMORY);
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->prev = last; // make backwards pointer
+    if (last) last->next = pkt;
+    else head = pkt;
+
    	// Every packet starts with a header
     spgp_parse_header(message, idx, length, pkt);
     if (!pkt->header) RAISE(FORMAT_UNSUPPORTED);
     
-    // Decode packet contents based on the type marked in its header
-    switch (pkt->header->type) {
-    	case PKT_TYPE_USER_ID:
-      	spgp_parse_user_id(message, idx, length, pkt);
-        break;
-      case PKT_TYPE_PUBLIC_KEY:
-      case PKT_TYPE_PUBLIC_SUBKEY:
-      	spgp_parse_public_key(message, idx, length, pkt);
-        break;
-      case PKT_TYPE_SECRET_KEY:
-      case PKT_TYPE_SECRET_SUBKEY:
-        spgp_parse_secret_key(message, idx, length, pkt);
-        break;
-      case PKT_TYPE_SESSION:
-      	spgp_parse_session_packet(message, idx, length, pkt);
-      	break;
-      case PKT_TYPE_SYM_ENC_INT_DATA:
-      	spgp_parse_encrypted_packet(message, idx, &length, pkt);
-      	break;
-      case PKT_TYPE_COMPRESSED_DATA:
-      	spgp_parse_compressed_packet(message, idx, length, pkt);
-        break;
-      case PKT_TYPE_LITERAL_DATA:
-      	spgp_parse_literal_packet(message, idx, length, pkt);
-        break;
-      case PKT_TYPE_SIGNATURE:
-      	spgp_parse_signature_packet(message, idx, length, pkt);
-        break;
-      default:
-        Serial.printf("WARNING: Unsupported packet type %u\n", pkt->header->type);
-        // Increment to next packet.  We add the contentLength, but subtract
-        // one parse_header() left us on the first byte of content.
-        if (*idx + pkt->header->contentLength - 1 < length)
-          *idx = *idx + pkt->header->contentLength - 1;
-        break;
+    // Types filtered out by the decode options are skipped by length alone
+    if (!spgp_packet_is_wanted(pkt)) {
+    	Serial.printf("Skipping filtered packet type %u\n", pkt->header->type);
+      spgp_skip_packet_body(message, idx, length, pkt);
+      action = SPGP_VISIT_DROP;
+    }
+    else {
+    	spgp_parse_packet_body(message, idx, length, pkt);
+      action = spgp_visit_packet(pkt);
+    }
+
+    if (action == SPGP_VISIT_DROP) {
+    	// Packets a container held go with it
+    	if (last) last->next = NULL;
+      else head = NULL;
+      spgp_free_packet(&pkt);
+    }
+    else {
+      // A packet can contain other packets -- if such a thing was just
+      // decoded, new packets have already been added to the list.  Progress
+      // until we get to the end of the packet list.
+      last = pkt;
+      while (last->next != NULL) last = last->next;
     }
+    if (action == SPGP_VISIT_STOP) decode_stopped = 1;
     
     // If we're at the end of the buffer, we're done
     if (*idx >= length-1) break;
-        
-    // A packet can contain other packets -- if such a thing was just decoded,
-    // new packets have already been added to the list.  Progress until we
-    // get to the end of the packet list.
-    while (pkt->next != NULL) pkt = pkt->next;
-        
-    // Allocate space for another packet
-    pkt->next = malloc(sizeof(*pkt->next));
-    if (NULL == pkt->next) RAISE(OUT_OF_MEMORY);
-    memset(pkt->next, 0, sizeof(*pkt->next));
-    pkt->next->prev = pkt; // make backwards pointer
-    pkt = pkt->next;
     
     // Packet parser increments to it's own last byte.  Need one more to get
     // to the next packet's first byte. 
@@ -552,8 +734,73 @@ static spgp_packet_t* spgp_packet_decode_loop(uint8_t *message,
 	return head;
 }
 
-static uint8_t spgp_parse_header(uint8_t *msg, uint32_t *idx, 
-														uint32_t length, spgp_packet_t *pkt) {
+/**
+ * Decode packet contents based on the type marked in its header.
+ */
+static void spgp_parse_packet_body(uint8_t *message, size_t *idx,
+                                   size_t length, spgp_packet_t *pkt) {
+	switch (pkt->header->type) {
+  	case PKT_TYPE_USER_ID:
+    	spgp_parse_user_id(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_PUBLIC_KEY:
+    case PKT_TYPE_PUBLIC_SUBKEY:
+    	spgp_parse_public_key(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_SECRET_KEY:
+    case PKT_TYPE_SECRET_SUBKEY:
+      spgp_parse_secret_key(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_SESSION:
+    	spgp_parse_session_packet(message, idx, length, pkt);
+    	break;
+    case PKT_TYPE_SYM_ENC_INT_DATA:
+    	spgp_parse_encrypted_packet(message, idx, length, pkt);
+    	break;
+    case PKT_TYPE_AEAD_DATA:
+    	spgp_parse_aead_packet(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_COMPRESSED_DATA:
+    	spgp_parse_compressed_packet(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_LITERAL_DATA:
+    	spgp_parse_literal_packet(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_SIGNATURE:
+    	spgp_parse_signature_packet(message, idx, length, pkt);
+      break;
+    case PKT_TYPE_ONE_PASS_SIG:
+    	spgp_parse_onepass_packet(message, idx, length, pkt);
+      break;
+    default:
+      Serial.printf("WARNING: Unsupported packet type %u\n", pkt->header->type);
+      spgp_skip_packet_body(message, idx, length, pkt);
+      break;
+  }
+}
+
+/**
+ * Check the decode options to see whether |pkt| should be parsed.
+ */
+static uint8_t spgp_packet_is_wanted(spgp_packet_t *pkt) {
+	if (NULL == decode_opts || 0 == decode_opts->wanted) return 1;
+  return (decode_opts->wanted & SPGP_PACKET_MASK(pkt->header->type)) != 0;
+}
+
+/**
+ * Hand a parsed packet to its visitor from the decode options, if any.
+ */
+static spgp_visit_t spgp_visit_packet(spgp_packet_t *pkt) {
+	spgp_visit_cb_t visit;
+
+	if (NULL == decode_opts) return SPGP_VISIT_KEEP;
+  visit = decode_opts->visit[pkt->header->type % SPGP_PACKET_TYPES];
+  if (NULL == visit) return SPGP_VISIT_KEEP;
+  return visit(pkt, decode_opts->ctx);
+}
+
+uint8_t spgp_parse_header(uint8_t *msg, size_t *idx, 
+												size_t length, spgp_packet_t *pkt) {
 	uint8_t i;
   
 	if (NULL == msg || NULL == pkt || NULL == idx || length == 0)
@@ -601,7 +848,7 @@ static uint8_t spgp_parse_header(uint8_t *msg, uint32_t *idx,
       	// "indeterminate length" packet
         Serial.printf("Indeterminate length packet\n");
       	pkt->header->headerLength = 1;
-        pkt->header->contentLength = length-*idx-1;
+        pkt->header->contentLength = length-*idx;
     }
     for (i = 0; i < pkt->header->headerLength - 1; i++) {
     	pkt->header->contentLength <<= 8;
@@ -614,58 +861,119 @@ static uint8_t spgp_parse_header(uint8_t *msg, uint32_t *idx,
   else { // This is new style packet.
 		pkt->header->contentLength = 
   		spgp_new_header_length(msg+*idx, 
+                             length-*idx,
       											 &(pkt->header->headerLength),
                              &(pkt->header->isPartial));
     *idx += pkt->header->headerLength - 2;
     SAFE_IDX_INCREMENT(*idx, length);
   }
   
-  Serial.printf("LENGTH: %u\n", pkt->header->contentLength);
+  Serial.printf("LENGTH: %lu\n", (unsigned long)pkt->header->contentLength);
   
 	return 0;
 }
 
-static uint32_t spgp_new_header_length(uint8_t *header, 
-																			uint8_t *header_len,
-                                      uint8_t *is_partial) {
-  uint32_t content;
-  uint8_t len[4];
-  uint8_t i = 0;
+/**
+ * Decode a new-format body length.
+ *
+ * Used both for packet headers and for the partial body length headers that
+ * can follow a chunk of packet data.  Raises INCOMPLETE_PACKET rather than
+ * reading past |avail| bytes.
+ *
+ * @param header First byte of the length (not the tag byte)
+ * @param avail Number of readable bytes at |header|
+ * @param header_len Set to the length of the header, plus one for a tag byte
+ * @param is_partial Set to 1 if another length header follows the chunk
+ * @return Length of the chunk following the header
+ */
+size_t spgp_new_header_length(uint8_t *header,
+                              size_t avail,
+                              uint8_t *header_len,
+                              uint8_t *is_partial) {
+  size_t content;
   
   if (NULL == header || NULL == header_len) RAISE(INVALID_ARGS);
+  if (avail == 0) RAISE(INCOMPLETE_PACKET);
   
   *is_partial = 0; // default to known length
   
-  len[0] = header[i];
-  if (len[0] <= 191) { // 1-byte length
+  if (header[0] <= 191) { // 1-byte length
     *header_len = 2;
-    content = len[0];
+    content = header[0];
   }
-  else if (len[0] > 191 && len[0] <= 223) { // 2-byte length
+  else if (header[0] <= 223) { // 2-byte length
+    if (avail < 2) RAISE(INCOMPLETE_PACKET);
     *header_len = 3;
-    len[1] = header[i+1]; 
-    content = ((len[0]-192)<<8) | (len[1] + 192);
+    content = ((size_t)(header[0]-192)<<8) + header[1] + 192;
   }
-  else if (len[0] == 255) { // 5-byte length
-    *header_len = 5;
-    len[0] = header[i+1];
-    len[1] = header[i+2];
-    len[2] = header[i+3];
-    len[3] = header[i+4];
-    content = (len[0]<<24) | (len[1]<<16) | (len[2]<<8) | len[3];
+  else if (header[0] == 255) { // 5-byte length
+    if (avail < 5) RAISE(INCOMPLETE_PACKET);
+    *header_len = 6;
+    content = ((size_t)header[1]<<24) | ((size_t)header[2]<<16) |
+    	((size_t)header[3]<<8) | header[4];
   }
   else {
-    // indeterminate length
+    // partial length: a power of two, with more headers to follow
     Serial.printf("Partial length header!\n");
     *header_len = 2;
     *is_partial = 1;
-    content = 1 << (len[0] & 0x1F);
+    content = (size_t)1 << (header[0] & 0x1F);
   }
 	return content;
 }
 
-static uint8_t spgp_parse_user_id(uint8_t *msg, uint32_t *idx, 
-          												uint32_t length, spgp_packet_t *pkt) {
+/**
+ * Step over the body of a packet without looking at it.
+ *
+ * Follows partial body length headers, so bodies of any size are skipped by
+ * reading only their headers.  Leaves |idx| on the last byte of the packet,
+ * like the packet parsers do.
+ *
+ * @return Length of the body, not counting partial body length headers
+ */
+size_t spgp_skip_packet_body(uint8_t *msg, size_t *idx,
+                             size_t length, spgp_packet_t *pkt) {
+	size_t chunk = pkt->header->contentLength;
+  size_t total = 0;
+  uint8_t is_partial = pkt->header->isPartial;
+  uint8_t headerlen;
+
+	while (1) {
+  	if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+    *idx += chunk;
+    total += chunk;
+    if (!is_partial) break;
+    if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+    chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                   &headerlen, &is_partial);
+    *idx += headerlen - 1;
+  }
+  // parse_header() left us on the first byte of content, so we are now one
+  // past the end of the packet.
+  *idx -= 1;
+  return total;
+}
+
+/**
+ * Send a literal or compressed packet's contents to |literal_sink|.
+ *
+ * The body is pushed through a stream decoder, so literal data reaches the
+ * sink as it is found or inflated, and is never held in memory as a whole.
+ */
+static uint8_t spgp_stream_packet(uint8_t *msg, size_t *idx,
+                                  size_t length, spgp_packet_t *pkt) {
+	spgp_stream_t *st;
+  size_t start = *idx;
+
+	spgp_skip_packet_body(msg, idx, length, pkt);
+  st = spgp_stream_open(literal_sink, pkt);
+  spgp_stream_push(st, msg + start, *idx - start + 1);
+  spgp_stream_close(&st);
+  return 0;
+}
+
+static uint8_t spgp_parse_user_id(uint8_t *msg, size_t *idx, 
+          												size_t length, spgp_packet_t *pkt) {
 	spgp_userid_pkt_t *userid;
 
   Serial.printf("Parsing user id.\n");
@@ -693,101 +1001,128 @@ static uint8_t spgp_parse_user_id(uint8_t *msg, uint32_t *idx,
 	return 0;                                     
 }
 
-static uint8_t spgp_generate_fingerprint(spgp_packet_t *pkt) {
-	uint16_t packetSize;
-  uint8_t packetHeaderSize;
+/**
+ * Get the V4 fingerprint of a public or secret key packet.
+ *
+ * Fingerprints are only computed the first time they are asked for, and are
+ * kept in the key itself.  The hash input is written to a SHA-1 context
+ * from spgp_crypto_hash_open(), on whichever backend is selected, a piece
+ * at a time (packet header, then each MPI as read), so nothing is copied
+ * or allocated.
+ *
+ * @param pkt Public key, public subkey, secret key or secret subkey packet
+ * @return The 20-byte fingerprint, stored in |pkt|
+ */
+uint8_t *spgp_key_fingerprint(spgp_packet_t *pkt) {
+	spgp_public_pkt_t *pub;
+  spgp_crypto_hash_t *md;
+  uint8_t header[9];
   spgp_mpi_t *curMpi;
-  uint8_t targetMpiCount;
-  gcry_md_hd_t md;
-  unsigned char *hash;
+  uint32_t packetSize;
+  uint8_t mpiCount;
   int i;
-  
-  if (NULL == pkt) RAISE(INVALID_ARGS);
-  
-  // Start with header info: 1 version, 4 creation time, 1 algorithm
-  packetHeaderSize = sizeof(pkt->c.pub->version) +
-  	sizeof(pkt->c.pub->creationTime) +
-    sizeof(pkt->c.pub->asymAlgo);
-  packetSize = packetHeaderSize;
 
-  // Figure out how many MPIs to add
-  switch(pkt->c.pub->asymAlgo) {
-  	case ASYM_ALGO_RSA:
-    	targetMpiCount = 2;
+	if (NULL == pkt || NULL == pkt->header) RAISE(INVALID_ARGS);
+  switch (pkt->header->type) {
+  	case PKT_TYPE_PUBLIC_KEY:
+    case PKT_TYPE_PUBLIC_SUBKEY:
+    case PKT_TYPE_SECRET_KEY:
+    case PKT_TYPE_SECRET_SUBKEY:
     	break;
-  	case ASYM_ALGO_DSA:
-    	targetMpiCount = 4;
-      break;
-    case ASYM_ALGO_ELGAMAL:
-    	targetMpiCount = 3;
-      break;
     default:
-    	RAISE(FORMAT_UNSUPPORTED);
+    	RAISE(INVALID_ARGS);
   }
-  
-  // Add size of each MPI
-  curMpi = pkt->c.pub->mpiHead;
-  i = 0;
-  while (curMpi && i < targetMpiCount) {
-  	packetSize += curMpi->count + 2; // add 2 for MPI header
-		curMpi = curMpi->next;
-    i++;
+  if (NULL == pkt->c.pub) RAISE(INVALID_ARGS);
+
+	// Secret keys start with their public part, so this covers both
+  pub = pkt->c.pub;
+  if (pub->hasFingerprint) return pub->fingerprint;
+
+	// Decrypted secret keys have their secret MPIs on the same list, after
+  // the public ones.  Only the public ones are hashed.
+  mpiCount = spgp_public_mpi_count(pub->asymAlgo);
+  if (0 == mpiCount) RAISE(FORMAT_UNSUPPORTED);
+
+	// Hash the public key packet as it would be written with a two-byte
+  // length: 1 version, 4 creation time, 1 algorithm, then the MPIs.
+  // Curve OIDs and KDF parameters are written with a one byte length.
+  packetSize = 6;
+  for (curMpi = pub->mpiHead, i = 0; curMpi && i < mpiCount;
+       curMpi = curMpi->next, i++) {
+  	if (spgp_mpi_is_field(pub->asymAlgo, i))
+    	packetSize += curMpi->count + 1;
+    else
+	    packetSize += curMpi->count + 2; // add 2 for MPI header
   }
-      
-  // Give data to hash to gcrypt
-	if (gcry_md_open (&md, GCRY_MD_SHA1, 0) != 0) RAISE(GCRY_ERROR);
-  gcry_md_putc(md, 0x99 );
-  gcry_md_putc(md, packetSize >> 8);
-  gcry_md_putc(md, packetSize);
-  gcry_md_putc(md, pkt->c.pub->version);
-  gcry_md_putc(md, pkt->c.pub->creationTime);
-  gcry_md_putc(md, pkt->c.pub->creationTime >> 8);
-  gcry_md_putc(md, pkt->c.pub->creationTime >> 16);
-  gcry_md_putc(md, pkt->c.pub->creationTime >> 24);
-  gcry_md_putc(md, pkt->c.pub->asymAlgo);
-  
-	// Write the public key MPIs
-  curMpi = pkt->c.pub->mpiHead;
-  i = 0;
-  while (curMpi && i < targetMpiCount) {
-  	gcry_md_write(md, curMpi->data, curMpi->count + 2);
-		curMpi = curMpi->next;
-    i++;
-  }
-  
-  // Perform SHA-1 hash
-  gcry_md_final(md);
-  hash = gcry_md_read(md, 0);
-
-	// Copy hash results (20-bytes) into fingerprint
-  pkt->c.pub->fingerprint = malloc(20);
-  if (NULL == pkt->c.pub->fingerprint) RAISE(OUT_OF_MEMORY);
-  memcpy(pkt->c.pub->fingerprint, hash, 20);
-  
+  if (packetSize > 0xFFFF) RAISE(FORMAT_UNSUPPORTED);
+
+	header[0] = 0x99;
+  header[1] = packetSize >> 8;
+  header[2] = packetSize;
+  header[3] = pub->version;
+  memcpy(header+4, &(pub->creationTime), 4); // still in packet byte order
+  header[8] = pub->asymAlgo;
+
+	md = spgp_crypto_hash_open(HASH_ALGO_SHA1);
+  spgp_crypto_hash_write(md, header, sizeof(header));
+  for (curMpi = pub->mpiHead, i = 0; curMpi && i < mpiCount;
+       curMpi = curMpi->next, i++) {
+  	if (spgp_mpi_is_field(pub->asymAlgo, i)) {
+    	header[0] = curMpi->count;
+      spgp_crypto_hash_write(md, header, 1);
+      spgp_crypto_hash_write(md, curMpi->data + 2, curMpi->count);
+    }
+    else {
+	  	spgp_crypto_hash_write(md, curMpi->data, curMpi->count + 2);
+    }
+  }
+  memcpy(pub->fingerprint, spgp_crypto_hash_read(md), SPGP_FINGERPRINT_LEN);
+  spgp_crypto_hash_close(md);
+  pub->hasFingerprint = 1;
+
   Serial.printf("HASH: ");
-  for (targetMpiCount=0; targetMpiCount < 20; targetMpiCount++) {
-  	Serial.printf("%.2X", pkt->c.pub->fingerprint[targetMpiCount]);
+  for (i = 0; i < SPGP_FINGERPRINT_LEN; i++) {
+  	Serial.printf("%.2X", pub->fingerprint[i]);
   }
   Serial.printf("\n");
-  
-  gcry_md_close(md);
-  
-  return 0;
+
+  return pub->fingerprint;
+}
+
+/**
+ * Compute the fingerprint of every key packet in |msg| that lacks one.
+ *
+ * Used before keys are shared (e.g. added to the keychain), so that later
+ * lookups only read them.
+ */
+void spgp_fingerprint_keys(spgp_packet_t *msg) {
+	spgp_packet_t *cur;
+
+	for (cur = msg; cur != NULL; cur = cur->next) {
+  	switch (cur->header->type) {
+    	case PKT_TYPE_PUBLIC_KEY:
+      case PKT_TYPE_PUBLIC_SUBKEY:
+      case PKT_TYPE_SECRET_KEY:
+      case PKT_TYPE_SECRET_SUBKEY:
+      	spgp_key_fingerprint(cur);
+        break;
+      default:
+      	break;
+    }
+  }
 }
 
-static uint8_t spgp_verify_decrypted_data(uint8_t *data, uint32_t length) {
-  gcry_md_hd_t md;
-  uint32_t hashlen = length - 20; // SHA1 hash is 20 bytes
-  uint8_t *hashResult;
+static uint8_t spgp_verify_decrypted_data(uint8_t *data, size_t length) {
+  spgp_crypto_hash_t *md;
+  size_t hashlen = length - 20; // SHA1 hash is 20 bytes
+  const uint8_t *hashResult;
   int result;
   
-  if (gcry_md_open (&md, GCRY_MD_SHA1, 0) != 0) RAISE(GCRY_ERROR);
-  gcry_md_write(md, data, hashlen);
-  gcry_md_final(md);
-  hashResult = gcry_md_read(md, 0);
-  if (NULL == hashResult) RAISE(GCRY_ERROR);
+  md = spgp_crypto_hash_open(HASH_ALGO_SHA1);
+  spgp_crypto_hash_write(md, data, hashlen);
+  hashResult = spgp_crypto_hash_read(md);
 	result = memcmp(data+hashlen, hashResult, 20);
-	gcry_md_close(md);
+	spgp_crypto_hash_close(md);
 	return result;
 }
 
@@ -814,7 +1149,7 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
 																			  uint8_t *passphrase, uint32_t length) {
 	spgp_secret_pkt_t *secret;
   spgp_public_pkt_t *pub;
-  gcry_md_hd_t md;
+  spgp_crypto_hash_t *md;
   uint32_t i;
   uint32_t keyBytesRemaining;// Bytes left to generate for key
   uint32_t hashLen;          // How long the hash is (algo-dependent)
@@ -825,7 +1160,8 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
   uint32_t hashCopies;       // How many integer copies of hashBuf per round
   uint32_t hashExtraBytes;   // How many extra bytes to hash for last round
   uint8_t *hashBuf;          // Store concatenated salt+passphrase
-  uint8_t *hashResult;       // Store result of actual hash algorithm
+  const uint8_t *hashResult; // Store result of actual hash algorithm
+  static const uint8_t zero = 0;
   
   if (NULL == pkt || NULL == passphrase) RAISE(INVALID_ARGS);
   
@@ -848,7 +1184,7 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
   // Initialize hash algorithm, determine how many bytes produces per round
 	switch (secret->s2kHashAlgo) {  
   	case HASH_ALGO_SHA1:
-  		if (gcry_md_open (&md, GCRY_MD_SHA1, 0) != 0) RAISE(GCRY_ERROR);
+  		md = spgp_crypto_hash_open(HASH_ALGO_SHA1);
       hashLen = 20;
       break;
 		default:
@@ -871,14 +1207,15 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
   }
    
   // Allocate space for the key
-  secret->key = malloc(secret->keyLength);
+  spgp_secure_free(secret->key, secret->keyLength);
+  secret->key = spgp_secure_alloc(secret->keyLength);
   if (NULL == secret->key) RAISE(OUT_OF_MEMORY);
   
   // Allocate a buffer to store the salt and passphrase combined
   // Since this buffer is local only, no exceptions can be raised after
   // this point or memory will be leaked.
   bufLen = secret->s2kSaltLength + length;
-  hashBuf = malloc(bufLen);
+  hashBuf = spgp_secure_alloc(bufLen);
   if (NULL == hashBuf) RAISE(OUT_OF_MEMORY);
   
   // Concatenate salt and passphrase into hashBuf
@@ -900,19 +1237,18 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
   while (curHashCount <= hashIters && keyBytesRemaining) {
     for (i = 0; i < curHashCount; i++) {
     	// pad front with 1 NUL byte per round (none on first round)
-      gcry_md_putc(md, '\0'); 
+      spgp_crypto_hash_write(md, &zero, 1);
     }
     // Copy the salt+passphrase combo into hash buffer as many times as fits
     for (i = 0; i < hashCopies; i++) {
-    	gcry_md_write(md, hashBuf, bufLen);
+    	spgp_crypto_hash_write(md, hashBuf, bufLen);
     }
     // Copy any leftover bytes into hash buffer to reach |hashBytes|
     if (hashExtraBytes) {
-    	gcry_md_write(md, hashBuf, hashExtraBytes);
+    	spgp_crypto_hash_write(md, hashBuf, hashExtraBytes);
     }
     // Perform the hash and append to the key
-	  gcry_md_final(md);
-  	hashResult = gcry_md_read(md, 0);
+  	hashResult = spgp_crypto_hash_read(md);
     
     if (keyBytesRemaining < hashLen) {
       memcpy(secret->key+(curHashCount*hashLen), 
@@ -927,17 +1263,17 @@ static uint8_t spgp_generate_cipher_key(spgp_packet_t *pkt,
       keyBytesRemaining -= hashLen;
     }
     // Reset hash algorithm for next round
-    gcry_md_reset(md);
+    spgp_crypto_hash_reset(md);
     curHashCount++;
   }
 
-	gcry_md_close(md);
-	free(hashBuf);
+	spgp_crypto_hash_close(md);
+	spgp_secure_free(hashBuf, bufLen);
 	return 0;
 }
 
-static uint8_t spgp_parse_public_key(uint8_t *msg, uint32_t *idx, 
-          													 uint32_t length, spgp_packet_t *pkt) {
+static uint8_t spgp_parse_public_key(uint8_t *msg, size_t *idx, 
+          													 size_t length, spgp_packet_t *pkt) {
   spgp_public_pkt_t *pub;
   
   Serial.printf("Parsing public key.\n");
@@ -980,11 +1316,11 @@ static uint8_t spgp_parse_public_key(uint8_t *msg, uint32_t *idx,
   return 0;
 }
 
-static uint8_t spgp_parse_secret_key(uint8_t *msg, uint32_t *idx, 
-          													 uint32_t length, spgp_packet_t *pkt) {
+static uint8_t spgp_parse_secret_key(uint8_t *msg, size_t *idx, 
+          													 size_t length, spgp_packet_t *pkt) {
   spgp_secret_pkt_t *secret;
   spgp_public_pkt_t *pub;
-  uint32_t startIdx = *idx;
+  size_t startIdx = *idx;
   
   Serial.printf("Parsing secret key.\n");
 
@@ -1069,8 +1405,8 @@ static uint8_t spgp_parse_secret_key(uint8_t *msg, uint32_t *idx,
     Serial.printf("IV length: %u\n", secret->ivLength);
   
   	// Figure out how much is left, and make sure it's available
-  	uint32_t packetOffset = *idx - startIdx;
-  	uint32_t remaining = pkt->header->contentLength - packetOffset;
+  	size_t packetOffset = *idx - startIdx;
+  	size_t remaining = pkt->header->contentLength - packetOffset;
 		if (packetOffset >= pkt->header->contentLength) RAISE(BUFFER_OVERFLOW);
     
     // Allocate buffer and copy data
@@ -1080,12 +1416,9 @@ static uint8_t spgp_parse_secret_key(uint8_t *msg, uint32_t *idx,
     secret->encryptedDataLength = remaining;
     
     *idx += remaining-1;
-    Serial.printf("Stored %u encrypted bytes.\n", remaining);
+    Serial.printf("Stored %lu encrypted bytes.\n", (unsigned long)remaining);
     // This is the end of the data, so we do NOT do a final idx increment
   }
-  
-  // Create and store fingerprint for this packet
-  spgp_generate_fingerprint(pkt);
     
 	return 0;
 }
@@ -1103,11 +1436,11 @@ static spgp_packet_t *spgp_next_secret_key_packet(spgp_packet_t *msg) {
 
 static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt, 
                                 			 uint8_t *passphrase, uint32_t length) {
-  gcry_cipher_hd_t hd;
+  spgp_crypto_cipher_t *hd;
 	spgp_secret_pkt_t *secret;
   spgp_public_pkt_t *pub;
   spgp_mpi_t *curMpi;
-  uint32_t idx;
+  size_t idx;
   uint32_t secretMpiCount;
   uint8_t *secdata;
   uint8_t i;
@@ -1129,11 +1462,6 @@ static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt,
   switch (secret->s2kEncryption) {
   	case SYM_ALGO_3DES:
     case SYM_ALGO_CAST5:
-		  if (gcry_cipher_open(&hd,
-      										 spgp_pgp_to_gcrypt_symmetric_algo(secret->s2kEncryption), 
-                           GCRY_CIPHER_MODE_CFB, 
-    	    	               GCRY_CIPHER_SECURE | GCRY_CIPHER_ENABLE_SYNC) != 0)
-      	RAISE(GCRY_ERROR);
       break;
     default:
     	RAISE(FORMAT_UNSUPPORTED);
@@ -1141,39 +1469,39 @@ static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt,
 
 	if (NULL == secret->key || NULL == secret->iv) RAISE(INCOMPLETE_PACKET);
 
-	if (gcry_cipher_setkey(hd, secret->key, secret->keyLength) != 0)
-  	RAISE(GCRY_ERROR);
-	if (gcry_cipher_setiv(hd, secret->iv, secret->ivLength) != 0)
-  	RAISE(GCRY_ERROR);
+	hd = spgp_crypto_cipher_open(secret->s2kEncryption,
+                               secret->key, secret->keyLength);
+  if (secret->ivLength != hd->blksize) {
+  	spgp_crypto_cipher_close(hd);
+  	RAISE(INCOMPLETE_PACKET);
+  }
+	spgp_crypto_cipher_setiv(hd, secret->iv);
     
   // Allocate secret data memory.  Must free it before raising any exceptions!
-  secdata = malloc(secret->encryptedDataLength);
-  if (NULL == secdata) RAISE(OUT_OF_MEMORY);
-  if (gcry_cipher_decrypt(hd, 
-  												secdata, 
-  												secret->encryptedDataLength, 
-      		                secret->encryptedData, 
-                          secret->encryptedDataLength) != 0) {
-    free(secdata);
+  secdata = spgp_secure_alloc(secret->encryptedDataLength);
+  if (NULL == secdata) {
+  	spgp_crypto_cipher_close(hd);
+  	RAISE(OUT_OF_MEMORY);
+  }
+  if (spgp_crypto_cipher_decrypt(hd, 
+  															 secdata, 
+  															 secret->encryptedData, 
+                                 secret->encryptedDataLength) != 0) {
+    spgp_secure_free(secdata, secret->encryptedDataLength);
+    spgp_crypto_cipher_close(hd);
   	RAISE(GCRY_ERROR);
   }
   
   // Verify checksum
-  if (spgp_verify_decrypted_data(secdata, secret->encryptedDataLength) != 0)
+  if (spgp_verify_decrypted_data(secdata, secret->encryptedDataLength) != 0) {
+  	spgp_secure_free(secdata, secret->encryptedDataLength);
+    spgp_crypto_cipher_close(hd);
   	RAISE(DECRYPT_FAILED);
+  }
   
   // Decode and store the secret MPIs (algo-specific):
-  switch(pub->asymAlgo) {
-  	case ASYM_ALGO_RSA:
-    	secretMpiCount = 4;
-      break;
-  	case ASYM_ALGO_DSA:
-    case ASYM_ALGO_ELGAMAL:
-    	secretMpiCount = 1;
-      break;
-    default:
-    	RAISE(FORMAT_UNSUPPORTED);
-  }
+  secretMpiCount = spgp_secret_mpi_count(pub->asymAlgo);
+  if (0 == secretMpiCount) RAISE(FORMAT_UNSUPPORTED);
     
   // Get to the last valid MPI
   if (NULL == pub->mpiHead) RAISE(INCOMPLETE_PACKET);
@@ -1182,7 +1510,8 @@ static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt,
   
   idx = 0;
   for (i = 0; i < secretMpiCount; i++) {
-	  curMpi->next = spgp_read_mpi(secdata, &idx, secret->encryptedDataLength);
+	  curMpi->next = spgp_read_secret_mpi(secdata, &idx,
+                                        secret->encryptedDataLength);
     if (NULL == curMpi->next) RAISE(GENERIC_ERROR);
     curMpi = curMpi->next;
     SAFE_IDX_INCREMENT(idx, secret->encryptedDataLength);
@@ -1190,98 +1519,172 @@ static uint8_t spgp_decrypt_secret_key(spgp_packet_t *pkt,
   }
   secret->isDecrypted = 1;
   
-  gcry_cipher_close(hd);
-  free(secdata);
+  spgp_crypto_cipher_close(hd);
+  spgp_secure_free(secdata, secret->encryptedDataLength);
   
   end:
 	return err;
 }
 
+/**
+ * Drop the secret MPIs of a decrypted secret key and the key they were
+ * decrypted with, clearing them first.
+ *
+ * The key can be decrypted again from its encrypted data.
+ */
+static void spgp_forget_secret_mpis(spgp_packet_t *pkt) {
+	spgp_secret_pkt_t *secret = pkt->c.secret;
+	spgp_public_pkt_t *pub = pkt->c.pub;
+  spgp_mpi_t *cur, *next;
+  uint8_t count;
+  uint32_t i;
+
+	spgp_secure_free(secret->key, secret->keyLength);
+  secret->key = NULL;
+
+	count = spgp_public_mpi_count(pub->asymAlgo);
+  if (0 == count || pub->mpiCount <= count) return;
+
+	for (cur = pub->mpiHead, i = 1; i < count; i++) cur = cur->next;
+  next = cur->next;
+  cur->next = NULL;
+  pub->mpiCount = count;
+  while (next) {
+  	cur = next;
+    next = cur->next;
+    spgp_secure_free(cur->data, cur->count + 2);
+    free(cur);
+  }
+  secret->isDecrypted = 0;
+}
+
 #include "zlib.h"
-static uint8_t spgp_zlib_decompress_buffer(uint8_t *inbuf, uint32_t inlen,
-                                           uint8_t **outbuf, uint32_t *outlen,
-                                           uint8_t algo) {
-	uint32_t maxsize;
+static uint8_t spgp_zlib_decompress_buffer(uint8_t *msg, size_t *idx,
+                                           size_t length, spgp_packet_t *pkt,
+                                           uint8_t algo,
+                                           uint8_t **outbuf, size_t *outlen) {
+	size_t maxsize;
+  size_t outpos;
+  size_t chunk;
 	z_stream s;
   uint8_t *tmpbuf;
+  uint8_t headerlen;
+  uint8_t is_partial;
+  uInt avail;
   int wbits;
   int err;
-  int i;
   
-  if (NULL == inbuf || inlen == 0 || NULL == outbuf || NULL == outlen)
+  if (NULL == msg || NULL == idx || NULL == outbuf || NULL == outlen)
   	RAISE(INVALID_ARGS);
+
+	// The algorithm byte has already been read from the first chunk
+	chunk = pkt->header->contentLength - 1;
+  is_partial = pkt->header->isPartial;
   
-  maxsize = inlen * 100;
+  maxsize = (chunk > 0 && chunk <= SIZE_MAX / 100) ? chunk * 100 : 4096;
   
   *outbuf = malloc(maxsize);
   if (NULL == *outbuf) RAISE(OUT_OF_MEMORY);
   
+  memset(&s, 0, sizeof(s));
 	s.zalloc = Z_NULL;
 	s.zfree = Z_NULL;
-	s.next_in = inbuf;
-	s.avail_in = inlen;
-	s.next_out = *outbuf;
-	s.avail_out = maxsize;
 
 	if (algo == COMPRESSION_ZIP) wbits = -15;
   else wbits = 15;
 	if (inflateInit2(&s, wbits) != Z_OK) RAISE(ZLIB_ERROR);
 
-  for (i = s.total_out; i < maxsize; i++)
-  	(*outbuf)[i] = 0x55;
-  
-  Serial.printf("Inflating up to %u bytes\n", maxsize);
-  while ((err = inflate(&s, Z_NO_FLUSH)) != Z_STREAM_END) {
-  	if (err != Z_OK) RAISE(ZLIB_ERROR);
-    if (s.avail_in == 0) break; // Done
-		// If we're here, our output buffer isn't large enough
-    maxsize <<= 1; // double size
-		tmpbuf = *outbuf;
-    *outbuf = realloc(*outbuf, maxsize);
-    if (NULL == *outbuf) {
-    	free(tmpbuf);
-      RAISE(OUT_OF_MEMORY);
+  Serial.printf("Inflating up to %lu bytes\n", (unsigned long)maxsize);
+  outpos = 0;
+  while (1) {
+  	// Feed zlib one chunk at a time, stepping over partial length headers.
+    // zlib counts bytes in a uInt, so big chunks go in several windows.
+  	if (s.avail_in == 0) {
+    	if (chunk == 0 && is_partial) {
+      	if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+      	chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                       &headerlen, &is_partial);
+        *idx += headerlen - 1;
+      }
+      if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+      s.next_in = msg + *idx;
+      s.avail_in = (chunk > UINT_MAX) ? UINT_MAX : chunk;
+      *idx += s.avail_in;
+      chunk -= s.avail_in;
+    }
+    if (outpos == maxsize) {
+			// If we're here, our output buffer isn't large enough
+      if (maxsize > SIZE_MAX / 2) RAISE(OUT_OF_MEMORY);
+      maxsize <<= 1; // double size
+      tmpbuf = *outbuf;
+      *outbuf = realloc(*outbuf, maxsize);
+      if (NULL == *outbuf) {
+        free(tmpbuf);
+        RAISE(OUT_OF_MEMORY);
+      }
+      Serial.printf("Grew to up to %lu bytes\n", (unsigned long)maxsize);
     }
-    s.next_out = *outbuf + s.total_out;
-    for (i = s.total_out; i < maxsize; i++)
-    	(*outbuf)[i] = 0x55;
-		s.avail_out = maxsize - s.total_out;
-    Serial.printf("Grew to up to %u bytes\n", maxsize);
+    s.next_out = *outbuf + outpos;
+    s.avail_out = (maxsize - outpos > UINT_MAX) ? UINT_MAX : maxsize - outpos;
+    avail = s.avail_out;
+    err = inflate(&s, Z_NO_FLUSH);
+    outpos += avail - s.avail_out;
+    if (err == Z_STREAM_END) break;
+  	if (err != Z_OK && err != Z_BUF_ERROR) RAISE(ZLIB_ERROR);
+    if (s.avail_in == 0 && chunk == 0 && !is_partial && s.avail_out != 0)
+    	break; // Done
   }
-  Serial.printf("Total inflated bytes: %lu\n", s.total_out);
-  *outlen = s.total_out;
+  Serial.printf("Total inflated bytes: %lu\n", (unsigned long)outpos);
+  *outlen = outpos;
   
   if (inflateEnd(&s) != Z_OK) RAISE(ZLIB_ERROR);
+
+	// Step over anything left in the packet after the deflate stream
+	*idx += chunk;
+  while (is_partial) {
+  	if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+  	chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                   &headerlen, &is_partial);
+    *idx += headerlen - 1;
+    if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+    *idx += chunk;
+  }
+  // Packet parser loop expects us to end on the last byte of this packet
+  *idx -= 1;
   
   return 0;
 }
 
 static uint8_t spgp_parse_compressed_packet(uint8_t *msg, 
-                                            uint32_t *idx, 
-          													 	      uint32_t length, 
+                                            size_t *idx, 
+          													 	      size_t length, 
                                             spgp_packet_t *pkt) {
   int algo;
   spgp_packet_t *pkts;
-  uint8_t *decomp;
-  uint32_t decomp_len;
-  uint32_t didx;
+  uint8_t *decomp = NULL;
+  size_t decomp_len;
+  size_t didx;
 
 
   if (NULL == msg || NULL == idx || length == 0 || NULL == pkt)
   	RAISE(INVALID_ARGS);
+  if (pkt->header->contentLength == 0) RAISE(INVALID_HEADER);
+
+	// Inflate straight into the sink's stream instead of a buffer
+	if (literal_sink) return spgp_stream_packet(msg, idx, length, pkt);
      
   algo = msg[*idx];
   SAFE_IDX_INCREMENT(*idx, length);
   switch (algo) {
     case 1:
     	Serial.printf("ZIP compressed packet\n");
-      spgp_zlib_decompress_buffer(msg+*idx, pkt->header->contentLength,
-                                  &decomp, &decomp_len, algo);
+      spgp_zlib_decompress_buffer(msg, idx, length, pkt, algo,
+                                  &decomp, &decomp_len);
       break;
     case 2:
     	Serial.printf("ZLIB compressed packet\n");
-      spgp_zlib_decompress_buffer(msg+*idx, pkt->header->contentLength,
-                                  &decomp, &decomp_len, algo);
+      spgp_zlib_decompress_buffer(msg, idx, length, pkt, algo,
+                                  &decomp, &decomp_len);
       break;
     default:
     	Serial.printf("Unsupported packet compression: %u\n", algo);
@@ -1293,45 +1696,46 @@ static uint8_t spgp_parse_compressed_packet(uint8_t *msg,
   // Decode all the packets in this compressed packet        
 	didx = 0;
   pkts = spgp_packet_decode_loop(decomp, &didx, decomp_len);
+  free(decomp);
+  decomp = NULL;
   if (NULL == pkts) RAISE(INCOMPLETE_PACKET);
   
   // Add packets to the current chain
   pkt->next = pkts;
   pkts->prev = pkt;
-  
-  free(decomp);
-  decomp = NULL;
-  
-  // Progress index through current chain
-  *idx += pkt->header->contentLength;
  
 	return 0;
 }
 
 
 static uint8_t spgp_parse_encrypted_packet(uint8_t *msg, 
-                                           uint32_t *idx, 
-          														 		 uint32_t *length, 
+                                           size_t *idx, 
+          														 		 size_t length, 
                                            spgp_packet_t *pkt) {
   spgp_packet_t *session_pkt;
+  spgp_packet_t *pkts;
   spgp_session_pkt_t *session;
-  gcry_cipher_hd_t cipher_hd;
-	gcry_error_t err;
+  spgp_crypto_cipher_t *cipher_hd;
+	uint8_t err;
   int version;
   unsigned long blksize;
-  uint32_t encbytes;
-  uint32_t startidx;
+  uint8_t *plain;
+  size_t plainlen;
+  size_t pidx;
+  size_t encbytes;
+  size_t startidx;
   uint8_t headerlen;
-  uint8_t is_done;
   uint8_t is_partial;
+  jmp_buf saved;
   
-  if (NULL == msg || NULL == idx || *length == 0 || NULL == pkt)
+  if (NULL == msg || NULL == idx || length == 0 || NULL == pkt)
   	RAISE(INVALID_ARGS);
     
   version = msg[*idx];
-  SAFE_IDX_INCREMENT(*idx, *length);
-  
-  // As of this writing, only version 1 exists
+
+	// Version 2 is chunked AEAD rather than CFB with a check
+	if (version == 2) return spgp_parse_aead_packet(msg, idx, length, pkt);
+  SAFE_IDX_INCREMENT(*idx, length);
   if (version != 1) RAISE(FORMAT_UNSUPPORTED);
   
   session_pkt = spgp_find_session_packet(pkt);
@@ -1340,97 +1744,391 @@ static uint8_t spgp_parse_encrypted_packet(uint8_t *msg,
   	RAISE(DECRYPT_FAILED);
   }
   session = session_pkt->c.session;
+  blksize = spgp_iv_length_for_symmetric_algo(session->symAlgo);
+  if (0 == blksize) RAISE(FORMAT_UNSUPPORTED);
+
+	// Decrypt a window at a time straight into the sink's stream
+	if (literal_sink)
+  	return spgp_decrypt_to_sink(msg, idx, length, pkt, session, blksize);
   
   startidx = *idx;
-  is_done = 0;
-  is_partial = pkt->header->isPartial;
-  
+
   // Drop 1 from contentLength to account for version
   encbytes = pkt->header->contentLength - 1;
+  if (length - startidx < encbytes) RAISE(BUFFER_OVERFLOW);
+
+  // Since data packets can have partial length, the ciphertext may be
+  // split up by length headers.  Walk them first so the plaintext can be
+  // allocated once.  Nothing is written to |msg|: it may be a read-only
+  // mapping, and callers are free to decode the same buffer again.
+  plainlen = encbytes;
+  *idx = startidx + encbytes;
+  is_partial = pkt->header->isPartial;
+  while (is_partial) {
+  	if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+    encbytes = spgp_new_header_length(msg+*idx, length-*idx,
+                                      &headerlen, &is_partial);
+    *idx += headerlen - 1;
+    if (*idx > length || length - *idx < encbytes) RAISE(BUFFER_OVERFLOW);
+    Serial.printf("%lu more bytes\n", (unsigned long)encbytes);
+    plainlen += encbytes;
+    *idx += encbytes;
+  }
 
-  err = gcry_cipher_open (&cipher_hd, 
-          spgp_pgp_to_gcrypt_symmetric_algo(session->symAlgo),
-          GCRY_CIPHER_MODE_CFB,
-          (GCRY_CIPHER_SECURE | GCRY_CIPHER_ENABLE_SYNC |
-          GCRY_CIPHER_ENABLE_SYNC));
-  blksize = spgp_iv_length_for_symmetric_algo(session->symAlgo);
-  err |= gcry_cipher_setkey(cipher_hd, session->key, session->keylen);
-  err |= gcry_cipher_setiv(cipher_hd, 0, blksize);
-  if (err) RAISE(GCRY_ERROR);
-  
-  // Since data packets can have partial length, we loop and decrypt
-  // here until the whole blasted thing is decrypted.
-  while (!is_done) {
-    err = gcry_cipher_decrypt(cipher_hd, 
-                              msg+*idx, 
-                              encbytes, 
-                              NULL, 
-                              0);
-    if (err) RAISE(GCRY_ERROR);
-    
-    *idx += encbytes - 1; // increment to last byte of data
-    
-    // Check if we're done
-    if (!(is_partial)) {
-    	is_done = 1;
-      continue;
+  if (plainlen < blksize + 2) RAISE(INCOMPLETE_PACKET);
+
+  plain = malloc(plainlen);
+  if (NULL == plain) RAISE(OUT_OF_MEMORY);
+
+  cipher_hd = spgp_open_session_cipher(session, blksize);
+  
+  // Decrypt each chunk straight into the plaintext buffer.  Partial length
+  // headers are skipped over rather than moved out of the way.
+  *idx = startidx;
+  encbytes = pkt->header->contentLength - 1;
+  is_partial = pkt->header->isPartial;
+  pidx = 0;
+  while (1) {
+    err = spgp_crypto_cipher_decrypt(cipher_hd, 
+                                     plain+pidx, 
+                                     msg+*idx, 
+                                     encbytes);
+      if (err) {
+    	memset(plain, 0, plainlen);
+    	free(plain);
+      spgp_crypto_cipher_close(cipher_hd);
+    	RAISE(GCRY_ERROR);
     }
-    
-    // We are processing a partial packet, so figure out next length
-	  SAFE_IDX_INCREMENT(*idx, *length); // inc to first byte of header
-    encbytes = spgp_new_header_length(msg+*idx, 
-               						            &(headerlen),
-                          						&(is_partial));
-    Serial.printf("%u more bytes\n", encbytes);
-
-  	// Fuck everything and everyone.  Partial lengths are the enemy of
-    // gentlemen.  We shall kill it brutishly, by moving everything down.
-    // God help you if your buffer is massive.
-    //
-    // The issue here is that a packet can technically be massive -- like
-    // exabytes -- and that's still valid by the OpenPGP spec.  You can't
-    // depend on the ability to create temporary buffers to stick this stuff
-    // in.  But if you leave it in the original buffer, the sub-packets won't
-    // know if there are "partial body length" headers jammed in the middle of
-    // their data.  
-    //
-    // The only proper solution is some sort of dynamic stream data structure,
-    // but it's too late for that now.  memmove() will have to do.  If your
-    // packet is gigabytes long, this is going to take a while.
-    memmove(msg+*idx, msg+*idx+headerlen-1, *length-(*idx+headerlen-1));
-    *length -= headerlen-1;
+    pidx += encbytes;
+    *idx += encbytes;
+    if (!is_partial) break;
+    encbytes = spgp_new_header_length(msg+*idx, length-*idx,
+                                      &headerlen, &is_partial);
+    *idx += headerlen - 1;
   }
+  spgp_crypto_cipher_close(cipher_hd);
+
+  // Packet parser loop expects us to end on the last byte of this packet
+  *idx -= 1;
 
 	// Validate decryption with PGP's MDC doo-hickey.  
-  if (memcmp(msg+startidx+blksize-2, msg+startidx+blksize, 2) != 0) {
+  if (memcmp(plain+blksize-2, plain+blksize, 2) != 0) {
   	Serial.printf("Decrypted data block fails validation!\n");
+    memset(plain, 0, plainlen);
+    free(plain);
     RAISE(DECRYPT_FAILED);
   }
   Serial.printf("Decrypt succeeded.\n");
 
-  // At this point, msg has been decrypted in place and now contains
-  // a bunch of packets.  Since it was decoded in place, and since we're
-  // already in the middle of a packet decode loop, we can just teleport
-  // idx back to the beginning of the data and exit.
-  //
-  // Packet data starts blocksize+2 bytes above decrypted data.  One block
-  // of random data, and 2 extra bytes of verification.
-  //
-  // Subtract 1 because startidx is the first byte of the decrypted packet, 
-  // but the packet parser loop expects us to end on the last byte of the 
-  // previous packet.
-  *idx = startidx + blksize + 2 - 1;
+	// The plaintext is wiped and freed before passing on anything raised
+	// while decoding it
+	memcpy(saved, exception, sizeof(jmp_buf));
+  if (setjmp(exception)) {
+  	memcpy(exception, saved, sizeof(jmp_buf));
+    memset(plain, 0, plainlen);
+    free(plain);
+    RAISE(_spgp_err);
+  }
+
+  // Decode all the packets in the plaintext, the same way as a compressed
+  // packet.  Packet data starts blocksize+2 bytes into the decrypted data:
+  // one block of random data, and 2 extra bytes of verification.
+  pidx = blksize + 2;
+  pkts = spgp_packet_decode_loop(plain, &pidx, plainlen);
+  memcpy(exception, saved, sizeof(jmp_buf));
+  memset(plain, 0, plainlen);
+  free(plain);
+  if (NULL == pkts) RAISE(INCOMPLETE_PACKET);
+
+  // Add packets to the current chain
+  pkt->next = pkts;
+  pkts->prev = pkt;
   
 	return 0;
 }
 
+static spgp_crypto_cipher_t *spgp_open_session_cipher(
+                                                 spgp_session_pkt_t *session,
+                                                 unsigned long blksize) {
+  spgp_crypto_cipher_t *cipher_hd;
+
+  cipher_hd = spgp_crypto_cipher_open(session->symAlgo,
+                                      (uint8_t *)session->key,
+                                      session->keylen);
+  if (cipher_hd->blksize != blksize) {
+  	spgp_crypto_cipher_close(cipher_hd);
+  	RAISE(FORMAT_UNSUPPORTED);
+  }
+  return cipher_hd;
+}
+
+static uint8_t spgp_decrypt_to_sink(uint8_t *msg, size_t *idx, size_t length,
+                                    spgp_packet_t *pkt,
+                                    spgp_session_pkt_t *session,
+                                    unsigned long blksize) {
+  spgp_crypto_cipher_t * volatile cipher_hd = NULL;
+  spgp_stream_t * volatile st = NULL;
+  spgp_stream_t *open;
+  spgp_packet_t *pkts;
+  uint8_t prefix[32 + 2];
+  uint8_t * volatile window = NULL;
+  size_t chunk, n, skip;
+  size_t prefixlen = 0;
+  uint8_t headerlen;
+  uint8_t is_partial;
+  jmp_buf saved;
+
+	if (blksize > sizeof(prefix) - 2) RAISE(FORMAT_UNSUPPORTED);
+
+	// The window and prefix hold plaintext, so they are wiped before passing
+  // on anything raised
+	memcpy(saved, exception, sizeof(jmp_buf));
+  if (setjmp(exception)) {
+  	memcpy(exception, saved, sizeof(jmp_buf));
+    if (window) {
+    	memset(window, 0, SPGP_SINK_WINDOW);
+      free(window);
+    }
+    memset(prefix, 0, sizeof(prefix));
+    if (cipher_hd) spgp_crypto_cipher_close(cipher_hd);
+    open = st;
+    spgp_stream_abort(&open);
+    RAISE(_spgp_err);
+  }
+
+	window = malloc(SPGP_SINK_WINDOW);
+  if (NULL == window) RAISE(OUT_OF_MEMORY);
+  cipher_hd = spgp_open_session_cipher(session, blksize);
+  st = spgp_stream_open(literal_sink, NULL);
+
+	// Drop 1 from contentLength to account for version
+  chunk = pkt->header->contentLength - 1;
+  is_partial = pkt->header->isPartial;
+  while (1) {
+  	if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+    while (chunk) {
+    	n = (chunk < SPGP_SINK_WINDOW) ? chunk : SPGP_SINK_WINDOW;
+      if (spgp_crypto_cipher_decrypt(cipher_hd, window, msg+*idx, n))
+      	RAISE(GCRY_ERROR);
+      *idx += n;
+      chunk -= n;
+
+			// The random prefix and its check bytes come before any packets
+			skip = 0;
+      if (prefixlen < blksize + 2) {
+      	skip = blksize + 2 - prefixlen;
+        if (skip > n) skip = n;
+        memcpy(prefix + prefixlen, window, skip);
+        prefixlen += skip;
+        if (prefixlen == blksize + 2 &&
+            memcmp(prefix+blksize-2, prefix+blksize, 2) != 0) {
+        	Serial.printf("Decrypted data block fails validation!\n");
+          RAISE(DECRYPT_FAILED);
+        }
+      }
+      spgp_stream_push(st, window + skip, n - skip);
+    }
+    if (!is_partial) break;
+    if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+    chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                   &headerlen, &is_partial);
+    *idx += headerlen - 1;
+  }
+  if (prefixlen < blksize + 2) RAISE(INCOMPLETE_PACKET);
+	open = st;
+  pkts = spgp_stream_close(&open);
+  st = NULL;
+  memcpy(exception, saved, sizeof(jmp_buf));
+
+  spgp_crypto_cipher_close(cipher_hd);
+  memset(window, 0, SPGP_SINK_WINDOW);
+  memset(prefix, 0, sizeof(prefix));
+  free(window);
+  if (NULL == pkts) RAISE(INCOMPLETE_PACKET);
+
+  // Packet parser loop expects us to end on the last byte of this packet
+  *idx -= 1;
+
+  // Add packets to the current chain
+  pkt->next = pkts;
+  pkts->prev = pkt;
+
+	return 0;
+}
+
+/**
+ * Decrypt a version 2 SEIPD packet or an AEAD packet and decode the
+ * packets inside it.
+ *
+ * Chunks are decrypted on the number of threads in the decode options.
+ * Decoding to a sink streams each chunk there once its tag is checked;
+ * otherwise the plaintext is decoded once the final tag is.
+ */
+static uint8_t spgp_parse_aead_packet(uint8_t *msg, size_t *idx,
+                                      size_t length, spgp_packet_t *pkt) {
+	spgp_aead_params_t params;
+  spgp_packet_t *session_pkt;
+  spgp_packet_t *pkts;
+  spgp_session_pkt_t *session;
+  spgp_aead_segment_t * volatile segs = NULL;
+  spgp_stream_t * volatile st = NULL;
+  spgp_stream_t *open;
+  uint8_t * volatile plain = NULL;
+  uint8_t *cursor;
+  volatile size_t plainlen = 0;
+  size_t startidx, pidx;
+  uint32_t count, threads;
+  jmp_buf saved;
+
+  if (NULL == msg || NULL == idx || length == 0 || NULL == pkt)
+  	RAISE(INVALID_ARGS);
+
+	startidx = *idx;
+  spgp_aead_read_params(msg, idx, length, pkt->header->type, &params);
+  if (*idx - startidx >= pkt->header->contentLength)
+  	RAISE(INCOMPLETE_PACKET);
+
+	session_pkt = spgp_find_session_packet(pkt);
+  if (NULL == session_pkt) {
+  	Serial.printf("No session key found!\n");
+  	RAISE(DECRYPT_FAILED);
+  }
+  session = session_pkt->c.session;
+  threads = decode_opts ? decode_opts->threads : 0;
+
+	segs = spgp_aead_segments(msg, idx, length, pkt,
+                            pkt->header->contentLength - (*idx - startidx),
+                            &count);
+
+	// The ciphertext runs, stream and plaintext are freed before passing on
+  // anything raised
+	memcpy(saved, exception, sizeof(jmp_buf));
+  if (setjmp(exception)) {
+  	memcpy(exception, saved, sizeof(jmp_buf));
+    free(segs);
+    open = st;
+    spgp_stream_abort(&open);
+    if (plain) {
+    	memset(plain, 0, plainlen);
+      free(plain);
+    }
+    RAISE(_spgp_err);
+  }
+
+	if (literal_sink) {
+  	st = spgp_stream_open(literal_sink, NULL);
+    spgp_aead_decrypt(&params, (uint8_t *)session->key, session->keylen,
+                      segs, count, threads, spgp_aead_to_stream, st);
+    open = st;
+    pkts = spgp_stream_close(&open);
+    st = NULL;
+  }
+  else {
+  	plainlen = spgp_aead_plain_length(&params, segs[count - 1].offset +
+                                      segs[count - 1].len);
+    if (0 == plainlen) RAISE(INCOMPLETE_PACKET);
+    plain = cursor = malloc(plainlen);
+    if (NULL == plain) RAISE(OUT_OF_MEMORY);
+    spgp_aead_decrypt(&params, (uint8_t *)session->key, session->keylen,
+                      segs, count, threads, spgp_aead_to_buffer, &cursor);
+    Serial.printf("Decrypt succeeded.\n");
+    pidx = 0;
+    pkts = spgp_packet_decode_loop(plain, &pidx, plainlen);
+    memset(plain, 0, plainlen);
+    free(plain);
+    plain = NULL;
+  }
+  memcpy(exception, saved, sizeof(jmp_buf));
+  free(segs);
+  if (NULL == pkts) RAISE(INCOMPLETE_PACKET);
+
+  // Add packets to the current chain
+  pkt->next = pkts;
+  pkts->prev = pkt;
+
+	return 0;
+}
+
+/**
+ * Find the runs of ciphertext between an encrypted packet's partial length
+ * headers.
+ *
+ * @param idx First byte of ciphertext.  Set to the packet's last byte.
+ * @param first Length of the first run, what is left of the first chunk
+ * @param count Set to the number of runs
+ * @return The runs, to be freed by the caller
+ */
+static spgp_aead_segment_t *spgp_aead_segments(uint8_t *msg, size_t *idx,
+                                               size_t length,
+                                               spgp_packet_t *pkt,
+                                               size_t first,
+                                               uint32_t *count) {
+	spgp_aead_segment_t *segs = NULL;
+  size_t startidx = *idx;
+  size_t chunk, offset;
+  uint32_t n;
+  uint8_t headerlen;
+  uint8_t is_partial;
+  uint8_t pass;
+
+	// Walk the length headers once to count the runs, and again to record
+  // them
+	for (pass = 0; pass < 2; pass++) {
+  	*idx = startidx;
+    chunk = first;
+    is_partial = pkt->header->isPartial;
+    offset = 0;
+    n = 0;
+    while (1) {
+    	if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+      if (segs) {
+      	segs[n].data = msg + *idx;
+        segs[n].offset = offset;
+        segs[n].len = chunk;
+      }
+      n++;
+      offset += chunk;
+      *idx += chunk;
+      if (!is_partial) break;
+      if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+      chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                     &headerlen, &is_partial);
+      *idx += headerlen - 1;
+      if (*idx > length) RAISE(BUFFER_OVERFLOW);
+    }
+    if (0 == pass) {
+    	segs = malloc(sizeof(*segs) * n);
+      if (NULL == segs) RAISE(OUT_OF_MEMORY);
+    }
+  }
+  *count = n;
+
+  // Packet parser loop expects us to end on the last byte of this packet
+  *idx -= 1;
+  return segs;
+}
+
+static void spgp_aead_to_stream(void *ctx, const uint8_t *data, size_t len) {
+	spgp_stream_push(ctx, data, len);
+}
+
+static void spgp_aead_to_buffer(void *ctx, const uint8_t *data, size_t len) {
+	uint8_t **cursor = ctx;
+
+	memcpy(*cursor, data, len);
+  *cursor += len;
+}
+
 static uint8_t spgp_parse_literal_packet(uint8_t *msg, 
-                                         uint32_t *idx, 
-          													 		 uint32_t length, 
+                                         size_t *idx, 
+          													 		 size_t length, 
                                          spgp_packet_t *pkt) {
 	spgp_literal_pkt_t *literal = NULL;
   uint32_t date;
-  uint32_t startidx;
+  size_t startidx;
+  size_t chunk, end, pos, n;
+  uint8_t headerlen;
+  uint8_t is_partial;
   uint8_t format;
   
   Serial.printf("Parsing literal packet\n");
@@ -1438,6 +2136,9 @@ static uint8_t spgp_parse_literal_packet(uint8_t *msg,
 	if (NULL == msg || NULL == idx || NULL == pkt || length == 0)                              
   	RAISE(INVALID_ARGS);
 
+	// Hand the data to the sink rather than keeping a copy
+	if (literal_sink) return spgp_stream_packet(msg, idx, length, pkt);
+
 	startidx = *idx;
 
   pkt->c.literal = malloc(sizeof(*(pkt->c.literal)));
@@ -1454,45 +2155,77 @@ static uint8_t spgp_parse_literal_packet(uint8_t *msg,
   SAFE_IDX_INCREMENT(*idx, length);
   
   // Read the filename
+  if (length - *idx <= literal->filenameLen) RAISE(BUFFER_OVERFLOW);
   literal->filename = malloc(literal->filenameLen + 1);
   if (NULL == literal->filename) RAISE(OUT_OF_MEMORY);
   memcpy(literal->filename, msg+*idx, literal->filenameLen);
   literal->filename[literal->filenameLen] = '\0';
-  *idx += literal->filenameLen - 1;
-	SAFE_IDX_INCREMENT(*idx, length);
+  *idx += literal->filenameLen;
   
   // Read the timestamp.  This is ignored.
   memcpy(&date, msg+*idx, sizeof(date));
   *idx += 3;
   SAFE_IDX_INCREMENT(*idx, length);
   
-  // Read the actual data in to buffer
-  literal->dataLen = pkt->header->contentLength - (*idx - startidx);
-  literal->data = malloc(literal->dataLen);
+  // The data is the rest of this chunk, plus any partial-length chunks
+  // after it.  Walk their headers first so the data is allocated once.
+  if (*idx - startidx > pkt->header->contentLength) RAISE(INVALID_HEADER);
+  chunk = pkt->header->contentLength - (*idx - startidx);
+  if (length - *idx < chunk) RAISE(BUFFER_OVERFLOW);
+  literal->dataLen = chunk;
+  end = *idx + chunk;
+  is_partial = pkt->header->isPartial;
+  while (is_partial) {
+  	if (end >= length) RAISE(INCOMPLETE_PACKET);
+    n = spgp_new_header_length(msg+end, length-end, &headerlen, &is_partial);
+    end += headerlen - 1;
+    if (length - end < n) RAISE(BUFFER_OVERFLOW);
+    literal->dataLen += n;
+    end += n;
+  }
+
+  literal->data = malloc(literal->dataLen ? literal->dataLen : 1);
   if (NULL == literal->data) RAISE(OUT_OF_MEMORY);
-  memcpy(literal->data, msg+*idx, literal->dataLen);
-  *idx += literal->dataLen - 1;
+  pos = 0;
+  is_partial = pkt->header->isPartial;
+  while (1) {
+  	memcpy(literal->data + pos, msg+*idx, chunk);
+    spgp_onepass_hash(msg+*idx, chunk);
+    pos += chunk;
+    *idx += chunk;
+    if (!is_partial) break;
+    chunk = spgp_new_header_length(msg+*idx, length-*idx,
+                                   &headerlen, &is_partial);
+    *idx += headerlen - 1;
+  }
+  // Packet parser loop expects us to end on the last byte of this packet
+  *idx -= 1;
   
-  Serial.printf("Stored %u bytes\n", literal->dataLen);
+  Serial.printf("Stored %lu bytes\n", (unsigned long)literal->dataLen);
   
 	return 0;
 }
 
 static uint8_t spgp_parse_signature_packet(uint8_t *msg, 
-                                           uint32_t *idx, 
-          													 		   uint32_t length, 
+                                           size_t *idx, 
+          													 		   size_t length, 
                                            spgp_packet_t *pkt) {
 	spgp_signature_pkt_t *sig;
   spgp_literal_pkt_t *literal;
-  gcry_md_hd_t md;
-  uint32_t startidx, stopidx;
-  unsigned char *hash;
-  uint32_t totalLen;
+  spgp_packet_t *key;
+  spgp_sig_md_t md;
+  size_t startidx, end;
 
 	Serial.printf("Parsing signature packet\n");
   
   if (msg == NULL || idx == NULL || pkt == NULL || 0 == length)
   	RAISE(INVALID_ARGS);
+
+	// Make sure we have enough bytes remaining for parsing.  The fixed fields
+  // are 4 bytes, two 2-byte subpacket lengths and the 2-byte hash test.
+  if (length - *idx < pkt->header->contentLength) RAISE(BUFFER_OVERFLOW);
+  if (pkt->header->contentLength < 10) RAISE(INCOMPLETE_PACKET);
+  end = *idx + pkt->header->contentLength;
     
   pkt->c.signature = malloc(sizeof(*(pkt->c.signature)));
   if (NULL == pkt->c.signature) RAISE(OUT_OF_MEMORY);
@@ -1502,46 +2235,42 @@ static uint8_t spgp_parse_signature_packet(uint8_t *msg,
 	startidx = *idx;
 
 	sig->version = msg[*idx];
-  SAFE_IDX_INCREMENT(*idx, length);
-
 	if (sig->version != 4) RAISE(FORMAT_UNSUPPORTED);
-
-	sig->type = msg[*idx];
-  SAFE_IDX_INCREMENT(*idx, length);
-
-	sig->asymAlgo = msg[*idx];
-  SAFE_IDX_INCREMENT(*idx, length);
-
-	sig->hashAlgo = msg[*idx];
-  SAFE_IDX_INCREMENT(*idx, length);
+	sig->type = msg[*idx + 1];
+	sig->asymAlgo = msg[*idx + 2];
+	sig->hashAlgo = msg[*idx + 3];
+  *idx += 4;
 	
   Serial.printf("Signature type 0x%X, algo 0x%X, hash 0x%X\n",
   	sig->type, sig->asymAlgo, sig->hashAlgo);
     
   sig->hashedSubLength = ((msg[*idx] & 0xFF) << 8) | msg[*idx + 1];
-  *idx += 1;
-  SAFE_IDX_INCREMENT(*idx, length);
-  
-  // skip hashed subpackets for now
-  *idx += sig->hashedSubLength - 1;
-  SAFE_IDX_INCREMENT(*idx, length);
-
-	stopidx = *idx;
+  *idx += 2;
+  if (end - *idx < (size_t)sig->hashedSubLength + 4) RAISE(BUFFER_OVERFLOW);
+  spgp_parse_sig_subpackets(msg + *idx, sig->hashedSubLength, sig);
+  *idx += sig->hashedSubLength;
+
+	// Everything up to here is covered by the signature.  Keep a copy, since
+  // the signed data may only be available after this packet is parsed.
+  sig->hashedLen = *idx - startidx;
+  sig->hashed = malloc(sig->hashedLen);
+  if (NULL == sig->hashed) RAISE(OUT_OF_MEMORY);
+  memcpy(sig->hashed, msg + startidx, sig->hashedLen);
 
   sig->unhashedSubLength = ((msg[*idx] & 0xFF) << 8) | msg[*idx + 1];
-  *idx += 1;
-  SAFE_IDX_INCREMENT(*idx, length);
-  
-  // skip unhashed subpackets for now
-  *idx += sig->unhashedSubLength - 1;
-  SAFE_IDX_INCREMENT(*idx, length);
+  *idx += 2;
+  if (end - *idx < (size_t)sig->unhashedSubLength + 2) RAISE(BUFFER_OVERFLOW);
+  // Issuers in the hashed area were found first, and take precedence
+  spgp_parse_sig_subpackets(msg + *idx, sig->unhashedSubLength, sig);
+  *idx += sig->unhashedSubLength;
 
   sig->hashTest = ((msg[*idx] & 0xFF) << 8) | (msg[*idx + 1] & 0xFF);
   *idx += 1;
   SAFE_IDX_INCREMENT(*idx, length);
 
 	sig->mpiHead = spgp_read_mpi(msg, idx, length);
-  if (sig->asymAlgo == ASYM_ALGO_DSA) {
+  // DSA and EdDSA signatures are r and s
+  if (sig->asymAlgo == ASYM_ALGO_DSA || sig->asymAlgo == ASYM_ALGO_EDDSA) {
 	  SAFE_IDX_INCREMENT(*idx, length);
   	sig->mpiHead->next = spgp_read_mpi(msg, idx, length);
   }
@@ -1549,6 +2278,19 @@ static uint8_t spgp_parse_signature_packet(uint8_t *msg,
 	// All data accounted for, idx incremented to the end
   // We can exit cleanly any time after this point
 
+	// A one-pass signed message was hashed as its literal data went by.
+  // Otherwise a signature straight after literal data is checked against
+  // it.  Either way the keys in the keychain are used, and the result is
+  // left in the packet.
+  md = spgp_onepass_take(sig);
+  if (md) {
+  	key = spgp_sig_prepare(pkt, NULL);
+    if (key) spgp_sig_finish(pkt, key, md);
+    spgp_sig_hash_close(md);
+    Serial.printf("Signature status: %u\n", sig->status);
+    return 0;
+  }
+
 	if (NULL == pkt->prev || 
   		pkt->prev->header->type != PKT_TYPE_LITERAL_DATA ||
   		NULL == pkt->prev->c.literal ||
@@ -1557,36 +2299,111 @@ static uint8_t spgp_parse_signature_packet(uint8_t *msg,
       
   literal = pkt->prev->c.literal;
 
-	if (gcry_md_open (&md, GCRY_MD_SHA1, 0) != 0) RAISE(GCRY_ERROR);
-  gcry_md_write (md, literal->data, literal->dataLen);
-  gcry_md_write (md, msg+startidx, stopidx-startidx);
-  
-  /* They hide this shit in here because they hate us.  What's really great
-   is that the length will always be (hashedSubLength+6), and hashedSubLength
-   is a 16-bit int, so in the worst case this final length would only be 3
-   bytes.  Top byte in this 32-bit int will always be zero.
-  
-   RFC 4880 - 5.2.4
-   V4 signatures also hash in a final trailer of six octets: the
-   version of the Signature packet, i.e., 0x04; 0xFF; and a four-octet,
-   big-endian number that is the length of the hashed data from the
-   Signature packet (note that this number does not include these final
-   six octets).*/
-   
-  totalLen = sig->hashedSubLength + 6;
-   
-  gcry_md_putc(md, sig->version);
-  gcry_md_putc(md, 0xFF);
-  gcry_md_putc(md, totalLen >> 24);
-  gcry_md_putc(md, totalLen >> 16);
-  gcry_md_putc(md, totalLen >>  8);
-  gcry_md_putc(md, totalLen >>  0);
-     
-  gcry_md_final(md);
-  hash = gcry_md_read(md, 0);
+	md = spgp_sig_hash_open(pkt);
+  if (NULL == md) return -1;
+  spgp_sig_hash_data(md, sig->type, (uint8_t*)literal->data, literal->dataLen);
+  spgp_check_signature(pkt, NULL, md);
+  spgp_sig_hash_close(md);
+  Serial.printf("Signature status: %u\n", sig->status);
   
 	return 0;
 }
+
+/**
+ * Parse a one-pass signature packet, and start hashing for it.
+ *
+ * The literal data that follows is hashed as it is decoded, so the
+ * signature packet after it can be checked without going over the data
+ * again.  This is what lets signed messages stream to a sink.
+ */
+static uint8_t spgp_parse_onepass_packet(uint8_t *msg, size_t *idx,
+                                         size_t length, spgp_packet_t *pkt) {
+	spgp_onepass_pkt_t *onepass;
+
+	Serial.printf("Parsing one-pass signature packet\n");
+
+	/* RFC 4880 - 5.4
+   version (1), signature type (1), hash algorithm (1), public-key
+   algorithm (1), key ID (8), nested flag (1) */
+	if (length - *idx < pkt->header->contentLength) RAISE(BUFFER_OVERFLOW);
+  if (pkt->header->contentLength < 1) RAISE(INCOMPLETE_PACKET);
+
+	pkt->c.onepass = malloc(sizeof(*(pkt->c.onepass)));
+  if (NULL == pkt->c.onepass) RAISE(OUT_OF_MEMORY);
+  onepass = pkt->c.onepass;
+  memset(onepass, 0, sizeof(*onepass));
+  onepass->version = msg[*idx];
+
+	// Other versions are laid out differently.  The packet is kept, but
+  // nothing is hashed for it, and the rest of the message still decodes.
+	if (onepass->version != 3) {
+  	Serial.printf("Skipping one-pass signature version %u\n",
+                  onepass->version);
+    onepass->isUnsupported = 1;
+    *idx += pkt->header->contentLength - 1;
+    return 0;
+  }
+  if (pkt->header->contentLength < 13) RAISE(INCOMPLETE_PACKET);
+  onepass->type = msg[*idx + 1];
+  onepass->hashAlgo = msg[*idx + 2];
+  onepass->asymAlgo = msg[*idx + 3];
+  memcpy(onepass->keyid, msg + *idx + 4, 8);
+  onepass->nested = msg[*idx + 12];
+
+	// Packet parser loop expects us to end on the last byte of this packet
+  *idx += pkt->header->contentLength - 1;
+
+  spgp_onepass_begin(onepass);
+  return 0;
+}
+
+/**
+ * Look through signature subpackets for the issuer's key ID.
+ *
+ * The first issuer found wins.  Issuer fingerprints (V4 keys) give the key
+ * ID as their last 8 bytes.
+ */
+static void spgp_parse_sig_subpackets(uint8_t *sub, size_t length,
+                                      spgp_signature_pkt_t *sig) {
+	size_t i = 0;
+  size_t sublen;
+
+	while (i < length) {
+  	if (sub[i] < 192) {
+    	sublen = sub[i];
+      i += 1;
+    }
+    else if (sub[i] < 255) {
+    	if (length - i < 2) RAISE(BUFFER_OVERFLOW);
+      sublen = ((size_t)(sub[i]-192) << 8) + sub[i+1] + 192;
+      i += 2;
+    }
+    else {
+    	if (length - i < 5) RAISE(BUFFER_OVERFLOW);
+      sublen = spgp_get_be32(sub+i+1);
+      i += 5;
+    }
+    // The length includes the type byte
+    if (sublen == 0 || length - i < sublen) RAISE(BUFFER_OVERFLOW);
+
+		switch (sub[i] & 0x7F) { // top bit is the 'critical' flag
+    	case SIG_SUBPKT_ISSUER:
+      	if (sublen != 9 || sig->hasIssuer) break;
+        memcpy(sig->issuer, sub+i+1, 8);
+        sig->hasIssuer = 1;
+        break;
+      case SIG_SUBPKT_ISSUER_FPR:
+      	if (sublen != 2 + SPGP_FINGERPRINT_LEN || sub[i+1] != 4 ||
+            sig->hasIssuer) break;
+        memcpy(sig->issuer, sub+i+2+SPGP_FINGERPRINT_LEN-8, 8);
+        sig->hasIssuer = 1;
+        break;
+      default:
+      	break;
+    }
+    i += sublen;
+  }
+}
                                          
 static spgp_packet_t *spgp_find_session_packet(spgp_packet_t *chain) {
 	spgp_packet_t *cur;
@@ -1601,21 +2418,20 @@ static spgp_packet_t *spgp_find_session_packet(spgp_packet_t *chain) {
         return cur;
     cur = cur->prev;
 	}
+
+	// None the keychain could open.  Ask the key agent, then the private key
+  // backend, for all of them.
+  if (spgp_agent_decrypt_sessions(chain) || spgp_pk_decrypt_sessions(chain))
+  	return spgp_find_session_packet(chain);
     
   return NULL;
 }
 
-static uint8_t spgp_parse_session_packet(uint8_t *msg, uint32_t *idx, 
-          													 		 uint32_t length, spgp_packet_t *pkt) {
+static uint8_t spgp_parse_session_packet(uint8_t *msg, size_t *idx, 
+          													 		 size_t length, spgp_packet_t *pkt) {
 	spgp_session_pkt_t *session;
-  spgp_packet_t *key, *chain;
-  gcry_sexp_t sexp_key, sexp_data, sexp_result;
-  gcry_mpi_t mpis[10], mpi_result;
-  spgp_mpi_t *cur;
-  uint32_t checksum, sum;
-  int i,mpi_count;
-  unsigned long frame_len;
-  uint8_t *frame;
+  uint8_t fprlen;
+  int i;
   
   Serial.printf("Parsing session packet.\n");
 
@@ -1636,9 +2452,24 @@ static uint8_t spgp_parse_session_packet(uint8_t *msg, uint32_t *idx,
   SAFE_IDX_INCREMENT(*idx, length);
   Serial.printf("Version: %u\n", session->version);
 
-	memcpy(session->keyid, msg+*idx, 8);
-  *idx += 7;
-  SAFE_IDX_INCREMENT(*idx, length);
+	// Version 6 names the key by version and fingerprint, or by nothing at
+  // all.  A V4 key's ID is the end of its fingerprint; V6 keys aren't
+  // supported, so their sessions are left for other recipients.
+	if (session->version == 6) {
+  	fprlen = msg[*idx];
+    SAFE_IDX_INCREMENT(*idx, length);
+    if (fprlen) {
+    	if (length - *idx <= fprlen) RAISE(BUFFER_OVERFLOW);
+    	if (fprlen == 1 + SPGP_FINGERPRINT_LEN && msg[*idx] == 4)
+      	memcpy(session->keyid, msg+*idx+fprlen-8, 8);
+      *idx += fprlen;
+    }
+  }
+  else {
+		memcpy(session->keyid, msg+*idx, 8);
+	  *idx += 7;
+  	SAFE_IDX_INCREMENT(*idx, length);
+  }
   Serial.printf("Session for key ID: ");
   for (i = 0; i < 8; i++) Serial.printf("%.2X",session->keyid[i]);
   Serial.printf("\n");
@@ -1648,149 +2479,144 @@ static uint8_t spgp_parse_session_packet(uint8_t *msg, uint32_t *idx,
 	
   // Read first MPI.  RSA only has one
   session->mpi1 = spgp_read_mpi(msg, idx, length);
-  // Elgamal has a second MPI
-	if (session->algo == ASYM_ALGO_ELGAMAL) {
+  // Elgamal has a second MPI.  ECDH's is the wrapped key, with a one byte
+  // length.
+	if (spgp_session_mpi_count(session->algo) > 1) {
 	  SAFE_IDX_INCREMENT(*idx, length);    
-  	session->mpi2 = spgp_read_mpi(msg, idx, length);
+    if (session->algo == ASYM_ALGO_ECDH)
+    	session->mpi2 = spgp_read_field(msg, idx, length);
+    else
+	  	session->mpi2 = spgp_read_mpi(msg, idx, length);
   }
   
   // DONE READING FROM STREAM AT THIS POINT
   // BELOW HERE -- DECRYPT SESSION KEY
   
+  // Keys only a key agent holds are asked for once the encrypted data is
+  // reached, for all of the recipients at once.
+  return spgp_decrypt_session_key(session);
+}
+
+/**
+ * Decrypt the session key in |session| with the matching keychain key.
+ *
+ * Sets the session's symmetric algorithm and key.
+ *
+ * @param session Session packet with its key ID, algorithm and MPIs read
+ * @return 0 if decrypted, -1 if the keychain has no key for it or a
+ *         private key backend is in use
+ */
+uint8_t spgp_decrypt_session_key(spgp_session_pkt_t *session) {
+  const spgp_keychain_key_t *key;
+  uint8_t *frame;
+  size_t frame_len;
+  uint32_t err;
+
+	if (NULL == session || NULL == session->mpi1) RAISE(INVALID_ARGS);
+  // Keys behind a private key backend are asked for once the encrypted
+  // data is reached, unless this decode finishes the backend's work
+  if (0 == spgp_pk_session_hint(session)) return 0;
+  if (spgp_pk_backend_active()) return -1;
   if (!spgp_keychain_is_valid()) RAISE(KEYCHAIN_ERROR);
-  spgp_keychain_iter_start();
-  while ((chain = spgp_keychain_iter_next()) != NULL) {
-  	if ((key = spgp_secret_key_matching_id(chain, session->keyid)) != NULL) {
-    	Serial.printf("Found a matching key in keychain.\n");
-      break;
-    }
-  }
-  spgp_keychain_iter_end();
-  
+  key = spgp_keychain_key_with_id(session->keyid);
   if (!key) return -1;
-  
-  
-  for (cur=key->c.pub->mpiHead,i = 0; cur != NULL; cur = cur->next,i++) {
-	  gcry_mpi_scan (&(mpis[i]), GCRYMPI_FMT_PGP, cur->data, cur->count+2, NULL);
-  }
-  gcry_mpi_scan (&(mpis[i++]), GCRYMPI_FMT_PGP, 
-                 session->mpi1->data, session->mpi1->count+2, NULL);
-  if (session->mpi2) {
-  	gcry_mpi_scan (&(mpis[i++]), GCRYMPI_FMT_PGP, 
-                   session->mpi2->data, session->mpi2->count+2, NULL);
-  }
-  mpi_count = i;
+  Serial.printf("Found a matching key in keychain.\n");
 
+	frame = spgp_session_private_op(session, key, &frame_len);
+  err = spgp_session_unwrap(session, frame, frame_len);
+  spgp_secure_free(frame, frame_len);
+  if (err) RAISE(err);
   
-  switch (session->algo) {
-  	case ASYM_ALGO_RSA:
-		  gcry_sexp_build(&sexp_key, NULL,
-				"(private-key(rsa(n%m)(e%m)(d%m)(p%m)(q%m)(u%m)))",
-				mpis[0], mpis[1], mpis[2], mpis[3], mpis[4], mpis[5]);
-		  gcry_sexp_build (&sexp_data, NULL,
-			   "(enc-val(rsa(a%m)))", mpis[6]);
-		  gcry_pk_decrypt (&sexp_result, sexp_data, sexp_key);
-  		mpi_result = gcry_sexp_nth_mpi (sexp_result, 0, GCRYMPI_FMT_STD);
-    	break;
-  	case ASYM_ALGO_ELGAMAL:
-		  gcry_sexp_build(&sexp_key, NULL,
-				"(private-key(elg(p%m)(g%m)(y%m)(x%m)))",
-				mpis[0], mpis[1], mpis[2], mpis[3]);
-		  gcry_sexp_build (&sexp_data, NULL,
-			   "(enc-val(elg(a%m)(b%m)))", mpis[4], mpis[5]);
-		  gcry_pk_decrypt (&sexp_result, sexp_data, sexp_key);
-  		mpi_result = gcry_sexp_nth_mpi (sexp_result, 0, GCRYMPI_FMT_STD);
-    	break;
-    default:
-    	RAISE(FORMAT_UNSUPPORTED);
-  }
-
-	if (!mpi_result) RAISE(GCRY_ERROR);
-
-  gcry_mpi_print(GCRYMPI_FMT_PGP, NULL, 0, &frame_len, mpi_result);
-  frame = malloc(frame_len);
-  if (NULL == frame) RAISE(OUT_OF_MEMORY);
-  gcry_mpi_print(GCRYMPI_FMT_PGP, frame, frame_len, NULL, mpi_result);
+	Serial.printf("Decrypted session key.\n");
+  return 0;
+}
 
-	if (mpi_result) {gcry_mpi_release(mpi_result);}
-  if (sexp_key) {gcry_sexp_release(sexp_key);}
-  if (sexp_data) {gcry_sexp_release(sexp_data);}
-  if (sexp_result) {gcry_sexp_release(sexp_result);}
+/**
+ * Run the private key operation for |session| with keychain key |key|.
+ *
+ * @param session Session packet with its algorithm and MPIs read
+ * @param key Keychain key the session is encrypted to
+ * @param frame_len Set to the length of the result
+ * @return The padded session key in secure memory, for
+ *         spgp_session_unwrap().  Free with spgp_secure_free().
+ */
+uint8_t *spgp_session_private_op(spgp_session_pkt_t *session,
+                                 const spgp_keychain_key_t *key,
+                                 size_t *frame_len) {
+	if (session->algo == ASYM_ALGO_ECDH)
+  	return spgp_ecdh_decrypt(key, session->mpi1, session->mpi2, frame_len);
+  return spgp_crypto_pk_decrypt(session->algo, key, session->mpi1,
+                                session->mpi2, frame_len);
+}
 
-	for (i = 0; i < mpi_count; i++) {
-  	gcry_mpi_release(mpis[i]);
+/**
+ * Take the session key out of a decrypted, padded frame.
+ *
+ * The frame is 2, nonzero padding, 0, the symmetric algorithm, the key and
+ * a two byte checksum of the key (RFC 4880 5.1 and 13.1).  ECDH frames are
+ * the algorithm, key and checksum with PKCS#5 padding after them (RFC 6637
+ * 8).  Version 6 sessions leave out the algorithm, which the encrypted
+ * data packet gives instead (RFC 9580 5.1.3).  Nothing is raised, so
+ * callers can clear the frame first.
+ *
+ * @param session Set to the algorithm and key
+ * @param frame Result of the private key operation, without leading zeros
+ * @param frame_len Length of |frame|
+ * @return 0 for success, or DECRYPT_FAILED or OUT_OF_MEMORY
+ */
+uint32_t spgp_session_unwrap(spgp_session_pkt_t *session,
+                             const uint8_t *frame, size_t frame_len) {
+  uint32_t checksum, sum;
+  size_t i = 0, start, keylen;
+  uint8_t *key, pad;
+
+	if (NULL == frame || frame_len < 1) return DECRYPT_FAILED;
+
+	if (session->algo == ASYM_ALGO_ECDH) {
+  	// The key wrap already checked its integrity, so the padding needn't
+    // be checked in constant time
+  	pad = frame[frame_len - 1];
+    if (frame_len % 8 || pad < 1 || pad > 8) return DECRYPT_FAILED;
+    for (i = frame_len - pad; i < frame_len; i++)
+    	if (frame[i] != pad) return DECRYPT_FAILED;
+    frame_len -= pad;
+    i = 0;
+  }
+  else {
+  	if (frame[i++] != 2) return DECRYPT_FAILED;
+		while (i < frame_len && frame[i++] != 0) ; // Find the next 0 in frame
   }
 
-	i = 2; // skip first two bytes, they're the length of the mpi
-  if (frame[i++] != 2) RAISE(DECRYPT_FAILED);
-
-	while (frame[i++] != 0 && i < frame_len) ; // Find the next 0 in frame
-  
-  // Algorithm is first byte after the 0
-  session->symAlgo = frame[i];
-  
-  // Key length is determined from current index.  Drop 3 bytes: 1 for
-  // algorithm, and 2 for the checksum at the end.
-  session->keylen = frame_len - i - 3;
-	i++;
+	// Algorithm, at least one key byte and the checksum must follow
+  if (i + 4 > frame_len) return DECRYPT_FAILED;
 
-	// Actual session key is the remaining bytes, except for the last two
-	session->key = malloc(session->keylen);
-  if (NULL == session->key) RAISE(OUT_OF_MEMORY);
-  if (i+session->keylen >= frame_len) RAISE(DECRYPT_FAILED);
-	memcpy(session->key, frame+i, session->keylen);
+	// Algorithm is first byte after the 0.  Key length is what is left after
+  // dropping 3 bytes: 1 for the algorithm, and 2 for the checksum.
+  start = i + (session->version != 6);
+  keylen = frame_len - start - 2;
 
 	// Checksum is last two bytes in buffer
 	checksum = frame[frame_len-2]<<8 | frame[frame_len-1];
-  
-  // Verify checksum
   sum = 0;
-  for (i = 0; i < session->keylen; i++) {
-  	sum = sum + (session->key[i] & 0xFF);
-  }
+  for (i = start; i < start + keylen; i++) sum += frame[i];
   if (sum % 65536 != checksum) {
   	Serial.printf("Session key checksum failed!\n");
-  	RAISE(DECRYPT_FAILED);
+  	return DECRYPT_FAILED;
   }
-  
-  free(frame);
-  frame = NULL;
-  
-	Serial.printf("Decrypted session key.\n");
-  return 0;
-}
 
-/**
- * Find a specific secret key in a chain of packets.
- *
- * Finds a secret key in the given chain of packets, |chain|, with a key ID
- * matching |keyid|.  KeyID is the last 8 octets of the 64-octet key
- * fingerprint.
- *
- * @param chain Chain of packets containing at least one secret key
- * @param keyid 8-octet key ID
- * @return Packet containing matching secret key, or NULL if not found
- *
- */
-static spgp_packet_t *spgp_secret_key_matching_id(spgp_packet_t *chain,
-																									uint8_t *keyid) {
-	spgp_packet_t *cur = NULL;
-  
-  if (NULL == chain || NULL == keyid) RAISE(INVALID_ARGS);
-  
-  cur = chain;
-	while ((cur = spgp_next_secret_key_packet(cur)) != NULL) {
-		if (memcmp((void*)((cur->c.pub->fingerprint)+12),keyid,8) == 0)
-    	return cur;
-  	cur = cur->next;
-  }
-  
-  return NULL;
+	key = spgp_secure_alloc(keylen);
+  if (NULL == key) return OUT_OF_MEMORY;
+	memcpy(key, frame + start, keylen);
+  spgp_secure_free(session->key, session->keylen);
+  session->symAlgo = session->version != 6 ? frame[start - 1] : 0;
+  session->key = (char *)key;
+  session->keylen = keylen;
+  return 0;
 }
 
 static uint8_t spgp_read_salt(uint8_t *msg, 
-                              uint32_t *idx,
-                              uint32_t length, 
+                              size_t *idx,
+                              size_t length, 
                               spgp_secret_pkt_t *secret) {
 	uint8_t saltLen = 0;
   
@@ -1814,8 +2640,8 @@ static uint8_t spgp_read_salt(uint8_t *msg,
 }
 
 static uint8_t spgp_read_iv(uint8_t *msg, 
-                            uint32_t *idx,
-                            uint32_t length, 
+                            size_t *idx,
+                            size_t length, 
                             spgp_secret_pkt_t *secret) {
 	uint8_t ivLen = 0;
   
@@ -27,6 +27,7 @@
 
 //#include <stdio.h>
 #include <setjmp.h>
+#include <stddef.h>
 #include <pthread.h>
 
 
@@ -46,6 +47,10 @@
   } while(0)
   
 
+// DSA has the most public key MPIs.  Curve keys count their OID and KDF
+// parameters as MPIs too (see spgp_read_field()).
+#define SPGP_MAX_PUBLIC_MPIS 4
+
 #define SAFE_IDX_INCREMENT(idx,max) \
 	do{ \
 		if (++(idx)>=(max)) {\
@@ -63,13 +68,13 @@
 
 extern pthread_mutex_t spgp_mtx;
 extern uint8_t debug_log_enabled;
-extern uint32_t _spgp_err;
-extern jmp_buf exception;
+extern __thread uint32_t _spgp_err;
+extern __thread jmp_buf exception;
 
 
 struct spgp_packet_header_struct {
 	spgp_packet_t *parent;
-  uint32_t contentLength;
+  size_t contentLength;
   uint8_t rawTagByte;
   uint8_t isNewFormat;
   uint8_t type;
@@ -86,6 +91,7 @@ struct spgp_packet_struct {
     spgp_session_pkt_t   *session;
     spgp_literal_pkt_t   *literal;
     spgp_signature_pkt_t *signature;
+    spgp_onepass_pkt_t   *onepass;
   } c;
 	spgp_packet_t *next;
   spgp_packet_t *prev;
@@ -101,7 +107,7 @@ struct spgp_mpi_struct {
 struct spgp_literal_packet_struct {
 	char *filename;
 	char *data;
-  uint32_t dataLen;
+  size_t dataLen;
   uint32_t filenameLen;
 };
 
@@ -114,6 +120,21 @@ struct spgp_signature_packet_struct {
   uint16_t unhashedSubLength;
   uint16_t hashTest;
   spgp_mpi_t *mpiHead;
+  uint8_t issuer[8];      // key ID, from the issuer subpackets
+  uint8_t hasIssuer;
+  uint8_t status;         // spgp_sig_status_t
+  uint8_t *hashed;        // hashed part of the packet, version to subpackets
+  size_t hashedLen;
+};
+
+struct spgp_onepass_packet_struct {
+	uint8_t version;
+  uint8_t type;
+  uint8_t hashAlgo;
+  uint8_t asymAlgo;
+  uint8_t keyid[8];
+  uint8_t nested;         // 0 if another one-pass packet follows for the data
+  uint8_t isUnsupported;  // version isn't 3, so only |version| was read
 };
 
 
@@ -139,7 +160,9 @@ struct spgp_public_packet_struct {
 	uint8_t asymAlgo;
   spgp_mpi_t *mpiHead;
   uint8_t mpiCount;
-  uint8_t *fingerprint;
+  uint8_t hasFingerprint; // fingerprint is computed on first use
+  uint8_t fingerprint[SPGP_FINGERPRINT_LEN];
+  struct gcry_sexp *verifyKey; // public key for gcrypt, built on first use
 } __attribute__((packed));
 
 struct spgp_secret_packet_struct {
@@ -155,7 +178,7 @@ struct spgp_secret_packet_struct {
   uint8_t s2kSaltLength;
   uint8_t s2kCount;
   uint8_t *encryptedData;
-  uint32_t encryptedDataLength;
+  size_t encryptedDataLength;
   uint8_t *key;
   uint32_t keyLength;
   uint8_t *iv;
@@ -174,12 +197,17 @@ typedef enum {
   GCRY_ERROR,
   KEYCHAIN_ERROR,
   ZLIB_ERROR,
+  IO_ERROR,
+  ARMOR_ERROR,
+  BAD_SIGNATURE,
+  KEY_NOT_FOUND,
 } spgp_error_t;
 
 
 typedef enum {
 	PKT_TYPE_SESSION           = 1,
 	PKT_TYPE_SIGNATURE         = 2,
+  PKT_TYPE_ONE_PASS_SIG      = 4,
 	PKT_TYPE_SECRET_KEY        = 5,
   PKT_TYPE_PUBLIC_KEY        = 6,
 	PKT_TYPE_SECRET_SUBKEY     = 7,
@@ -188,6 +216,7 @@ typedef enum {
   PKT_TYPE_USER_ID           = 13,
   PKT_TYPE_PUBLIC_SUBKEY     = 14,
   PKT_TYPE_SYM_ENC_INT_DATA  = 18,
+  PKT_TYPE_AEAD_DATA         = 20,
 } spgp_pkt_type_t;
 
 typedef enum {
@@ -196,6 +225,8 @@ typedef enum {
   ASYM_ALGO_RSA_SIGN         = 3,
   ASYM_ALGO_ELGAMAL          = 16,
   ASYM_ALGO_DSA              = 17,
+  ASYM_ALGO_ECDH             = 18,
+  ASYM_ALGO_EDDSA            = 22,
 } spgp_asym_algo_t;
 
 typedef enum {
@@ -204,7 +235,7 @@ typedef enum {
   SYM_ALGO_3DES,
   SYM_ALGO_CAST5,
   SYM_ALGO_BLOWFISH,
-  SYM_ALGO_AES128,
+  SYM_ALGO_AES128            = 7,
   SYM_ALGO_AES192,
   SYM_ALGO_AES256,
   SYM_ALGO_TWOFISH,
@@ -214,12 +245,28 @@ typedef enum {
 	HASH_ALGO_MD5              = 1,
   HASH_ALGO_SHA1,
   HASH_ALGO_RIPEMD160,
-  HASH_ALGO_SHA256,
+  HASH_ALGO_SHA256           = 8,
   HASH_ALGO_SHA384,
   HASH_ALGO_SHA512,
   HASH_ALGO_SHA224,
 } spgp_hash_algo_t;
 
+typedef enum {
+	AEAD_ALGO_EAX              = 1,
+  AEAD_ALGO_OCB,
+  AEAD_ALGO_GCM,
+} spgp_aead_algo_t;
+
+typedef enum {
+	SIG_TYPE_BINARY            = 0x00,
+  SIG_TYPE_TEXT              = 0x01,
+} spgp_sig_type_t;
+
+typedef enum {
+	SIG_SUBPKT_ISSUER          = 16,
+  SIG_SUBPKT_ISSUER_FPR      = 33,
+} spgp_sig_subpkt_t;
+
 typedef enum {
 	COMPRESSION_UNCOMPRESSED   = 0,
   COMPRESSION_ZIP,
@@ -235,5 +282,34 @@ typedef enum {
 } spgp_s2k_type_t;
 
 
+/**********************************************************************
+**
+** Decoder internals shared with other modules
+**
+***********************************************************************/
+#pragma mark Shared Decoder Functions
+
+spgp_packet_t* spgp_packet_decode_loop(uint8_t *message,
+                                       size_t *idx,
+                                       size_t length);
+
+uint8_t spgp_parse_header(uint8_t *msg, size_t *idx,
+												size_t length, spgp_packet_t *pkt);
+
+size_t spgp_new_header_length(uint8_t *header,
+                              size_t avail,
+                              uint8_t *header_len,
+                              uint8_t *is_partial);
+
+size_t spgp_skip_packet_body(uint8_t *msg, size_t *idx,
+                             size_t length, spgp_packet_t *pkt);
+
+uint8_t *spgp_key_fingerprint(spgp_packet_t *pkt);
+
+uint8_t spgp_decrypt_session_key(spgp_session_pkt_t *session);
+
+void spgp_fingerprint_keys(spgp_packet_t *msg);
+
+
 #define _PACKET_PRIVATE_H
 #endif
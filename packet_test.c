@@ -21,6 +21,24 @@
  */
 
 #include "packet_test.h"
+#include "keychain.h"
+#include "secmem.h"
+#include "rsa.h"
+#include "bn.h"
+#include "crypto.h"
+#include "ecc.h"
+#include "aead.h"
+#include "agent.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #define ASSERT_SUCCESS(result) do { \
 		if (result) {PRINT_FAIL();goto fail;} \
@@ -36,9 +54,193 @@
 #define PRINT_PASS() Serial.printf("PASS\n");
 #define PRINT_FAIL() Serial.printf("FAIL\n");
 
+// Built without libgcrypt, no signature is checked, and each one is
+// reported unsupported as soon as it is decoded.
+#ifdef HAVE_GCRYPT
+#define TEST_SIG_UNCHECKED SPGP_SIG_UNCHECKED
+#define TEST_SIG_NO_KEY SPGP_SIG_NO_KEY
+#define TEST_ERR_NO_KEY KEY_NOT_FOUND
+#else
+#define TEST_SIG_UNCHECKED SPGP_SIG_UNSUPPORTED
+#define TEST_SIG_NO_KEY SPGP_SIG_UNSUPPORTED
+#define TEST_ERR_NO_KEY FORMAT_UNSUPPORTED
+#endif
+
 static const char* module;
 static const char* function;
 
+// 2048-bit RSA key as keychain MPIs: n, e, d, p, q and u = 1/p mod q
+static const uint8_t test_rsa_keyid[8] = { 0x20, 0x48, 0, 0, 0, 0, 0, 1 };
+static const uint8_t test_rsa_mpis[] = {
+  0x08, 0x00, 0xC2, 0x20, 0x74, 0x23, 0xE4, 0x22, 0xF7, 0x94, 0xC9, 0xED,
+  0x08, 0xD9, 0xE4, 0xF8, 0x23, 0xBB, 0x01, 0x48, 0x25, 0x3E, 0x2D, 0x82,
+  0x99, 0x65, 0x69, 0x23, 0x7B, 0x53, 0x59, 0x98, 0xAF, 0xD3, 0x55, 0xE4,
+  0x38, 0x24, 0xF2, 0xE1, 0x01, 0x98, 0x9E, 0xF1, 0xA5, 0x7F, 0x85, 0x2E,
+  0xAA, 0x94, 0xB4, 0xAE, 0x2C, 0x70, 0x23, 0xAA, 0x69, 0xFB, 0xB1, 0x85,
+  0x2D, 0x3A, 0xBC, 0xCD, 0xA3, 0xF5, 0x88, 0x6D, 0xE0, 0x93, 0x98, 0xD6,
+  0xBD, 0x10, 0x09, 0xA5, 0xEC, 0x77, 0x45, 0xDD, 0x71, 0x6A, 0xFA, 0x0D,
+  0xDE, 0xC9, 0x9C, 0x20, 0x68, 0x9C, 0x5A, 0x85, 0x2C, 0x94, 0x12, 0x30,
+  0xB6, 0x63, 0x8C, 0x7B, 0xCD, 0xE5, 0x27, 0xFE, 0xA2, 0xAC, 0x73, 0xB0,
+  0x4F, 0xAA, 0xFF, 0x9B, 0x6B, 0x09, 0x36, 0x54, 0x30, 0x2B, 0x03, 0xD1,
+  0x21, 0x6F, 0xFE, 0x58, 0x8D, 0x4B, 0x65, 0x53, 0xDE, 0x9E, 0x7D, 0x13,
+  0xD2, 0xE5, 0x21, 0xEC, 0x8C, 0x40, 0x59, 0x27, 0x45, 0x8E, 0x35, 0x47,
+  0x63, 0x48, 0x22, 0x16, 0x64, 0x97, 0x5C, 0xA0, 0xA8, 0x91, 0x46, 0x6B,
+  0x30, 0x4C, 0xD9, 0xF3, 0xE8, 0x90, 0xAB, 0x8A, 0x6B, 0xB3, 0x38, 0xE2,
+  0x75, 0xD2, 0x24, 0xE2, 0xA9, 0x35, 0x12, 0x86, 0xA3, 0x0B, 0xD5, 0x47,
+  0x36, 0x67, 0x03, 0x52, 0x8B, 0x1A, 0xD0, 0x64, 0xEE, 0xEB, 0xC2, 0xAA,
+  0xC3, 0x1B, 0xD7, 0x83, 0xC6, 0x87, 0x71, 0x6F, 0x71, 0x3C, 0xEB, 0x7E,
+  0xF6, 0x76, 0x6F, 0x78, 0x4A, 0xBB, 0xDB, 0xA2, 0xBC, 0x06, 0xF9, 0x7D,
+  0xF8, 0xC3, 0x78, 0xAB, 0x4E, 0xD4, 0xCA, 0x72, 0x8C, 0xFA, 0x22, 0x68,
+  0x1E, 0xD4, 0x41, 0x19, 0xAB, 0xB6, 0xE5, 0x64, 0xA6, 0x96, 0x40, 0x93,
+  0xFC, 0x55, 0xFA, 0xEE, 0x2F, 0x1F, 0x0F, 0x21, 0xF3, 0xE5, 0x82, 0x9D,
+  0x20, 0x97, 0x4C, 0xE3, 0xAB, 0xCD, 0x00, 0x11, 0x01, 0x00, 0x01, 0x07,
+  0xF7, 0x7A, 0x28, 0x99, 0x63, 0x4B, 0x4F, 0x18, 0x38, 0x5C, 0xC5, 0x6F,
+  0x0C, 0x73, 0xD3, 0x77, 0x6D, 0x80, 0x34, 0xAF, 0xFF, 0xEB, 0xAD, 0x6F,
+  0xA8, 0xDC, 0x4A, 0x68, 0xE9, 0x7B, 0xAE, 0x4F, 0xBB, 0x6D, 0x9B, 0x34,
+  0x92, 0x0B, 0xBA, 0xF8, 0x37, 0x66, 0x1C, 0xA0, 0x5C, 0x2D, 0x6E, 0x0D,
+  0xE0, 0x06, 0x0D, 0xF7, 0x1A, 0x10, 0x43, 0xD9, 0x15, 0x04, 0xD6, 0xF5,
+  0xB7, 0xF1, 0xE6, 0x4E, 0x9A, 0x91, 0x58, 0x44, 0xB0, 0x4D, 0xDA, 0xFB,
+  0x14, 0x70, 0x38, 0xEA, 0xAD, 0x72, 0x7F, 0xB0, 0xF8, 0x1B, 0xA7, 0x94,
+  0xF2, 0x04, 0xB4, 0xC2, 0xA9, 0x79, 0xEA, 0x85, 0x27, 0xCF, 0xE8, 0x1C,
+  0x67, 0xE1, 0x21, 0xF3, 0x91, 0x6C, 0xED, 0x41, 0x18, 0x3A, 0x66, 0x02,
+  0x81, 0x1D, 0x9D, 0x20, 0xE0, 0x6B, 0x2D, 0x4A, 0x49, 0xC7, 0x3F, 0x92,
+  0xE3, 0xB0, 0xAF, 0x61, 0x4E, 0x50, 0xAB, 0x53, 0xEF, 0x93, 0x8D, 0x40,
+  0x77, 0xA7, 0x95, 0x61, 0x42, 0xAE, 0x50, 0xA9, 0x70, 0x30, 0xA5, 0xCC,
+  0x78, 0xCE, 0xBD, 0xB3, 0x15, 0xAF, 0x1B, 0x47, 0x45, 0xD3, 0x63, 0x49,
+  0x7E, 0x71, 0xB1, 0x13, 0xBE, 0xA7, 0x85, 0xAE, 0xD2, 0x8A, 0xD6, 0x8F,
+  0xF4, 0x70, 0xD6, 0x7C, 0x46, 0x5E, 0x58, 0x94, 0xFF, 0x1E, 0x50, 0x26,
+  0xA8, 0xB5, 0xBD, 0x8C, 0xE0, 0xD8, 0x72, 0x40, 0x5E, 0x7B, 0xC5, 0x0D,
+  0x2D, 0x4A, 0x2B, 0xA7, 0xED, 0x94, 0xC6, 0x60, 0x4D, 0x82, 0xFE, 0xBD,
+  0xAE, 0xAA, 0xC3, 0xD0, 0x9C, 0xC6, 0xC4, 0xC8, 0x48, 0x6D, 0xE0, 0xA9,
+  0xF2, 0xCF, 0x06, 0xD0, 0xAB, 0x16, 0x0F, 0x5C, 0xE6, 0xFC, 0xE1, 0x8F,
+  0xCD, 0x45, 0x9F, 0xDE, 0x6C, 0xCC, 0x42, 0x25, 0x1B, 0xDA, 0x7F, 0xA6,
+  0x3F, 0x09, 0xC2, 0x9F, 0x4B, 0xA7, 0x75, 0xCA, 0x0C, 0xC9, 0x27, 0x36,
+  0xF6, 0x53, 0x86, 0xD1, 0x04, 0x00, 0xCF, 0x05, 0xC9, 0x63, 0x31, 0xF1,
+  0x86, 0xBD, 0x75, 0xB6, 0xE1, 0xB6, 0x83, 0x0D, 0x5D, 0x70, 0xD8, 0x1D,
+  0x39, 0x00, 0x5E, 0x08, 0xA4, 0x6B, 0xCA, 0xA3, 0x4C, 0x60, 0xAD, 0x15,
+  0xCB, 0xFA, 0xB5, 0xAF, 0xDE, 0x1C, 0xF1, 0x5B, 0x2C, 0x65, 0x7A, 0xE2,
+  0x20, 0x6A, 0x78, 0xB3, 0x3A, 0x23, 0x43, 0xB9, 0x10, 0x14, 0xDD, 0xBD,
+  0x45, 0x40, 0x80, 0x31, 0xD6, 0xEF, 0x6B, 0xCB, 0xEC, 0x4E, 0x8D, 0x8C,
+  0xB0, 0x11, 0x89, 0x2F, 0xFA, 0x7C, 0x78, 0x72, 0xCA, 0x0C, 0xCF, 0x98,
+  0xF2, 0xD3, 0xD7, 0x56, 0x7F, 0xF9, 0xDE, 0x22, 0xF5, 0x40, 0x07, 0x57,
+  0x93, 0x67, 0x6F, 0x34, 0x1D, 0x09, 0x4F, 0x94, 0x57, 0x0B, 0x54, 0xE3,
+  0x13, 0x4D, 0xD0, 0x27, 0x8F, 0xD6, 0x40, 0xD9, 0x85, 0x87, 0x16, 0x11,
+  0xB1, 0x5D, 0x9C, 0xDB, 0x53, 0x38, 0x0C, 0x65, 0x8A, 0xE5, 0xD4, 0x4E,
+  0x8A, 0x71, 0x04, 0x00, 0xF0, 0x0D, 0xA3, 0x48, 0xF0, 0x6B, 0x4E, 0x00,
+  0xB2, 0xCA, 0x35, 0xF7, 0x87, 0xCB, 0x98, 0xEB, 0x42, 0x4C, 0xF4, 0x3F,
+  0x71, 0x31, 0xEA, 0x0E, 0x85, 0x36, 0x8D, 0x3A, 0x8F, 0x86, 0x86, 0x1E,
+  0x49, 0x68, 0x74, 0xE5, 0xA6, 0xF4, 0xCC, 0xC3, 0x7A, 0xCF, 0x9A, 0x5E,
+  0x19, 0xD5, 0x13, 0xD5, 0xE2, 0x33, 0x1C, 0x8E, 0x34, 0x3A, 0x6E, 0xC4,
+  0x62, 0x53, 0x45, 0xA1, 0x43, 0xAC, 0x15, 0xAF, 0xED, 0xC3, 0x96, 0xC7,
+  0x10, 0x6A, 0xCD, 0xF0, 0x16, 0x48, 0x8E, 0x3A, 0x57, 0x7F, 0xB8, 0x3E,
+  0x1C, 0x91, 0x63, 0xC9, 0xE7, 0xD9, 0xFE, 0xAF, 0xB4, 0xD7, 0xC4, 0x97,
+  0x49, 0xE3, 0xC9, 0x34, 0x71, 0xFD, 0xB8, 0xB4, 0x02, 0x4D, 0x89, 0x34,
+  0x68, 0x67, 0xFE, 0x7B, 0x8C, 0x1A, 0x3B, 0xED, 0x6E, 0x4F, 0x2C, 0x0A,
+  0xA8, 0x0D, 0x63, 0x25, 0x03, 0xD8, 0x4C, 0x61, 0x4E, 0xFA, 0x4D, 0x1D,
+  0x03, 0xFF, 0x67, 0x87, 0xC6, 0xAB, 0xDB, 0x62, 0x62, 0x6C, 0x3F, 0x4F,
+  0x5C, 0x7C, 0x67, 0x19, 0xF4, 0x88, 0x04, 0x17, 0x2A, 0x79, 0x67, 0x1B,
+  0xE4, 0x1F, 0xD4, 0xBB, 0x4A, 0x76, 0x98, 0x0F, 0xE7, 0xFC, 0x7F, 0xA5,
+  0xA7, 0xED, 0x78, 0x3B, 0x6E, 0x60, 0x74, 0xBE, 0xF6, 0xA0, 0x17, 0x73,
+  0xF8, 0x26, 0x13, 0x08, 0xE7, 0x8F, 0xC1, 0x04, 0x79, 0xEE, 0xDC, 0x7B,
+  0xA3, 0x96, 0x45, 0x0A, 0x2D, 0xD1, 0x03, 0x73, 0x73, 0x0C, 0xE6, 0x65,
+  0x5F, 0x52, 0x56, 0xCC, 0x98, 0x06, 0xA3, 0x65, 0x32, 0x82, 0xC2, 0xCF,
+  0x94, 0x28, 0xA9, 0x7E, 0x48, 0x95, 0xF4, 0x47, 0xB8, 0x5B, 0x03, 0x2B,
+  0xDE, 0x65, 0xD7, 0x17, 0xE6, 0xE0, 0x89, 0xAD, 0x13, 0xDF, 0xF5, 0x8B,
+  0xDE, 0x60, 0x9D, 0xF5, 0x5F, 0x7F, 0x2D, 0xEE, 0xCE, 0xB8, 0xA6, 0x2D,
+  0xEC, 0x67, 0x91, 0x93, 0xA7, 0x40, 0x49, 0x06, 0x3B, 0x6F };
+
+// MPI of an RSA session packet to that key, for AES-128 key 00 01 .. 0F
+static const uint8_t test_rsa_session[] = {
+  0x07, 0xFE, 0x24, 0x73, 0xB6, 0xB0, 0x6A, 0xF0, 0x29, 0xDA, 0xA5, 0xC7,
+  0xA9, 0x94, 0x23, 0x3C, 0x2E, 0xFE, 0xC8, 0x98, 0xCB, 0x2F, 0xB6, 0xB5,
+  0x8A, 0x87, 0xAE, 0x3F, 0xB4, 0x96, 0x64, 0xCA, 0x76, 0xF6, 0x19, 0x79,
+  0x33, 0x5A, 0xAD, 0x77, 0x25, 0x7F, 0x29, 0x92, 0xAD, 0x25, 0xE3, 0x85,
+  0x96, 0x07, 0x8D, 0x4C, 0xCD, 0xE9, 0x9A, 0xF1, 0x4A, 0x03, 0xC2, 0x87,
+  0xB2, 0xF5, 0x70, 0x3F, 0xD5, 0xEF, 0x28, 0xA8, 0xB3, 0xF6, 0x74, 0xB9,
+  0x0C, 0x1E, 0xBE, 0xC5, 0x8B, 0x92, 0xB6, 0xAF, 0xB1, 0x03, 0x40, 0x64,
+  0xB7, 0xE1, 0x43, 0xE4, 0x53, 0xBA, 0x39, 0xAA, 0xA1, 0xFA, 0xE4, 0xC1,
+  0x8E, 0xAF, 0x02, 0xD1, 0x5F, 0x88, 0x4D, 0x91, 0x27, 0x09, 0x72, 0x83,
+  0x9C, 0x7D, 0x51, 0x29, 0x20, 0xF7, 0xE1, 0xEE, 0x36, 0x91, 0x1C, 0xEF,
+  0x2E, 0xE8, 0x7B, 0xA1, 0x17, 0x44, 0x6E, 0xDB, 0x1D, 0x19, 0xB4, 0x99,
+  0xA3, 0x56, 0xD2, 0x17, 0xFE, 0xF9, 0x6F, 0x8C, 0xD3, 0x27, 0xC3, 0x1A,
+  0xFE, 0x69, 0x4B, 0x92, 0x71, 0x2E, 0x7C, 0x49, 0x95, 0x41, 0xC5, 0x36,
+  0x25, 0xD7, 0xAD, 0xC3, 0x1B, 0x75, 0x5D, 0x96, 0x1B, 0xCC, 0x0A, 0x5A,
+  0xC5, 0x0E, 0x2B, 0x2F, 0xE8, 0x79, 0x3C, 0xAF, 0x0E, 0xC7, 0xD8, 0x54,
+  0xE8, 0xBB, 0x04, 0x9C, 0x8D, 0xBB, 0x6A, 0xA2, 0x54, 0x49, 0xE9, 0x6E,
+  0x20, 0x48, 0xB1, 0xE5, 0xEA, 0x2F, 0xB4, 0xD7, 0x0D, 0x2D, 0x01, 0xB6,
+  0xD0, 0x28, 0x60, 0x51, 0xCF, 0xF3, 0x64, 0xE3, 0x8B, 0xC7, 0x63, 0xAD,
+  0x6C, 0x04, 0xED, 0xC5, 0x09, 0x7A, 0xE0, 0xAC, 0x87, 0x38, 0x0C, 0xEB,
+  0x69, 0x3B, 0x59, 0x48, 0x71, 0x0F, 0x80, 0xFD, 0x87, 0x52, 0x3F, 0x8B,
+  0x3C, 0x62, 0x19, 0x89, 0x5D, 0xCA, 0x9B, 0x9C, 0x80, 0xB3, 0x5B, 0xD8,
+  0x14, 0xB4, 0x58, 0x3B, 0xF0, 0xFA };
+
+// Body of a SEIPD packet under that session key.  It holds a literal packet
+// of 700 bytes of data, itself split 512 / 195 by partial lengths.
+static const uint8_t test_seipd_body[] = {
+  0x01, 0x7D, 0x81, 0x8C, 0xFA, 0x4F, 0x41, 0xDF, 0xC1, 0x00, 0x5C, 0xE0,
+  0x01, 0x97, 0xFF, 0x98, 0xD0, 0xB9, 0xA2, 0x6F, 0x0B, 0xE0, 0x2F, 0xE2,
+  0x2B, 0xFD, 0x7D, 0x38, 0xEA, 0x56, 0xBA, 0xF5, 0x3F, 0xA6, 0x5B, 0x8B,
+  0x1C, 0xD5, 0xA6, 0x80, 0x7A, 0x11, 0xF4, 0x94, 0x4D, 0xFC, 0xAA, 0xBE,
+  0x6F, 0x21, 0xCE, 0x1D, 0x36, 0x62, 0x02, 0x90, 0xD8, 0xEB, 0xD8, 0x97,
+  0xBC, 0x77, 0x9B, 0xD8, 0x76, 0x93, 0xE1, 0x19, 0xBD, 0x3F, 0xBD, 0x4D,
+  0x54, 0x54, 0x1C, 0x00, 0xBD, 0xAD, 0xA2, 0xF3, 0x2B, 0xF7, 0x65, 0xFA,
+  0x63, 0xE1, 0xE7, 0x94, 0x13, 0x5B, 0xD5, 0xBF, 0x7F, 0x37, 0x33, 0x9B,
+  0xEE, 0xD5, 0x35, 0x4A, 0xD0, 0x43, 0x05, 0x0B, 0x62, 0xB2, 0x80, 0x9D,
+  0x24, 0x45, 0x60, 0xF1, 0xF7, 0x38, 0xDE, 0x28, 0x47, 0xC8, 0xCD, 0x6B,
+  0x20, 0x09, 0x77, 0x26, 0xD1, 0x98, 0xBF, 0x10, 0xB9, 0x14, 0xA5, 0x7C,
+  0x8A, 0x50, 0x49, 0x0A, 0x4D, 0xDA, 0xF4, 0xA2, 0x20, 0x35, 0xD2, 0x79,
+  0x96, 0x72, 0xA2, 0x19, 0x00, 0x52, 0xD2, 0x66, 0xEF, 0x5E, 0xD3, 0xD4,
+  0x26, 0x0C, 0xA3, 0x87, 0x92, 0xAF, 0x67, 0x10, 0x41, 0xD4, 0xF6, 0x1F,
+  0xAE, 0x46, 0x64, 0xEE, 0x5B, 0x2D, 0x12, 0x59, 0x2C, 0xCA, 0x5E, 0xA4,
+  0xFC, 0x8F, 0x63, 0x40, 0x8E, 0x50, 0xAC, 0x03, 0x71, 0xB6, 0xAC, 0xBD,
+  0xC0, 0x01, 0xFF, 0xB4, 0x81, 0x43, 0x4E, 0x47, 0xAC, 0x6D, 0xCE, 0xE0,
+  0xD6, 0x8D, 0x2F, 0x70, 0x99, 0x14, 0x0E, 0x9E, 0xDB, 0x24, 0xA3, 0xED,
+  0xC8, 0x58, 0xFB, 0x66, 0xE3, 0xC5, 0xA8, 0xF5, 0x10, 0x72, 0x36, 0xB5,
+  0xFF, 0xD2, 0x63, 0x5C, 0x52, 0x3C, 0xB2, 0xFB, 0x93, 0xC1, 0x75, 0xBC,
+  0x54, 0x3D, 0x90, 0x5D, 0x52, 0xFE, 0x6E, 0xF8, 0x47, 0x64, 0xCF, 0x53,
+  0x4A, 0xF9, 0xFE, 0x22, 0x97, 0x5A, 0xCE, 0x0A, 0x56, 0xFE, 0x37, 0x1A,
+  0x5C, 0xB6, 0xD0, 0x11, 0x1A, 0x65, 0x60, 0x52, 0x10, 0x8A, 0x3D, 0x83,
+  0xA2, 0x53, 0xAE, 0xC1, 0x6F, 0xCA, 0xDC, 0x7F, 0x02, 0xE6, 0x4A, 0x87,
+  0xE7, 0xD2, 0x6C, 0xAA, 0x16, 0x8B, 0x39, 0xCC, 0x32, 0x7B, 0x79, 0xE5,
+  0x64, 0x9F, 0xEF, 0x7A, 0x9E, 0x40, 0xF7, 0x5D, 0xB7, 0x7F, 0xF6, 0xCE,
+  0xEE, 0x6B, 0xE6, 0x41, 0xD4, 0xBF, 0xBC, 0x91, 0x36, 0x1E, 0x94, 0x19,
+  0xFA, 0xC1, 0x47, 0xBC, 0xE9, 0xE6, 0x21, 0xBF, 0x52, 0x9F, 0x99, 0x71,
+  0x46, 0xEA, 0x73, 0xF4, 0xE6, 0x42, 0x3F, 0x48, 0xC5, 0xC8, 0xC8, 0xCB,
+  0x8A, 0x3E, 0xFA, 0x02, 0xA2, 0x9E, 0x2E, 0x98, 0xA4, 0xEA, 0x7A, 0x51,
+  0xE8, 0xCA, 0x9A, 0x14, 0x12, 0xFA, 0xCB, 0x39, 0x33, 0x65, 0x08, 0x00,
+  0x29, 0x3E, 0xB2, 0xC3, 0xBD, 0x7E, 0x03, 0x1F, 0x20, 0x32, 0x55, 0xBD,
+  0x5D, 0xF3, 0xB6, 0xC4, 0x3E, 0xF7, 0x71, 0x81, 0x5B, 0xCD, 0x1F, 0x50,
+  0x81, 0x0A, 0x29, 0xB9, 0x35, 0xAA, 0xF0, 0x4C, 0x98, 0x4D, 0xFD, 0x4F,
+  0x58, 0x48, 0x58, 0x02, 0x91, 0x83, 0x4A, 0x72, 0xA2, 0x4E, 0x99, 0x87,
+  0x4E, 0xC1, 0x53, 0xEF, 0x13, 0x3B, 0x9F, 0x4A, 0xEB, 0xBC, 0x0A, 0x61,
+  0x01, 0xC2, 0x18, 0xD0, 0x3E, 0x09, 0xBB, 0x63, 0x10, 0xAB, 0x16, 0x59,
+  0x87, 0x57, 0x5E, 0x07, 0x88, 0xCC, 0xAD, 0xAD, 0xA5, 0xAF, 0x40, 0x0C,
+  0x61, 0x44, 0x98, 0x51, 0x7D, 0xB3, 0xB4, 0x5A, 0xE9, 0x17, 0x69, 0xA8,
+  0x96, 0xB5, 0x33, 0x2C, 0xB3, 0x4E, 0x5F, 0x62, 0xD5, 0xA3, 0x60, 0x1A,
+  0xCE, 0x29, 0x65, 0x8C, 0x5F, 0xA4, 0xBE, 0x66, 0x42, 0x5C, 0x05, 0xBD,
+  0xF1, 0xCE, 0xF2, 0x69, 0x72, 0x00, 0x4D, 0xBA, 0x54, 0x79, 0x45, 0x26,
+  0x3A, 0x15, 0x8E, 0x69, 0x4F, 0x68, 0xD8, 0x01, 0x64, 0x5A, 0x93, 0x6A,
+  0x6D, 0xC2, 0xA0, 0xD3, 0x61, 0x52, 0xA0, 0x18, 0x1D, 0x08, 0x95, 0x76,
+  0xAA, 0xC6, 0x30, 0xB9, 0x2C, 0x57, 0x95, 0x4A, 0x6D, 0x43, 0x24, 0xC2,
+  0xDE, 0x7B, 0xE3, 0x66, 0x5C, 0xD5, 0x31, 0x5F, 0x37, 0x3F, 0xB5, 0x75,
+  0x8C, 0x0D, 0x30, 0x81, 0x29, 0x45, 0xF2, 0x2B, 0x69, 0x30, 0xA7, 0x88,
+  0xE4, 0xD8, 0x79, 0xC6, 0x77, 0x38, 0xDC, 0x04, 0xAB, 0x59, 0x86, 0x12,
+  0x5B, 0x6D, 0x18, 0xC5, 0x1B, 0x45, 0xF2, 0x16, 0x83, 0x8C, 0x87, 0x50,
+  0xC6, 0xD7, 0x71, 0x85, 0x76, 0x0A, 0x01, 0x33, 0x6E, 0xF8, 0x67, 0xF3,
+  0xBF, 0x81, 0x39, 0x36, 0x5C, 0xBE, 0x1F, 0x28, 0x4B, 0x2C, 0xE2, 0x65,
+  0x6C, 0x8E, 0x44, 0x3A, 0xB2, 0xE0, 0xF8, 0x70, 0x29, 0x00, 0xE6, 0x4B,
+  0xD6, 0x2F, 0x9A, 0xD1, 0x96, 0x5F, 0xED, 0x25, 0x22, 0x8A, 0x07, 0xE3,
+  0x26, 0x69, 0xE0, 0xAC, 0xEA, 0x39, 0x4B, 0xC8, 0x30, 0x0E, 0x01, 0x9C,
+  0x49, 0x84, 0xB9, 0x59, 0x81, 0x74, 0x11, 0xF9, 0xBE, 0x87, 0x6F, 0x3A,
+  0x53, 0xBE, 0x87, 0x14, 0x23, 0xD9, 0x69, 0x4E, 0x82, 0xC2, 0xA0, 0x86,
+  0x9E, 0xB7, 0x25, 0x8C, 0x73, 0xE4, 0xEE, 0xF5, 0x4A, 0x5A, 0x89, 0x9F,
+  0xF4, 0x0C, 0x85, 0xC8, 0xCD, 0xCB, 0x1C, 0x6C, 0x0F, 0x9F, 0xD9, 0x47,
+  0xAC, 0xAF, 0x26, 0xF1, 0x03, 0x81, 0x6E, 0x46, 0xA5, 0x1D, 0x67, 0xCC,
+  0x55, 0x6A, 0x7D, 0x65, 0x67, 0xC2, 0x11, 0xD6, 0xA5, 0x56, 0x49, 0x5D,
+  0x85, 0xB2, 0xED, 0xC5, 0xA1, 0x60, 0xB9, 0x5C, 0xE2, 0x6E, 0x17, 0x63,
+  0x54, 0x5D, 0x15, 0x1D, 0x26, 0xD7, 0x0D, 0xDB, 0xC3, 0x53, 0xD0, 0x5F,
+  0x0B, 0x98, 0xE8, 0xB8, 0x81, 0x8C, 0x77, 0x83 };
+
 static uint8_t test_spgp_decode_message(void) {
 	uint8_t buf[1024];
 	function = __FUNCTION__;
@@ -57,6 +259,1475 @@ static uint8_t test_spgp_decode_message(void) {
   return 1;
 }
 
+static uint8_t test_spgp_decode_file(void) {
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL PATH");
+	spgp_decode_file(NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("MISSING FILE");
+	spgp_decode_file("/nonexistent/simplepgp/message.pgp");
+  ASSERT_EQUAL(spgp_err(), IO_ERROR);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_large_message(void) {
+	char path[] = "/tmp/spgp_large_XXXXXX";
+  uint8_t tag = 0xCA;          // new format marker packet
+  uint8_t partial = 0xE0 | 30; // 1 GB partial body length
+  uint8_t tail[] = { 0x00, 0xCD, 0x04, 't', 'e', 's', 't' };
+  spgp_packet_t *msg = NULL;
+  off_t pos;
+  int fd, i;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  // Offsets past 4 GB only fit in a 64-bit size_t
+  if (sizeof(size_t) < 8) return 0;
+
+  PRINT_TEST("8 GB PARTIAL BODY");
+  // Sparse file: only the length headers are written, and the decoder
+  // should only ever touch those pages while skipping the body.
+  fd = mkstemp(path);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  pos = 1;
+  i = (pwrite(fd, &tag, 1, 0) == 1) ? 0 : 8;
+  for (; i < 8; i++) {
+  	if (pwrite(fd, &partial, 1, pos) != 1) break;
+    pos += 1 + (1 << 30);
+  }
+  if (pos != 1 + 8 * (off_t)(1 + (1 << 30)) ||
+      pwrite(fd, tail, sizeof(tail), pos) != sizeof(tail)) {
+  	close(fd);
+    unlink(path);
+    PRINT_FAIL();
+    goto fail;
+  }
+  close(fd);
+  msg = spgp_decode_file(path);
+  unlink(path);
+  ASSERT_EQUAL((msg != NULL), 1);
+
+  PRINT_TEST("PACKET AFTER 8 GB");
+  ASSERT_EQUAL((msg->next != NULL &&
+                msg->next->header->type == PKT_TYPE_USER_ID &&
+                strcmp((char *)msg->next->c.userid->data, "test") == 0), 1);
+
+  spgp_free_packet(&msg);
+  return 0;
+  fail:
+  spgp_free_packet(&msg);
+  return 1;
+}
+
+static uint8_t test_spgp_dearmor(void) {
+	char armored[] = "Leading text\n"
+                   "-----BEGIN PGP MESSAGE-----\n"
+                   "Version: test\n"
+                   "\n"
+                   "zQV0ZX\r\nN0cw==\r\n"
+                   "=s2ud\n"
+                   "-----END PGP MESSAGE-----\n";
+  uint8_t *bin = NULL;
+  size_t binlen = 0;
+  spgp_packet_t *msg = NULL;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL ARMOR");
+	spgp_dearmor(NULL, 100, &bin, &binlen);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NO ARMOR LINE");
+	spgp_dearmor((uint8_t *)"hello", 5, &bin, &binlen);
+  ASSERT_EQUAL(spgp_err(), FORMAT_UNSUPPORTED);
+
+  PRINT_TEST("SPLIT QUAD AND PADDING");
+  ASSERT_SUCCESS(spgp_dearmor((uint8_t *)armored, strlen(armored),
+                              &bin, &binlen));
+
+  PRINT_TEST("DECODED BYTES");
+  ASSERT_EQUAL((binlen == 7 && memcmp(bin, "\xCD\x05tests", 7) == 0), 1);
+  free(bin);
+  bin = NULL;
+
+  PRINT_TEST("ARMORED MESSAGE");
+  msg = spgp_decode_message((uint8_t *)armored, strlen(armored));
+  ASSERT_EQUAL((msg != NULL && msg->header->type == PKT_TYPE_USER_ID), 1);
+  spgp_free_packet(&msg);
+
+  PRINT_TEST("BAD CHECKSUM");
+  armored[strlen(armored) - 31] = 'X';
+	spgp_dearmor((uint8_t *)armored, strlen(armored), &bin, &binlen);
+  ASSERT_EQUAL(spgp_err(), ARMOR_ERROR);
+
+  return 0;
+  fail:
+  free(bin);
+  spgp_free_packet(&msg);
+  return 1;
+}
+
+static uint8_t test_spgp_sink(void) {
+	// Literal packet, "hello" in file "f", split into two partial chunks
+	uint8_t msg[] = { 0xCB, 0xE3, 'b', 1, 'f', 0, 0, 0, 0, 'h',
+                    0x04, 'e', 'l', 'l', 'o' };
+  uint8_t out[8];
+  spgp_sink_t *sink = NULL;
+  spgp_packet_t *pkt = NULL;
+  char *data, *filename;
+  size_t datalen;
+  uint32_t filenamelen;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL CALLBACK");
+	spgp_sink_open_callback(NULL, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("BAD DESCRIPTOR");
+	spgp_sink_open_fd(-1);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("PARTIAL LITERAL TO MEMORY");
+  pkt = spgp_decode_message(msg, sizeof(msg));
+  data = spgp_get_literal_data(pkt, &datalen, &filename, &filenamelen);
+  ASSERT_EQUAL((data != NULL && datalen == 5 &&
+                memcmp(data, "hello", 5) == 0), 1);
+  spgp_free_packet(&pkt);
+
+  PRINT_TEST("PARTIAL LITERAL TO SINK");
+  sink = spgp_sink_open_buffer(out, sizeof(out));
+  pkt = spgp_decode_message_to_sink(msg, sizeof(msg), sink);
+  data = spgp_get_literal_data(pkt, &datalen, &filename, &filenamelen);
+  ASSERT_EQUAL((data == NULL && datalen == 5 && filename[0] == 'f' &&
+                spgp_sink_length(sink) == 5 &&
+                memcmp(out, "hello", 5) == 0), 1);
+  spgp_free_packet(&pkt);
+  spgp_sink_close(&sink);
+
+  PRINT_TEST("SINK TOO SMALL");
+  sink = spgp_sink_open_buffer(out, 2);
+  spgp_decode_message_to_sink(msg, sizeof(msg), sink);
+  ASSERT_EQUAL(spgp_err(), BUFFER_OVERFLOW);
+  spgp_sink_close(&sink);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  spgp_sink_close(&sink);
+  return 1;
+}
+
+static spgp_visit_t test_count_visit(spgp_packet_t *pkt, void *ctx) {
+	spgp_visit_t *action = ctx;
+  (void)pkt;
+  action[1]++;
+  return action[0];
+}
+
+static uint8_t test_spgp_decode_opts(void) {
+	// User ID "a", marker packet, user ID "b"
+	uint8_t msg[] = { 0xCD, 1, 'a', 0xCA, 3, 'P', 'G', 'P', 0xCD, 1, 'b' };
+  spgp_decode_opts_t opts;
+  spgp_packet_t *pkt = NULL;
+  spgp_visit_t visit[2]; // action to return, visit count
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  memset(&opts, 0, sizeof(opts));
+  opts.wanted = SPGP_PACKET_MASK(PKT_TYPE_USER_ID);
+  opts.visit[PKT_TYPE_USER_ID] = test_count_visit;
+  opts.ctx = visit;
+
+  PRINT_TEST("FILTER");
+  visit[0] = SPGP_VISIT_KEEP;
+  visit[1] = 0;
+  pkt = spgp_decode_message_with_opts(msg, sizeof(msg), &opts);
+  ASSERT_EQUAL((pkt != NULL && visit[1] == 2 &&
+                spgp_packet_type(pkt) == PKT_TYPE_USER_ID &&
+                pkt->next != NULL && pkt->next->next == NULL &&
+                spgp_packet_type(pkt->next) == PKT_TYPE_USER_ID), 1);
+  spgp_free_packet(&pkt);
+
+  PRINT_TEST("VISITOR DROP");
+  visit[0] = SPGP_VISIT_DROP;
+  visit[1] = 0;
+  pkt = spgp_decode_message_with_opts(msg, sizeof(msg), &opts);
+  ASSERT_EQUAL((pkt == NULL && visit[1] == 2), 1);
+
+  PRINT_TEST("VISITOR STOP");
+  visit[0] = SPGP_VISIT_STOP;
+  visit[1] = 0;
+  pkt = spgp_decode_message_with_opts(msg, sizeof(msg), &opts);
+  ASSERT_EQUAL((pkt != NULL && pkt->next == NULL && visit[1] == 1), 1);
+  spgp_free_packet(&pkt);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  return 1;
+}
+
+static int test_collect_span(const spgp_span_t *span, void *ctx) {
+	spgp_span_t *spans = ctx;
+  spans[spans[0].offset++ + 1] = *span; // spans[0].offset counts
+  return span->type == PKT_TYPE_LITERAL_DATA;
+}
+
+static uint8_t test_spgp_scan(void) {
+	// New-format user ID, old-format marker, partial literal data, user ID
+	uint8_t msg[] = { 0xCD, 1, 'a', 0xA8, 3, 'P', 'G', 'P',
+                    0xCB, 0xE1, 'b', 't', 0x01, 'x', 0xCD, 1, 'c' };
+  spgp_span_t spans[5];
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL CALLBACK");
+	spgp_scan(msg, sizeof(msg), NULL, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("BOUNDARIES");
+  memset(spans, 0, sizeof(spans));
+  ASSERT_EQUAL(spgp_scan(msg, sizeof(msg), test_collect_span, spans), 0);
+  ASSERT_EQUAL((spans[0].offset == 3 &&
+                spans[1].type == PKT_TYPE_USER_ID && spans[1].length == 3 &&
+                spans[2].type == 10 && spans[2].offset == 3 &&
+                spans[2].bodyOffset == 5 && spans[2].length == 5 &&
+                spans[3].isPartial && spans[3].offset == 8 &&
+                spans[3].bodyLength == 3 && spans[3].length == 6), 1);
+
+  PRINT_TEST("NOT A TAG BYTE");
+	spgp_scan(msg + 1, sizeof(msg) - 1, test_collect_span, spans);
+  ASSERT_EQUAL(spgp_err(), INVALID_HEADER);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_import_keyring(void) {
+	// Four toy RSA public keys (n = 0xFF, e = 3), each with one user ID
+	uint8_t key[] = { 0xC6, 12, 4, 0, 0, 0, 0, 1, 0, 8, 0xFF, 0, 2, 3,
+                    0xCD, 1, 'a' };
+  uint8_t keyring[4 * sizeof(key)];
+  spgp_packet_t *pkt = NULL;
+  spgp_packet_t *cur;
+  int i, count;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  for (i = 0; i < 4; i++) {
+  	key[sizeof(key)-1] = 'a' + i;
+  	memcpy(keyring + i * sizeof(key), key, sizeof(key));
+  }
+
+  PRINT_TEST("NULL KEYRING");
+	spgp_import_keyring(NULL, sizeof(keyring), 2);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("KEYRING ORDER");
+  pkt = spgp_import_keyring(keyring, sizeof(keyring), 3);
+  for (cur = pkt, count = 0; cur != NULL; cur = cur->next, count++) {
+  	if (spgp_packet_type(cur) != (count % 2 ? PKT_TYPE_USER_ID :
+                                  PKT_TYPE_PUBLIC_KEY)) break;
+    if (count % 2 && cur->c.userid->data[0] != 'a' + count / 2) break;
+    if (cur->next && cur->next->prev != cur) break;
+  }
+  ASSERT_EQUAL(count, 8);
+  spgp_free_packet(&pkt);
+
+  PRINT_TEST("BAD KEY");
+  keyring[2 * sizeof(key) + 2] = 3; // version 3 key in the third run
+  pkt = spgp_import_keyring(keyring, sizeof(keyring), 2);
+  ASSERT_EQUAL((pkt == NULL && spgp_err() == FORMAT_UNSUPPORTED), 1);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  return 1;
+}
+
+static uint8_t test_spgp_fingerprint(void) {
+	// Toy RSA public key (n = 0xFF, e = 3) and a user ID
+	uint8_t key[] = { 0xC6, 12, 4, 0, 0, 0, 0, 1, 0, 8, 0xFF, 0, 2, 3,
+                    0xCD, 1, 'a' };
+  uint8_t expected[SPGP_FINGERPRINT_LEN] = {
+  	0xF2, 0x3A, 0x4A, 0x10, 0x5E, 0x40, 0x47, 0xD5, 0xB0, 0x08,
+    0x91, 0xAB, 0x49, 0x4D, 0x02, 0xD6, 0x77, 0xBF, 0xAC, 0x40 };
+  spgp_packet_t *pkt = NULL;
+  const uint8_t *fpr;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL PACKET");
+	spgp_fingerprint(NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  pkt = spgp_decode_message(key, sizeof(key));
+  ASSERT_EQUAL((pkt != NULL && !pkt->c.pub->hasFingerprint), 1);
+
+  PRINT_TEST("NOT A KEY");
+	spgp_fingerprint(pkt->next);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("LAZY FINGERPRINT");
+  fpr = spgp_fingerprint(pkt);
+  ASSERT_EQUAL((fpr != NULL &&
+                memcmp(fpr, expected, SPGP_FINGERPRINT_LEN) == 0), 1);
+
+  PRINT_TEST("ALL FINGERPRINTS");
+  pkt->c.pub->hasFingerprint = 0;
+  memset(pkt->c.pub->fingerprint, 0, SPGP_FINGERPRINT_LEN);
+  ASSERT_EQUAL(spgp_fingerprint_all(pkt), 0);
+  ASSERT_EQUAL((pkt->c.pub->hasFingerprint && memcmp(pkt->c.pub->fingerprint,
+                 expected, SPGP_FINGERPRINT_LEN) == 0), 1);
+  spgp_free_packet(&pkt);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  return 1;
+}
+
+static uint8_t test_spgp_verify(void) {
+	// V4 binary RSA/SHA-256 signature, issuer 0102030405060708 in the hashed
+  // subpackets, no unhashed subpackets, and a dummy 8-bit MPI.
+	uint8_t msg[] = { 0xC2, 23, 4, 0x00, 1, 8, 0, 10, 9, 16, 1, 2, 3, 4, 5, 6,
+                    7, 8, 0, 0, 0xAB, 0xCD, 0, 8, 0xFF };
+  spgp_packet_t *sig = NULL;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL SIGNATURE");
+	spgp_verify(NULL, NULL, msg, sizeof(msg));
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  sig = spgp_decode_message(msg, sizeof(msg));
+  ASSERT_EQUAL((sig != NULL && sig->c.signature->hasIssuer &&
+                sig->c.signature->issuer[7] == 8 &&
+                spgp_signature_status(sig) == TEST_SIG_UNCHECKED), 1);
+
+  PRINT_TEST("UNKNOWN ISSUER");
+  ASSERT_EQUAL((spgp_verify(sig, NULL, msg, sizeof(msg)) != 0 &&
+                spgp_err() == TEST_ERR_NO_KEY &&
+                spgp_signature_status(sig) == TEST_SIG_NO_KEY), 1);
+
+  PRINT_TEST("BATCH");
+  ASSERT_EQUAL((spgp_verify_batch(&sig, 1, NULL, msg, sizeof(msg), 2) != 0 &&
+                spgp_err() == TEST_ERR_NO_KEY), 1);
+
+  PRINT_TEST("UNSUPPORTED HASH");
+  sig->c.signature->hashAlgo = HASH_ALGO_MD5;
+  ASSERT_EQUAL((spgp_verify(sig, NULL, msg, sizeof(msg)) != 0 &&
+                spgp_err() == FORMAT_UNSUPPORTED &&
+                spgp_signature_status(sig) == SPGP_SIG_UNSUPPORTED), 1);
+  spgp_free_packet(&sig);
+
+  return 0;
+  fail:
+  spgp_free_packet(&sig);
+  return 1;
+}
+
+static uint8_t test_spgp_verify_detached(void) {
+	// The signature from test_spgp_verify, and a literal packet
+	uint8_t sig[] = { 0xC2, 23, 4, 0x00, 1, 8, 0, 10, 9, 16, 1, 2, 3, 4, 5, 6,
+                    7, 8, 0, 0, 0xAB, 0xCD, 0, 8, 0xFF };
+  uint8_t literal[] = { 0xCB, 7, 'b', 0, 0, 0, 0, 0, 'x' };
+  spgp_detached_t files[2];
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL PATH");
+	spgp_verify_detached(sig, sizeof(sig), NULL, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NOT A SIGNATURE");
+	spgp_verify_detached(literal, sizeof(literal), NULL, "/dev/null");
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("UNKNOWN ISSUER");
+	spgp_verify_detached_fd(sig, sizeof(sig), NULL, 0);
+  ASSERT_EQUAL(spgp_err(), TEST_ERR_NO_KEY);
+
+  PRINT_TEST("FILES");
+  memset(files, 0, sizeof(files));
+  files[0].sig = sig;
+  files[0].sigLength = sizeof(sig);
+  files[0].path = "/dev/null";
+  files[1] = files[0];
+  files[1].sig = literal;
+  files[1].sigLength = sizeof(literal);
+  ASSERT_EQUAL((spgp_verify_detached_files(files, 2, NULL, 2) != 0 &&
+                spgp_err() == TEST_ERR_NO_KEY &&
+                files[0].status == TEST_SIG_NO_KEY &&
+                files[1].err == INVALID_ARGS), 1);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_verify_cleartext(void) {
+	char unsigned_msg[] = "-----BEGIN PGP SIGNED MESSAGE-----\n"
+                        "Hash: SHA256\n"
+                        "\n"
+                        "- -- no signature follows\n";
+	char plain[] = "Just some text\n";
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL MESSAGE");
+	spgp_verify_cleartext(NULL, 10, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NOT CLEARTEXT SIGNED");
+	spgp_verify_cleartext((uint8_t *)plain, strlen(plain), NULL);
+  ASSERT_EQUAL(spgp_err(), FORMAT_UNSUPPORTED);
+
+  PRINT_TEST("NO SIGNATURE");
+	spgp_verify_cleartext((uint8_t *)unsigned_msg, strlen(unsigned_msg), NULL);
+  ASSERT_EQUAL(spgp_err(), ARMOR_ERROR);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_keystore(void) {
+	// The toy key from test_spgp_fingerprint
+	uint8_t key[] = { 0xC6, 12, 4, 0, 0, 0, 0, 1, 0, 8, 0xFF, 0, 2, 3,
+                    0xCD, 1, 'a' };
+  uint8_t fpr[SPGP_FINGERPRINT_LEN] = {
+  	0xF2, 0x3A, 0x4A, 0x10, 0x5E, 0x40, 0x47, 0xD5, 0xB0, 0x08,
+    0x91, 0xAB, 0x49, 0x4D, 0x02, 0xD6, 0x77, 0xBF, 0xAC, 0x40 };
+  uint8_t missing[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	char path[] = "/tmp/spgp_keystore_XXXXXX";
+  spgp_keystore_t *ks = NULL;
+  spgp_packet_t *pkt;
+  int fd;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NOT A STORE");
+	ASSERT_EQUAL((spgp_keystore_open("/dev/null") == NULL &&
+                spgp_err() == FORMAT_UNSUPPORTED), 1);
+
+  PRINT_TEST("CREATE");
+  fd = mkstemp(path);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  close(fd);
+  ASSERT_EQUAL(spgp_keystore_create(path, key, sizeof(key)), 0);
+  ks = spgp_keystore_open(path);
+  unlink(path);
+  ASSERT_EQUAL((ks != NULL && spgp_keystore_count(ks) == 1), 1);
+
+  PRINT_TEST("FIND BY KEY ID");
+  pkt = spgp_keystore_find(ks, fpr + 12);
+  ASSERT_EQUAL((pkt != NULL && pkt->header->type == PKT_TYPE_PUBLIC_KEY &&
+                pkt->c.pub->hasFingerprint &&
+                spgp_keystore_find(ks, fpr + 12) == pkt), 1);
+
+  PRINT_TEST("FIND BY FINGERPRINT");
+  ASSERT_EQUAL((spgp_keystore_find_fingerprint(ks, fpr) == pkt), 1);
+
+  PRINT_TEST("MISSING KEY");
+  ASSERT_EQUAL((spgp_keystore_find(ks, missing) == NULL), 1);
+
+  spgp_keystore_close(&ks);
+  return 0;
+  fail:
+  spgp_keystore_close(&ks);
+  return 1;
+}
+
+static uint8_t test_spgp_keychain(void) {
+	// The toy key from test_spgp_fingerprint, with made-up secret MPIs
+	uint8_t mpis[] = { 0, 8, 0xFF, 0, 2, 3, 0, 7, 0x7B, 0, 4, 0x0F, 0, 4, 0x0D,
+                     0, 1, 1 };
+  uint8_t fpr[SPGP_FINGERPRINT_LEN] = {
+  	0xF2, 0x3A, 0x4A, 0x10, 0x5E, 0x40, 0x47, 0xD5, 0xB0, 0x08,
+    0x91, 0xAB, 0x49, 0x4D, 0x02, 0xD6, 0x77, 0xBF, 0xAC, 0x40 };
+  spgp_keychain_key_t key;
+  const spgp_keychain_key_t *rec;
+  spgp_packet_t *pub;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("ADD KEY");
+  memset(&key, 0, sizeof(key));
+  memcpy(key.keyid, fpr + 12, 8);
+  memcpy(key.fingerprint, fpr, SPGP_FINGERPRINT_LEN);
+  key.type = PKT_TYPE_SECRET_KEY;
+  key.version = 4;
+  key.asymAlgo = ASYM_ALGO_RSA;
+  key.mpiCount = 6;
+  key.mpiLength = sizeof(mpis);
+  rec = spgp_keychain_add(&key, mpis);
+  ASSERT_EQUAL((rec != NULL && ((uintptr_t)rec & 63) == 0 &&
+                spgp_keychain_add(&key, mpis) == rec &&
+                spgp_keychain_key_with_id(fpr + 12) == rec &&
+                memcmp(rec->mpis, mpis, sizeof(mpis)) == 0), 1);
+
+  PRINT_TEST("PUBLIC KEY");
+  pub = spgp_keychain_public_key_with_id(fpr + 12);
+  ASSERT_EQUAL((pub != NULL && pub->header->type == PKT_TYPE_PUBLIC_KEY &&
+                pub->c.pub->mpiCount == 2 &&
+                spgp_keychain_public_key_with_id(fpr + 12) == pub), 1);
+  // Only the public MPIs are hashed
+  pub->c.pub->hasFingerprint = 0;
+  ASSERT_EQUAL(memcmp(spgp_fingerprint(pub), fpr, SPGP_FINGERPRINT_LEN), 0);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_secmem(void) {
+	uint8_t *a, *b, *big;
+  uint32_t i;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("ALLOC ZEROED");
+  a = spgp_secure_alloc(100);
+  ASSERT_EQUAL((a != NULL), 1);
+  for (i = 0; i < 100 && a[i] == 0; i++) ;
+  ASSERT_EQUAL(i, 100);
+
+  PRINT_TEST("REUSE CLEARED");
+  memset(a, 0xA5, 100);
+  spgp_secure_free(a, 100);
+  b = spgp_secure_alloc(120);
+  for (i = 0; i < 120 && b[i] == 0; i++) ;
+  ASSERT_EQUAL(i, 120);
+  spgp_secure_free(b, 120);
+
+  PRINT_TEST("LARGE BLOCK");
+  big = spgp_secure_alloc(10000);
+  ASSERT_EQUAL((big != NULL && big[9999] == 0), 1);
+  spgp_secure_free(big, 10000);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+/**
+ * Add the 2048-bit test key to the keychain, if it isn't there yet.
+ */
+static const spgp_keychain_key_t *test_rsa_key(void) {
+	spgp_keychain_key_t key;
+
+	memset(&key, 0, sizeof(key));
+  memcpy(key.keyid, test_rsa_keyid, 8);
+  memset(key.fingerprint, 0x20, SPGP_FINGERPRINT_LEN);
+  key.type = PKT_TYPE_SECRET_KEY;
+  key.version = 4;
+  key.asymAlgo = ASYM_ALGO_RSA;
+  key.mpiCount = 6;
+  key.mpiLength = sizeof(test_rsa_mpis);
+  return spgp_keychain_add(&key, test_rsa_mpis);
+}
+
+/**
+ * Write an agent request for test_rsa_session to |keyid|.
+ *
+ * @return Length of the request
+ */
+static size_t test_agent_request(uint8_t *buf, uint32_t tag,
+                                 const uint8_t *keyid) {
+	uint8_t *p = buf + 4;
+
+	p = spgp_put_be32(p, tag);
+  *p++ = SPGP_AGENT_OP_DECRYPT_SESSION;
+  memcpy(p, keyid, 8);
+  p += 8;
+  *p++ = ASYM_ALGO_RSA;
+  memcpy(p, test_rsa_session, sizeof(test_rsa_session));
+  p += sizeof(test_rsa_session);
+  spgp_put_be32(buf, p - buf - 4);
+  return p - buf;
+}
+
+/**
+ * Answer the first client of the listening socket |arg| until it hangs up.
+ */
+static void *test_agent_serve(void *arg) {
+	spgp_agent_replies_t out = { NULL, 0, 0 };
+  unsigned long requests = 0;
+  uint8_t in[1024];
+  size_t len = 0, used;
+  ssize_t n;
+  int fd;
+
+	fd = accept(*(int *)arg, NULL, NULL);
+  if (fd < 0) return NULL;
+  while ((n = read(fd, in + len, sizeof(in) - len)) > 0) {
+  	len += n;
+    if (spgp_agent_answer(in, len, &used, &out, &requests) != 0) break;
+    memmove(in, in + used, len - used);
+    len -= used;
+    if (write(fd, out.data, out.len) != (ssize_t)out.len) break;
+    spgp_agent_replies_sent(&out, out.len);
+  }
+  spgp_agent_replies_free(&out);
+  close(fd);
+  return NULL;
+}
+
+static uint8_t test_spgp_agent(void) {
+	char path[] = "/tmp/spgp_agent_XXXXXX";
+	uint8_t missing[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  uint8_t req[512];
+  uint8_t key[16];
+  spgp_agent_replies_t out = { NULL, 0, 0 };
+  unsigned long requests = 0;
+  struct sockaddr_un addr;
+  pthread_t thread;
+  spgp_pkt_header_t hdrs[2];
+  spgp_session_pkt_t sessions[2];
+  spgp_packet_t pkts[2];
+  spgp_mpi_t mpi;
+  size_t len, used;
+  uint32_t err, i;
+  int fd, lfd = -1;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  for (i = 0; i < sizeof(key); i++) key[i] = i;
+  memset(sessions, 0, sizeof(sessions));
+
+  PRINT_TEST("NO AGENT");
+  err = spgp_agent_connect("/tmp/spgp_no_such_agent");
+  ASSERT_EQUAL((err != 0 && spgp_err() == IO_ERROR), 1);
+  spgp_agent_disconnect();
+
+  PRINT_TEST("ANSWER");
+  ASSERT_EQUAL((test_rsa_key() != NULL), 1);
+  len = test_agent_request(req, 0xA1B2C3D4, test_rsa_keyid);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) == 0 &&
+                used == len && requests == 1 &&
+                out.len == SPGP_AGENT_REPLY_LEN + 1 + sizeof(key) &&
+                spgp_get_be32(out.data) == out.len - 4 &&
+                spgp_get_be32(out.data + 4) == 0xA1B2C3D4 &&
+                out.data[8] == 0 && out.data[9] == 0 &&
+                out.data[10] == SYM_ALGO_AES128 &&
+                memcmp(out.data + 11, key, sizeof(key)) == 0), 1);
+  spgp_agent_replies_sent(&out, out.len);
+
+  PRINT_TEST("UNKNOWN KEY");
+  len = test_agent_request(req, 7, missing);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) == 0 &&
+                out.len == SPGP_AGENT_REPLY_LEN &&
+                spgp_get_be32(out.data + 4) == 7 &&
+                ((out.data[8] << 8) | out.data[9]) == KEY_NOT_FOUND), 1);
+  spgp_agent_replies_sent(&out, out.len);
+
+  PRINT_TEST("PARTIAL FRAME");
+  len = test_agent_request(req, 0, test_rsa_keyid);
+  ASSERT_EQUAL((spgp_agent_answer(req, len - 1, &used, &out,
+                                  &requests) == 0 &&
+                used == 0 && out.len == 0), 1);
+
+  PRINT_TEST("SHORT FRAME");
+  spgp_put_be32(req, SPGP_AGENT_REQUEST_LEN - 5);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) != 0 &&
+                out.len == 0), 1);
+
+  PRINT_TEST("LONG FRAME");
+  spgp_put_be32(req, SPGP_AGENT_MAX_FRAME - 3);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) != 0 &&
+                out.len == 0), 1);
+
+  PRINT_TEST("MPI PAST FRAME END");
+  len = test_agent_request(req, 0, test_rsa_keyid) - 1;
+  spgp_put_be32(req, len - 4);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) == 0 &&
+                used == len && out.len == SPGP_AGENT_REPLY_LEN &&
+                ((out.data[8] << 8) | out.data[9]) == INVALID_HEADER), 1);
+  spgp_agent_replies_sent(&out, out.len);
+
+  PRINT_TEST("TRAILING BYTES");
+  len = test_agent_request(req, 0, test_rsa_keyid);
+  req[len++] = 0;
+  spgp_put_be32(req, len - 4);
+  ASSERT_EQUAL((spgp_agent_answer(req, len, &used, &out, &requests) == 0 &&
+                used == len && out.len == SPGP_AGENT_REPLY_LEN &&
+                ((out.data[8] << 8) | out.data[9]) == INVALID_HEADER), 1);
+  spgp_agent_replies_free(&out);
+
+	// Two sessions in one exchange, only the second to a key the agent
+  // has, so its key only lands there if the reply tags are followed
+  PRINT_TEST("ROUND TRIP");
+  fd = mkstemp(path);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  close(fd);
+  unlink(path);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(lfd, 1) != 0 ||
+      pthread_create(&thread, NULL, test_agent_serve, &lfd) != 0) {
+  	unlink(path);
+  	PRINT_FAIL();
+    goto fail;
+  }
+  mpi.data = (uint8_t *)test_rsa_session;
+  mpi.bits = 2048;
+  mpi.count = sizeof(test_rsa_session) - 2;
+  mpi.next = NULL;
+  for (i = 0; i < 2; i++) {
+  	memset(&hdrs[i], 0, sizeof(hdrs[i]));
+    hdrs[i].type = PKT_TYPE_SESSION;
+    sessions[i].version = 3;
+    sessions[i].algo = ASYM_ALGO_RSA;
+    sessions[i].mpi1 = &mpi;
+    pkts[i].header = &hdrs[i];
+    pkts[i].c.session = &sessions[i];
+    pkts[i].prev = i ? &pkts[0] : NULL;
+    pkts[i].next = i ? NULL : &pkts[1];
+  }
+  memcpy(sessions[0].keyid, missing, 8);
+  memcpy(sessions[1].keyid, test_rsa_keyid, 8);
+  err = spgp_agent_connect(path);
+  i = err ? 0 : spgp_agent_decrypt_sessions(&pkts[1]);
+  spgp_agent_disconnect();
+  pthread_join(thread, NULL);
+  close(lfd);
+  lfd = -1;
+  unlink(path);
+  ASSERT_EQUAL((err == 0 && i == 1 && sessions[0].key == NULL &&
+                sessions[1].key != NULL &&
+                sessions[1].symAlgo == SYM_ALGO_AES128 &&
+                sessions[1].keylen == sizeof(key) &&
+                memcmp(sessions[1].key, key, sizeof(key)) == 0), 1);
+  spgp_secure_free(sessions[1].key, sessions[1].keylen);
+
+  return 0;
+  fail:
+  spgp_agent_replies_free(&out);
+  if (lfd >= 0) close(lfd);
+  spgp_secure_free(sessions[1].key, sessions[1].keylen);
+  return 1;
+}
+
+// What test_spgp_pk_backend's backend and callback were given
+typedef struct {
+	uint8_t keyid[8];
+  uint8_t algo;
+  uint32_t submitted;
+  uint32_t calls;
+  uint32_t err;
+  spgp_packet_t *msg;
+} test_pk_result_t;
+
+static uint8_t test_pk_submit(spgp_pk_request_t *req, void *ctx) {
+	test_pk_result_t *result = ctx;
+  memcpy(result->keyid, spgp_pk_request_keyid(req), 8);
+  result->algo = spgp_pk_request_algo(req);
+  result->submitted++;
+  // A token without the key
+  spgp_pk_request_done(req, NULL, 0, KEY_NOT_FOUND);
+  return 0;
+}
+
+static void test_pk_done(spgp_packet_t *msg, uint32_t err, void *ctx) {
+	test_pk_result_t *result = ctx;
+  result->calls++;
+  result->err = err;
+  result->msg = msg;
+}
+
+static uint8_t test_spgp_pk_backend(void) {
+	// Session key for key ID 0102030405060708 (RSA), then encrypted data
+	uint8_t msg[] = { 0xC1, 12, 3, 1, 2, 3, 4, 5, 6, 7, 8, 1, 0x00, 0x00,
+                    0xD2, 0xE1, 1, 0xAA, 3, 0xBB, 0xCC, 0xDD };
+  uint8_t literal[] = { 0xCB, 7, 'b', 0, 0, 0, 0, 0, 'x' };
+  test_pk_result_t result;
+  spgp_pk_backend_t backend = { test_pk_submit, &result };
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL CALLBACK");
+	spgp_decode_message_async(literal, sizeof(literal), NULL, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NO BACKEND");
+  memset(&result, 0, sizeof(result));
+  ASSERT_EQUAL(spgp_decode_message_async(literal, sizeof(literal),
+                                         test_pk_done, &result), 0);
+  ASSERT_EQUAL((result.calls == 1 && result.err == 0 && result.msg &&
+                result.msg->header->type == PKT_TYPE_LITERAL_DATA), 1);
+  spgp_free_packet(&result.msg);
+
+  PRINT_TEST("REQUEST FAILED");
+  memset(&result, 0, sizeof(result));
+  spgp_pk_backend_set(&backend);
+  ASSERT_EQUAL(spgp_decode_message_async(msg, sizeof(msg),
+                                         test_pk_done, &result), 0);
+  spgp_pk_backend_set(NULL);
+  ASSERT_EQUAL((result.submitted == 1 && result.keyid[0] == 1 &&
+                result.keyid[7] == 8 && result.algo == ASYM_ALGO_RSA &&
+                result.calls == 1 && result.msg == NULL &&
+                result.err == DECRYPT_FAILED), 1);
+
+  return 0;
+  fail:
+  spgp_pk_backend_set(NULL);
+  return 1;
+}
+
+static uint8_t test_spgp_crypto_backend(void) {
+	// The toy key from test_spgp_fingerprint
+	uint8_t key[] = { 0xC6, 12, 4, 0, 0, 0, 0, 1, 0, 8, 0xFF, 0, 2, 3,
+                    0xCD, 1, 'a' };
+  uint8_t expected[SPGP_FINGERPRINT_LEN] = {
+  	0xF2, 0x3A, 0x4A, 0x10, 0x5E, 0x40, 0x47, 0xD5, 0xB0, 0x08,
+    0x91, 0xAB, 0x49, 0x4D, 0x02, 0xD6, 0x77, 0xBF, 0xAC, 0x40 };
+  char previous[16];
+  spgp_packet_t *pkt = NULL;
+  const uint8_t *fpr;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+	strncpy(previous, spgp_crypto_backend_name(), sizeof(previous) - 1);
+  previous[sizeof(previous) - 1] = 0;
+
+  PRINT_TEST("UNKNOWN BACKEND");
+  ASSERT_EQUAL((spgp_crypto_backend_select("nope") != 0 &&
+                spgp_err() == INVALID_ARGS), 1);
+  ASSERT_EQUAL(strcmp(spgp_crypto_backend_name(), previous), 0);
+
+  PRINT_TEST("BUILTIN FINGERPRINT");
+  ASSERT_EQUAL(spgp_crypto_backend_select("builtin"), 0);
+  ASSERT_EQUAL(strcmp(spgp_crypto_backend_name(), "builtin"), 0);
+  pkt = spgp_decode_message(key, sizeof(key));
+  fpr = pkt ? spgp_fingerprint(pkt) : NULL;
+  ASSERT_EQUAL((fpr != NULL &&
+                memcmp(fpr, expected, SPGP_FINGERPRINT_LEN) == 0), 1);
+  spgp_free_packet(&pkt);
+  spgp_crypto_backend_select(previous);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  spgp_crypto_backend_select(previous);
+  return 1;
+}
+
+static uint8_t test_spgp_rsa(void) {
+	// n = 53 * 61, e = 17, d = 2753, p = 53, q = 61, u = 1/p mod q = 38
+	uint8_t mpis[] = { 0, 12, 0x0C, 0xA1, 0, 5, 0x11, 0, 12, 0x0A, 0xC1,
+                     0, 6, 0x35, 0, 6, 0x3D, 0, 6, 0x26 };
+  // 65^17 mod n
+  uint8_t cdata[] = { 0, 12, 0x0A, 0xE6 };
+  spgp_mpi_t c = { cdata, 12, 2, NULL };
+  // 2^17 mod n, and n itself, which is rejected
+  uint8_t c2data[] = { 0, 11, 0x06, 0xD8 }, c3data[] = { 0, 12, 0x0C, 0xA1 };
+  spgp_mpi_t c2 = { c2data, 11, 2, NULL }, c3 = { c3data, 12, 2, NULL };
+  const spgp_mpi_t *batch[] = { &c, &c2, &c3 };
+  uint8_t *frames[SPGP_BN_LANES];
+  size_t lens[SPGP_BN_LANES];
+  spgp_keychain_key_t key;
+  const spgp_keychain_key_t *rec;
+  const spgp_rsa_key_t *rsa;
+  uint8_t *m = NULL;
+  size_t len = 0;
+  // 2048-bit ciphertexts, the test session packet and copies with the low
+  // byte changed, over more than one limb so carries run between them
+  static uint8_t wide[SPGP_BN_LANES][sizeof(test_rsa_session)];
+  const char *units[] = { "avx512f", "avx2", "generic" };
+  const char *unit = spgp_bn_lanes_unit();
+  spgp_mpi_t wc[SPGP_BN_LANES];
+  const spgp_mpi_t *wcp[SPGP_BN_LANES];
+  uint8_t *single[SPGP_BN_LANES];
+  size_t slen[SPGP_BN_LANES];
+  uint8_t ok;
+  uint32_t i, u;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+	memset(single, 0, sizeof(single));
+
+  PRINT_TEST("CRT PARAMETERS");
+  memset(&key, 0, sizeof(key));
+  memset(key.keyid, 0x52, 8);
+  memset(key.fingerprint, 0x52, SPGP_FINGERPRINT_LEN);
+  key.type = PKT_TYPE_SECRET_KEY;
+  key.version = 4;
+  key.asymAlgo = ASYM_ALGO_RSA;
+  key.mpiCount = 6;
+  key.mpiLength = sizeof(mpis);
+  rec = spgp_keychain_add(&key, mpis);
+  ASSERT_EQUAL((rec != NULL), 1);
+  rsa = spgp_keychain_rsa_key(rec);
+  ASSERT_EQUAL((rsa != NULL && spgp_keychain_rsa_key(rec) == rsa), 1);
+
+  PRINT_TEST("DECRYPT");
+  m = spgp_rsa_decrypt(rsa, &c, &len);
+  ASSERT_EQUAL((m != NULL && len == 1 && m[0] == 65), 1);
+  spgp_secure_free(m, len);
+
+  PRINT_TEST("DECRYPT LANES");
+  spgp_rsa_decrypt_lanes(rsa, batch, 3, frames, lens);
+  ASSERT_EQUAL((frames[0] != NULL && lens[0] == 1 && frames[0][0] == 65 &&
+                frames[1] != NULL && lens[1] == 1 && frames[1][0] == 2 &&
+                frames[2] == NULL), 1);
+  spgp_secure_free(frames[0], lens[0]);
+  spgp_secure_free(frames[1], lens[1]);
+
+  PRINT_TEST("2048-BIT DECRYPT");
+  rec = test_rsa_key();
+  rsa = rec ? spgp_keychain_rsa_key(rec) : NULL;
+  ASSERT_EQUAL((rsa != NULL), 1);
+  for (i = 0; i < SPGP_BN_LANES; i++) {
+  	memcpy(wide[i], test_rsa_session, sizeof(test_rsa_session));
+    wide[i][sizeof(test_rsa_session) - 1] ^= i;
+    wc[i].data = wide[i];
+    wc[i].bits = (wide[i][0] << 8) | wide[i][1];
+    wc[i].count = sizeof(test_rsa_session) - 2;
+    wc[i].next = NULL;
+    wcp[i] = &wc[i];
+    single[i] = spgp_rsa_decrypt(rsa, &wc[i], &slen[i]);
+    if (NULL == single[i]) {PRINT_FAIL();goto fail;}
+  }
+  // Block type 2, then AES-128 and key 00 01 .. 0F before the checksum
+  ok = slen[0] == 255 && single[0][0] == 2 && single[0][slen[0] - 19] == 7;
+  for (i = 0; ok && i < 16; i++) ok = single[0][slen[0] - 18 + i] == i;
+  ASSERT_EQUAL(ok, 1);
+
+	// Every lanes unit this CPU has must agree with the scalar path
+	for (u = 0; u < sizeof(units) / sizeof(units[0]); u++) {
+  	if (spgp_bn_lanes_select(units[u]) != 0) continue;
+    PRINT_TEST("2048-BIT LANES ON %s", units[u]);
+    spgp_rsa_decrypt_lanes(rsa, wcp, SPGP_BN_LANES, frames, lens);
+    ok = 1;
+    for (i = 0; i < SPGP_BN_LANES; i++) {
+    	if (NULL == frames[i] || lens[i] != slen[i] ||
+          memcmp(frames[i], single[i], slen[i]) != 0)
+      	ok = 0;
+      spgp_secure_free(frames[i], lens[i]);
+    }
+    ASSERT_EQUAL(ok, 1);
+  }
+  spgp_bn_lanes_select(unit);
+  for (i = 0; i < SPGP_BN_LANES; i++) spgp_secure_free(single[i], slen[i]);
+
+  return 0;
+  fail:
+  spgp_bn_lanes_select(unit);
+  for (i = 0; i < SPGP_BN_LANES; i++) spgp_secure_free(single[i], slen[i]);
+  return 1;
+}
+
+static uint8_t test_spgp_keychain_snapshot(void) {
+	char keypath[] = "/tmp/spgp_snapkey_XXXXXX";
+	char path[] = "/tmp/spgp_snapshot_XXXXXX";
+  uint8_t key[SPGP_SNAPSHOT_KEY_LEN];
+#ifdef HAVE_GCRYPT
+  int fd;
+#endif
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+#ifdef HAVE_GCRYPT
+  PRINT_TEST("BAD KEY LENGTH");
+	spgp_keychain_export("/dev/null", key, 16);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("KEY FILE");
+  fd = mkstemp(keypath);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  close(fd);
+  unlink(keypath);
+  ASSERT_EQUAL((spgp_snapshot_key_create(keypath) == 0 &&
+                spgp_snapshot_key_read(keypath, key) == 0), 1);
+  chmod(keypath, 0644);
+  spgp_snapshot_key_read(keypath, key);
+  unlink(keypath);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("EXPORT AND IMPORT");
+  fd = mkstemp(path);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  close(fd);
+  ASSERT_EQUAL((spgp_keychain_export(path, key, sizeof(key)) == 0 &&
+                spgp_keychain_import(path, key, sizeof(key)) == 0), 1);
+
+  PRINT_TEST("WRONG KEY");
+  key[0] ^= 1;
+  spgp_keychain_import(path, key, sizeof(key));
+  unlink(path);
+  ASSERT_EQUAL(spgp_err(), DECRYPT_FAILED);
+#else
+  PRINT_TEST("NO LIBGCRYPT");
+  ASSERT_EQUAL((spgp_snapshot_key_create(keypath) != 0 &&
+                spgp_err() == FORMAT_UNSUPPORTED), 1);
+  ASSERT_EQUAL((spgp_keychain_export(path, key, sizeof(key)) != 0 &&
+                spgp_err() == FORMAT_UNSUPPORTED), 1);
+#endif
+
+  return 0;
+  fail:
+  return 1;
+}
+
+static uint8_t test_spgp_onepass(void) {
+	// One-pass packet, literal "x", then the signature from test_spgp_verify
+	uint8_t msg[] = { 0xC4, 13, 3, 0x00, 8, 1, 1, 2, 3, 4, 5, 6, 7, 8, 1,
+                    0xCB, 7, 'b', 0, 0, 0, 0, 0, 'x',
+                    0xC2, 23, 4, 0x00, 1, 8, 0, 10, 9, 16, 1, 2, 3, 4, 5, 6,
+                    7, 8, 0, 0, 0xAB, 0xCD, 0, 8, 0xFF };
+  uint8_t out[4];
+  spgp_packet_t *pkt = NULL;
+  spgp_sink_t *sink = NULL;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("ONE-PASS TO MEMORY");
+  pkt = spgp_decode_message(msg, sizeof(msg));
+  ASSERT_EQUAL((pkt != NULL && pkt->header->type == PKT_TYPE_ONE_PASS_SIG &&
+                pkt->c.onepass->keyid[7] == 8 && pkt->c.onepass->nested &&
+                pkt->next->next != NULL &&
+                spgp_signature_status(pkt->next->next) == TEST_SIG_NO_KEY), 1);
+  spgp_free_packet(&pkt);
+
+  // The literal data isn't kept, so only the one-pass hash can have
+  // checked the signature.
+  PRINT_TEST("ONE-PASS TO SINK");
+  sink = spgp_sink_open_buffer(out, sizeof(out));
+  pkt = spgp_decode_message_to_sink(msg, sizeof(msg), sink);
+  ASSERT_EQUAL((pkt != NULL && spgp_sink_length(sink) == 1 &&
+                out[0] == 'x' && pkt->next->next != NULL &&
+                spgp_signature_status(pkt->next->next) == TEST_SIG_NO_KEY), 1);
+  spgp_free_packet(&pkt);
+  spgp_sink_close(&sink);
+
+  PRINT_TEST("UNKNOWN ONE-PASS VERSION");
+  msg[2] = 9;
+  pkt = spgp_decode_message(msg, sizeof(msg));
+  ASSERT_EQUAL((pkt != NULL && pkt->c.onepass->isUnsupported &&
+                pkt->next != NULL &&
+                spgp_packet_type(pkt->next) == PKT_TYPE_LITERAL_DATA &&
+                pkt->next->next != NULL), 1);
+  spgp_free_packet(&pkt);
+
+  return 0;
+  fail:
+  spgp_free_packet(&pkt);
+  spgp_sink_close(&sink);
+  return 1;
+}
+
+static uint8_t test_spgp_inspect(void) {
+	// Session key for key ID 0102030405060708 (RSA), then an encrypted data
+  // packet with a 2-byte partial chunk and a 3-byte final chunk.
+	uint8_t msg[] = { 0xC1, 12, 3, 1, 2, 3, 4, 5, 6, 7, 8, 1, 0x00, 0x00,
+                    0xD2, 0xE1, 1, 0xAA, 3, 0xBB, 0xCC, 0xDD };
+  spgp_inspect_t info;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL MESSAGE");
+	spgp_inspect(NULL, sizeof(msg), &info);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NULL INFO");
+	spgp_inspect(msg, sizeof(msg), NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("RECIPIENTS");
+  ASSERT_EQUAL(spgp_inspect(msg, sizeof(msg), &info), 0);
+  ASSERT_EQUAL((info.recipientCount == 1 && info.recipients[0].algo == 1 &&
+                info.recipients[0].keyid[0] == 1 &&
+                info.recipients[0].keyid[7] == 8 &&
+                !info.recipients[0].hasKey), 1);
+
+  PRINT_TEST("ENCRYPTED LENGTH");
+  ASSERT_EQUAL((info.isEncrypted && !info.isDecryptable &&
+                info.encryptedLength == 5 &&
+                info.packetTypes == (SPGP_PACKET_MASK(PKT_TYPE_SESSION) |
+                  SPGP_PACKET_MASK(PKT_TYPE_SYM_ENC_INT_DATA))), 1);
+
+  PRINT_TEST("TRUNCATED");
+	spgp_inspect(msg, sizeof(msg) - 1, &info);
+  ASSERT_EQUAL(spgp_err(), BUFFER_OVERFLOW);
+
+  return 0;
+  fail:
+  return 1;
+}
+
+/**
+ * Build a message of the session packet for the 2048-bit test key and
+ * test_seipd_body, the body split into partial chunks of 2^|partials[i]|
+ * bytes and a last chunk with a five-octet length.
+ *
+ * @return Length of the message
+ */
+static size_t test_range_message(uint8_t *buf, const uint8_t *partials,
+                                 uint32_t count) {
+	size_t sessionLen = 10 + sizeof(test_rsa_session);
+	uint8_t *p = buf;
+  size_t off = 0, n;
+  uint32_t i;
+
+	*p++ = 0xC0 | PKT_TYPE_SESSION;
+  *p++ = ((sessionLen - 192) >> 8) + 192;
+  *p++ = (sessionLen - 192) & 0xFF;
+  *p++ = 3;
+  memcpy(p, test_rsa_keyid, 8);
+  p += 8;
+  *p++ = ASYM_ALGO_RSA;
+  memcpy(p, test_rsa_session, sizeof(test_rsa_session));
+  p += sizeof(test_rsa_session);
+
+	*p++ = 0xC0 | PKT_TYPE_SYM_ENC_INT_DATA;
+  for (i = 0; i <= count; i++) {
+  	if (i < count) {
+    	n = (size_t)1 << partials[i];
+      *p++ = 0xE0 | partials[i];
+    }
+    else {
+    	n = sizeof(test_seipd_body) - off;
+      *p++ = 0xFF;
+      p = spgp_put_be32(p, n);
+    }
+    memcpy(p, test_seipd_body + off, n);
+    p += n;
+    off += n;
+  }
+  return p - buf;
+}
+
+/**
+ * Compare range reads of |range| with |data|: from the start, a single
+ * byte inside a cipher block, across the ends of the first ciphertext
+ * chunk and of the literal's first chunk, and the whole of it.
+ */
+static uint8_t test_range_reads(spgp_range_t *range, const char *data,
+                                size_t len) {
+	const size_t reads[][2] = { { 0, 16 }, { 3, 1 }, { 480, 40 },
+                              { 600, 20 }, { 690, 10 }, { 0, 700 } };
+	uint8_t out[700];
+  uint32_t i;
+
+	if (spgp_range_length(range) != len || len != sizeof(out)) return 1;
+  for (i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+  	if (spgp_read_range(range, reads[i][0], reads[i][1], out) != 0 ||
+        memcmp(out, data + reads[i][0], reads[i][1]) != 0)
+    	return 1;
+  }
+  return 0;
+}
+
+static uint8_t test_spgp_range(void) {
+	// Chunk sizes of two messages with the same length and ciphertext
+	const uint8_t split[] = { 9, 7 }, resplit[] = { 8, 8 };
+	char path[] = "/tmp/spgp_range_XXXXXX";
+	uint8_t buf[16];
+  uint8_t msg[1100], other[1100];
+  spgp_range_t *range = NULL;
+  spgp_packet_t *pkt = NULL;
+  char *data, *filename;
+  size_t len, otherLen, dataLen;
+  uint32_t filenameLen;
+  int fd;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+  PRINT_TEST("NULL MESSAGE");
+	spgp_range_open(NULL, 100, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("ZERO LENGTH");
+	spgp_range_open(buf, 0, NULL);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NULL READER");
+	spgp_read_range(NULL, 0, sizeof(buf), buf);
+  ASSERT_EQUAL(spgp_err(), INVALID_ARGS);
+
+  PRINT_TEST("NO ENCRYPTED PACKET");
+  buf[0] = 0xCD; // new format user ID
+  buf[1] = 1;
+  buf[2] = 'a';
+	spgp_range_open(buf, 3, NULL);
+  ASSERT_EQUAL(spgp_err(), FORMAT_UNSUPPORTED);
+
+  PRINT_TEST("DECODE WHOLE MESSAGE");
+  ASSERT_EQUAL((test_rsa_key() != NULL), 1);
+  len = test_range_message(msg, split, sizeof(split));
+  pkt = spgp_decode_message(msg, len);
+  data = pkt ? spgp_get_literal_data(pkt, &dataLen, &filename,
+                                     &filenameLen) : NULL;
+  ASSERT_EQUAL((data != NULL && dataLen == 700), 1);
+
+  PRINT_TEST("READS");
+  range = spgp_range_open(msg, len, NULL);
+  ASSERT_EQUAL((range != NULL && test_range_reads(range, data, dataLen) == 0),
+               1);
+
+  PRINT_TEST("PAST THE END");
+  ASSERT_EQUAL((spgp_read_range(range, dataLen - 4, 8, buf) != 0 &&
+                spgp_err() == BUFFER_OVERFLOW), 1);
+
+  PRINT_TEST("SAVE INDEX");
+  fd = mkstemp(path);
+  if (fd < 0) {PRINT_FAIL();goto fail;}
+  close(fd);
+  ASSERT_EQUAL(spgp_range_save_index(range, path), 0);
+  spgp_range_close(&range);
+
+  PRINT_TEST("LOAD INDEX");
+  range = spgp_range_open(msg, len, path);
+  ASSERT_EQUAL((range != NULL && test_range_reads(range, data, dataLen) == 0),
+               1);
+  spgp_range_close(&range);
+
+	// Read with the first message's chunk map, the second would have length
+  // headers in its data, so only the digest keeps the index out.
+  PRINT_TEST("INDEX OF ANOTHER MESSAGE");
+  otherLen = test_range_message(other, resplit, sizeof(resplit));
+  range = spgp_range_open(other, otherLen, path);
+  unlink(path);
+  ASSERT_EQUAL((otherLen == len && range != NULL &&
+                test_range_reads(range, data, dataLen) == 0), 1);
+  spgp_range_close(&range);
+  spgp_free_packet(&pkt);
+
+  return 0;
+  fail:
+  spgp_range_close(&range);
+  spgp_free_packet(&pkt);
+  return 1;
+}
+
+static uint8_t test_spgp_ecc(void) {
+	// Ed25519 public key, and its detached signature over |data|
+	uint8_t key[] = { 0x98, 0x33, 0x04, 0x6A, 0xD4, 0xD0, 0x32, 0x16, 0x09,
+                    0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01,
+                    0x01, 0x07, 0x40, 0x5B, 0xA5, 0x1C, 0xDE, 0x53, 0x02,
+                    0xE1, 0x80, 0xAE, 0x20, 0xF1, 0x87, 0xE3, 0x2A, 0x3E,
+                    0x6E, 0xD2, 0x63, 0xD4, 0xE1, 0xF1, 0xEE, 0x5E, 0xC2,
+                    0xE1, 0x16, 0x4A, 0x35, 0x99, 0x5A, 0x5B, 0xC6 };
+#ifdef HAVE_GCRYPT
+  uint8_t sig[] = { 0x88, 0x75, 0x04, 0x00, 0x16, 0x08, 0x00, 0x1D, 0x16,
+                    0x21, 0x04, 0x3A, 0x62, 0x11, 0x29, 0x26, 0x3B, 0x69,
+                    0x52, 0x5F, 0xD9, 0x6D, 0xC0, 0x27, 0x76, 0x82, 0x40,
+                    0x6C, 0x30, 0xCF, 0x85, 0x05, 0x02, 0x6A, 0xD4, 0xD0,
+                    0x3A, 0x00, 0x0A, 0x09, 0x10, 0x27, 0x76, 0x82, 0x40,
+                    0x6C, 0x30, 0xCF, 0x85, 0xC5, 0x20, 0x01, 0x00, 0xB5,
+                    0x59, 0xAD, 0xFB, 0x14, 0x0D, 0xB3, 0x3D, 0x41, 0x3E,
+                    0xFB, 0x43, 0xEA, 0xBB, 0xCE, 0x09, 0x38, 0x58, 0x73,
+                    0x3A, 0x6A, 0x27, 0x82, 0x3D, 0xB8, 0x6F, 0x6A, 0x94,
+                    0x99, 0x8F, 0x3B, 0x7E, 0x01, 0x00, 0xB9, 0xDA, 0xC5,
+                    0x25, 0x11, 0xB3, 0x8E, 0x0B, 0xF6, 0x97, 0xF8, 0x73,
+                    0x67, 0x3F, 0x16, 0xA6, 0x59, 0x18, 0x8A, 0x6B, 0x67,
+                    0x78, 0x5D, 0x48, 0xD1, 0x33, 0xFC, 0x0B, 0x9A, 0x17,
+                    0xED, 0x0B };
+  uint8_t data[] = "hello curve25519\n";
+#endif
+  uint8_t expected[SPGP_FINGERPRINT_LEN] = {
+  	0x3A, 0x62, 0x11, 0x29, 0x26, 0x3B, 0x69, 0x52, 0x5F, 0xD9,
+    0x6D, 0xC0, 0x27, 0x76, 0x82, 0x40, 0x6C, 0x30, 0xCF, 0x85 };
+  // RFC 3394 4.1: 128 bits of key data wrapped with a 128-bit KEK
+  uint8_t kek[16], keydata[16];
+  uint8_t wrapped[24] = { 0x1F, 0xA6, 0x8B, 0x0A, 0x81, 0x12, 0xB4, 0x47,
+                          0xAE, 0xF3, 0x4B, 0xD8, 0xFB, 0x5A, 0x7B, 0x82,
+                          0x9D, 0x3E, 0x86, 0x23, 0x71, 0xD2, 0xCF, 0xE5 };
+  // RFC 7748 5.2, the first X25519 vector
+  uint8_t scalar[32] = {
+  	0xA5, 0x46, 0xE3, 0x6B, 0xF0, 0x52, 0x7C, 0x9D, 0x3B, 0x16, 0x15,
+    0x4B, 0x82, 0x46, 0x5E, 0xDD, 0x62, 0x14, 0x4C, 0x0A, 0xC1, 0xFC,
+    0x5A, 0x18, 0x50, 0x6A, 0x22, 0x44, 0xBA, 0x44, 0x9A, 0xC4 };
+  uint8_t point[32] = {
+  	0xE6, 0xDB, 0x68, 0x67, 0x58, 0x30, 0x30, 0xDB, 0x35, 0x94, 0xC1,
+    0xA4, 0x24, 0xB1, 0x5F, 0x7C, 0x72, 0x66, 0x24, 0xEC, 0x26, 0xB3,
+    0x35, 0x3B, 0x10, 0xA9, 0x03, 0xA6, 0xD0, 0xAB, 0x1C, 0x4C };
+  uint8_t shared[32] = {
+  	0xC3, 0xDA, 0x55, 0x37, 0x9D, 0xE9, 0xC6, 0x90, 0x8E, 0x94, 0xEA,
+    0x4D, 0xF2, 0x8D, 0x08, 0x4F, 0x32, 0xEC, 0xCF, 0x03, 0x49, 0x1C,
+    0x71, 0xF7, 0x54, 0xB4, 0x07, 0x55, 0x77, 0xA2, 0x85, 0x52 };
+  uint8_t x[32];
+  const char *backends[] = {
+#ifdef HAVE_GCRYPT
+  	"gcrypt",
+#endif
+    "builtin" };
+  char previous[16];
+  spgp_packet_t *pub = NULL, *msg = NULL;
+  uint8_t *out = NULL;
+  size_t len = 0;
+  uint32_t i;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+	strncpy(previous, spgp_crypto_backend_name(), sizeof(previous) - 1);
+  previous[sizeof(previous) - 1] = 0;
+  for (i = 0; i < 16; i++) {
+  	kek[i] = i;
+    keydata[i] = i * 0x11;
+  }
+
+  PRINT_TEST("ED25519 FINGERPRINT");
+  pub = spgp_decode_message(key, sizeof(key));
+  ASSERT_EQUAL((pub != NULL && pub->c.pub->mpiCount == 2 &&
+                memcmp(spgp_fingerprint(pub), expected,
+                       SPGP_FINGERPRINT_LEN) == 0), 1);
+
+#ifdef HAVE_GCRYPT
+  PRINT_TEST("ED25519 SIGNATURE");
+  msg = spgp_decode_message(sig, sizeof(sig));
+  ASSERT_EQUAL((msg != NULL &&
+                spgp_verify(msg, pub, data, sizeof(data) - 1) == 0 &&
+                spgp_signature_status(msg) == SPGP_SIG_GOOD), 1);
+
+  PRINT_TEST("ED25519 CHANGED DATA");
+  data[0] = 'j';
+  ASSERT_EQUAL((spgp_verify(msg, pub, data, sizeof(data) - 1) != 0 &&
+                spgp_signature_status(msg) == SPGP_SIG_BAD), 1);
+  spgp_free_packet(&msg);
+#endif
+  spgp_free_packet(&pub);
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+	  PRINT_TEST("%s KEY UNWRAP", backends[i]);
+    ASSERT_EQUAL(spgp_crypto_backend_select(backends[i]), 0);
+    out = spgp_crypto_key_unwrap(SYM_ALGO_AES128, kek, wrapped,
+                                 sizeof(wrapped), &len);
+    ASSERT_EQUAL((len == 16 && memcmp(out, keydata, 16) == 0), 1);
+    spgp_secure_free(out, len);
+    out = NULL;
+  }
+  spgp_crypto_backend_select(previous);
+
+#ifdef SPGP_ECC_X25519
+  PRINT_TEST("X25519");
+  ASSERT_EQUAL((spgp_ecc_x25519(x, scalar, point) == 0 &&
+                memcmp(x, shared, sizeof(x)) == 0), 1);
+#endif
+
+  return 0;
+  fail:
+  spgp_secure_free(out, len);
+  spgp_free_packet(&msg);
+  spgp_free_packet(&pub);
+  spgp_crypto_backend_select(previous);
+  return 1;
+}
+
+typedef struct {
+	uint8_t data[128];
+  size_t len;
+} test_aead_out_t;
+
+static void test_aead_emit(void *ctx, const uint8_t *data, size_t len) {
+	test_aead_out_t *out = ctx;
+
+	if (len > sizeof(out->data) - out->len) RAISE(BUFFER_OVERFLOW);
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static uint32_t test_aead_decrypt(const spgp_aead_params_t *params,
+                                  const uint8_t *key,
+                                  const spgp_aead_segment_t *segs,
+                                  uint32_t threads, test_aead_out_t *out) {
+	memset(out, 0, sizeof(*out));
+	if (setjmp(exception)) return _spgp_err;
+  spgp_aead_decrypt(params, key, 16, segs, 2, threads, test_aead_emit, out);
+  return 0;
+}
+
+static uint8_t test_spgp_aead(void) {
+	// SEIPD v2 body, AES-128 OCB in 64 byte chunks, session key 00 01 .. 0F
+	uint8_t body[] = {
+  	0x02, 0x07, 0x02, 0x00, 0x37, 0x82, 0x2E, 0xB2, 0x30, 0x16, 0x2F,
+    0x4F, 0x7D, 0x3E, 0xA7, 0x4D, 0x43, 0x30, 0x3B, 0x5B, 0x01,
+    0x55, 0xA9, 0x05, 0x53, 0x90, 0xE5, 0x12, 0x68, 0x6D, 0xCD,
+    0x7C, 0x6C, 0xF8, 0x3E, 0xDF, 0x43, 0x27, 0x94, 0x09, 0x6C,
+    0x13, 0x53, 0x1C, 0x69, 0xA4, 0x29, 0x94, 0x8A, 0x2B, 0x61,
+    0x77, 0x7B, 0xE0, 0xD5, 0xE8, 0xAD, 0x11, 0xC4, 0x87, 0x7C,
+    0x10, 0xE2, 0x81, 0x8A, 0xF9, 0x77, 0xEF, 0x9B, 0x4B, 0x1B,
+    0x9F, 0xFD, 0x19, 0x73, 0x42, 0xDA, 0x5F, 0xCE, 0x5E, 0x03,
+    0x2D, 0x79, 0x7A, 0x47, 0x9A, 0xD0, 0x1F, 0x99, 0xE7, 0x5B,
+    0x1C, 0xB8, 0xB9, 0x70, 0x50, 0x66, 0xBE, 0xB8, 0x7D, 0xDE,
+    0xD4, 0xCF, 0xD0, 0x85, 0x89, 0x09, 0xC3, 0x7D, 0xF7, 0x1E,
+    0x5D, 0x5D, 0xAC, 0xF2, 0xEB, 0x87, 0x6C, 0x13, 0x56, 0xE4,
+    0xAA, 0xD2, 0x73, 0x1B, 0xE6, 0xE7, 0x6C, 0xCB, 0xF8, 0xDB,
+    0x13, 0x83, 0xBC, 0x4D, 0xEB, 0x7E, 0x20, 0x36, 0x03, 0x58,
+    0x45, 0x34, 0x94, 0x1F, 0xAD, 0x7F, 0xC4, 0xE6, 0x91, 0x2C,
+    0x6E, 0x20, 0xF1 };
+  const char plain[] =
+  	"Chunks of AEAD encrypted data are decrypted on every thread there is.\n";
+  const char *backends[] = {
+#ifdef HAVE_GCRYPT
+  	"gcrypt",
+#endif
+    "builtin" };
+  char previous[16];
+  uint8_t key[16];
+  spgp_aead_params_t params;
+  spgp_aead_segment_t segs[2];
+  test_aead_out_t out;
+  size_t idx = 0;
+  uint32_t i, threads;
+	function = __FUNCTION__;
+  PRINT_FUNCTION();
+
+	strncpy(previous, spgp_crypto_backend_name(), sizeof(previous) - 1);
+  previous[sizeof(previous) - 1] = 0;
+  for (i = 0; i < sizeof(key); i++) key[i] = i;
+
+  PRINT_TEST("SEIPD V2 HEADER");
+  spgp_aead_read_params(body, &idx, sizeof(body), PKT_TYPE_SYM_ENC_INT_DATA,
+                        &params);
+  ASSERT_EQUAL((idx == 4 + SPGP_AEAD_SALT_LEN &&
+                params.aeadAlgo == AEAD_ALGO_OCB &&
+                spgp_aead_plain_length(&params, sizeof(body) - idx) ==
+                sizeof(plain) - 1), 1);
+
+	// Split inside the first chunk, as a partial length header would
+	segs[0].data = body + idx;
+  segs[0].offset = 0;
+  segs[0].len = 50;
+  segs[1].data = body + idx + 50;
+  segs[1].offset = 50;
+  segs[1].len = sizeof(body) - idx - 50;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+  	ASSERT_EQUAL(spgp_crypto_backend_select(backends[i]), 0);
+  	for (threads = 1; threads <= 2; threads++) {
+  	  PRINT_TEST("%s DECRYPT ON %u THREADS", backends[i], threads);
+      ASSERT_EQUAL((test_aead_decrypt(&params, key, segs, threads,
+                                      &out) == 0 &&
+                    out.len == sizeof(plain) - 1 &&
+                    memcmp(out.data, plain, out.len) == 0), 1);
+    }
+  }
+
+  PRINT_TEST("CHANGED FINAL TAG");
+  body[sizeof(body) - 1] ^= 1;
+  ASSERT_EQUAL(test_aead_decrypt(&params, key, segs, 2, &out),
+               DECRYPT_FAILED);
+  spgp_crypto_backend_select(previous);
+
+  return 0;
+  fail:
+  spgp_crypto_backend_select(previous);
+  return 1;
+}
+
 uint8_t test_spgp_packet(void) {
 	uint8_t wasEnabled;
   
@@ -67,6 +1738,30 @@ uint8_t test_spgp_packet(void) {
   spgp_debug_log_set(0);
   
 	ASSERT_SUCCESS(test_spgp_decode_message());
+	ASSERT_SUCCESS(test_spgp_decode_file());
+	ASSERT_SUCCESS(test_spgp_large_message());
+	ASSERT_SUCCESS(test_spgp_range());
+	ASSERT_SUCCESS(test_spgp_dearmor());
+	ASSERT_SUCCESS(test_spgp_sink());
+	ASSERT_SUCCESS(test_spgp_decode_opts());
+	ASSERT_SUCCESS(test_spgp_scan());
+	ASSERT_SUCCESS(test_spgp_inspect());
+	ASSERT_SUCCESS(test_spgp_import_keyring());
+	ASSERT_SUCCESS(test_spgp_fingerprint());
+	ASSERT_SUCCESS(test_spgp_verify());
+	ASSERT_SUCCESS(test_spgp_onepass());
+	ASSERT_SUCCESS(test_spgp_verify_detached());
+	ASSERT_SUCCESS(test_spgp_verify_cleartext());
+	ASSERT_SUCCESS(test_spgp_keystore());
+	ASSERT_SUCCESS(test_spgp_keychain());
+	ASSERT_SUCCESS(test_spgp_secmem());
+	ASSERT_SUCCESS(test_spgp_keychain_snapshot());
+	ASSERT_SUCCESS(test_spgp_agent());
+	ASSERT_SUCCESS(test_spgp_pk_backend());
+	ASSERT_SUCCESS(test_spgp_crypto_backend());
+	ASSERT_SUCCESS(test_spgp_rsa());
+	ASSERT_SUCCESS(test_spgp_ecc());
+	ASSERT_SUCCESS(test_spgp_aead());
   
   spgp_debug_log_set(wasEnabled);
   
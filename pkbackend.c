@@ -0,0 +1,656 @@
+/*
+ *  pkbackend.c
+ *  libsimplepgp
+ *
+ *  Asynchronous session key decryption for keys kept outside the library.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "pkbackend.h"
+#include "keychain.h"
+#include "mpi.h"
+#include "secmem.h"
+#include "bn.h"
+#include "rsa.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Recipients of one message sent to the backend
+#define SPGP_PK_MAX_BATCH 64
+
+typedef struct spgp_pk_job_struct spgp_pk_job_t;
+
+struct spgp_pk_request_struct {
+	spgp_pk_job_t *job;
+  spgp_session_pkt_t *session;
+  spgp_pk_request_t *next;      // soft and batch backend queue
+};
+
+/* The session packets of one message, out with the backend.  A job waited
+   on by a decoding thread is freed by that thread.  An asynchronous one is
+   finished by whichever thread completes its last request. */
+struct spgp_pk_job_struct {
+	pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  uint32_t pending;             // requests not done, +1 while submitting
+  uint32_t decrypted;
+  spgp_session_pkt_t *session;  // first session decrypted
+  uint8_t async;
+  spgp_packet_t *chain;         // session packets, for asynchronous jobs
+  uint8_t *message;
+  size_t length;
+  spgp_decode_done_t done;
+  void *ctx;
+  uint32_t count;
+  spgp_pk_request_t reqs[];
+};
+
+/* The soft and batch backends: a queue of requests and the threads that
+   work through it. */
+typedef struct spgp_pk_soft_struct {
+	spgp_pk_backend_t backend;    // first, so the backend finds the rest
+	pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  spgp_pk_request_t *head;
+  spgp_pk_request_t *tail;
+  uint32_t queued;
+  uint32_t latencyUs;           // soft: time each request takes
+  uint32_t lingerUs;            // batch: wait for a full batch
+  uint32_t depth;
+  uint8_t stop;
+  pthread_t workers[];
+} spgp_pk_soft_t;
+
+static pthread_mutex_t backend_mtx = PTHREAD_MUTEX_INITIALIZER;
+static spgp_pk_backend_t backend;
+static uint8_t backend_set;
+
+// Session decrypted by the backend, for the decode that finishes its job
+static __thread spgp_session_pkt_t *session_hint = NULL;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static uint8_t spgp_pk_backend_get(spgp_pk_backend_t *be);
+
+static spgp_pk_job_t *spgp_pk_job_new(spgp_packet_t *chain);
+static void spgp_pk_job_submit(spgp_pk_job_t *job,
+                               const spgp_pk_backend_t *be);
+static void spgp_pk_job_release(spgp_pk_job_t *job);
+static void spgp_pk_job_finish(spgp_pk_job_t *job);
+static void spgp_pk_job_free(spgp_pk_job_t *job);
+
+static spgp_pk_soft_t *spgp_pk_soft_new(uint32_t depth);
+static spgp_pk_backend_t *spgp_pk_soft_start(spgp_pk_soft_t *soft,
+                                             void *(*worker)(void *));
+static uint8_t spgp_pk_soft_submit(spgp_pk_request_t *req, void *ctx);
+static void *spgp_pk_soft_worker(void *arg);
+static void spgp_pk_soft_decrypt(spgp_pk_request_t *req);
+
+static void *spgp_pk_batch_worker(void *arg);
+static uint32_t spgp_pk_batch_take(spgp_pk_soft_t *soft,
+                                   spgp_pk_request_t **reqs);
+static void spgp_pk_batch_decrypt(spgp_pk_request_t **reqs, uint32_t count);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+void spgp_pk_backend_set(const spgp_pk_backend_t *be) {
+	pthread_mutex_lock(&backend_mtx);
+  if (be && be->submit) {
+  	backend = *be;
+    backend_set = 1;
+  }
+  else {
+  	memset(&backend, 0, sizeof(backend));
+    backend_set = 0;
+  }
+  pthread_mutex_unlock(&backend_mtx);
+}
+
+uint8_t spgp_pk_backend_active(void) {
+	uint8_t active;
+
+	pthread_mutex_lock(&backend_mtx);
+  active = backend_set;
+  pthread_mutex_unlock(&backend_mtx);
+  return active;
+}
+
+const uint8_t *spgp_pk_request_keyid(const spgp_pk_request_t *req) {
+	return req->session->keyid;
+}
+
+uint8_t spgp_pk_request_algo(const spgp_pk_request_t *req) {
+	return req->session->algo;
+}
+
+const uint8_t *spgp_pk_request_mpi(const spgp_pk_request_t *req, uint8_t i,
+                                   size_t *len) {
+	spgp_mpi_t *mpi;
+
+	mpi = (i == 0) ? req->session->mpi1 : (i == 1) ? req->session->mpi2 : NULL;
+  if (NULL == mpi) return NULL;
+  if (len) *len = mpi->count;
+  return mpi->data + 2;
+}
+
+void spgp_pk_request_done(spgp_pk_request_t *req, const uint8_t *frame,
+                          size_t len, uint32_t err) {
+	spgp_pk_job_t *job = req->job;
+
+	pthread_mutex_lock(&job->mtx);
+	if (0 == err) {
+  	// Tokens return the full modulus length, with leading zeros
+  	while (len && frame && 0 == *frame) {
+    	frame++;
+      len--;
+    }
+    err = spgp_session_unwrap(req->session, frame, len);
+  }
+  if (0 == err) {
+  	job->decrypted++;
+    if (NULL == job->session) job->session = req->session;
+  }
+  else {
+  	Serial.printf("Backend failed a session key (0x%x)\n", err);
+  }
+  pthread_mutex_unlock(&job->mtx);
+  spgp_pk_job_release(job);
+}
+
+uint8_t spgp_decode_message_async(uint8_t *message, size_t length,
+                                  spgp_decode_done_t done, void *ctx) {
+	spgp_decode_opts_t opts;
+  spgp_pk_backend_t be;
+  spgp_packet_t *chain = NULL;
+  spgp_packet_t *msg;
+  spgp_pk_job_t *job = NULL;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == message || 0 == length || NULL == done) RAISE(INVALID_ARGS);
+
+	// Read just the session packets, and leave the rest for when a key is in
+	if (spgp_pk_backend_get(&be)) {
+  	memset(&opts, 0, sizeof(opts));
+    opts.wanted = SPGP_PACKET_MASK(PKT_TYPE_SESSION);
+    chain = spgp_decode_message_with_opts(message, length, &opts);
+    job = spgp_pk_job_new(chain);
+  }
+
+	// Nothing for the backend, so the message is decoded as usual
+	if (NULL == job) {
+  	spgp_free_packet(&chain);
+    msg = spgp_decode_message(message, length);
+    done(msg, msg ? 0 : spgp_err(), ctx);
+    return 0;
+  }
+
+	job->async = 1;
+  job->chain = chain;
+  job->message = message;
+  job->length = length;
+  job->done = done;
+  job->ctx = ctx;
+  spgp_pk_job_submit(job, &be);
+  return 0;
+}
+
+/**
+ * Ask the backend for every session key in |chain| that isn't decrypted
+ * yet, and wait for it.
+ *
+ * Nothing is raised, so callers can free what they hold and fail the
+ * message as having no session key.
+ *
+ * @param chain Any packet of the chain holding the session packets
+ * @return Number of session keys decrypted, 0 if there is no backend
+ */
+uint32_t spgp_pk_decrypt_sessions(spgp_packet_t *chain) {
+	spgp_pk_backend_t be;
+  spgp_pk_job_t *job;
+  uint32_t decrypted;
+
+	// Finishing an asynchronous job, possibly on a backend thread that
+  // mustn't wait on itself
+	if (session_hint) return 0;
+	if (!spgp_pk_backend_get(&be)) return 0;
+  job = spgp_pk_job_new(chain);
+  if (NULL == job) return 0;
+
+	spgp_pk_job_submit(job, &be);
+  pthread_mutex_lock(&job->mtx);
+  while (job->pending) pthread_cond_wait(&job->cond, &job->mtx);
+  decrypted = job->decrypted;
+  pthread_mutex_unlock(&job->mtx);
+  spgp_pk_job_free(job);
+
+	Serial.printf("Backend decrypted %u session keys\n", decrypted);
+  return decrypted;
+}
+
+/**
+ * Give |session| the key the backend decrypted for this thread's message,
+ * if it is the same session key packet.
+ *
+ * @return 0 if |session| has its key, -1 otherwise
+ */
+uint8_t spgp_pk_session_hint(spgp_session_pkt_t *session) {
+	spgp_session_pkt_t *hint = session_hint;
+  char *key;
+
+	if (NULL == hint || NULL == hint->key) return -1;
+  if (memcmp(hint->keyid, session->keyid, 8) || hint->algo != session->algo)
+  	return -1;
+  if (NULL == session->mpi1 || hint->mpi1->count != session->mpi1->count ||
+      memcmp(hint->mpi1->data, session->mpi1->data, hint->mpi1->count + 2))
+  	return -1;
+  if ((NULL == hint->mpi2) != (NULL == session->mpi2)) return -1;
+  if (hint->mpi2 && (hint->mpi2->count != session->mpi2->count ||
+      memcmp(hint->mpi2->data, session->mpi2->data, hint->mpi2->count + 2)))
+  	return -1;
+
+	key = spgp_secure_alloc(hint->keylen);
+  if (NULL == key) return -1;
+  memcpy(key, hint->key, hint->keylen);
+  spgp_secure_free(session->key, session->keylen);
+  session->key = key;
+  session->keylen = hint->keylen;
+  session->symAlgo = hint->symAlgo;
+  return 0;
+}
+
+spgp_pk_backend_t *spgp_pk_soft_backend_create(uint32_t latencyUs,
+                                               uint32_t depth) {
+	spgp_pk_soft_t *soft = spgp_pk_soft_new(depth);
+
+	if (NULL == soft) return NULL;
+  soft->latencyUs = latencyUs;
+  return spgp_pk_soft_start(soft, spgp_pk_soft_worker);
+}
+
+void spgp_pk_soft_backend_free(spgp_pk_backend_t *be) {
+	spgp_pk_soft_t *soft = (spgp_pk_soft_t *)be;
+  uint32_t i;
+
+	if (NULL == soft) return;
+	pthread_mutex_lock(&soft->mtx);
+  soft->stop = 1;
+  pthread_cond_broadcast(&soft->cond);
+  pthread_mutex_unlock(&soft->mtx);
+  for (i = 0; i < soft->depth; i++) pthread_join(soft->workers[i], NULL);
+
+	pthread_cond_destroy(&soft->cond);
+  pthread_mutex_destroy(&soft->mtx);
+  free(soft);
+}
+
+spgp_pk_backend_t *spgp_pk_batch_backend_create(uint32_t threads,
+                                                uint32_t lingerUs) {
+	spgp_pk_soft_t *soft = spgp_pk_soft_new(threads);
+
+	if (NULL == soft) return NULL;
+  soft->lingerUs = lingerUs;
+  return spgp_pk_soft_start(soft, spgp_pk_batch_worker);
+}
+
+void spgp_pk_batch_backend_free(spgp_pk_backend_t *be) {
+	// Same queue and threads as the soft backend
+	spgp_pk_soft_backend_free(be);
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static uint8_t spgp_pk_backend_get(spgp_pk_backend_t *be) {
+	uint8_t active;
+
+	pthread_mutex_lock(&backend_mtx);
+  active = backend_set;
+  *be = backend;
+  pthread_mutex_unlock(&backend_mtx);
+  return active;
+}
+
+/**
+ * Make a request for every session packet in |chain| without a key.
+ *
+ * @return The job, or NULL if there is nothing to ask for
+ */
+static spgp_pk_job_t *spgp_pk_job_new(spgp_packet_t *chain) {
+	spgp_session_pkt_t *sessions[SPGP_PK_MAX_BATCH];
+  spgp_session_pkt_t *session;
+  spgp_packet_t *cur;
+  spgp_pk_job_t *job;
+  uint32_t count = 0;
+  uint32_t i;
+
+	if (NULL == chain) return NULL;
+  while (chain->prev) chain = chain->prev;
+
+	for (cur = chain; cur && count < SPGP_PK_MAX_BATCH; cur = cur->next) {
+  	if (NULL == cur->header || cur->header->type != PKT_TYPE_SESSION)
+    	continue;
+    session = cur->c.session;
+    if (NULL == session || session->key || NULL == session->mpi1) continue;
+    if (spgp_session_mpi_count(session->algo) > 1 && NULL == session->mpi2)
+    	continue;
+    sessions[count++] = session;
+  }
+  if (0 == count) return NULL;
+
+	job = calloc(1, sizeof(*job) + count * sizeof(spgp_pk_request_t));
+  if (NULL == job) return NULL;
+  pthread_mutex_init(&job->mtx, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  job->count = count;
+  for (i = 0; i < count; i++) {
+  	job->reqs[i].job = job;
+    job->reqs[i].session = sessions[i];
+  }
+  return job;
+}
+
+/**
+ * Hand every request of |job| to the backend.  The job is held until all
+ * of them are submitted, so one finished early can't finish the job.
+ */
+static void spgp_pk_job_submit(spgp_pk_job_t *job,
+                               const spgp_pk_backend_t *be) {
+	uint32_t i;
+
+	job->pending = job->count + 1;
+	for (i = 0; i < job->count; i++) {
+  	if (be->submit(&job->reqs[i], be->ctx))
+    	spgp_pk_request_done(&job->reqs[i], NULL, 0, KEY_NOT_FOUND);
+  }
+  spgp_pk_job_release(job);
+}
+
+/**
+ * Drop one hold on |job|, and finish it with the last.  A job can't be
+ * used after.
+ */
+static void spgp_pk_job_release(spgp_pk_job_t *job) {
+	uint8_t last, async;
+
+	// A waiting thread may free the job as soon as it is unlocked
+	pthread_mutex_lock(&job->mtx);
+  last = (0 == --job->pending);
+  async = job->async;
+  if (last && !async) pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->mtx);
+  if (last && async) spgp_pk_job_finish(job);
+}
+
+/**
+ * Decode an asynchronous job's message, with the session key the backend
+ * decrypted, and pass it on.
+ */
+static void spgp_pk_job_finish(spgp_pk_job_t *job) {
+	spgp_packet_t *msg = NULL;
+  uint32_t err = DECRYPT_FAILED;
+
+	if (job->session) {
+  	session_hint = job->session;
+    msg = spgp_decode_message(job->message, job->length);
+    session_hint = NULL;
+    err = msg ? 0 : spgp_err();
+  }
+  job->done(msg, err, job->ctx);
+  spgp_pk_job_free(job);
+}
+
+static void spgp_pk_job_free(spgp_pk_job_t *job) {
+	spgp_free_packet(&job->chain);
+	pthread_cond_destroy(&job->cond);
+  pthread_mutex_destroy(&job->mtx);
+  free(job);
+}
+
+static spgp_pk_soft_t *spgp_pk_soft_new(uint32_t depth) {
+	spgp_pk_soft_t *soft;
+
+	if (0 == depth) depth = 1;
+  soft = calloc(1, sizeof(*soft) + depth * sizeof(pthread_t));
+  if (NULL == soft) return NULL;
+  pthread_mutex_init(&soft->mtx, NULL);
+  pthread_cond_init(&soft->cond, NULL);
+  soft->depth = depth;
+  soft->backend.submit = spgp_pk_soft_submit;
+  soft->backend.ctx = soft;
+  return soft;
+}
+
+/**
+ * Start |soft|'s threads.  It is freed if none start.
+ */
+static spgp_pk_backend_t *spgp_pk_soft_start(spgp_pk_soft_t *soft,
+                                             void *(*worker)(void *)) {
+	uint32_t i, depth = soft->depth;
+
+	soft->depth = 0;
+	for (i = 0; i < depth; i++) {
+  	if (pthread_create(&soft->workers[i], NULL, worker, soft)) break;
+    soft->depth++;
+  }
+  if (0 == soft->depth) {
+  	pthread_cond_destroy(&soft->cond);
+    pthread_mutex_destroy(&soft->mtx);
+    free(soft);
+    return NULL;
+  }
+  return &soft->backend;
+}
+
+static uint8_t spgp_pk_soft_submit(spgp_pk_request_t *req, void *ctx) {
+	spgp_pk_soft_t *soft = ctx;
+
+	pthread_mutex_lock(&soft->mtx);
+  if (soft->stop) {
+  	pthread_mutex_unlock(&soft->mtx);
+    return -1;
+  }
+  req->next = NULL;
+  if (soft->tail) soft->tail->next = req;
+  else soft->head = req;
+  soft->tail = req;
+  soft->queued++;
+  pthread_cond_signal(&soft->cond);
+  pthread_mutex_unlock(&soft->mtx);
+  return 0;
+}
+
+static void *spgp_pk_soft_worker(void *arg) {
+	spgp_pk_soft_t *soft = arg;
+  spgp_pk_request_t *req;
+
+	for (;;) {
+  	pthread_mutex_lock(&soft->mtx);
+    while (NULL == soft->head && !soft->stop)
+    	pthread_cond_wait(&soft->cond, &soft->mtx);
+    req = soft->head;
+    if (req) {
+    	soft->head = req->next;
+      if (NULL == soft->head) soft->tail = NULL;
+      soft->queued--;
+    }
+    pthread_mutex_unlock(&soft->mtx);
+    if (NULL == req) break;
+
+		// The token's time, while the caller gets on with other messages
+		if (soft->latencyUs) usleep(soft->latencyUs);
+    spgp_pk_soft_decrypt(req);
+  }
+  return NULL;
+}
+
+/**
+ * Decrypt |req| with the keychain, as a token would with its own key.
+ */
+static void spgp_pk_soft_decrypt(spgp_pk_request_t *req) {
+	const spgp_keychain_key_t *key;
+  uint8_t *frame;
+  size_t len;
+
+	if (setjmp(exception)) {
+  	spgp_pk_request_done(req, NULL, 0, _spgp_err);
+    return;
+  }
+
+	if (!spgp_keychain_is_valid()) RAISE(KEYCHAIN_ERROR);
+  key = spgp_keychain_key_with_id(req->session->keyid);
+  if (NULL == key) RAISE(KEY_NOT_FOUND);
+  frame = spgp_session_private_op(req->session, key, &len);
+
+	spgp_pk_request_done(req, frame, len, 0);
+  spgp_secure_free(frame, len);
+}
+
+static void *spgp_pk_batch_worker(void *arg) {
+	spgp_pk_soft_t *soft = arg;
+  spgp_pk_request_t *reqs[SPGP_BN_LANES];
+  struct timespec until;
+  uint32_t count;
+
+	for (;;) {
+  	pthread_mutex_lock(&soft->mtx);
+    while (NULL == soft->head && !soft->stop)
+    	pthread_cond_wait(&soft->cond, &soft->mtx);
+
+		// Give a partial batch a moment to fill
+		if (soft->head && soft->queued < SPGP_BN_LANES && soft->lingerUs &&
+        !soft->stop) {
+    	clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += (long)(soft->lingerUs % 1000000) * 1000;
+      until.tv_sec += soft->lingerUs / 1000000 + until.tv_nsec / 1000000000;
+      until.tv_nsec %= 1000000000;
+      while (soft->queued < SPGP_BN_LANES && !soft->stop &&
+             0 == pthread_cond_timedwait(&soft->cond, &soft->mtx, &until))
+      	;
+    }
+    count = spgp_pk_batch_take(soft, reqs);
+    pthread_mutex_unlock(&soft->mtx);
+    if (0 == count) break;
+
+		spgp_pk_batch_decrypt(reqs, count);
+  }
+  return NULL;
+}
+
+/**
+ * Take the request at the head of the queue and, for RSA, later ones for
+ * the same key until the batch is full.  Called with the lock held.
+ *
+ * @return Number of requests put in |reqs|
+ */
+static uint32_t spgp_pk_batch_take(spgp_pk_soft_t *soft,
+                                   spgp_pk_request_t **reqs) {
+	spgp_pk_request_t *first = soft->head, *cur, *kept = NULL;
+  spgp_pk_request_t **link;
+  uint32_t count = 0;
+
+	if (NULL == first) return 0;
+  soft->head = first->next;
+  reqs[count++] = first;
+
+	link = &soft->head;
+  while (first->session->algo == ASYM_ALGO_RSA && *link &&
+         count < SPGP_BN_LANES) {
+  	cur = *link;
+    if (cur->session->algo == ASYM_ALGO_RSA &&
+        0 == memcmp(cur->session->keyid, first->session->keyid, 8)) {
+    	reqs[count++] = cur;
+      *link = cur->next;
+    }
+    else {
+    	kept = cur;
+      link = &cur->next;
+    }
+  }
+  // The tail only moves if the walk reached it
+  if (NULL == *link) soft->tail = kept;
+  soft->queued -= count;
+  return count;
+}
+
+/**
+ * Decrypt requests for one RSA key together, in vector lanes.  A lone
+ * request is done as the soft backend does it.
+ */
+static void spgp_pk_batch_decrypt(spgp_pk_request_t **reqs, uint32_t count) {
+	const spgp_keychain_key_t *key;
+  const spgp_mpi_t *c[SPGP_BN_LANES];
+  uint8_t *frames[SPGP_BN_LANES];
+  size_t lens[SPGP_BN_LANES];
+  uint32_t i;
+
+	if (1 == count) {
+  	spgp_pk_soft_decrypt(reqs[0]);
+    return;
+  }
+
+	// Nothing is finished before the lanes are, so all fail together
+	if (setjmp(exception)) {
+  	for (i = 0; i < count; i++)
+    	spgp_pk_request_done(reqs[i], NULL, 0, _spgp_err);
+    return;
+  }
+
+	if (!spgp_keychain_is_valid()) RAISE(KEYCHAIN_ERROR);
+  key = spgp_keychain_key_with_id(reqs[0]->session->keyid);
+  if (NULL == key) RAISE(KEY_NOT_FOUND);
+  for (i = 0; i < count; i++) c[i] = reqs[i]->session->mpi1;
+  spgp_rsa_decrypt_lanes(spgp_keychain_rsa_key(key), c, count, frames, lens);
+
+	for (i = 0; i < count; i++) {
+  	spgp_pk_request_done(reqs[i], frames[i], lens[i],
+                         frames[i] ? 0 : DECRYPT_FAILED);
+    spgp_secure_free(frames[i], lens[i]);
+  }
+}
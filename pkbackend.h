@@ -0,0 +1,39 @@
+/*
+ *  pkbackend.h
+ *  libsimplepgp
+ *
+ *  Session key decryption through a pluggable private key backend.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _PKBACKEND_H
+
+#include "packet_private.h"
+#include "keychain.h"
+
+uint8_t spgp_pk_backend_active(void);
+uint8_t spgp_pk_session_hint(spgp_session_pkt_t *session);
+uint32_t spgp_pk_decrypt_sessions(spgp_packet_t *chain);
+
+uint8_t *spgp_session_private_op(spgp_session_pkt_t *session,
+                                 const spgp_keychain_key_t *key,
+                                 size_t *frame_len);
+uint32_t spgp_session_unwrap(spgp_session_pkt_t *session,
+                             const uint8_t *frame, size_t frame_len);
+
+#define _PKBACKEND_H
+#endif
@@ -0,0 +1,661 @@
+/*
+ *  range.c
+ *  libsimplepgp
+ *
+ *  Random-access reads of literal data inside an encrypted message.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "util.h"
+#include "agent.h"
+#include "pkbackend.h"
+#include "crypto.h"
+
+//#include "gcrypt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_RANGE_INDEX_MAGIC    "SPGPRIDX"
+#define SPGP_RANGE_INDEX_VERSION  2
+#define SPGP_RANGE_DIGEST_LEN     20
+#define SPGP_RANGE_DIGEST_SPAN    64
+#define SPGP_RANGE_BUFSIZE        4096
+#define SPGP_RANGE_MAX_BLKSIZE    16
+#define SPGP_RANGE_DEFAULT_CHUNKS 8
+
+// One contiguous run of body bytes.  Partial-length packets split their
+// body into many of these, separated by length headers in the stream.
+typedef struct {
+  size_t srcOffset; // first byte of the chunk in the underlying stream
+  size_t offset;    // logical offset of that byte within the body
+  size_t length;
+} spgp_chunk_t;
+
+typedef struct {
+  spgp_chunk_t *chunks;
+  uint32_t count;
+  uint32_t size;
+} spgp_chunk_map_t;
+
+struct spgp_range_struct {
+	uint8_t *message;
+  size_t length;
+  size_t encryptedIdx;     // tag byte of the encrypted data packet
+  size_t cipherLength;     // ciphertext bytes, excluding the version byte
+  size_t dataLength;       // literal data bytes
+  uint32_t blksize;
+  uint8_t hasCipher;
+  spgp_crypto_cipher_t *hd;
+  spgp_chunk_map_t cipher; // ciphertext stream -> message
+  spgp_chunk_map_t data;   // literal data -> plaintext stream
+};
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+
+static void spgp_chunk_map_add(spgp_chunk_map_t *map, size_t srcOffset,
+                               size_t offset, size_t length);
+
+static spgp_chunk_t *spgp_chunk_map_find(spgp_chunk_map_t *map,
+                                         size_t offset);
+
+static void spgp_range_gather(spgp_range_t *range, size_t offset,
+                              size_t len, uint8_t *out);
+
+static void spgp_range_decrypt(spgp_range_t *range, size_t offset,
+                               size_t len, uint8_t *out);
+
+static void spgp_range_scan_message(spgp_range_t *range);
+
+static void spgp_range_load_session_key(spgp_range_t *range);
+
+static void spgp_range_scan_literal(spgp_range_t *range);
+
+static uint8_t spgp_range_load_index(spgp_range_t *range,
+                                     const char *index_path);
+
+static void spgp_range_digest(spgp_range_t *range, uint8_t *digest);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+spgp_range_t *spgp_range_open(uint8_t *message, size_t length,
+                              const char *index_path) {
+	spgp_range_t *range = NULL;
+
+	Serial.printf("begin\n");
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    spgp_range_close(&range);
+    goto end;
+  }
+
+	if (NULL == message || 0 == length) RAISE(INVALID_ARGS);
+
+	range = malloc(sizeof(*range));
+  if (NULL == range) RAISE(OUT_OF_MEMORY);
+  memset(range, 0, sizeof(*range));
+  range->message = message;
+  range->length = length;
+
+	// A usable index saves walking every partial-length header of the
+  // encrypted packet and of the literal packet inside it.
+  if (NULL == index_path || spgp_range_load_index(range, index_path) != 0)
+    spgp_range_scan_message(range);
+
+	spgp_range_load_session_key(range);
+
+	if (range->data.count == 0)
+  	spgp_range_scan_literal(range);
+
+	Serial.printf("%lu bytes of literal data in %u chunks\n",
+  	(unsigned long)range->dataLength, range->data.count);
+
+  end:
+  return range;
+}
+
+uint8_t spgp_read_range(spgp_range_t *range, size_t offset, size_t len,
+                        uint8_t *out) {
+	spgp_chunk_t *chunk;
+  size_t n;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == range || NULL == out) RAISE(INVALID_ARGS);
+  if (offset + len < offset || offset + len > range->dataLength)
+  	RAISE(BUFFER_OVERFLOW);
+
+	// Literal data can straddle chunks, so decrypt it one chunk at a time
+	while (len) {
+  	chunk = spgp_chunk_map_find(&range->data, offset);
+    if (NULL == chunk) RAISE(BUFFER_OVERFLOW);
+    n = chunk->offset + chunk->length - offset;
+    if (n > len) n = len;
+    spgp_range_decrypt(range, chunk->srcOffset + (offset - chunk->offset),
+                       n, out);
+    out += n;
+    offset += n;
+    len -= n;
+  }
+
+	return 0;
+}
+
+size_t spgp_range_length(spgp_range_t *range) {
+	if (NULL == range) return 0;
+  return range->dataLength;
+}
+
+uint8_t spgp_range_save_index(spgp_range_t *range, const char *index_path) {
+	spgp_chunk_map_t *maps[2];
+  uint8_t *buf = NULL;
+  uint8_t *p;
+  size_t buflen;
+  size_t i, j;
+  FILE *fp;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == range || NULL == index_path) RAISE(INVALID_ARGS);
+
+	maps[0] = &range->cipher;
+  maps[1] = &range->data;
+
+	// Header: magic, version, 4 lengths, digest, 2 chunk counts.  Then 3
+  // words per chunk.  All fields are 64-bit big-endian except version,
+  // digest and counts.
+	buflen = 8 + 4 + 4*8 + SPGP_RANGE_DIGEST_LEN + 2*4 +
+  	(maps[0]->count + maps[1]->count) * 3 * 8;
+	buf = malloc(buflen);
+  if (NULL == buf) RAISE(OUT_OF_MEMORY);
+
+	p = buf;
+  memcpy(p, SPGP_RANGE_INDEX_MAGIC, 8);
+  p += 8;
+  p = spgp_put_be32(p, SPGP_RANGE_INDEX_VERSION);
+  p = spgp_put_be64(p, range->length);
+  p = spgp_put_be64(p, range->encryptedIdx);
+  p = spgp_put_be64(p, range->cipherLength);
+  p = spgp_put_be64(p, range->dataLength);
+  spgp_range_digest(range, p);
+  p += SPGP_RANGE_DIGEST_LEN;
+  for (i = 0; i < 2; i++)
+  	p = spgp_put_be32(p, maps[i]->count);
+  for (i = 0; i < 2; i++) {
+  	for (j = 0; j < maps[i]->count; j++) {
+    	p = spgp_put_be64(p, maps[i]->chunks[j].srcOffset);
+    	p = spgp_put_be64(p, maps[i]->chunks[j].offset);
+    	p = spgp_put_be64(p, maps[i]->chunks[j].length);
+    }
+  }
+
+	fp = fopen(index_path, "wb");
+  if (NULL == fp) {
+  	free(buf);
+    RAISE(IO_ERROR);
+  }
+  i = fwrite(buf, 1, buflen, fp);
+  if (fclose(fp) != 0 || i != buflen) {
+  	free(buf);
+    RAISE(IO_ERROR);
+  }
+  free(buf);
+
+	Serial.printf("Wrote %lu byte range index\n", (unsigned long)buflen);
+  return 0;
+}
+
+void spgp_range_close(spgp_range_t **range) {
+	if (NULL == range || NULL == *range) return;
+
+	if ((*range)->hasCipher) spgp_crypto_cipher_close((*range)->hd);
+  if ((*range)->cipher.chunks) free((*range)->cipher.chunks);
+  if ((*range)->data.chunks) free((*range)->data.chunks);
+  memset(*range, 0, sizeof(**range));
+  free(*range);
+  *range = NULL;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static void spgp_chunk_map_add(spgp_chunk_map_t *map, size_t srcOffset,
+                               size_t offset, size_t length) {
+	spgp_chunk_t *tmp;
+
+	if (map->count == map->size) {
+  	map->size = map->size ? map->size << 1 : SPGP_RANGE_DEFAULT_CHUNKS;
+    tmp = realloc(map->chunks, map->size * sizeof(*tmp));
+    if (NULL == tmp) RAISE(OUT_OF_MEMORY);
+    map->chunks = tmp;
+  }
+  map->chunks[map->count].srcOffset = srcOffset;
+  map->chunks[map->count].offset = offset;
+  map->chunks[map->count].length = length;
+  map->count++;
+}
+
+static spgp_chunk_t *spgp_chunk_map_find(spgp_chunk_map_t *map,
+                                         size_t offset) {
+	uint32_t lo = 0;
+  uint32_t hi = map->count;
+  uint32_t mid;
+
+	// Chunks are stored in order of logical offset, so bisect
+	while (lo < hi) {
+  	mid = lo + (hi - lo) / 2;
+    if (offset < map->chunks[mid].offset)
+    	hi = mid;
+    else if (offset - map->chunks[mid].offset >= map->chunks[mid].length)
+    	lo = mid + 1;
+    else
+    	return &map->chunks[mid];
+  }
+  return NULL;
+}
+
+/**
+ * Copy bytes of the ciphertext stream out of the message.
+ *
+ * The ciphertext stream is the body of the encrypted packet with its version
+ * byte and every partial body length header removed.
+ */
+static void spgp_range_gather(spgp_range_t *range, size_t offset,
+                              size_t len, uint8_t *out) {
+	spgp_chunk_t *chunk;
+  size_t n;
+
+	while (len) {
+  	chunk = spgp_chunk_map_find(&range->cipher, offset);
+    if (NULL == chunk) RAISE(BUFFER_OVERFLOW);
+    n = chunk->offset + chunk->length - offset;
+    if (n > len) n = len;
+    memcpy(out, range->message + chunk->srcOffset + (offset - chunk->offset), n);
+    out += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/**
+ * Decrypt bytes of the plaintext stream.
+ *
+ * OpenPGP's CFB mode feeds each ciphertext block forward as the IV of the
+ * next, so decryption can start at any block boundary given only the
+ * ciphertext block before it.  The first block uses an all-zero IV.
+ */
+static void spgp_range_decrypt(spgp_range_t *range, size_t offset,
+                               size_t len, uint8_t *out) {
+	uint8_t buf[SPGP_RANGE_BUFSIZE];
+  uint8_t iv[SPGP_RANGE_MAX_BLKSIZE];
+  size_t pos, skip, n;
+
+	if (offset + len < offset || offset + len > range->cipherLength)
+  	RAISE(BUFFER_OVERFLOW);
+
+	pos = offset - (offset % range->blksize);
+  skip = offset - pos;
+  if (pos)
+  	spgp_range_gather(range, pos - range->blksize, range->blksize, iv);
+  else
+  	memset(iv, 0, range->blksize);
+  spgp_crypto_cipher_setiv(range->hd, iv);
+
+	// The buffer is a whole number of blocks, so CFB state carries across
+  // each pass without resetting the IV.
+	while (len) {
+  	n = SPGP_RANGE_BUFSIZE;
+    if (n > skip + len) n = skip + len;
+    spgp_range_gather(range, pos, n, buf);
+    if (spgp_crypto_cipher_decrypt(range->hd, buf, buf, n) != 0)
+    	RAISE(GCRY_ERROR);
+    memcpy(out, buf + skip, n - skip);
+    out += n - skip;
+    len -= n - skip;
+    pos += n;
+    skip = 0;
+  }
+  memset(buf, 0, sizeof(buf));
+}
+
+/**
+ * Find the encrypted data packet and record where each of its chunks lies.
+ */
+static void spgp_range_scan_message(spgp_range_t *range) {
+	spgp_pkt_header_t header;
+  spgp_packet_t pkt;
+  uint8_t *msg = range->message;
+  size_t length = range->length;
+  size_t idx = 0;
+  size_t start = 0;
+  size_t chunklen;
+  uint8_t headerlen;
+  uint8_t is_partial;
+
+	// Walk top-level packets up to the encrypted data
+	while (1) {
+  	if (idx >= length) RAISE(FORMAT_UNSUPPORTED);
+    start = idx;
+  	memset(&header, 0, sizeof(header));
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.header = &header;
+    spgp_parse_header(msg, &idx, length, &pkt);
+    if (header.type == PKT_TYPE_SYM_ENC_INT_DATA) break;
+    if (header.isPartial) RAISE(FORMAT_UNSUPPORTED);
+    if (length - idx < header.contentLength) RAISE(BUFFER_OVERFLOW);
+    idx += header.contentLength;
+  }
+  range->encryptedIdx = start;
+
+	// As of this writing, only version 1 exists
+	if (msg[idx] != 1) RAISE(FORMAT_UNSUPPORTED);
+  if (header.contentLength < 1 || length - idx < header.contentLength)
+  	RAISE(INCOMPLETE_PACKET);
+
+	spgp_chunk_map_add(&range->cipher, idx + 1, 0, header.contentLength - 1);
+  range->cipherLength = header.contentLength - 1;
+  idx += header.contentLength;
+  is_partial = header.isPartial;
+
+	while (is_partial) {
+  	chunklen = spgp_new_header_length(msg + idx, length - idx,
+                                      &headerlen, &is_partial);
+    idx += headerlen - 1;
+    if (idx > length || length - idx < chunklen) RAISE(INCOMPLETE_PACKET);
+    spgp_chunk_map_add(&range->cipher, idx, range->cipherLength, chunklen);
+    range->cipherLength += chunklen;
+    idx += chunklen;
+  }
+
+	Serial.printf("%lu ciphertext bytes in %u chunks\n",
+  	(unsigned long)range->cipherLength, range->cipher.count);
+}
+
+/**
+ * Decrypt the session key with the keychain and prepare the cipher.
+ */
+static void spgp_range_load_session_key(spgp_range_t *range) {
+	spgp_packet_t *chain = NULL;
+  spgp_packet_t *cur;
+  spgp_session_pkt_t *session = NULL;
+  size_t idx = 0;
+  uint8_t check[SPGP_RANGE_MAX_BLKSIZE + 2];
+
+	// Session packets are everything before the encrypted data.  Decoding
+  // only that much leaves the bulk data untouched.
+	if (range->encryptedIdx)
+  	chain = spgp_packet_decode_loop(range->message, &idx,
+                                    range->encryptedIdx);
+  for (cur = chain; cur; cur = cur->next) {
+  	if (cur->header && cur->header->type == PKT_TYPE_SESSION &&
+    		cur->c.session && cur->c.session->key) {
+      session = cur->c.session;
+      break;
+    }
+  }
+  // None the keychain could open.  Ask the key agent, then the private key
+  // backend, for all of them.
+  if (NULL == session && chain && (spgp_agent_decrypt_sessions(chain) ||
+                                   spgp_pk_decrypt_sessions(chain))) {
+  	for (cur = chain; cur && NULL == session; cur = cur->next)
+    	if (cur->header && cur->header->type == PKT_TYPE_SESSION &&
+      		cur->c.session && cur->c.session->key)
+        session = cur->c.session;
+  }
+  if (NULL == session) {
+  	Serial.printf("No session key found!\n");
+    spgp_free_packet(&chain);
+    RAISE(DECRYPT_FAILED);
+  }
+
+	range->blksize = spgp_iv_length_for_symmetric_algo(session->symAlgo);
+  if (range->blksize == 0 || range->blksize > SPGP_RANGE_MAX_BLKSIZE) {
+  	spgp_free_packet(&chain);
+  	RAISE(FORMAT_UNSUPPORTED);
+  }
+
+	range->hd = spgp_crypto_cipher_open(session->symAlgo,
+                                      (uint8_t *)session->key,
+                                      session->keylen);
+  range->hasCipher = 1;
+  spgp_free_packet(&chain);
+
+	// Same quick check as a full decrypt: the last two bytes of the random
+  // prefix are repeated.
+	spgp_range_decrypt(range, 0, range->blksize + 2, check);
+  if (memcmp(check + range->blksize - 2, check + range->blksize, 2) != 0) {
+  	Serial.printf("Decrypted data block fails validation!\n");
+    RAISE(DECRYPT_FAILED);
+  }
+}
+
+/**
+ * Find the literal data inside the plaintext stream.
+ *
+ * Only the few bytes of each literal header are decrypted.  The literal can
+ * itself use partial lengths, in which case its headers are interleaved with
+ * the data in the plaintext.
+ */
+static void spgp_range_scan_literal(spgp_range_t *range) {
+	spgp_pkt_header_t header;
+  spgp_packet_t pkt;
+  uint8_t hdr[8];
+  size_t pos, avail, idx;
+  size_t chunklen, fields;
+  uint8_t headerlen;
+  uint8_t is_partial;
+
+	// Plaintext starts with one block of random data and 2 check bytes
+  pos = range->blksize + 2;
+  if (pos >= range->cipherLength) RAISE(INCOMPLETE_PACKET);
+  avail = range->cipherLength - pos;
+  if (avail > sizeof(hdr)) avail = sizeof(hdr);
+  spgp_range_decrypt(range, pos, avail, hdr);
+
+	memset(&header, 0, sizeof(header));
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.header = &header;
+  idx = 0;
+  spgp_parse_header(hdr, &idx, avail, &pkt);
+  if (header.type != PKT_TYPE_LITERAL_DATA) {
+  	Serial.printf("Range reads need a bare literal packet, found %u\n",
+    	header.type);
+  	RAISE(FORMAT_UNSUPPORTED);
+  }
+  pos += idx;
+  chunklen = header.contentLength;
+  is_partial = header.isPartial;
+
+	// Format byte, filename length, filename, and 4-byte date come before
+  // the data.  The first chunk is always large enough to hold them.
+	if (chunklen < 2 || range->cipherLength - pos < chunklen)
+  	RAISE(INCOMPLETE_PACKET);
+  spgp_range_decrypt(range, pos, 2, hdr);
+  fields = 6 + hdr[1];
+  if (chunklen < fields) RAISE(INVALID_HEADER);
+
+	spgp_chunk_map_add(&range->data, pos + fields, 0, chunklen - fields);
+  range->dataLength = chunklen - fields;
+  pos += chunklen;
+
+	while (is_partial) {
+  	if (pos >= range->cipherLength) RAISE(INCOMPLETE_PACKET);
+  	avail = range->cipherLength - pos;
+    if (avail > 5) avail = 5;
+    spgp_range_decrypt(range, pos, avail, hdr);
+    chunklen = spgp_new_header_length(hdr, avail, &headerlen, &is_partial);
+    pos += headerlen - 1;
+    if (range->cipherLength - pos < chunklen) RAISE(INCOMPLETE_PACKET);
+    spgp_chunk_map_add(&range->data, pos, range->dataLength, chunklen);
+    range->dataLength += chunklen;
+    pos += chunklen;
+  }
+}
+
+/**
+ * Load chunk maps from a sidecar index.
+ *
+ * Any problem with the file -- missing, stale, or corrupt -- just means the
+ * message gets scanned instead, so nothing here raises.  The index must
+ * carry the digest of this message's encrypted packet, and every offset is
+ * checked against the message, since reads trust the maps blindly.
+ *
+ * @return 0 if the index was loaded, non-0 if the message must be scanned.
+ */
+static uint8_t spgp_range_load_index(spgp_range_t *range,
+                                     const char *index_path) {
+	spgp_chunk_map_t *maps[2];
+  uint64_t limits[2];
+  uint64_t totals[2];
+  uint64_t src, off, len, sum;
+  uint32_t counts[2];
+  uint8_t digest[SPGP_RANGE_DIGEST_LEN];
+  uint8_t *buf = NULL;
+  uint8_t *p;
+  long filelen;
+  uint32_t i, j;
+  FILE *fp;
+
+	fp = fopen(index_path, "rb");
+  if (NULL == fp) return -1;
+  if (fseek(fp, 0, SEEK_END) != 0 ||
+  		(filelen = ftell(fp)) < 8 + 4 + 4*8 + SPGP_RANGE_DIGEST_LEN + 2*4 ||
+  		fseek(fp, 0, SEEK_SET) != 0 || NULL == (buf = malloc(filelen)) ||
+      fread(buf, 1, filelen, fp) != (size_t)filelen) {
+  	fclose(fp);
+    if (buf) free(buf);
+    return -1;
+  }
+  fclose(fp);
+
+	p = buf;
+  if (memcmp(p, SPGP_RANGE_INDEX_MAGIC, 8) != 0) goto fail;
+  p += 8;
+  if (spgp_get_be32(p) != SPGP_RANGE_INDEX_VERSION) goto fail;
+  p += 4;
+  if (spgp_get_be64(p) != range->length) goto fail;
+  p += 8;
+  range->encryptedIdx = spgp_get_be64(p);
+  p += 8;
+  totals[0] = spgp_get_be64(p);
+  p += 8;
+  totals[1] = spgp_get_be64(p);
+  p += 8;
+  // Same length isn't enough: another message could have been written
+  // over this one.  Its encrypted packet starts with a fresh random prefix.
+  if (range->encryptedIdx >= range->length) goto fail;
+  spgp_range_digest(range, digest);
+  if (memcmp(p, digest, SPGP_RANGE_DIGEST_LEN) != 0) goto fail;
+  p += SPGP_RANGE_DIGEST_LEN;
+  counts[0] = spgp_get_be32(p);
+  p += 4;
+  counts[1] = spgp_get_be32(p);
+  p += 4;
+
+	if (totals[0] > range->length || totals[1] > totals[0] ||
+      counts[0] == 0 || counts[1] == 0 ||
+      (uint64_t)(filelen - (p - buf)) !=
+      	((uint64_t)counts[0] + counts[1]) * 3 * 8)
+  	goto fail;
+
+	maps[0] = &range->cipher;
+  maps[1] = &range->data;
+  limits[0] = range->length;
+  limits[1] = totals[0];
+	for (i = 0; i < 2; i++) {
+  	sum = 0;
+  	for (j = 0; j < counts[i]; j++) {
+    	src = spgp_get_be64(p);
+      off = spgp_get_be64(p + 8);
+      len = spgp_get_be64(p + 16);
+      p += 24;
+      // Chunks must be contiguous, in order, and inside their stream
+      if (off != sum || src > limits[i] || len > limits[i] - src) goto fail;
+      sum += len;
+      spgp_chunk_map_add(maps[i], src, off, len);
+    }
+    if (sum != totals[i]) goto fail;
+  }
+  range->cipherLength = totals[0];
+  range->dataLength = totals[1];
+
+	free(buf);
+  Serial.printf("Loaded range index from %s\n", index_path);
+  return 0;
+
+  fail:
+  Serial.printf("Ignoring stale or invalid range index %s\n", index_path);
+  free(buf);
+  range->cipher.count = 0;
+  range->data.count = 0;
+  range->encryptedIdx = 0;
+  range->cipherLength = 0;
+  range->dataLength = 0;
+  return -1;
+}
+
+/**
+ * Hash the start of the encrypted data packet: its header, version and the
+ * first few cipher blocks, which begin with the random prefix.
+ *
+ * @param digest Buffer of SPGP_RANGE_DIGEST_LEN bytes
+ */
+static void spgp_range_digest(spgp_range_t *range, uint8_t *digest) {
+	spgp_crypto_hash_t *hash;
+  size_t len;
+
+	len = range->length - range->encryptedIdx;
+  if (len > SPGP_RANGE_DIGEST_SPAN) len = SPGP_RANGE_DIGEST_SPAN;
+
+	hash = spgp_crypto_hash_open(HASH_ALGO_SHA1);
+  spgp_crypto_hash_write(hash, range->message + range->encryptedIdx, len);
+  memcpy(digest, spgp_crypto_hash_read(hash), SPGP_RANGE_DIGEST_LEN);
+  spgp_crypto_hash_close(hash);
+}
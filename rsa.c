@@ -0,0 +1,316 @@
+/*
+ *  rsa.c
+ *  libsimplepgp
+ *
+ *  RSA decryption with the Chinese remainder theorem.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "rsa.h"
+#include "mpi.h"
+#include "secmem.h"
+
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// OpenPGP's RSA secret key MPIs, after n and e
+#define SPGP_RSA_MPIS 6
+
+enum { RSA_N, RSA_E, RSA_D, RSA_P, RSA_Q, RSA_U };
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static uint32_t spgp_rsa_limbs(const uint8_t *buf, size_t len);
+static uint8_t spgp_rsa_read(const spgp_rsa_key_t *key, const spgp_mpi_t *c,
+                             uint32_t *cc);
+static uint8_t *spgp_rsa_combine(const spgp_rsa_key_t *key,
+                                 const uint32_t *m1, const uint32_t *m2,
+                                 size_t *len);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+/**
+ * Work out a key's CRT parameters.
+ *
+ * @param mpis The key's n, e, d, p, q and u, as in packets
+ * @param mpiCount Number of MPIs in |mpis|
+ * @return The parameters, in secure memory.  Free with spgp_rsa_key_free().
+ */
+spgp_rsa_key_t *spgp_rsa_key_new(const uint8_t *mpis, uint8_t mpiCount) {
+	const uint8_t *val[SPGP_RSA_MPIS];
+  size_t len[SPGP_RSA_MPIS];
+  uint32_t tmp[SPGP_BN_MAX_LIMBS], pq[SPGP_BN_MAX_LIMBS];
+  spgp_rsa_key_t *key;
+  uint32_t pLimbs, qLimbs;
+  uint8_t bad, i;
+
+	if (NULL == mpis || mpiCount < SPGP_RSA_MPIS) RAISE(INVALID_ARGS);
+  for (i = 0; i < SPGP_RSA_MPIS; i++) {
+  	len[i] = spgp_mpi_length((uint8_t *)mpis);
+    val[i] = mpis + 2;
+    mpis += len[i] + 2;
+  }
+
+	key = spgp_secure_alloc(sizeof(*key));
+  if (NULL == key) RAISE(OUT_OF_MEMORY);
+
+	// Each prime has to fit half the largest modulus, and be odd
+	key->nLimbs = spgp_rsa_limbs(val[RSA_N], len[RSA_N]);
+  bad = key->nLimbs == 0 || key->nLimbs > SPGP_BN_MAX_LIMBS ||
+  	spgp_rsa_limbs(val[RSA_P], len[RSA_P]) > SPGP_BN_MAX_LIMBS / 2 ||
+    spgp_rsa_limbs(val[RSA_Q], len[RSA_Q]) > SPGP_BN_MAX_LIMBS / 2 ||
+    spgp_bn_mont_init(&key->p, val[RSA_P], len[RSA_P]) != 0 ||
+    spgp_bn_mont_init(&key->q, val[RSA_Q], len[RSA_Q]) != 0;
+  if (!bad) {
+  	pLimbs = key->p.limbs;
+    qLimbs = key->q.limbs;
+    spgp_bn_read(key->n, key->nLimbs, val[RSA_N], len[RSA_N]);
+
+		// A key whose primes aren't the modulus' would decrypt to noise.
+    // Reductions also need each prime at least half as long as the
+    // numbers reduced by it.
+		bad = pLimbs + qLimbs < key->nLimbs || key->nLimbs > 2 * pLimbs ||
+    	key->nLimbs > 2 * qLimbs || pLimbs > 2 * qLimbs;
+    if (!bad) {
+    	spgp_bn_mul(pq, key->p.n, pLimbs, key->q.n, qLimbs);
+      memset(tmp, 0, sizeof(tmp));
+      memcpy(tmp, key->n, key->nLimbs * sizeof(*tmp));
+      bad = memcmp(pq, tmp, (pLimbs + qLimbs) * sizeof(*tmp)) != 0;
+    }
+    // d and u are below n
+    bad |= spgp_bn_read(tmp, key->nLimbs, val[RSA_D], len[RSA_D]) != 0;
+  }
+  if (bad) {
+  	spgp_rsa_key_free(key);
+    RAISE(FORMAT_UNSUPPORTED);
+  }
+
+	// Exponents mod p - 1 and q - 1.  The primes are odd, so that is just
+  // the low bit cleared.
+	memcpy(pq, key->p.n, pLimbs * sizeof(*pq));
+  pq[0] &= ~1;
+  spgp_bn_mod(key->dp, tmp, key->nLimbs, pq, pLimbs);
+  memcpy(pq, key->q.n, qLimbs * sizeof(*pq));
+  pq[0] &= ~1;
+  spgp_bn_mod(key->dq, tmp, key->nLimbs, pq, qLimbs);
+
+	// u = 1/p mod q, kept as u * R so one Montgomery product applies it
+	bad = spgp_bn_read(tmp, key->nLimbs, val[RSA_U], len[RSA_U]) != 0;
+  if (!bad) {
+  	spgp_bn_mod(key->uR, tmp, key->nLimbs, key->q.n, qLimbs);
+    spgp_bn_mont_mul(key->uR, key->uR, key->q.rr, &key->q);
+  }
+  spgp_secure_wipe(tmp, sizeof(tmp));
+  spgp_secure_wipe(pq, sizeof(pq));
+  if (bad) {
+  	spgp_rsa_key_free(key);
+    RAISE(FORMAT_UNSUPPORTED);
+  }
+  return key;
+}
+
+void spgp_rsa_key_free(spgp_rsa_key_t *key) {
+	if (key) spgp_secure_free(key, sizeof(*key));
+}
+
+/**
+ * m = c^d mod n, as m1 = c^dp mod p and m2 = c^dq mod q put back together
+ * with Garner's formula: m = m1 + p * (u * (m2 - m1) mod q).
+ *
+ * Each step costs the same for every key and ciphertext of a given size.
+ *
+ * @param key Parameters from spgp_rsa_key_new()
+ * @param c Ciphertext
+ * @param len Set to the length of the result
+ * @return The result without leading zeros, in secure memory.  Free with
+ *         spgp_secure_free().
+ */
+uint8_t *spgp_rsa_decrypt(const spgp_rsa_key_t *key, const spgp_mpi_t *c,
+                          size_t *len) {
+	uint32_t cc[SPGP_BN_MAX_LIMBS];
+  uint32_t m1[SPGP_BN_MAX_LIMBS / 2], m2[SPGP_BN_MAX_LIMBS / 2];
+  uint32_t t[SPGP_BN_MAX_LIMBS / 2];
+  uint8_t *frame;
+
+	if (spgp_rsa_read(key, c, cc) != 0) RAISE(DECRYPT_FAILED);
+
+	spgp_bn_mont_reduce(t, cc, key->nLimbs, &key->p);
+  spgp_bn_mod_exp(m1, t, key->dp, key->p.limbs, &key->p);
+  spgp_bn_mont_reduce(t, cc, key->nLimbs, &key->q);
+  spgp_bn_mod_exp(m2, t, key->dq, key->q.limbs, &key->q);
+
+	frame = spgp_rsa_combine(key, m1, m2, len);
+  spgp_secure_wipe(m1, sizeof(m1));
+  spgp_secure_wipe(m2, sizeof(m2));
+  spgp_secure_wipe(t, sizeof(t));
+  spgp_secure_wipe(cc, sizeof(cc));
+  if (NULL == frame) RAISE(OUT_OF_MEMORY);
+  return frame;
+}
+
+/**
+ * spgp_rsa_decrypt() for up to SPGP_BN_LANES ciphertexts at once.
+ *
+ * The exponentiations mod p and mod q run in the lanes of a vector unit,
+ * all with the key's dp and dq, so a batch costs little more than one.
+ *
+ * @param key Parameters from spgp_rsa_key_new()
+ * @param c Ciphertexts
+ * @param count Number of ciphertexts, at most SPGP_BN_LANES
+ * @param frames Set to each result, as from spgp_rsa_decrypt(), or to NULL
+ *        for a ciphertext at or above n
+ * @param lens Set to the length of each result
+ */
+void spgp_rsa_decrypt_lanes(const spgp_rsa_key_t *key,
+                            const spgp_mpi_t *const *c, uint32_t count,
+                            uint8_t **frames, size_t *lens) {
+	uint32_t cc[SPGP_BN_MAX_LIMBS];
+  uint32_t m1[SPGP_BN_MAX_LIMBS / 2], m2[SPGP_BN_MAX_LIMBS / 2];
+  uint32_t pLimbs = key->p.limbs, qLimbs = key->q.limbs;
+  uint8_t valid[SPGP_BN_LANES];
+  uint64_t *lp, *lq;
+  size_t size;
+  uint32_t i, j;
+  uint8_t err = 0;
+
+	if (count > SPGP_BN_LANES) RAISE(INVALID_ARGS);
+  size = (pLimbs + qLimbs) * SPGP_BN_LANES * sizeof(*lp);
+  lp = spgp_secure_alloc(size);
+  if (NULL == lp) RAISE(OUT_OF_MEMORY);
+  lq = lp + pLimbs * SPGP_BN_LANES;
+  memset(lp, 0, size);
+
+	// Each ciphertext mod p and mod q into its lane.  Unused lanes stay 0.
+	for (i = 0; i < count; i++) {
+  	frames[i] = NULL;
+    lens[i] = 0;
+    valid[i] = spgp_rsa_read(key, c[i], cc) == 0;
+    if (!valid[i]) continue;
+    spgp_bn_mont_reduce(m1, cc, key->nLimbs, &key->p);
+    for (j = 0; j < pLimbs; j++) lp[j * SPGP_BN_LANES + i] = m1[j];
+    spgp_bn_mont_reduce(m2, cc, key->nLimbs, &key->q);
+    for (j = 0; j < qLimbs; j++) lq[j * SPGP_BN_LANES + i] = m2[j];
+  }
+
+	err = spgp_bn_mod_exp_lanes(lp, lp, key->dp, pLimbs, &key->p) ||
+  	spgp_bn_mod_exp_lanes(lq, lq, key->dq, qLimbs, &key->q);
+
+	for (i = 0; !err && i < count; i++) {
+  	if (!valid[i]) continue;
+    for (j = 0; j < pLimbs; j++) m1[j] = (uint32_t)lp[j * SPGP_BN_LANES + i];
+    for (j = 0; j < qLimbs; j++) m2[j] = (uint32_t)lq[j * SPGP_BN_LANES + i];
+    frames[i] = spgp_rsa_combine(key, m1, m2, &lens[i]);
+    err = NULL == frames[i];
+  }
+
+	spgp_secure_free(lp, size);
+  spgp_secure_wipe(m1, sizeof(m1));
+  spgp_secure_wipe(m2, sizeof(m2));
+  spgp_secure_wipe(cc, sizeof(cc));
+  if (err) {
+  	for (i = 0; i < count; i++) {
+    	spgp_secure_free(frames[i], lens[i]);
+      frames[i] = NULL;
+    }
+    RAISE(OUT_OF_MEMORY);
+  }
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Limbs needed for a big-endian number, ignoring leading zeros.
+ */
+static uint32_t spgp_rsa_limbs(const uint8_t *buf, size_t len) {
+	while (len && 0 == *buf) {
+  	buf++;
+    len--;
+  }
+  return (len + 3) / 4;
+}
+
+/**
+ * Read a ciphertext.  Ones at or above n are rejected rather than reduced.
+ *
+ * @return 0 if |c| is below n, -1 otherwise
+ */
+static uint8_t spgp_rsa_read(const spgp_rsa_key_t *key, const spgp_mpi_t *c,
+                             uint32_t *cc) {
+	uint32_t tmp[SPGP_BN_MAX_LIMBS];
+
+	if (spgp_bn_read(cc, key->nLimbs, c->data + 2, c->count) != 0) return -1;
+  return spgp_bn_sub(tmp, cc, key->n, key->nLimbs) ? 0 : -1;
+}
+
+/**
+ * Put m1 = m mod p and m2 = m mod q back together with Garner's formula.
+ *
+ * @return m without leading zeros in secure memory, or NULL if out of
+ *         memory
+ */
+static uint8_t *spgp_rsa_combine(const spgp_rsa_key_t *key,
+                                 const uint32_t *m1, const uint32_t *m2,
+                                 size_t *len) {
+	uint32_t m[SPGP_BN_MAX_LIMBS], a[SPGP_BN_MAX_LIMBS];
+  uint32_t t[SPGP_BN_MAX_LIMBS / 2];
+  uint32_t pLimbs = key->p.limbs, qLimbs = key->q.limbs;
+  uint8_t *frame;
+
+	// m2 - m1 mod q, as m2 + (q - (m1 mod q))
+	spgp_bn_mont_reduce(t, m1, pLimbs, &key->q);
+  spgp_bn_sub(t, key->q.n, t, qLimbs);
+  spgp_bn_mod_add(t, m2, t, &key->q);
+  spgp_bn_mont_mul(t, t, key->uR, &key->q);
+
+	// p * h + m1 is below n, so the carry out is always 0
+	spgp_bn_mul(m, key->p.n, pLimbs, t, qLimbs);
+  memset(a, 0, (pLimbs + qLimbs) * sizeof(*a));
+  memcpy(a, m1, pLimbs * sizeof(*a));
+  spgp_bn_add(m, m, a, pLimbs + qLimbs);
+
+	frame = spgp_bn_export(m, pLimbs + qLimbs, len);
+  spgp_secure_wipe(m, sizeof(m));
+  spgp_secure_wipe(a, sizeof(a));
+  spgp_secure_wipe(t, sizeof(t));
+  return frame;
+}
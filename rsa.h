@@ -0,0 +1,49 @@
+/*
+ *  rsa.h
+ *  libsimplepgp
+ *
+ *  RSA decryption with the Chinese remainder theorem.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _RSA_H
+
+#include "packet_private.h"
+#include "bn.h"
+
+/* Everything a private key operation needs that doesn't depend on the
+   ciphertext, worked out once per key.  Held in secure memory. */
+typedef struct spgp_rsa_key_struct {
+	spgp_bn_mont_t p;
+  spgp_bn_mont_t q;
+  uint32_t n[SPGP_BN_MAX_LIMBS];
+  uint32_t nLimbs;
+  uint32_t dp[SPGP_BN_MAX_LIMBS / 2];   // d mod (p - 1)
+  uint32_t dq[SPGP_BN_MAX_LIMBS / 2];   // d mod (q - 1)
+  uint32_t uR[SPGP_BN_MAX_LIMBS / 2];   // 1/p mod q, in Montgomery form
+} spgp_rsa_key_t;
+
+spgp_rsa_key_t *spgp_rsa_key_new(const uint8_t *mpis, uint8_t mpiCount);
+void spgp_rsa_key_free(spgp_rsa_key_t *key);
+uint8_t *spgp_rsa_decrypt(const spgp_rsa_key_t *key, const spgp_mpi_t *c,
+                          size_t *len);
+void spgp_rsa_decrypt_lanes(const spgp_rsa_key_t *key,
+                            const spgp_mpi_t *const *c, uint32_t count,
+                            uint8_t **frames, size_t *lens);
+
+#define _RSA_H
+#endif
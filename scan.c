@@ -0,0 +1,216 @@
+/*
+ *  scan.c
+ *  libsimplepgp
+ *
+ *  Table-driven packet boundary scanner.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "scan.h"
+
+#include <string.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// tag_len values.  Other values are the number of old-format length bytes.
+#define SCAN_INDETERMINATE 0    // old format, body runs to the end
+#define SCAN_NEW_FORMAT    0xFE // new format, see new_len
+#define SCAN_INVALID       0xFF // top bit clear, not a tag byte
+
+// new_len flag for partial body lengths; low bits are the length bytes
+#define SCAN_PARTIAL       0x80
+
+// Indexed by tag byte: packet type and how its length is encoded
+static uint8_t tag_type[256];
+static uint8_t tag_len[256];
+
+// Indexed by first new-format length byte: number of length bytes
+static uint8_t new_len[256];
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static size_t spgp_scan_new_length(uint8_t *msg, size_t *idx, size_t length,
+                                   uint8_t *is_partial);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_scan(uint8_t *message, size_t length,
+                  spgp_scan_cb_t cb, void *ctx) {
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == message || 0 == length || NULL == cb) RAISE(INVALID_ARGS);
+  spgp_scan_packets(message, length, cb, ctx);
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+uint8_t spgp_scan_init(void) {
+	int i;
+
+	for (i = 0; i < 256; i++) {
+  	if (!(i & 0x80)) {
+    	tag_type[i] = 0;
+      tag_len[i] = SCAN_INVALID;
+    }
+    else if (i & 0x40) {
+    	tag_type[i] = i & 0x3F;
+      tag_len[i] = SCAN_NEW_FORMAT;
+    }
+    else {
+    	tag_type[i] = (i >> 2) & 0x0F;
+      switch (i & 0x03) {
+      	case 0: tag_len[i] = 1; break;
+        case 1: tag_len[i] = 2; break;
+        case 2: tag_len[i] = 4; break;
+        default: tag_len[i] = SCAN_INDETERMINATE; break;
+      }
+    }
+
+		if (i <= 191) new_len[i] = 1;
+    else if (i <= 223) new_len[i] = 2;
+    else if (i == 255) new_len[i] = 5;
+    else new_len[i] = SCAN_PARTIAL | 1;
+  }
+  return 0;
+}
+
+/**
+ * Find the boundaries of each packet in |msg|, without allocating.
+ *
+ * Each tag byte and first length byte is decoded with one table lookup, and
+ * bodies are stepped over using their lengths, so the cost is per packet
+ * (and per partial chunk) rather than per byte.  Only top-level packets are
+ * reported; compressed and encrypted packets are not opened.
+ *
+ * @param msg Binary packet stream
+ * @param length Length of |msg|
+ * @param cb Called for each packet.  Returning non-0 stops the scan.  May be
+ *           NULL to only validate the framing.
+ * @param ctx Passed to |cb|
+ * @return Offset just past the last packet scanned
+ */
+size_t spgp_scan_packets(uint8_t *msg, size_t length,
+                         spgp_scan_cb_t cb, void *ctx) {
+	spgp_span_t span;
+  size_t idx = 0;
+  size_t chunk;
+  uint8_t lenlen;
+  uint8_t is_partial;
+
+	while (idx < length) {
+  	span.offset = idx;
+    span.type = tag_type[msg[idx]];
+    span.isPartial = 0;
+    is_partial = 0;
+    lenlen = tag_len[msg[idx]];
+    idx++;
+
+		if (lenlen == SCAN_INVALID) RAISE(INVALID_HEADER);
+    if (lenlen == SCAN_NEW_FORMAT) {
+    	chunk = spgp_scan_new_length(msg, &idx, length, &is_partial);
+    }
+    else if (lenlen == SCAN_INDETERMINATE) {
+    	chunk = length - idx;
+    }
+    else {
+    	if (length - idx < lenlen) RAISE(INCOMPLETE_PACKET);
+      for (chunk = 0; lenlen; lenlen--)
+      	chunk = (chunk << 8) | msg[idx++];
+    }
+
+		span.bodyOffset = idx;
+    span.bodyLength = 0;
+    while (1) {
+    	if (length - idx < chunk) RAISE(BUFFER_OVERFLOW);
+      idx += chunk;
+      span.bodyLength += chunk;
+      if (!is_partial) break;
+      span.isPartial = 1;
+      chunk = spgp_scan_new_length(msg, &idx, length, &is_partial);
+    }
+    span.length = idx - span.offset;
+
+		if (cb && cb(&span, ctx)) break;
+  }
+  return idx;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+/**
+ * Decode the new-format length at |idx| and advance |idx| past it.
+ *
+ * Same encoding as spgp_new_header_length(), but looked up in new_len.
+ */
+static size_t spgp_scan_new_length(uint8_t *msg, size_t *idx, size_t length,
+                                   uint8_t *is_partial) {
+	uint8_t *p = msg + *idx;
+  uint8_t n;
+
+	if (*idx >= length) RAISE(INCOMPLETE_PACKET);
+  n = new_len[p[0]];
+  *is_partial = n & SCAN_PARTIAL;
+  n &= ~SCAN_PARTIAL;
+  if (length - *idx < n) RAISE(INCOMPLETE_PACKET);
+  *idx += n;
+
+	switch (n) {
+  	case 1:
+    	if (*is_partial) return (size_t)1 << (p[0] & 0x1F);
+    	return p[0];
+    case 2:
+    	return ((size_t)(p[0]-192) << 8) + p[1] + 192;
+    default:
+    	return ((size_t)p[1]<<24) | ((size_t)p[2]<<16) |
+      	((size_t)p[3]<<8) | p[4];
+  }
+}
@@ -0,0 +1,33 @@
+/*
+ *  scan.h
+ *  libsimplepgp
+ *
+ *  Table-driven packet boundary scanner.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _SCAN_H
+
+#include "packet_private.h"
+
+uint8_t spgp_scan_init(void);
+
+size_t spgp_scan_packets(uint8_t *msg, size_t length,
+                         spgp_scan_cb_t cb, void *ctx);
+
+#define _SCAN_H
+#endif
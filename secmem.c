@@ -0,0 +1,243 @@
+/*
+ *  secmem.c
+ *  libsimplepgp
+ *
+ *  Slab allocator over locked pages for secret material.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "secmem.h"
+#include "packet_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+// Address space set aside once, and made usable a slab at a time.  Every
+// slab serves one size class, so a block's class is found from its
+// address and frees don't need a header.
+#define SPGP_SECMEM_RESERVE ((size_t)16 << 20)
+#define SPGP_SECMEM_SLAB    ((size_t)64 << 10)
+#define SPGP_SECMEM_SLABS   (SPGP_SECMEM_RESERVE / SPGP_SECMEM_SLAB)
+
+// Classes are powers of two from 32 bytes (a session key) to 8192 (a
+// keychain key's RSA CRT parameters).  Larger requests go to malloc().
+#define SPGP_SECMEM_MIN_SHIFT 5
+#define SPGP_SECMEM_MAX_SHIFT 13
+#define SPGP_SECMEM_CLASSES   (SPGP_SECMEM_MAX_SHIFT - SPGP_SECMEM_MIN_SHIFT + 1)
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// A free block holds the link to the next one in its first word; the rest
+// of it is already zero.
+typedef struct spgp_secmem_block_struct {
+	struct spgp_secmem_block_struct *next;
+} spgp_secmem_block_t;
+
+static pthread_once_t secmem_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t secmem_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *pool;
+static uint32_t pool_slabs;          // slabs handed out so far
+static uint8_t pool_locked;
+static uint8_t slab_class[SPGP_SECMEM_SLABS];
+static spgp_secmem_block_t *free_list[SPGP_SECMEM_CLASSES];
+static uint8_t *bump[SPGP_SECMEM_CLASSES];     // unused end of newest slab
+static uint8_t *bump_end[SPGP_SECMEM_CLASSES];
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+static void spgp_secmem_setup(void);
+static uint8_t spgp_secmem_class(size_t size);
+static uint8_t *spgp_secmem_new_slab(uint8_t cls);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+/**
+ * Reserve the pool.  Safe to call more than once; the pool lasts for the
+ * life of the process, since packets holding secure memory may be freed
+ * after spgp_close().
+ *
+ * @return 0 if the pool is available, -1 if allocations fall back to malloc
+ */
+uint8_t spgp_secmem_init(void) {
+	pthread_once(&secmem_once, spgp_secmem_setup);
+  return pool ? 0 : -1;
+}
+
+/**
+ * Allocate |size| zeroed bytes for secret data.  Free it with
+ * spgp_secure_free().
+ *
+ * Blocks of up to 8192 bytes come from locked pages that are left out of
+ * core dumps.  Larger ones, or any once the pool is used up, come from
+ * malloc() and are only cleared on free.
+ *
+ * @param size Number of bytes to allocate
+ * @return Pointer to the memory, or NULL if out of memory
+ */
+void *spgp_secure_alloc(size_t size) {
+	spgp_secmem_block_t *blk = NULL;
+  uint8_t cls;
+
+	if (0 == size) size = 1;
+  if (spgp_secmem_init() != 0 ||
+      size > ((size_t)1 << SPGP_SECMEM_MAX_SHIFT))
+  	return calloc(1, size);
+
+	cls = spgp_secmem_class(size);
+	pthread_mutex_lock(&secmem_mtx);
+  if (free_list[cls]) {
+  	blk = free_list[cls];
+    free_list[cls] = blk->next;
+    blk->next = NULL;
+  }
+  else if (bump[cls] < bump_end[cls] || spgp_secmem_new_slab(cls)) {
+  	blk = (spgp_secmem_block_t *)bump[cls];
+    bump[cls] += (size_t)1 << (cls + SPGP_SECMEM_MIN_SHIFT);
+  }
+  pthread_mutex_unlock(&secmem_mtx);
+
+	if (NULL == blk) return calloc(1, size);
+  return blk;
+}
+
+/**
+ * Clear and free memory from spgp_secure_alloc().
+ *
+ * Memory from malloc() is also accepted, so lists holding both public and
+ * secret MPIs can be freed with one call.
+ *
+ * @param ptr Memory to free, may be NULL
+ * @param size Size it was allocated with
+ */
+void spgp_secure_free(void *ptr, size_t size) {
+	spgp_secmem_block_t *blk = ptr;
+  uint8_t cls;
+
+	if (NULL == ptr) return;
+  if (NULL == pool || (uint8_t *)ptr < pool ||
+      (uint8_t *)ptr >= pool + SPGP_SECMEM_RESERVE) {
+  	spgp_secure_wipe(ptr, size);
+    free(ptr);
+    return;
+  }
+
+	// Clear the whole block so everything on a free list is zero
+	cls = slab_class[((uint8_t *)ptr - pool) / SPGP_SECMEM_SLAB];
+  spgp_secure_wipe(ptr, (size_t)1 << (cls + SPGP_SECMEM_MIN_SHIFT));
+  pthread_mutex_lock(&secmem_mtx);
+  blk->next = free_list[cls];
+  free_list[cls] = blk;
+  pthread_mutex_unlock(&secmem_mtx);
+}
+
+/**
+ * Clear |size| bytes in a way the compiler can't drop as a dead store.
+ */
+void spgp_secure_wipe(void *ptr, size_t size) {
+	if (NULL == ptr || 0 == size) return;
+	memset(ptr, 0, size);
+#if defined(__GNUC__)
+  __asm__ __volatile__("" : : "r"(ptr) : "memory");
+#else
+	{
+  	volatile uint8_t *p = ptr;
+    while (size--) *p++ = 0;
+  }
+#endif
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static void spgp_secmem_setup(void) {
+	uint8_t *region;
+
+	region = mmap(NULL, SPGP_SECMEM_RESERVE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == region) {
+  	Serial.printf("Secure memory can't be reserved\n");
+  	return;
+  }
+#ifdef MADV_DONTDUMP
+	// Keep secrets out of core dumps
+	madvise(region, SPGP_SECMEM_RESERVE, MADV_DONTDUMP);
+#endif
+	pool_slabs = 0;
+  pool_locked = 1;
+  pool = region;
+}
+
+/**
+ * Smallest class that holds |size| bytes.
+ */
+static uint8_t spgp_secmem_class(size_t size) {
+	uint8_t cls = 0;
+
+	while (((size_t)1 << (cls + SPGP_SECMEM_MIN_SHIFT)) < size) cls++;
+  return cls;
+}
+
+/**
+ * Make the next slab usable for class |cls|.  Called with the pool locked.
+ *
+ * @return The new slab, or NULL if the pool is used up
+ */
+static uint8_t *spgp_secmem_new_slab(uint8_t cls) {
+	uint8_t *slab;
+
+	if (pool_slabs >= SPGP_SECMEM_SLABS) return NULL;
+  slab = pool + (size_t)pool_slabs * SPGP_SECMEM_SLAB;
+  if (mprotect(slab, SPGP_SECMEM_SLAB, PROT_READ | PROT_WRITE) != 0)
+  	return NULL;
+  // Locking is limited by RLIMIT_MEMLOCK.  Secrets are still kept out of
+  // core dumps and cleared if it fails, just not pinned.
+  if (pool_locked && mlock(slab, SPGP_SECMEM_SLAB) != 0) {
+  	Serial.printf("Secure memory can't be locked\n");
+    pool_locked = 0;
+  }
+  slab_class[pool_slabs++] = cls;
+  bump[cls] = slab;
+  bump_end[cls] = slab + SPGP_SECMEM_SLAB;
+  return slab;
+}
@@ -0,0 +1,35 @@
+/*
+ *  secmem.h
+ *  libsimplepgp
+ *
+ *  Locked, zeroized memory for secret keys and the buffers around them.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _SECMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t spgp_secmem_init(void);
+
+void *spgp_secure_alloc(size_t size);
+void spgp_secure_free(void *ptr, size_t size);
+void spgp_secure_wipe(void *ptr, size_t size);
+
+#define _SECMEM_H
+#endif
@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct spgp_packet_header_struct spgp_pkt_header_t;
 typedef struct spgp_packet_struct spgp_packet_t;
@@ -34,6 +35,159 @@ typedef struct spgp_userid_packet_struct    spgp_userid_pkt_t;
 typedef struct spgp_session_packet_struct   spgp_session_pkt_t;
 typedef struct spgp_literal_packet_struct   spgp_literal_pkt_t;
 typedef struct spgp_signature_packet_struct spgp_signature_pkt_t;
+typedef struct spgp_onepass_packet_struct   spgp_onepass_pkt_t;
+typedef struct spgp_range_struct spgp_range_t;
+typedef struct spgp_sink_struct spgp_sink_t;
+typedef struct spgp_keystore_struct spgp_keystore_t;
+typedef struct spgp_pk_request_struct spgp_pk_request_t;
+
+/**
+ * Callback that receives literal data from a sink.
+ *
+ * @param ctx Pointer given to spgp_sink_open_callback()
+ * @param data Next piece of literal data
+ * @param len Length of |data|
+ * @return 0 to continue, non-0 to stop decoding with an error
+ */
+typedef int (*spgp_sink_cb_t)(void *ctx, const uint8_t *data, size_t len);
+
+/** Length of a V4 key fingerprint (SHA-1) */
+#define SPGP_FINGERPRINT_LEN 20
+
+/** Length of the key that seals keychain snapshots (AES-256) */
+#define SPGP_SNAPSHOT_KEY_LEN 32
+
+/** Number of distinct packet types (RFC 4880 tags) */
+#define SPGP_PACKET_TYPES 64
+
+/** Bit for packet type |type| in spgp_decode_opts_t.wanted */
+#define SPGP_PACKET_MASK(type) ((uint64_t)1 << ((type) % SPGP_PACKET_TYPES))
+
+/** What the decoder should do with a packet after visiting it */
+typedef enum {
+	SPGP_VISIT_KEEP = 0, /**< Keep the packet in the returned list */
+  SPGP_VISIT_DROP,     /**< Free the packet (and any it contains) now */
+  SPGP_VISIT_STOP,     /**< Keep the packet and stop decoding */
+} spgp_visit_t;
+
+/**
+ * Callback run on each decoded packet of one type.
+ *
+ * @param pkt Fully decoded packet.  Packets inside a compressed or encrypted
+ *            packet are visited before the packet holding them.
+ * @param ctx spgp_decode_opts_t.ctx
+ * @return What to do with |pkt|
+ */
+typedef spgp_visit_t (*spgp_visit_cb_t)(spgp_packet_t *pkt, void *ctx);
+
+/** Options for spgp_decode_message_with_opts() */
+typedef struct spgp_decode_opts_struct {
+	/**
+   * Packet types to decode, as SPGP_PACKET_MASK() bits.  Other packets are
+   * skipped using their length alone and never allocated.  0 decodes all.
+   * Compressed and encrypted packets are only opened if wanted, and
+   * encrypted packets also need session key packets.
+   */
+	uint64_t wanted;
+  /** Visitor for each packet type, indexed by type.  NULL keeps the packet. */
+  spgp_visit_cb_t visit[SPGP_PACKET_TYPES];
+  /** Passed to every visitor */
+  void *ctx;
+  /**
+   * Threads decrypting the chunks of AEAD encrypted data (SEIPD version 2,
+   * or packet type 20), the decoding thread included.  0 uses one per CPU.
+   */
+  uint32_t threads;
+} spgp_decode_opts_t;
+
+/** Result of checking a signature packet */
+typedef enum {
+	SPGP_SIG_UNCHECKED = 0, /**< Not checked (e.g. no signed data seen yet) */
+  SPGP_SIG_GOOD,          /**< Signature is valid */
+  SPGP_SIG_BAD,           /**< Signature does not match the data or key */
+  SPGP_SIG_NO_KEY,        /**< Issuer's key not found */
+  SPGP_SIG_UNSUPPORTED,   /**< Signature type or algorithm not supported */
+} spgp_sig_status_t;
+
+/** Where one packet lies in a binary message, as found by spgp_scan() */
+typedef struct spgp_span_struct {
+	size_t offset;     /**< Offset of the tag byte */
+  size_t length;     /**< Bytes from the tag byte to the end of the packet */
+  size_t bodyOffset; /**< Offset of the first body byte */
+  size_t bodyLength; /**< Body bytes, not counting partial length headers */
+  uint8_t type;      /**< Packet type (RFC 4880 tag) */
+  uint8_t isPartial; /**< Non-0 if partial length headers split the body */
+} spgp_span_t;
+
+/**
+ * Callback run by spgp_scan() on each packet.
+ *
+ * @param span Location of the packet
+ * @param ctx Pointer given to spgp_scan()
+ * @return 0 to continue, non-0 to stop scanning
+ */
+typedef int (*spgp_scan_cb_t)(const spgp_span_t *span, void *ctx);
+
+/** Most recipients spgp_inspect() reports individually */
+#define SPGP_INSPECT_MAX_RECIPIENTS 16
+
+/** One public-key encrypted session key packet, as seen by spgp_inspect() */
+typedef struct spgp_recipient_struct {
+	uint8_t keyid[8]; /**< Key ID the session key is encrypted to, or 0s */
+  uint8_t algo;     /**< Public-key algorithm (RFC 4880 9.1) */
+  uint8_t hasKey;   /**< Non-0 if the in-RAM keychain holds the secret key */
+} spgp_recipient_t;
+
+/** Summary of a message filled in by spgp_inspect() */
+typedef struct spgp_inspect_struct {
+	/** Top-level packet types present, as SPGP_PACKET_MASK() bits */
+	uint64_t packetTypes;
+  /** Body length of the encrypted data packet, excluding length headers */
+  size_t encryptedLength;
+  /** Number of session key packets.  May exceed SPGP_INSPECT_MAX_RECIPIENTS */
+  uint32_t recipientCount;
+  /** The first SPGP_INSPECT_MAX_RECIPIENTS session key packets */
+  spgp_recipient_t recipients[SPGP_INSPECT_MAX_RECIPIENTS];
+  /** Non-0 if the message holds encrypted data */
+  uint8_t isEncrypted;
+  /** Non-0 if encrypted and some recipient's secret key is in the keychain */
+  uint8_t isDecryptable;
+} spgp_inspect_t;
+
+/**
+ * Private key operations done outside the library, as on a hardware token.
+ *
+ * submit() is given each session key the message is encrypted to, and must
+ * return quickly.  The work is done elsewhere, and every accepted request
+ * finished with spgp_pk_request_done(), from any thread.
+ */
+typedef struct spgp_pk_backend_struct {
+	/** Start |req|.  Return 0 if accepted, non-0 to fail it at once. */
+	uint8_t (*submit)(spgp_pk_request_t *req, void *ctx);
+  /** Passed to submit() */
+  void *ctx;
+} spgp_pk_backend_t;
+
+/**
+ * Called once spgp_decode_message_async() is done with a message.
+ *
+ * @param msg Decoded message, as from spgp_decode_message(), or NULL.  The
+ *        callback owns it.
+ * @param err 0, or the error if |msg| is NULL
+ * @param ctx Context given to spgp_decode_message_async()
+ */
+typedef void (*spgp_decode_done_t)(spgp_packet_t *msg, uint32_t err,
+                                   void *ctx);
+
+/** A detached signature and the file it signs, for spgp_verify_detached_files() */
+typedef struct spgp_detached_struct {
+	uint8_t *sig;             /**< Detached signature, binary or armored */
+  size_t sigLength;         /**< Length of |sig| */
+  const char *path;         /**< Signed file, or NULL to use |fd| */
+  int fd;                   /**< Signed file, if |path| is NULL */
+  spgp_sig_status_t status; /**< Set to the result */
+  uint32_t err;             /**< Set to the error, or 0 if the file is good */
+} spgp_detached_t;
 
 /**
  * Initialize simplepgp library
@@ -53,6 +207,28 @@ uint8_t spgp_init(void);
  */
 uint8_t spgp_close(void);
 
+/**
+ * Choose which crypto backend hashes, decrypts and runs private key
+ * operations.
+ *
+ * "gcrypt" uses libgcrypt.  "builtin" is portable C with no dependencies,
+ * covering SHA-1, SHA-224, SHA-256, CAST5, AES, RSA/Elgamal decryption and
+ * Curve25519 ECDH; anything else still goes to libgcrypt.  The default is "gcrypt", or
+ * "builtin" if the library was configured with --enable-builtin-crypto.
+ * Configured --without-gcrypt, "builtin" is the only backend.
+ *
+ * Call before starting any threads that use the library.
+ *
+ * @param name "gcrypt" or "builtin"
+ * @return 0 on success, non-zero if there is no backend by that name
+ */
+uint8_t spgp_crypto_backend_select(const char *name);
+
+/**
+ * Return the name of the selected crypto backend.
+ */
+const char *spgp_crypto_backend_name(void);
+
 
 /**
  * Break a binary OpenPGP message into decoded packets.
@@ -66,19 +242,224 @@ uint8_t spgp_close(void);
  * in-RAM keychain.  See spgp_decrypt_all_secret_keys() for how to load
  * a secret key into the keychain.
  *
+ * |message| may also be ASCII armored ("-----BEGIN PGP MESSAGE-----"); the
+ * armor is stripped and its checksum verified before decoding.
+ *
+ * |message| is only read, never modified, so the same buffer can be decoded
+ * again (for instance, after loading another key).
+ *
  * @param message Binary OpenPGP message to analyze
  * @param length Length of |message|
  * @return Linked list of decoded PGP packets, or NULL on failure
  */
-spgp_packet_t *spgp_decode_message(uint8_t *message, uint32_t length);
+spgp_packet_t *spgp_decode_message(uint8_t *message, size_t length);
+
+/**
+ * Break a binary OpenPGP message stored in a file into decoded packets.
+ *
+ * Same as spgp_decode_message(), but the file is memory-mapped read-only
+ * rather than copied into a buffer.  Encrypted data is decrypted into
+ * separate memory, so the file is never written.
+ *
+ * @param path Path of the file to decode
+ * @return Linked list of decoded PGP packets, or NULL on failure
+ */
+spgp_packet_t *spgp_decode_file(const char *path);
+
+/**
+ * Decode a message, sending its literal data to |sink|.
+ *
+ * Same as spgp_decode_message(), except that literal data is written to
+ * |sink| as it is decrypted and inflated, instead of being collected in
+ * memory.  The returned literal packets carry the filename and data length,
+ * but no data.
+ *
+ * @param message Binary or armored OpenPGP message to decode
+ * @param length Length of |message|
+ * @param sink Destination for literal data
+ * @return Linked list of decoded PGP packets, or NULL on failure
+ */
+spgp_packet_t *spgp_decode_message_to_sink(uint8_t *message, size_t length,
+                                           spgp_sink_t *sink);
+
+/**
+ * Decode a message stored in a file, sending its literal data to |sink|.
+ *
+ * See spgp_decode_file() and spgp_decode_message_to_sink().
+ *
+ * @param path Path of the file to decode
+ * @param sink Destination for literal data
+ * @return Linked list of decoded PGP packets, or NULL on failure
+ */
+spgp_packet_t *spgp_decode_file_to_sink(const char *path, spgp_sink_t *sink);
+
+/**
+ * Decode a message, keeping only packets selected by |opts|.
+ *
+ * Same as spgp_decode_message(), but unwanted packet types are skipped
+ * without being parsed, and visitors can inspect, drop, or stop at each
+ * packet as it is decoded.  Packets streamed to a sink are not filtered.
+ *
+ * @param message Binary or armored OpenPGP message to decode
+ * @param length Length of |message|
+ * @param opts Packet filter and visitors
+ * @return Linked list of kept packets, or NULL on failure or if no packets
+ *         were kept
+ */
+spgp_packet_t *spgp_decode_message_with_opts(uint8_t *message, size_t length,
+                                             const spgp_decode_opts_t *opts);
+
+/**
+ * Decode a message stored in a file, keeping only packets selected by |opts|.
+ *
+ * See spgp_decode_file() and spgp_decode_message_with_opts().
+ *
+ * @param path Path of the file to decode
+ * @param opts Packet filter and visitors
+ * @return Linked list of kept packets, or NULL on failure or if no packets
+ *         were kept
+ */
+spgp_packet_t *spgp_decode_file_with_opts(const char *path,
+                                          const spgp_decode_opts_t *opts);
+
+/**
+ * Get the type (RFC 4880 tag) of a decoded packet.
+ *
+ * @param pkt Packet to query
+ * @return Packet type, or 0 if |pkt| is NULL
+ */
+uint8_t spgp_packet_type(spgp_packet_t *pkt);
+
+/**
+ * Create a sink that passes literal data to a callback.
+ *
+ * @param cb Function to call with each piece of data
+ * @param ctx Passed to |cb| unchanged
+ * @return Sink, or NULL on failure
+ */
+spgp_sink_t *spgp_sink_open_callback(spgp_sink_cb_t cb, void *ctx);
+
+/**
+ * Create a sink that writes literal data to a file descriptor.
+ *
+ * Pieces of data found together are written with a single writev().  The
+ * descriptor is not closed by spgp_sink_close().
+ *
+ * @param fd Descriptor open for writing
+ * @return Sink, or NULL on failure
+ */
+spgp_sink_t *spgp_sink_open_fd(int fd);
+
+/**
+ * Create a sink that copies literal data into a caller-provided buffer.
+ *
+ * Decoding fails with a buffer overflow error if the data does not fit.
+ *
+ * @param buf Buffer to fill
+ * @param size Size of |buf|
+ * @return Sink, or NULL on failure
+ */
+spgp_sink_t *spgp_sink_open_buffer(uint8_t *buf, size_t size);
+
+/**
+ * Get the number of bytes written to a sink so far.
+ *
+ * @param sink Sink to query
+ * @return Bytes written
+ */
+size_t spgp_sink_length(spgp_sink_t *sink);
+
+/**
+ * Frees all resources associated with a sink.
+ *
+ * @param sink Pointer-to-pointer-to-sink to free.
+ */
+void spgp_sink_close(spgp_sink_t **sink);
 
+/**
+ * Convert an ASCII armored OpenPGP block to its binary form.
+ *
+ * Text before the "-----BEGIN PGP" line and armor headers are skipped.  If
+ * the block carries a CRC-24 checksum it must match.  Cleartext signed
+ * messages are not handled here.
+ *
+ * @param armored ASCII armored text
+ * @param length Length of |armored|
+ * @param binary Set to a newly allocated buffer.  Caller must free().
+ * @param binlen Set to size of |binary| (in bytes)
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_dearmor(uint8_t *armored, size_t length,
+                     uint8_t **binary, size_t *binlen);
+
+
+/**
+ * Find the boundaries of every packet in a binary message or keyring.
+ *
+ * Packet headers are decoded with table lookups and bodies are stepped over
+ * using their lengths, so nothing is copied or allocated and the cost does
+ * not depend on the size of the bodies.  Only top-level packets are
+ * reported: compressed and encrypted packets are not opened.  ASCII armor
+ * is not accepted; see spgp_dearmor().
+ *
+ * @param message Binary OpenPGP packets
+ * @param length Length of |message|
+ * @param cb Called with the location of each packet, in order
+ * @param ctx Passed to |cb|
+ * @return 0 for success (including when |cb| stops the scan), non-0 if the
+ *         packet framing is invalid or truncated.
+ */
+uint8_t spgp_scan(uint8_t *message, size_t length,
+                  spgp_scan_cb_t cb, void *ctx);
+
+/**
+ * Summarize a message without decoding or decrypting it.
+ *
+ * Only packet headers and the fixed fields at the start of each session key
+ * packet are read; packet bodies are stepped over using their lengths, and
+ * nothing is allocated for binary messages.  Session keys are not decrypted
+ * and secret keys in the keychain are only matched by key ID, so this is
+ * cheap enough to triage messages before deciding which ones to decrypt.
+ *
+ * Packets inside the encrypted data (literal data, compression, signatures)
+ * cannot be seen without decrypting, so only top-level packets are reported.
+ *
+ * |message| may be ASCII armored, in which case it is dearmored first.
+ *
+ * @param message OpenPGP message to inspect
+ * @param length Length of |message|
+ * @param info Filled in with what was found
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_inspect(uint8_t *message, size_t length, spgp_inspect_t *info);
+
+/**
+ * Decode a keyring, parsing its keys on several threads.
+ *
+ * The keyring is first scanned for key boundaries (every public or secret
+ * key packet starts a new transferable key), then split into runs of whole
+ * keys which are parsed concurrently.  The runs are joined
+ * back in their original order, so the result is the same packet list that
+ * spgp_decode_message() returns for |keyring|.
+ *
+ * |keyring| may be ASCII armored.
+ *
+ * @param keyring OpenPGP keyring, such as a file of exported keys
+ * @param length Length of |keyring|
+ * @param threads Number of threads to use, or 0 for one per online CPU
+ * @return Linked list of decoded PGP packets, or NULL on failure
+ */
+spgp_packet_t *spgp_import_keyring(uint8_t *keyring, size_t length,
+                                   uint32_t threads);
 
 /**
  * Decrypt all secret keys found in |msg| with given passphrase.
  *
  * Call this function after decoding a message known to contain secret keys.
- * This function decrypts the secret keys in the packet chain, and stores the
- * decrypted keys internally in the in-RAM keychain.
+ * This function decrypts the secret keys in the packet chain, and copies the
+ * decrypted keys into the in-RAM keychain, which keeps them in locked memory.
+ * The secret parts are cleared from |msg| afterwards, and |msg| is still
+ * owned by the caller.
  *
  * @param msg Linked list of PGP packets
  * @param passphrase String to use as decryption passphrase.  No NUL termination.
@@ -87,19 +468,511 @@ spgp_packet_t *spgp_decode_message(uint8_t *message, uint32_t length);
  */
 uint8_t spgp_decrypt_all_secret_keys(spgp_packet_t *msg, 
                                 		 uint8_t *passphrase, uint32_t length);
+
+/**
+ * Save the decrypted secret keys in the keychain to a sealed snapshot.
+ *
+ * Only the key material and a key ID index are saved, encrypted and
+ * authenticated with AES-256-GCM under |key|.  Loading the snapshot with
+ * spgp_keychain_import() restores the keys without running S2K again.
+ * The snapshot is written to "|path|.tmp" and renamed over |path|.
+ * Snapshots need libgcrypt; without it this fails with FORMAT_UNSUPPORTED,
+ * as do spgp_keychain_import() and spgp_snapshot_key_create().
+ *
+ * @param path Path of the snapshot
+ * @param key Sealing key, from spgp_snapshot_key_read() or a key agent
+ * @param keyLength Length of |key|.  Must be SPGP_SNAPSHOT_KEY_LEN.
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_keychain_export(const char *path,
+                             const uint8_t *key, size_t keyLength);
+
+/**
+ * Add the keys from a snapshot made by spgp_keychain_export() to the
+ * keychain.
+ *
+ * The snapshot is mapped and decrypted in one pass.  The keys are owned by
+ * the keychain and freed by spgp_close().
+ *
+ * @param path Path of the snapshot
+ * @param key Sealing key the snapshot was saved with
+ * @param keyLength Length of |key|.  Must be SPGP_SNAPSHOT_KEY_LEN.
+ * @return 0 for success, non-0 for failure.  spgp_err() is DECRYPT_FAILED
+ *         if the key is wrong or the snapshot was modified.
+ */
+uint8_t spgp_keychain_import(const char *path,
+                             const uint8_t *key, size_t keyLength);
+
+/**
+ * Create a file holding a new random snapshot sealing key.
+ *
+ * The file is created readable by its owner only, and must not exist.
+ *
+ * @param path Path of the key file
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_snapshot_key_create(const char *path);
+
+/**
+ * Read a snapshot sealing key from a key file.
+ *
+ * Key files that group or others may access are refused.
+ *
+ * @param path Path of the key file
+ * @param key Set to the SPGP_SNAPSHOT_KEY_LEN byte key
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_snapshot_key_read(const char *path, uint8_t *key);
+
+/**
+ * Send session keys the keychain can't decrypt to a key agent.
+ *
+ * spgp-agent holds the unlocked keys for many processes, so they don't
+ * each run S2K and keep their own copy.  Once connected, messages for keys
+ * only the agent has are decrypted as usual; the agent is asked for all of
+ * a message's recipients in one request.  Connect in each process after
+ * fork().  A failed connection is opened again for the next message.
+ *
+ * @param path Path of the agent's socket
+ * @return 0 for success, non-0 for failure.  spgp_err() is IO_ERROR if the
+ *         agent can't be reached.
+ */
+uint8_t spgp_agent_connect(const char *path);
+
+/**
+ * Stop using the key agent and close the connection.
+ */
+void spgp_agent_disconnect(void);
+
+/**
+ * Send private key operations to |backend| instead of the keychain.
+ *
+ * Once set, session keys are only decrypted by the backend, after the
+ * keychain and key agent are asked.  Messages decoded with
+ * spgp_decode_message() wait for it; spgp_decode_message_async() doesn't.
+ * The backend is copied, but must stay usable until every request it was
+ * given is done.
+ *
+ * @param backend Backend to use, or NULL to use the keychain again
+ */
+void spgp_pk_backend_set(const spgp_pk_backend_t *backend);
+
+/**
+ * Get the ID of the key a request is for.
+ *
+ * @param req Request given to the backend
+ * @return The 8 byte key ID
+ */
+const uint8_t *spgp_pk_request_keyid(const spgp_pk_request_t *req);
+
+/**
+ * Get the public-key algorithm of a request.
+ *
+ * @param req Request given to the backend
+ * @return Public-key algorithm (RFC 4880 9.1): 1 for RSA, 16 for Elgamal,
+ *         18 for ECDH
+ */
+uint8_t spgp_pk_request_algo(const spgp_pk_request_t *req);
+
+/**
+ * Get one of the encrypted session key's MPIs: m^e mod n for RSA,
+ * g^k mod p and m * y^k mod p for Elgamal, or the ephemeral point and the
+ * wrapped key for ECDH.
+ *
+ * @param req Request given to the backend
+ * @param i Which MPI, from 0
+ * @param len Set to the length of the returned value
+ * @return The MPI as a big-endian number without its bit count, or NULL
+ *         if there is no MPI |i|
+ */
+const uint8_t *spgp_pk_request_mpi(const spgp_pk_request_t *req, uint8_t i,
+                                   size_t *len);
+
+/**
+ * Finish a request.  |req| must not be used after.
+ *
+ * @param req Request given to the backend
+ * @param frame Result of the decryption, the PKCS#1 padded session key
+ *        with or without leading zeros.  For ECDH it is the unwrapped key
+ *        with its PKCS#5 padding.  Only read during the call.
+ * @param len Length of |frame|
+ * @param err 0 if |frame| holds the result, or why the request failed
+ */
+void spgp_pk_request_done(spgp_pk_request_t *req, const uint8_t *frame,
+                          size_t len, uint32_t err);
+
+/**
+ * Decode a message without waiting for the private key backend.
+ *
+ * The session keys are read and handed to the backend, and the call
+ * returns.  When the backend has decrypted one, the message is decoded on
+ * the thread that finished it and |done| is called.  Many messages can be
+ * started this way while a slow token works through them.
+ *
+ * Without a backend the message is decoded at once, and |done| called
+ * before returning.
+ *
+ * @param message Message as for spgp_decode_message().  It must not change
+ *        or be freed until |done| is called.
+ * @param length Length of |message|
+ * @param done Called once with the result, unless non-0 is returned
+ * @param ctx Passed to |done|
+ * @return 0 if |done| will be called, non-0 for invalid arguments
+ */
+uint8_t spgp_decode_message_async(uint8_t *message, size_t length,
+                                  spgp_decode_done_t done, void *ctx);
+
+/**
+ * Create a backend that does private key operations in software, with the
+ * keychain's keys, as slowly as a hardware token.  For testing pipelines
+ * without one.
+ *
+ * @param latencyUs Time each operation takes, in microseconds
+ * @param depth Number of operations it works on at once
+ * @return Backend for spgp_pk_backend_set(), or NULL for failure
+ */
+spgp_pk_backend_t *spgp_pk_soft_backend_create(uint32_t latencyUs,
+                                               uint32_t depth);
+
+/**
+ * Finish the soft backend's queued requests and free it.  Remove it with
+ * spgp_pk_backend_set(NULL) first.
+ *
+ * @param backend Backend from spgp_pk_soft_backend_create(), may be NULL
+ */
+void spgp_pk_soft_backend_free(spgp_pk_backend_t *backend);
+
+/**
+ * Create a backend that decrypts session keys with the keychain's RSA keys
+ * in batches.  Requests for the same key are gathered, up to 8 at a time,
+ * and exponentiated together in the lanes of the CPU's vector unit (AVX2
+ * or AVX-512 where present), sharing the key's setup.  Batches use the
+ * builtin RSA engine whichever crypto backend is selected.  Other requests
+ * are done one at a time.
+ *
+ * Meant for decrypting many messages to one key with
+ * spgp_decode_message_async().
+ *
+ * @param threads Number of worker threads
+ * @param lingerUs How long a worker waits for a full batch before starting
+ *        with fewer requests, in microseconds
+ * @return Backend for spgp_pk_backend_set(), or NULL for failure
+ */
+spgp_pk_backend_t *spgp_pk_batch_backend_create(uint32_t threads,
+                                                uint32_t lingerUs);
+
+/**
+ * Finish the batch backend's queued requests and free it.  Remove it with
+ * spgp_pk_backend_set(NULL) first.
+ *
+ * @param backend Backend from spgp_pk_batch_backend_create(), may be NULL
+ */
+void spgp_pk_batch_backend_free(spgp_pk_backend_t *backend);
                                      
+/**
+ * Get the fingerprint of a key packet.
+ *
+ * Fingerprints are not computed while decoding, only the first time they
+ * are asked for.  The result is kept in the packet, so later calls are free.
+ *
+ * @param pkt Public key, public subkey, secret key or secret subkey packet
+ * @return SPGP_FINGERPRINT_LEN bytes owned by |pkt|, or NULL on failure
+ */
+const uint8_t *spgp_fingerprint(spgp_packet_t *pkt);
+
+/**
+ * Compute the fingerprints of all keys in a packet list at once.
+ *
+ * Useful after spgp_import_keyring() when every fingerprint will be needed,
+ * or before sharing a packet list between threads, since spgp_fingerprint()
+ * otherwise writes into the packet on first use.
+ *
+ * @param msg Linked list of PGP packets
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_fingerprint_all(spgp_packet_t *msg);
+
+/**
+ * Write a public keyring to a key store file.
+ *
+ * The store holds a copy of the keyring together with an index of its
+ * public keys and subkeys by key ID and by fingerprint, so a store can be
+ * opened without decoding any keys.  Secret keys and V3 keys are not
+ * indexed.  The store is written to "|path|.tmp" and renamed over |path|.
+ *
+ * @param path Path of the store
+ * @param keyring Binary or armored keyring
+ * @param length Length of |keyring|
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_keystore_create(const char *path, uint8_t *keyring,
+                             size_t length);
+
+/**
+ * Open a key store written by spgp_keystore_create().
+ *
+ * The store is mapped read-only and only its header is read, so opening
+ * takes the same time for any number of keys.  Keys are decoded the first
+ * time they are looked up and kept until the store is closed.
+ *
+ * @param path Path of the store
+ * @return Opened store, or NULL on failure
+ */
+spgp_keystore_t *spgp_keystore_open(const char *path);
+
+/**
+ * Close a key store and free the keys decoded from it.
+ *
+ * Packets returned by lookups are freed too.
+ *
+ * @param ks Store to close.  Set to NULL.
+ */
+void spgp_keystore_close(spgp_keystore_t **ks);
+
+/**
+ * Get the number of keys indexed in a key store.
+ *
+ * @param ks Opened store
+ * @return Number of public keys and subkeys
+ */
+uint32_t spgp_keystore_count(spgp_keystore_t *ks);
+
+/**
+ * Look up a key by key ID.
+ *
+ * @param ks Opened store
+ * @param keyid 8-byte key ID
+ * @return Public key or subkey packet owned by |ks|, or NULL if not found
+ */
+spgp_packet_t *spgp_keystore_find(spgp_keystore_t *ks, const uint8_t *keyid);
+
+/**
+ * Look up a key by fingerprint.
+ *
+ * @param ks Opened store
+ * @param fpr SPGP_FINGERPRINT_LEN byte fingerprint
+ * @return Public key or subkey packet owned by |ks|, or NULL if not found
+ */
+spgp_packet_t *spgp_keystore_find_fingerprint(spgp_keystore_t *ks,
+                                              const uint8_t *fpr);
+
+/**
+ * Use a key store to find signing keys.
+ *
+ * Signature checks look in the store after the keys they are given and the
+ * keychain.  Attach before checking signatures from several threads; the
+ * store itself may be searched by many threads at once.
+ *
+ * @param ks Opened store, or NULL to detach
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_keystore_attach(spgp_keystore_t *ks);
+
+/**
+ * Check a signature over |data|.
+ *
+ * Binary (0x00) and text (0x01) signatures made with RSA, DSA or Ed25519
+ * over SHA-1, SHA-2 or RIPEMD-160 are supported.  The issuer is found from the
+ * signature's issuer subpackets, looking first in |keys|, then in the
+ * keychain, then in the store set with spgp_keystore_attach().  The key's
+ * gcrypt context is kept in the key packet, so checking more signatures by
+ * the same key is cheaper.
+ *
+ * Signatures decoded straight after literal data are checked automatically
+ * against the keychain; see spgp_signature_status().
+ *
+ * Checking signatures needs libgcrypt.  Built without it, every signature
+ * is SPGP_SIG_UNSUPPORTED and this fails with FORMAT_UNSUPPORTED.
+ *
+ * @param sig Signature packet
+ * @param keys Linked list of packets with public keys, or NULL to only
+ *             use the keychain
+ * @param data Signed data
+ * @param len Length of |data|
+ * @return 0 if the signature is good, non-0 otherwise.  spgp_err() is then
+ *         BAD_SIGNATURE, KEY_NOT_FOUND or FORMAT_UNSUPPORTED.
+ */
+uint8_t spgp_verify(spgp_packet_t *sig, spgp_packet_t *keys,
+                    const uint8_t *data, size_t len);
+
+/**
+ * Check several signatures over the same data.
+ *
+ * The data is hashed once for all hash algorithms in use (once more if
+ * there are text signatures), and the public-key operations are spread over
+ * |threads| threads.  Each signature's result is left in the packet, to be
+ * read with spgp_signature_status().
+ *
+ * @param sigs Signature packets
+ * @param count Number of packets in |sigs|
+ * @param keys Linked list of packets with public keys, or NULL
+ * @param data Signed data
+ * @param len Length of |data|
+ * @param threads Number of threads to use, or 0 for one per online CPU
+ * @return 0 if every signature is good, non-0 otherwise
+ */
+uint8_t spgp_verify_batch(spgp_packet_t **sigs, uint32_t count,
+                          spgp_packet_t *keys,
+                          const uint8_t *data, size_t len,
+                          uint32_t threads);
+
+/**
+ * Check a detached signature over a file.
+ *
+ * The file is hashed straight from a read-only mapping, a window at a
+ * time, so files of any size are checked without being loaded.  Every
+ * signature packet in |sig| must be good.  Keys are found as for
+ * spgp_verify().
+ *
+ * @param sig Detached signature, binary or armored
+ * @param sigLength Length of |sig|
+ * @param keys Linked list of packets with public keys, or NULL
+ * @param path Path of the signed file
+ * @return 0 if the signature is good, non-0 otherwise.  spgp_err() is then
+ *         BAD_SIGNATURE, KEY_NOT_FOUND, FORMAT_UNSUPPORTED or IO_ERROR.
+ */
+uint8_t spgp_verify_detached(uint8_t *sig, size_t sigLength,
+                             spgp_packet_t *keys, const char *path);
+
+/**
+ * Check a detached signature over an open file.
+ *
+ * A regular file is hashed from its start, whatever its offset.  Anything
+ * else, such as a pipe, is read from its current position to the end.
+ *
+ * @param sig Detached signature, binary or armored
+ * @param sigLength Length of |sig|
+ * @param keys Linked list of packets with public keys, or NULL
+ * @param fd Descriptor of the signed data.  Not closed.
+ * @return 0 if the signature is good, non-0 otherwise
+ */
+uint8_t spgp_verify_detached_fd(uint8_t *sig, size_t sigLength,
+                                spgp_packet_t *keys, int fd);
+
+/**
+ * Check detached signatures over many files, several files at a time.
+ *
+ * All signatures are decoded and their keys prepared first; then each file
+ * is hashed and checked by one of |threads| threads.  Each file's result
+ * is left in its |status| and |err|.
+ *
+ * @param files Signatures and the files they sign
+ * @param count Number of entries in |files|
+ * @param keys Linked list of packets with public keys, or NULL
+ * @param threads Number of threads to use, or 0 for one per online CPU
+ * @return 0 if every file is good, non-0 otherwise.  spgp_err() is then the
+ *         error of the first file that isn't.
+ */
+uint8_t spgp_verify_detached_files(spgp_detached_t *files, uint32_t count,
+                                   spgp_packet_t *keys, uint32_t threads);
+
+/**
+ * Check a cleartext signed message ("-----BEGIN PGP SIGNED MESSAGE-----").
+ *
+ * The text is dash-unescaped, stripped of trailing whitespace and given
+ * CR LF line endings as it is hashed, without making a canonical copy.
+ * Every signature in the message must be good.  Keys are found as for
+ * spgp_verify().
+ *
+ * @param message Cleartext signed message
+ * @param length Length of |message|
+ * @param keys Linked list of packets with public keys, or NULL
+ * @return 0 if the signatures are good, non-0 otherwise.  spgp_err() is
+ *         then BAD_SIGNATURE, KEY_NOT_FOUND, FORMAT_UNSUPPORTED or
+ *         ARMOR_ERROR.
+ */
+uint8_t spgp_verify_cleartext(uint8_t *message, size_t length,
+                              spgp_packet_t *keys);
+
+/**
+ * Get the result of the last check of a signature packet.
+ *
+ * @param sig Signature packet
+ * @return Status of |sig|, or SPGP_SIG_UNCHECKED if it is not a signature
+ */
+spgp_sig_status_t spgp_signature_status(spgp_packet_t *sig);
+
 /**
  * Gets the literal data buffer from a decrypted message
  *
+ * Messages decoded to a sink have no data buffer: NULL is returned, but
+ * |datalen| and the filename are still set.
+ *
  * @param Linked-list of packets to search for data
  * @param datalen Set to size of returned data (in bytes)
  * @param filename Set to buffer containing filename
  * @param filenamelen Set to size of filename (in bytes)
  * @return Buffer with literal data, or NULL if none available
  */
-char *spgp_get_literal_data(spgp_packet_t *msg, uint32_t *datalen,
+char *spgp_get_literal_data(spgp_packet_t *msg, size_t *datalen,
 														char **filename, uint32_t *filenamelen);
 
+/**
+ * Prepare an encrypted message for random-access reads of its literal data.
+ *
+ * The message must hold a single Symmetrically Encrypted Integrity Protected
+ * data packet whose plaintext is an uncompressed literal data packet.  The
+ * session key is decrypted with the in-RAM keychain, but none of the bulk
+ * data is decrypted here: only the packet headers are walked to record where
+ * every partial-length chunk begins.
+ *
+ * If |index_path| names an index previously written by
+ * spgp_range_save_index() for this message, the chunk boundaries are loaded
+ * from it instead of being rescanned.  Pass NULL to always scan.
+ *
+ * Because only the requested bytes are decrypted, the modification detection
+ * code at the end of the message is NOT checked by range reads.
+ *
+ * @param message Binary OpenPGP message.  Must stay valid until closed.
+ * @param length Length of |message|
+ * @param index_path Path of a sidecar index to load, or NULL
+ * @return Range reader, or NULL on failure
+ */
+spgp_range_t *spgp_range_open(uint8_t *message, size_t length,
+                              const char *index_path);
+
+/**
+ * Decrypt |len| bytes of literal data, starting at |offset|, into |out|.
+ *
+ * Only the cipher blocks covering the requested bytes are decrypted.
+ *
+ * @param range Reader returned by spgp_range_open()
+ * @param offset Offset into the literal data (not the packet)
+ * @param len Number of bytes to read
+ * @param out Buffer of at least |len| bytes
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_read_range(spgp_range_t *range, size_t offset, size_t len,
+                        uint8_t *out);
+
+/**
+ * Get the total length of the literal data behind a range reader.
+ *
+ * @param range Reader returned by spgp_range_open()
+ * @return Length of literal data, in bytes
+ */
+size_t spgp_range_length(spgp_range_t *range);
+
+/**
+ * Write the chunk boundaries found by spgp_range_open() to a sidecar file.
+ *
+ * The index holds only offsets -- never key material -- and is tied to the
+ * message it was built from by its length and a digest of the start of its
+ * encrypted packet.
+ *
+ * @param range Reader returned by spgp_range_open()
+ * @param index_path Path of the index file to create or replace
+ * @return 0 for success, non-0 for failure.
+ */
+uint8_t spgp_range_save_index(spgp_range_t *range, const char *index_path);
+
+/**
+ * Frees all resources associated with a range reader.
+ *
+ * @param range Pointer-to-pointer-to-reader to free.
+ */
+void spgp_range_close(spgp_range_t **range);
+
 /**
  * Frees all dynamic resources associated with |pkt|.
  *
@@ -110,6 +983,9 @@ void spgp_free_packet(spgp_packet_t **pkt);
 /**
  * Get last error code
  *
+ * Errors are kept per thread, so this reports the last error raised by a
+ * call made on the calling thread.
+ *
  * @return Value of last error
  */
 uint32_t spgp_err(void);
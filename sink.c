@@ -0,0 +1,653 @@
+/*
+ *  sink.c
+ *  libsimplepgp
+ *
+ *  Output sinks for literal data, and the streaming decoder that feeds them.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "sink.h"
+#include "verify.h"
+
+#include "zlib.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_SINK_IOVECS     16
+// Tag, 5-octet length, then format, filename length, filename and date
+#define SPGP_STREAM_HEADMAX  (1 + 5 + 6 + 255)
+
+typedef enum {
+	SINK_CALLBACK,
+  SINK_FD,
+  SINK_BUFFER,
+} spgp_sink_type_t;
+
+struct spgp_sink_struct {
+	spgp_sink_type_t type;
+  spgp_sink_cb_t cb;
+  void *ctx;
+  int fd;
+  uint8_t *buf;
+  size_t size;
+  size_t written;
+  spgp_stream_t *streams;  // open streams, released if decoding fails
+};
+
+typedef enum {
+	STREAM_HEADER,           // collecting a packet tag and length
+  STREAM_BODY,             // inside a chunk of packet body
+  STREAM_CHUNK_LENGTH,     // collecting a partial body length
+  STREAM_LEAD,             // collecting a one-pass packet ahead of the data
+  STREAM_TAIL,             // buffering the rest for the regular decoder
+} spgp_stream_phase_t;
+
+// Streams the first packet of a sequence, when it is a literal or a
+// compressed packet, and buffers everything after it.  One-pass signature
+// packets in front of it are decoded as they arrive, so signed data still
+// streams.  Anything else is buffered from the start, so the regular
+// decoder still sees it.
+struct spgp_stream_struct {
+	spgp_sink_t *sink;
+  spgp_stream_t *nextOpen;
+  spgp_stream_phase_t phase;
+  spgp_packet_t *pkt;      // packet being streamed
+  uint8_t ownsPkt;
+  spgp_packet_t *lead;     // one-pass packets decoded before it
+  size_t leadNeed;         // one-pass packet bytes still to collect
+  uint8_t buf[SPGP_STREAM_HEADMAX];
+  size_t buflen;
+  size_t headNeed;         // literal header bytes still to collect
+  uint8_t lenbuf[5];       // partial body length being collected
+  uint8_t lenlen;
+  size_t chunkLeft;
+  uint8_t isPartial;
+  uint8_t isIndeterminate;
+  z_stream *z;
+  uint8_t zdone;
+  uint8_t *window;         // inflated bytes on their way to |inner|
+  spgp_stream_t *inner;
+  uint8_t *tail;
+  size_t tailLen;
+  size_t tailSize;
+  struct iovec iov[SPGP_SINK_IOVECS];
+  int iovcnt;
+};
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+
+static spgp_sink_t *spgp_sink_alloc(spgp_sink_type_t type);
+
+static void spgp_stream_free(spgp_stream_t **st);
+
+static uint8_t spgp_stream_length_size(uint8_t first);
+
+static uint8_t spgp_stream_header_size(uint8_t *buf, size_t buflen);
+
+static void spgp_stream_setup(spgp_stream_t *st, spgp_packet_t *pkt);
+
+static void spgp_stream_next_phase(spgp_stream_t *st);
+
+static void spgp_stream_begin_packet(spgp_stream_t *st);
+
+static void spgp_stream_lead_packet(spgp_stream_t *st);
+
+static void spgp_stream_body(spgp_stream_t *st, const uint8_t *data,
+                             size_t len);
+
+static void spgp_stream_inflate(spgp_stream_t *st, const uint8_t *data,
+                                size_t len);
+
+static void spgp_stream_tail(spgp_stream_t *st, const uint8_t *data,
+                             size_t len);
+
+static void spgp_stream_flush(spgp_stream_t *st);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+spgp_sink_t *spgp_sink_open_callback(spgp_sink_cb_t cb, void *ctx) {
+	spgp_sink_t *sink;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == cb) RAISE(INVALID_ARGS);
+	sink = spgp_sink_alloc(SINK_CALLBACK);
+  sink->cb = cb;
+  sink->ctx = ctx;
+  return sink;
+}
+
+spgp_sink_t *spgp_sink_open_fd(int fd) {
+	spgp_sink_t *sink;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (fd < 0) RAISE(INVALID_ARGS);
+	sink = spgp_sink_alloc(SINK_FD);
+  sink->fd = fd;
+  return sink;
+}
+
+spgp_sink_t *spgp_sink_open_buffer(uint8_t *buf, size_t size) {
+	spgp_sink_t *sink;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return NULL;
+  }
+
+	if (NULL == buf && size != 0) RAISE(INVALID_ARGS);
+	sink = spgp_sink_alloc(SINK_BUFFER);
+  sink->buf = buf;
+  sink->size = size;
+  return sink;
+}
+
+size_t spgp_sink_length(spgp_sink_t *sink) {
+	if (NULL == sink) return 0;
+  return sink->written;
+}
+
+void spgp_sink_close(spgp_sink_t **sink) {
+	if (NULL == sink || NULL == *sink) return;
+  spgp_sink_abort(*sink);
+  free(*sink);
+  *sink = NULL;
+}
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+void spgp_sink_write(spgp_sink_t *sink, const uint8_t *data, size_t len) {
+	struct iovec iov;
+
+	switch (sink->type) {
+  	case SINK_CALLBACK:
+    	if (sink->cb(sink->ctx, data, len) != 0) RAISE(IO_ERROR);
+      sink->written += len;
+      break;
+    case SINK_BUFFER:
+    	if (sink->size - sink->written < len) RAISE(BUFFER_OVERFLOW);
+      memcpy(sink->buf + sink->written, data, len);
+      sink->written += len;
+      break;
+    case SINK_FD:
+    	iov.iov_base = (void *)data;
+      iov.iov_len = len;
+      spgp_sink_writev(sink, &iov, 1);
+      break;
+  }
+}
+
+void spgp_sink_writev(spgp_sink_t *sink, struct iovec *iov, int iovcnt) {
+	ssize_t n;
+  int i;
+
+	if (sink->type != SINK_FD) {
+  	for (i = 0; i < iovcnt; i++)
+    	spgp_sink_write(sink, iov[i].iov_base, iov[i].iov_len);
+    return;
+  }
+
+	while (iovcnt > 0) {
+  	n = writev(sink->fd, iov, iovcnt);
+    if (n < 0) {
+    	if (errno == EINTR) continue;
+      RAISE(IO_ERROR);
+    }
+    sink->written += n;
+    // Drop the vectors that were written in full and retry the rest
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+    	n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+    	iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void spgp_sink_abort(spgp_sink_t *sink) {
+	spgp_stream_t *st;
+
+	// Free the oldest stream first: it can't be another stream's inner one,
+  // and freeing it takes its inner streams with it.
+	while (sink->streams) {
+  	for (st = sink->streams; st->nextOpen; st = st->nextOpen);
+    spgp_stream_free(&st);
+  }
+}
+
+/**
+ * Free a stream, and the streams inside it, without finishing its
+ * packets.  For callers cleaning up after an exception.
+ */
+void spgp_stream_abort(spgp_stream_t **st) {
+	spgp_stream_free(st);
+}
+
+spgp_stream_t *spgp_stream_open(spgp_sink_t *sink, spgp_packet_t *pkt) {
+	spgp_stream_t *st;
+
+	st = malloc(sizeof(*st));
+  if (NULL == st) RAISE(OUT_OF_MEMORY);
+  memset(st, 0, sizeof(*st));
+  st->sink = sink;
+  st->nextOpen = sink->streams;
+  sink->streams = st;
+
+	// A packet whose header was already parsed starts straight in its body
+	st->phase = STREAM_HEADER;
+  if (pkt) spgp_stream_setup(st, pkt);
+  return st;
+}
+
+void spgp_stream_push(spgp_stream_t *st, const uint8_t *data, size_t len) {
+	uint8_t headerlen;
+  size_t n;
+
+	while (len) {
+  	switch (st->phase) {
+    	case STREAM_HEADER:
+      	st->buf[st->buflen++] = *data++;
+        len--;
+        n = spgp_stream_header_size(st->buf, st->buflen);
+        if (n != 0 && st->buflen == n) spgp_stream_begin_packet(st);
+        break;
+      case STREAM_CHUNK_LENGTH:
+      	st->lenbuf[st->lenlen++] = *data++;
+        len--;
+        if (st->lenlen < spgp_stream_length_size(st->lenbuf[0])) break;
+        st->chunkLeft = spgp_new_header_length(st->lenbuf, st->lenlen,
+                                               &headerlen, &st->isPartial);
+        st->lenlen = 0;
+        spgp_stream_next_phase(st);
+        break;
+      case STREAM_BODY:
+      	n = (len < st->chunkLeft) ? len : st->chunkLeft;
+        spgp_stream_body(st, data, n);
+        data += n;
+        len -= n;
+        if (!st->isIndeterminate) st->chunkLeft -= n;
+        spgp_stream_next_phase(st);
+        break;
+      case STREAM_LEAD:
+      	st->buf[st->buflen++] = *data++;
+        len--;
+        if (--st->leadNeed == 0) spgp_stream_lead_packet(st);
+        break;
+      case STREAM_TAIL:
+      	spgp_stream_tail(st, data, len);
+        len = 0;
+        break;
+    }
+  }
+
+	// Literal data is only queued by reference, so it goes out before the
+  // caller can reuse its buffer.
+	spgp_stream_flush(st);
+}
+
+spgp_packet_t *spgp_stream_close(spgp_stream_t **stp) {
+	spgp_stream_t *st = *stp;
+  spgp_packet_t *head, *chain, *last;
+  size_t idx = 0;
+
+	// Anything but a packet boundary means the input was cut short
+	if ((st->phase == STREAM_HEADER && st->buflen) ||
+      (st->phase == STREAM_BODY && !st->isIndeterminate) ||
+      st->phase == STREAM_CHUNK_LENGTH || st->phase == STREAM_LEAD ||
+      st->headNeed ||
+      (st->z && !st->zdone))
+  	RAISE(INCOMPLETE_PACKET);
+
+	head = st->pkt;
+  if (st->inner) {
+  	chain = spgp_stream_close(&st->inner);
+    if (chain) {
+    	head->next = chain;
+      chain->prev = head;
+    }
+  }
+  if (st->lead) {
+  	for (last = st->lead; last->next; last = last->next);
+    last->next = head;
+    if (head) head->prev = last;
+    head = st->lead;
+  }
+
+	// Whatever followed the streamed packet goes through the regular decoder
+	if (st->tailLen) {
+  	chain = spgp_packet_decode_loop(st->tail, &idx, st->tailLen);
+    if (NULL == head) {
+    	head = chain;
+    }
+    else if (chain) {
+    	for (last = head; last->next; last = last->next);
+      last->next = chain;
+      chain->prev = last;
+    }
+  }
+
+	// The packets now belong to the caller
+	st->pkt = NULL;
+  st->lead = NULL;
+  spgp_stream_free(stp);
+  return head;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+static spgp_sink_t *spgp_sink_alloc(spgp_sink_type_t type) {
+	spgp_sink_t *sink;
+
+	sink = malloc(sizeof(*sink));
+  if (NULL == sink) RAISE(OUT_OF_MEMORY);
+  memset(sink, 0, sizeof(*sink));
+  sink->type = type;
+  sink->fd = -1;
+  return sink;
+}
+
+static void spgp_stream_free(spgp_stream_t **stp) {
+	spgp_stream_t *st = *stp;
+  spgp_stream_t **link;
+
+	if (NULL == st) return;
+
+	for (link = &st->sink->streams; *link; link = &(*link)->nextOpen) {
+  	if (*link == st) {
+    	*link = st->nextOpen;
+      break;
+    }
+  }
+
+	spgp_stream_free(&st->inner);
+  if (st->z) {
+  	inflateEnd(st->z);
+    free(st->z);
+  }
+  if (st->window) {
+  	memset(st->window, 0, SPGP_SINK_WINDOW);
+    free(st->window);
+  }
+  if (st->tail) {
+  	memset(st->tail, 0, st->tailSize);
+    free(st->tail);
+  }
+  if (st->ownsPkt) spgp_free_packet(&st->pkt);
+  spgp_free_packet(&st->lead);
+  memset(st, 0, sizeof(*st));
+  free(st);
+  *stp = NULL;
+}
+
+static uint8_t spgp_stream_length_size(uint8_t first) {
+	if (first <= 191) return 1;
+  if (first <= 223) return 2;
+  if (first == 255) return 5;
+  return 1; // partial length
+}
+
+static uint8_t spgp_stream_header_size(uint8_t *buf, size_t buflen) {
+	if (!(buf[0] & 0x80)) RAISE(INVALID_HEADER);
+  if (!(buf[0] & 0x40)) {
+  	switch (buf[0] & 0x03) {
+    	case 0: return 2;
+      case 1: return 3;
+      case 2: return 5;
+      default: return 1; // indeterminate length
+    }
+  }
+  if (buflen < 2) return 0;
+  return 1 + spgp_stream_length_size(buf[1]);
+}
+
+static void spgp_stream_setup(spgp_stream_t *st, spgp_packet_t *pkt) {
+	st->pkt = pkt;
+  st->chunkLeft = pkt->header->contentLength;
+  st->isPartial = pkt->header->isPartial;
+  st->isIndeterminate = !pkt->header->isNewFormat &&
+    (pkt->header->rawTagByte & 0x03) == 0x03;
+  if (st->isIndeterminate) st->chunkLeft = SIZE_MAX; // runs to the end
+  st->buflen = 0;
+
+	if (pkt->header->type == PKT_TYPE_LITERAL_DATA) {
+  	pkt->c.literal = malloc(sizeof(*(pkt->c.literal)));
+    if (NULL == pkt->c.literal) RAISE(OUT_OF_MEMORY);
+    memset(pkt->c.literal, 0, sizeof(*(pkt->c.literal)));
+    st->headNeed = 6; // grows by the filename length once it is known
+  }
+  spgp_stream_next_phase(st);
+}
+
+static void spgp_stream_next_phase(spgp_stream_t *st) {
+	if (st->chunkLeft || st->isIndeterminate) st->phase = STREAM_BODY;
+  else if (st->isPartial) st->phase = STREAM_CHUNK_LENGTH;
+  else st->phase = STREAM_TAIL; // only the first packet is streamed
+}
+
+static void spgp_stream_begin_packet(spgp_stream_t *st) {
+	spgp_packet_t *pkt;
+  size_t idx = 0;
+
+	pkt = malloc(sizeof(*pkt));
+  if (NULL == pkt) RAISE(OUT_OF_MEMORY);
+  memset(pkt, 0, sizeof(*pkt));
+
+	// spgp_parse_header() finishes on the first body byte, which hasn't
+  // arrived yet, so let it think there is one more.
+	spgp_parse_header(st->buf, &idx, st->buflen + 1, pkt);
+
+	// One-pass packets are small and fixed size.  Only ones ahead of the
+  // streamed packet matter, since they must start hashing before it.
+	if (pkt->header->type == PKT_TYPE_ONE_PASS_SIG && NULL == st->pkt &&
+      !pkt->header->isPartial && pkt->header->contentLength > 0 &&
+      pkt->header->contentLength <= sizeof(st->buf) - st->buflen) {
+    st->leadNeed = pkt->header->contentLength;
+    st->phase = STREAM_LEAD;
+    spgp_free_packet(&pkt);
+    return;
+  }
+
+	if (pkt->header->type != PKT_TYPE_LITERAL_DATA &&
+      pkt->header->type != PKT_TYPE_COMPRESSED_DATA) {
+    spgp_stream_tail(st, st->buf, st->buflen);
+    st->buflen = 0;
+    st->phase = STREAM_TAIL;
+    spgp_free_packet(&pkt);
+    return;
+  }
+
+	st->ownsPkt = 1;
+  spgp_stream_setup(st, pkt);
+}
+
+/**
+ * Decode the one-pass packet collected in the header buffer, and go on to
+ * the packet after it.
+ */
+static void spgp_stream_lead_packet(spgp_stream_t *st) {
+	spgp_packet_t *chain, *last;
+  size_t idx = 0;
+
+	chain = spgp_packet_decode_loop(st->buf, &idx, st->buflen);
+  st->buflen = 0;
+  st->phase = STREAM_HEADER;
+  if (NULL == chain) return;
+  if (NULL == st->lead) {
+  	st->lead = chain;
+    return;
+  }
+  for (last = st->lead; last->next; last = last->next);
+  last->next = chain;
+  chain->prev = last;
+}
+
+static void spgp_stream_body(spgp_stream_t *st, const uint8_t *data,
+                             size_t len) {
+	spgp_literal_pkt_t *literal;
+
+	if (st->pkt->header->type == PKT_TYPE_COMPRESSED_DATA) {
+  	spgp_stream_inflate(st, data, len);
+    return;
+  }
+
+	// Literal packets start with format, filename and date
+	literal = st->pkt->c.literal;
+  while (st->headNeed && len) {
+  	st->buf[st->buflen++] = *data++;
+    len--;
+    st->headNeed--;
+    if (st->buflen == 2) st->headNeed += st->buf[1];
+    if (st->headNeed == 0) {
+    	literal->filenameLen = st->buf[1];
+      literal->filename = malloc(literal->filenameLen + 1);
+      if (NULL == literal->filename) RAISE(OUT_OF_MEMORY);
+      memcpy(literal->filename, st->buf + 2, literal->filenameLen);
+      literal->filename[literal->filenameLen] = '\0';
+    }
+  }
+  if (len == 0) return;
+
+	literal->dataLen += len;
+  spgp_onepass_hash(data, len);
+  if (st->iovcnt == SPGP_SINK_IOVECS) spgp_stream_flush(st);
+  st->iov[st->iovcnt].iov_base = (void *)data;
+  st->iov[st->iovcnt].iov_len = len;
+  st->iovcnt++;
+}
+
+static void spgp_stream_inflate(spgp_stream_t *st, const uint8_t *data,
+                                size_t len) {
+	size_t produced;
+  int wbits;
+  int err;
+
+	// The first body byte names the compression algorithm
+	if (NULL == st->z) {
+  	if (data[0] == COMPRESSION_ZIP) wbits = -15;
+    else if (data[0] == COMPRESSION_ZLIB) wbits = 15;
+    else RAISE(FORMAT_UNSUPPORTED);
+    data++;
+    len--;
+
+		st->z = malloc(sizeof(*st->z));
+    if (NULL == st->z) RAISE(OUT_OF_MEMORY);
+    memset(st->z, 0, sizeof(*st->z));
+    if (inflateInit2(st->z, wbits) != Z_OK) {
+    	free(st->z);
+      st->z = NULL;
+      RAISE(ZLIB_ERROR);
+    }
+    st->window = malloc(SPGP_SINK_WINDOW);
+    if (NULL == st->window) RAISE(OUT_OF_MEMORY);
+    st->inner = spgp_stream_open(st->sink, NULL);
+  }
+
+	// Bytes after the end of the deflate stream are ignored
+	while (len && !st->zdone) {
+  	st->z->next_in = (Bytef *)data;
+    st->z->avail_in = (len > UINT_MAX) ? UINT_MAX : len;
+    data += st->z->avail_in;
+    len -= st->z->avail_in;
+    do {
+    	st->z->next_out = st->window;
+      st->z->avail_out = SPGP_SINK_WINDOW;
+      err = inflate(st->z, Z_NO_FLUSH);
+      if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+      	RAISE(ZLIB_ERROR);
+      produced = SPGP_SINK_WINDOW - st->z->avail_out;
+      if (produced) spgp_stream_push(st->inner, st->window, produced);
+      if (err == Z_STREAM_END) st->zdone = 1;
+    } while (!st->zdone && st->z->avail_out == 0);
+  }
+}
+
+static void spgp_stream_tail(spgp_stream_t *st, const uint8_t *data,
+                             size_t len) {
+	uint8_t *tmp;
+  size_t size;
+
+	if (st->tailSize - st->tailLen < len) {
+  	size = st->tailSize ? st->tailSize : 1024;
+    while (size - st->tailLen < len) {
+    	if (size > SIZE_MAX / 2) RAISE(OUT_OF_MEMORY);
+      size <<= 1;
+    }
+    tmp = malloc(size);
+    if (NULL == tmp) RAISE(OUT_OF_MEMORY);
+    if (st->tail) {
+    	memcpy(tmp, st->tail, st->tailLen);
+      memset(st->tail, 0, st->tailSize);
+      free(st->tail);
+    }
+    st->tail = tmp;
+    st->tailSize = size;
+  }
+  memcpy(st->tail + st->tailLen, data, len);
+  st->tailLen += len;
+}
+
+static void spgp_stream_flush(spgp_stream_t *st) {
+	if (st->iovcnt == 0) return;
+  spgp_sink_writev(st->sink, st->iov, st->iovcnt);
+  st->iovcnt = 0;
+}
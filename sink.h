@@ -0,0 +1,48 @@
+/*
+ *  sink.h
+ *  simplepgp
+ *
+ *  Output sinks for literal data.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _SINK_H
+
+#include "packet_private.h"
+
+#include <sys/uio.h>
+
+#define SPGP_SINK_WINDOW 65536
+
+typedef struct spgp_stream_struct spgp_stream_t;
+
+void spgp_sink_write(spgp_sink_t *sink, const uint8_t *data, size_t len);
+
+void spgp_sink_writev(spgp_sink_t *sink, struct iovec *iov, int iovcnt);
+
+void spgp_sink_abort(spgp_sink_t *sink);
+
+spgp_stream_t *spgp_stream_open(spgp_sink_t *sink, spgp_packet_t *pkt);
+
+void spgp_stream_push(spgp_stream_t *st, const uint8_t *data, size_t len);
+
+spgp_packet_t *spgp_stream_close(spgp_stream_t **st);
+
+void spgp_stream_abort(spgp_stream_t **st);
+
+#define _SINK_H
+#endif
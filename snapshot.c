@@ -0,0 +1,520 @@
+/*
+ *  snapshot.c
+ *  libsimplepgp
+ *
+ *  Sealed snapshots of the decrypted keychain.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "keychain.h"
+#include "mpi.h"
+#include "secmem.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+/* Snapshot layout.  All integers are big-endian.
+
+     0  magic "SPGPKC01"
+     8  cipher, 1 = AES-256-GCM (1)
+     9  reserved, 0 (3)
+    12  key count (4)
+    16  payload length (8)
+    24  nonce (12)
+    36  reserved, 0, to 48
+    48  payload, encrypted
+        tag (16)
+
+   The whole header is authenticated along with the payload.  The payload
+   starts with the key ID index: for each key, sorted by key ID, the key ID
+   (8), the fingerprint (20) and the offset of its record in the payload
+   (4).  A record is the packet type (1), the version (1), the creation
+   time as in the packet (4), the algorithm (1), the number of MPIs (1),
+   then the public and secret MPIs as they appear in packets. */
+#define SPGP_SNAPSHOT_MAGIC       "SPGPKC01"
+#define SPGP_SNAPSHOT_HEADER_LEN  48
+#define SPGP_SNAPSHOT_NONCE_LEN   12
+#define SPGP_SNAPSHOT_TAG_LEN     16
+#define SPGP_SNAPSHOT_INDEX_LEN   32
+#define SPGP_SNAPSHOT_RECORD_LEN  8
+#define SPGP_SNAPSHOT_AES256_GCM  1
+
+// Ordered copy of an index entry, while the payload is written
+typedef struct {
+	uint8_t entry[SPGP_SNAPSHOT_INDEX_LEN];
+} spgp_snapshot_entry_t;
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+#ifdef HAVE_GCRYPT
+static const spgp_keychain_key_t **spgp_snapshot_collect(uint32_t *count);
+
+static size_t spgp_snapshot_write_record(uint8_t *buf,
+                                         const spgp_keychain_key_t *key);
+
+static void spgp_snapshot_read_record(uint8_t *buf, size_t length,
+                                      const uint8_t *entry);
+
+static gcry_cipher_hd_t spgp_snapshot_cipher(const uint8_t *key,
+                                             size_t keyLength,
+                                             const uint8_t *header);
+
+static void spgp_snapshot_write(int fd, const void *buf, size_t len);
+
+static int spgp_snapshot_cmp_entry(const void *a, const void *b);
+#else
+static uint8_t spgp_snapshot_unsupported(void);
+#endif
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+#ifdef HAVE_GCRYPT
+
+uint8_t spgp_keychain_export(const char *path,
+                             const uint8_t *key, size_t keyLength) {
+	const spgp_keychain_key_t ** volatile keys = NULL;
+  spgp_snapshot_entry_t * volatile index = NULL;
+  uint8_t * volatile payload = NULL;
+  volatile size_t payloadLength = 0;
+  char * volatile tmp = NULL;
+  volatile int fd = -1;
+  gcry_cipher_hd_t volatile hd = NULL;
+  uint8_t header[SPGP_SNAPSHOT_HEADER_LEN];
+  uint8_t tag[SPGP_SNAPSHOT_TAG_LEN];
+  uint32_t count = 0;
+  uint32_t i;
+  size_t off;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    if (hd) gcry_cipher_close(hd);
+    if (fd >= 0) {
+    	close(fd);
+      unlink(tmp);
+    }
+    if (payload) {
+    	spgp_secure_wipe(payload, payloadLength);
+      free(payload);
+    }
+    free(tmp);
+    free(index);
+    free(keys);
+    return -1;
+  }
+
+	if (NULL == path || NULL == key || keyLength != SPGP_SNAPSHOT_KEY_LEN)
+  	RAISE(INVALID_ARGS);
+  if (!spgp_keychain_is_valid()) RAISE(KEYCHAIN_ERROR);
+
+	keys = spgp_snapshot_collect(&count);
+
+	// Size everything first, so the payload is built in one buffer
+	off = (size_t)count * SPGP_SNAPSHOT_INDEX_LEN;
+  for (i = 0; i < count; i++)
+  	off += SPGP_SNAPSHOT_RECORD_LEN + keys[i]->mpiLength;
+  if (off > 0xFFFFFFFF) RAISE(FORMAT_UNSUPPORTED);
+  payloadLength = off;
+
+	index = malloc(sizeof(*index) * (count ? count : 1));
+  payload = malloc(payloadLength ? payloadLength : 1);
+  if (NULL == index || NULL == payload) RAISE(OUT_OF_MEMORY);
+
+	off = (size_t)count * SPGP_SNAPSHOT_INDEX_LEN;
+  for (i = 0; i < count; i++) {
+  	memcpy(index[i].entry, keys[i]->keyid, 8);
+    memcpy(index[i].entry + 8, keys[i]->fingerprint, SPGP_FINGERPRINT_LEN);
+    spgp_put_be32(index[i].entry + 28, off);
+    off += spgp_snapshot_write_record(payload + off, keys[i]);
+  }
+  qsort(index, count, sizeof(*index), spgp_snapshot_cmp_entry);
+  for (i = 0; i < count; i++)
+  	memcpy(payload + (size_t)i * SPGP_SNAPSHOT_INDEX_LEN, index[i].entry,
+           SPGP_SNAPSHOT_INDEX_LEN);
+
+	memset(header, 0, sizeof(header));
+  memcpy(header, SPGP_SNAPSHOT_MAGIC, 8);
+  header[8] = SPGP_SNAPSHOT_AES256_GCM;
+  spgp_put_be32(header + 12, count);
+  spgp_put_be64(header + 16, payloadLength);
+  gcry_create_nonce(header + 24, SPGP_SNAPSHOT_NONCE_LEN);
+
+	// Sealed in place; only ciphertext reaches the file
+	hd = spgp_snapshot_cipher(key, keyLength, header);
+  if (gcry_cipher_encrypt(hd, payload, payloadLength, NULL, 0) != 0 ||
+      gcry_cipher_gettag(hd, tag, sizeof(tag)) != 0)
+  	RAISE(GCRY_ERROR);
+  gcry_cipher_close(hd);
+  hd = NULL;
+
+	tmp = malloc(strlen(path) + 5);
+  if (NULL == tmp) RAISE(OUT_OF_MEMORY);
+  sprintf(tmp, "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) RAISE(IO_ERROR);
+  spgp_snapshot_write(fd, header, sizeof(header));
+  spgp_snapshot_write(fd, payload, payloadLength);
+  spgp_snapshot_write(fd, tag, sizeof(tag));
+  if (fsync(fd) != 0 || close(fd) != 0) {
+  	fd = -1;
+    unlink(tmp);
+    RAISE(IO_ERROR);
+  }
+  fd = -1;
+  if (rename(tmp, path) != 0) {
+  	unlink(tmp);
+    RAISE(IO_ERROR);
+  }
+
+	Serial.printf("Saved %u keys to %s\n", count, path);
+  free(tmp);
+  free(index);
+  free(payload);
+  free(keys);
+  return 0;
+}
+
+uint8_t spgp_keychain_import(const char *path,
+                             const uint8_t *key, size_t keyLength) {
+	uint8_t * volatile map = NULL;
+  volatile size_t mapLength = 0;
+  uint8_t * volatile payload = NULL;
+  volatile size_t payloadLength = 0;
+  gcry_cipher_hd_t volatile hd = NULL;
+  const uint8_t *entry;
+  struct stat st;
+  uint64_t length;
+  uint32_t count;
+  uint32_t i;
+  int fd;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    if (hd) gcry_cipher_close(hd);
+    if (map) munmap(map, mapLength);
+    if (payload) {
+    	spgp_secure_wipe(payload, payloadLength);
+      free(payload);
+    }
+    return -1;
+  }
+
+	if (NULL == path || NULL == key || keyLength != SPGP_SNAPSHOT_KEY_LEN)
+  	RAISE(INVALID_ARGS);
+  if (!spgp_keychain_is_valid()) RAISE(KEYCHAIN_ERROR);
+
+	fd = open(path, O_RDONLY);
+  if (fd < 0) RAISE(IO_ERROR);
+  if (fstat(fd, &st) != 0) {
+  	close(fd);
+    RAISE(IO_ERROR);
+  }
+  if (st.st_size < SPGP_SNAPSHOT_HEADER_LEN + SPGP_SNAPSHOT_TAG_LEN) {
+  	close(fd);
+    RAISE(FORMAT_UNSUPPORTED);
+  }
+  mapLength = st.st_size;
+  map = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+  	map = NULL;
+  	RAISE(IO_ERROR);
+  }
+
+	count = spgp_get_be32(map + 12);
+  length = spgp_get_be64(map + 16);
+  if (memcmp(map, SPGP_SNAPSHOT_MAGIC, 8) != 0 ||
+      map[8] != SPGP_SNAPSHOT_AES256_GCM ||
+      length != mapLength - SPGP_SNAPSHOT_HEADER_LEN - SPGP_SNAPSHOT_TAG_LEN ||
+      (uint64_t)count * SPGP_SNAPSHOT_INDEX_LEN > length)
+  	RAISE(FORMAT_UNSUPPORTED);
+  payloadLength = length;
+
+	// One pass decrypts straight out of the mapping
+	payload = malloc(payloadLength ? payloadLength : 1);
+  if (NULL == payload) RAISE(OUT_OF_MEMORY);
+  hd = spgp_snapshot_cipher(key, keyLength, map);
+  if (gcry_cipher_decrypt(hd, payload, payloadLength,
+                          map + SPGP_SNAPSHOT_HEADER_LEN, payloadLength) != 0)
+  	RAISE(GCRY_ERROR);
+  if (gcry_cipher_checktag(hd, map + SPGP_SNAPSHOT_HEADER_LEN + payloadLength,
+                           SPGP_SNAPSHOT_TAG_LEN) != 0)
+  	RAISE(DECRYPT_FAILED);
+  gcry_cipher_close(hd);
+  hd = NULL;
+  munmap(map, mapLength);
+  map = NULL;
+
+	// Records go straight into the keychain's locked memory
+  for (i = 0; i < count; i++) {
+  	entry = payload + (size_t)i * SPGP_SNAPSHOT_INDEX_LEN;
+    spgp_snapshot_read_record(payload, payloadLength, entry);
+  }
+
+	spgp_secure_wipe(payload, payloadLength);
+  free(payload);
+  payload = NULL;
+
+  Serial.printf("Loaded %u keys from %s\n", count, path);
+  return 0;
+}
+
+uint8_t spgp_snapshot_key_create(const char *path) {
+	uint8_t key[SPGP_SNAPSHOT_KEY_LEN];
+  int fd;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == path) RAISE(INVALID_ARGS);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) RAISE(IO_ERROR);
+  gcry_randomize(key, sizeof(key), GCRY_STRONG_RANDOM);
+  if (write(fd, key, sizeof(key)) != sizeof(key)) {
+  	spgp_secure_wipe(key, sizeof(key));
+  	close(fd);
+    unlink(path);
+    RAISE(IO_ERROR);
+  }
+  spgp_secure_wipe(key, sizeof(key));
+  if (close(fd) != 0) RAISE(IO_ERROR);
+  return 0;
+}
+
+#else
+
+uint8_t spgp_keychain_export(const char *path,
+                             const uint8_t *key, size_t keyLength) {
+	(void)path; (void)key; (void)keyLength;
+  return spgp_snapshot_unsupported();
+}
+
+uint8_t spgp_keychain_import(const char *path,
+                             const uint8_t *key, size_t keyLength) {
+	(void)path; (void)key; (void)keyLength;
+  return spgp_snapshot_unsupported();
+}
+
+uint8_t spgp_snapshot_key_create(const char *path) {
+	(void)path;
+  return spgp_snapshot_unsupported();
+}
+
+#endif /* HAVE_GCRYPT */
+
+uint8_t spgp_snapshot_key_read(const char *path, uint8_t *key) {
+	struct stat st;
+  ssize_t n;
+  int fd;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == path || NULL == key) RAISE(INVALID_ARGS);
+
+	fd = open(path, O_RDONLY);
+  if (fd < 0) RAISE(IO_ERROR);
+  // A key anyone else can read doesn't protect anything
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (st.st_mode & (S_IRWXG | S_IRWXO)) ||
+      st.st_size != SPGP_SNAPSHOT_KEY_LEN) {
+  	close(fd);
+    RAISE(INVALID_ARGS);
+  }
+  n = read(fd, key, SPGP_SNAPSHOT_KEY_LEN);
+  close(fd);
+  if (n != SPGP_SNAPSHOT_KEY_LEN) RAISE(IO_ERROR);
+  return 0;
+}
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+#ifdef HAVE_GCRYPT
+
+/**
+ * Gather every key in the keychain.
+ *
+ * Keychain records are never moved or freed before spgp_close(), so they
+ * can be read after the keychain is unlocked.
+ *
+ * @param count Set to the number of keys
+ * @return Array of keys, to be freed by the caller
+ */
+static const spgp_keychain_key_t **spgp_snapshot_collect(uint32_t *count) {
+	const spgp_keychain_key_t **keys = NULL;
+  const spgp_keychain_key_t **grown;
+  const spgp_keychain_key_t *key;
+  uint32_t size = 0;
+
+	*count = 0;
+	spgp_keychain_iter_start();
+  while ((key = spgp_keychain_iter_next()) != NULL) {
+  	if (*count == size) {
+    	size = size ? size * 2 : 16;
+      grown = realloc(keys, sizeof(*keys) * size);
+      if (NULL == grown) {
+      	spgp_keychain_iter_end();
+        free(keys);
+        RAISE(OUT_OF_MEMORY);
+      }
+      keys = grown;
+    }
+    keys[(*count)++] = key;
+  }
+  spgp_keychain_iter_end();
+  return keys;
+}
+
+static size_t spgp_snapshot_write_record(uint8_t *buf,
+                                         const spgp_keychain_key_t *key) {
+  buf[0] = key->type;
+  buf[1] = key->version;
+  memcpy(buf + 2, &key->creationTime, 4); // still in packet byte order
+  buf[6] = key->asymAlgo;
+  buf[7] = key->mpiCount;
+  memcpy(buf + SPGP_SNAPSHOT_RECORD_LEN, key->mpis, key->mpiLength);
+  return SPGP_SNAPSHOT_RECORD_LEN + key->mpiLength;
+}
+
+/**
+ * Add the key of index |entry| to the keychain from its record.
+ */
+static void spgp_snapshot_read_record(uint8_t *buf, size_t length,
+                                      const uint8_t *entry) {
+	spgp_keychain_key_t key;
+  size_t idx = spgp_get_be32(entry + 28);
+  size_t mpis;
+  uint8_t i;
+
+	if (idx > length || length - idx < SPGP_SNAPSHOT_RECORD_LEN ||
+      (buf[idx] != PKT_TYPE_SECRET_KEY && buf[idx] != PKT_TYPE_SECRET_SUBKEY))
+  	RAISE(FORMAT_UNSUPPORTED);
+
+	memset(&key, 0, sizeof(key));
+  memcpy(key.keyid, entry, 8);
+  memcpy(key.fingerprint, entry + 8, SPGP_FINGERPRINT_LEN);
+  key.type = buf[idx];
+  key.version = buf[idx + 1];
+  memcpy(&key.creationTime, buf + idx + 2, 4);
+  key.asymAlgo = buf[idx + 6];
+  key.mpiCount = buf[idx + 7];
+  idx += SPGP_SNAPSHOT_RECORD_LEN;
+
+	// Each MPI must fit in the payload
+	for (mpis = idx, i = 0; i < key.mpiCount; i++) {
+  	if (length - idx < 2 || length - idx - 2 < spgp_mpi_length(buf + idx))
+    	RAISE(FORMAT_UNSUPPORTED);
+    idx += spgp_mpi_length(buf + idx) + 2;
+  }
+  key.mpiLength = idx - mpis;
+  if (NULL == spgp_keychain_add(&key, buf + mpis)) RAISE(KEYCHAIN_ERROR);
+}
+
+/**
+ * Open the snapshot cipher with its key, nonce and header.
+ */
+static gcry_cipher_hd_t spgp_snapshot_cipher(const uint8_t *key,
+                                             size_t keyLength,
+                                             const uint8_t *header) {
+	gcry_cipher_hd_t hd;
+
+	if (gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM,
+                       GCRY_CIPHER_SECURE) != 0)
+  	RAISE(GCRY_ERROR);
+  if (gcry_cipher_setkey(hd, key, keyLength) != 0 ||
+      gcry_cipher_setiv(hd, header + 24, SPGP_SNAPSHOT_NONCE_LEN) != 0 ||
+      gcry_cipher_authenticate(hd, header, SPGP_SNAPSHOT_HEADER_LEN) != 0) {
+  	gcry_cipher_close(hd);
+  	RAISE(GCRY_ERROR);
+  }
+  return hd;
+}
+
+static void spgp_snapshot_write(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+  ssize_t n;
+
+	while (len) {
+  	n = write(fd, p, len);
+    if (n < 0) {
+    	if (errno == EINTR) continue;
+      RAISE(IO_ERROR);
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static int spgp_snapshot_cmp_entry(const void *a, const void *b) {
+	return memcmp(a, b, 8 + SPGP_FINGERPRINT_LEN);
+}
+
+#else
+
+/**
+ * Fail a snapshot call.  Snapshots are sealed with libgcrypt's AES-256-GCM
+ * and their keys come from its random number generator.
+ */
+static uint8_t spgp_snapshot_unsupported(void) {
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	RAISE(FORMAT_UNSUPPORTED);
+  return -1;
+}
+
+#endif /* HAVE_GCRYPT */
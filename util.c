@@ -22,31 +22,40 @@
 
 #include "util.h"
 
-/*uint8_t spgp_pgp_to_gcrypt_symmetric_algo(uint8_t pgpalgo) {
-  switch (pgpalgo) {
-  case 1: return GCRY_CIPHER_IDEA;
-  case 2: return GCRY_CIPHER_3DES;
-  case 3: return GCRY_CIPHER_CAST5;
-  case 4: return GCRY_CIPHER_BLOWFISH;
-  case 7: return GCRY_CIPHER_AES128;
-  case 8: return GCRY_CIPHER_AES192;
-  case 9: return GCRY_CIPHER_AES256;
-  case 10:return GCRY_CIPHER_TWOFISH;
-  default: return 0xFF;
+uint8_t spgp_iv_length_for_symmetric_algo(uint8_t algo) {
+	switch (algo) {
+  	case SYM_ALGO_IDEA:
+    case SYM_ALGO_3DES:
+    case SYM_ALGO_CAST5:
+    case SYM_ALGO_BLOWFISH:
+    	return 8;
+    case SYM_ALGO_AES128:
+    case SYM_ALGO_AES192:
+    case SYM_ALGO_AES256:
+    case SYM_ALGO_TWOFISH:
+    	return 16;
+    default:
+    	return 0;
   }
-}*/
+}
 
-/*
-uint8_t spgp_iv_length_for_symmetric_algo(uint8_t algo) {
-	size_t ivlen = 0;
-	if (gcry_cipher_algo_info(spgp_pgp_to_gcrypt_symmetric_algo(algo), 
-  													GCRYCTL_GET_BLKLEN, 
-                            NULL, 
-                            &ivlen) != 0)
-  	RAISE(FORMAT_UNSUPPORTED);
-  return ivlen;
+uint8_t spgp_key_length_for_symmetric_algo(uint8_t algo) {
+	switch (algo) {
+  	case SYM_ALGO_IDEA:
+    case SYM_ALGO_CAST5:
+    case SYM_ALGO_BLOWFISH:
+    case SYM_ALGO_AES128:
+    	return 16;
+    case SYM_ALGO_3DES:
+    case SYM_ALGO_AES192:
+    	return 24;
+    case SYM_ALGO_AES256:
+    case SYM_ALGO_TWOFISH:
+    	return 32;
+    default:
+    	return 0;
+  }
 }
-*/
 
 uint8_t spgp_salt_length_for_hash_algo(uint8_t algo) {
 	if (algo == HASH_ALGO_SHA1) return 8;
@@ -54,3 +63,24 @@ uint8_t spgp_salt_length_for_hash_algo(uint8_t algo) {
   return 0;
 }
 
+uint8_t *spgp_put_be32(uint8_t *buf, uint32_t val) {
+	buf[0] = val >> 24;
+  buf[1] = val >> 16;
+  buf[2] = val >> 8;
+  buf[3] = val;
+  return buf + 4;
+}
+
+uint8_t *spgp_put_be64(uint8_t *buf, uint64_t val) {
+	spgp_put_be32(buf, val >> 32);
+  return spgp_put_be32(buf + 4, val);
+}
+
+uint32_t spgp_get_be32(const uint8_t *buf) {
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+  	((uint32_t)buf[2] << 8) | buf[3];
+}
+
+uint64_t spgp_get_be64(const uint8_t *buf) {
+	return ((uint64_t)spgp_get_be32(buf) << 32) | spgp_get_be32(buf + 4);
+}
@@ -24,11 +24,18 @@
 
 #include "packet_private.h"
 
-//uint8_t spgp_pgp_to_gcrypt_symmetric_algo(uint8_t pgpalgo);
-                            
-//uint8_t spgp_iv_length_for_symmetric_algo(uint8_t algo);
+// Block size of a cipher, or 0 if it isn't known
+uint8_t spgp_iv_length_for_symmetric_algo(uint8_t algo);
+
+// Key size of a cipher, or 0 if it isn't known
+uint8_t spgp_key_length_for_symmetric_algo(uint8_t algo);
 
 uint8_t spgp_salt_length_for_hash_algo(uint8_t algo);
 
+uint8_t *spgp_put_be32(uint8_t *buf, uint32_t val);
+uint8_t *spgp_put_be64(uint8_t *buf, uint64_t val);
+uint32_t spgp_get_be32(const uint8_t *buf);
+uint64_t spgp_get_be64(const uint8_t *buf);
+
 #define _UTIL_H
 #endif
@@ -0,0 +1,864 @@
+/*
+ *  verify.c
+ *  libsimplepgp
+ *
+ *  RSA and DSA signature verification.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "simplepgp.h"
+#include "packet_private.h"
+#include "keychain.h"
+#include "keystore.h"
+#include "mpi.h"
+#include "ecc.h"
+#include "verify.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**********************************************************************
+**
+** Types and constants
+**
+***********************************************************************/
+
+#define SPGP_VERIFY_MAX_THREADS 64
+
+// One-pass signatures that can be open at once, per thread
+#define SPGP_ONEPASS_MAX 8
+
+// One signature of a batch, with its key and a private copy of the hash
+typedef struct {
+	spgp_packet_t *sig;
+  spgp_packet_t *key;
+  spgp_sig_md_t md;
+  uint32_t err;
+} spgp_verify_job_t;
+
+typedef struct {
+	spgp_verify_job_t *jobs;
+  uint32_t count;
+  uint32_t next;
+  pthread_mutex_t mtx;
+} spgp_verify_pool_t;
+
+#ifdef HAVE_GCRYPT
+// Hash started by a one-pass signature packet, waiting for its signature
+typedef struct {
+	spgp_sig_md_t md;
+  uint8_t type;
+  uint8_t hashAlgo;
+  uint8_t asymAlgo;
+  uint8_t keyid[8];
+  uint8_t last;            // last byte hashed, for text canonicalization
+} spgp_onepass_hash_t;
+
+// Literal data is hashed into these as it is decoded.  They belong to the
+// decode running on this thread, not to any packet, so dropping or freeing
+// the one-pass packets can't leave them dangling.
+static __thread spgp_onepass_hash_t onepass_hashes[SPGP_ONEPASS_MAX];
+static __thread uint32_t onepass_count;
+#endif
+
+
+/**********************************************************************
+**
+** Static function prototypes
+**
+***********************************************************************/
+#pragma mark Static Function Prototypes
+
+#ifdef HAVE_GCRYPT
+static int spgp_gcrypt_hash_algo(uint8_t algo);
+
+static spgp_packet_t *spgp_signing_key(spgp_packet_t *keys, uint8_t *keyid);
+
+static void spgp_prepare_verify_key(spgp_public_pkt_t *pub);
+
+static gcry_sexp_t spgp_sig_data_sexp(spgp_signature_pkt_t *sig,
+                                      spgp_public_pkt_t *pub,
+                                      const uint8_t *digest);
+
+static gcry_sexp_t spgp_sig_value_sexp(spgp_signature_pkt_t *sig);
+#endif
+
+static void *spgp_verify_worker(void *arg);
+
+
+/**********************************************************************
+**
+** External function definitions
+**
+***********************************************************************/
+#pragma mark External Function Definitions
+
+uint8_t spgp_verify(spgp_packet_t *sig, spgp_packet_t *keys,
+                    const uint8_t *data, size_t len) {
+	spgp_sig_md_t md;
+  spgp_sig_status_t status;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    return -1;
+  }
+
+	if (NULL == sig || NULL == sig->header ||
+      sig->header->type != PKT_TYPE_SIGNATURE || NULL == sig->c.signature ||
+      (NULL == data && len))
+  	RAISE(INVALID_ARGS);
+
+	md = spgp_sig_hash_open(sig);
+  if (NULL == md) RAISE(FORMAT_UNSUPPORTED);
+  spgp_sig_hash_data(md, sig->c.signature->type, data, len);
+  status = spgp_check_signature(sig, keys, md);
+  spgp_sig_hash_close(md);
+
+	if (status != SPGP_SIG_GOOD) RAISE(spgp_sig_status_error(status));
+  return 0;
+}
+
+uint8_t spgp_verify_batch(spgp_packet_t **sigs, uint32_t count,
+                          spgp_packet_t *keys,
+                          const uint8_t *data, size_t len,
+                          uint32_t threads) {
+	spgp_verify_pool_t pool;
+  pthread_t tids[SPGP_VERIFY_MAX_THREADS];
+  spgp_sig_md_t shared[2] = { NULL, NULL }; // binary, canonical text
+  spgp_signature_pkt_t *sig;
+  uint32_t err = 0;
+  uint32_t started = 0;
+  uint32_t i;
+  int form;
+  long cpus;
+
+	memset(&pool, 0, sizeof(pool));
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    for (i = 0; pool.jobs && i < count; i++)
+    	if (pool.jobs[i].md) spgp_sig_hash_close(pool.jobs[i].md);
+    if (shared[0]) spgp_sig_hash_close(shared[0]);
+    if (shared[1]) spgp_sig_hash_close(shared[1]);
+    free(pool.jobs);
+    return -1;
+  }
+
+	if (NULL == sigs || 0 == count || (NULL == data && len))
+  	RAISE(INVALID_ARGS);
+  for (i = 0; i < count; i++) {
+  	if (NULL == sigs[i] || NULL == sigs[i]->header ||
+        sigs[i]->header->type != PKT_TYPE_SIGNATURE ||
+        NULL == sigs[i]->c.signature)
+      RAISE(INVALID_ARGS);
+  }
+
+	pool.jobs = malloc(sizeof(*pool.jobs) * count);
+  if (NULL == pool.jobs) RAISE(OUT_OF_MEMORY);
+  memset(pool.jobs, 0, sizeof(*pool.jobs) * count);
+  pool.count = count;
+
+	// Every hash algorithm in use is enabled on one handle per canonical
+  // form, so the data is read once (twice if there are text signatures)
+  // however many signatures there are.
+  for (i = 0; i < count; i++) spgp_sig_hash_share(shared, sigs[i]);
+  if (shared[0]) spgp_sig_hash_data(shared[0], SIG_TYPE_BINARY, data, len);
+  if (shared[1]) spgp_sig_hash_data(shared[1], SIG_TYPE_TEXT, data, len);
+
+	// Keys are looked up, and their gcrypt contexts built, before any
+  // threads start, so the threads only read shared state.
+  for (i = 0; i < count; i++) {
+  	sig = sigs[i]->c.signature;
+  	pool.jobs[i].sig = sigs[i];
+    if (sig->status == SPGP_SIG_UNSUPPORTED) continue;
+    pool.jobs[i].key = spgp_sig_prepare(sigs[i], keys);
+    if (NULL == pool.jobs[i].key) continue;
+    form = sig->type == SIG_TYPE_TEXT;
+    pool.jobs[i].md = spgp_sig_hash_copy(shared[form]);
+  }
+  spgp_sig_hash_close(shared[0]);
+  spgp_sig_hash_close(shared[1]);
+  shared[0] = shared[1] = NULL;
+  if (pthread_mutex_init(&pool.mtx, NULL)) RAISE(GENERIC_ERROR);
+
+	if (0 == threads) {
+  	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  if (threads > SPGP_VERIFY_MAX_THREADS) threads = SPGP_VERIFY_MAX_THREADS;
+  if (threads > count) threads = count;
+
+	// This thread verifies alongside the ones started here.  That replaces
+  // our exception handler, so nothing below may RAISE().
+  for (i = 1; i < threads; i++) {
+  	if (pthread_create(&tids[started], NULL, spgp_verify_worker, &pool))
+    	break;
+    started++;
+  }
+  spgp_verify_worker(&pool);
+  for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&pool.mtx);
+
+	for (i = 0; i < count; i++) {
+  	if (pool.jobs[i].md) spgp_sig_hash_close(pool.jobs[i].md);
+    if (err) continue;
+    if (pool.jobs[i].err) err = pool.jobs[i].err;
+    else if (sigs[i]->c.signature->status != SPGP_SIG_GOOD)
+    	err = spgp_sig_status_error(sigs[i]->c.signature->status);
+  }
+  free(pool.jobs);
+
+	if (err) {
+  	pthread_mutex_lock(&spgp_mtx);
+    _spgp_err = err;
+    pthread_mutex_unlock(&spgp_mtx);
+    return -1;
+  }
+  return 0;
+}
+
+spgp_sig_status_t spgp_signature_status(spgp_packet_t *sig) {
+	if (NULL == sig || NULL == sig->header ||
+      sig->header->type != PKT_TYPE_SIGNATURE || NULL == sig->c.signature)
+  	return SPGP_SIG_UNCHECKED;
+  return sig->c.signature->status;
+}
+
+
+/**********************************************************************
+**
+** Library-internal function definitions
+**
+***********************************************************************/
+#pragma mark Library-internal Function Definitions
+
+/**
+ * Error code for a signature that did not verify.
+ */
+uint32_t spgp_sig_status_error(spgp_sig_status_t status) {
+	switch (status) {
+  	case SPGP_SIG_NO_KEY:      return KEY_NOT_FOUND;
+    case SPGP_SIG_UNSUPPORTED: return FORMAT_UNSUPPORTED;
+    default:                   return BAD_SIGNATURE;
+  }
+}
+
+#ifdef HAVE_GCRYPT
+
+/**
+ * Start the hash for signature |sig|.
+ *
+ * @return New hash handle, or NULL if the signature type or hash algorithm
+ *         is not supported (|sig| is then marked SPGP_SIG_UNSUPPORTED)
+ */
+spgp_sig_md_t spgp_sig_hash_open(spgp_packet_t *sig) {
+	spgp_signature_pkt_t *s = sig->c.signature;
+	spgp_sig_md_t md;
+  int algo;
+
+	algo = spgp_gcrypt_hash_algo(s->hashAlgo);
+	if (algo == 0 || (s->type != SIG_TYPE_BINARY && s->type != SIG_TYPE_TEXT)) {
+  	Serial.printf("Unsupported signature type 0x%X, hash %u\n",
+    	s->type, s->hashAlgo);
+  	s->status = SPGP_SIG_UNSUPPORTED;
+    return NULL;
+  }
+  if (gcry_md_open(&md, algo, 0) != 0) RAISE(GCRY_ERROR);
+  return md;
+}
+
+void spgp_sig_hash_write(spgp_sig_md_t md, const void *data, size_t len) {
+	gcry_md_write(md, data, len);
+}
+
+/**
+ * Copy a hash, so the copy can be finished while |md| goes on.
+ */
+spgp_sig_md_t spgp_sig_hash_copy(spgp_sig_md_t md) {
+	spgp_sig_md_t copy;
+
+	if (gcry_md_copy(&copy, md) != 0) RAISE(GCRY_ERROR);
+  return copy;
+}
+
+void spgp_sig_hash_close(spgp_sig_md_t md) {
+	gcry_md_close(md);
+}
+
+/**
+ * Hash signed data, given in one piece, the way a signature of type
+ * |sig_type| covers it.
+ */
+void spgp_sig_hash_data(spgp_sig_md_t md, uint8_t sig_type,
+                        const uint8_t *data, size_t len) {
+	uint8_t last = 0;
+
+	spgp_sig_hash_update(md, sig_type, data, len, &last);
+}
+
+/**
+ * Hash one piece of signed data the way a signature of type |sig_type|
+ * covers it.
+ *
+ * Text signatures are made over the data with every line ending as CR LF,
+ * so bare LFs are hashed as CR LF.  |last| carries the previous piece's
+ * final byte, so a CR LF split between pieces isn't doubled.
+ */
+void spgp_sig_hash_update(spgp_sig_md_t md, uint8_t sig_type,
+                          const uint8_t *data, size_t len, uint8_t *last) {
+	const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  const uint8_t *nl;
+
+	if (sig_type != SIG_TYPE_TEXT) {
+  	gcry_md_write(md, data, len);
+    return;
+  }
+  if (len == 0) return;
+
+	while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+  	if ((nl > data ? nl[-1] : *last) == '\r') {
+    	gcry_md_write(md, p, nl - p + 1);
+    }
+    else {
+    	gcry_md_write(md, p, nl - p);
+      gcry_md_write(md, "\r\n", 2);
+    }
+    p = nl + 1;
+  }
+  gcry_md_write(md, p, end - p);
+  *last = end[-1];
+}
+
+/**
+ * Add |sig|'s hash algorithm to the hash shared by signatures of its form.
+ *
+ * |shared| holds one handle for binary and one for canonical text
+ * signatures, opened as needed, so the data is hashed once per form however
+ * many signatures cover it.
+ *
+ * @return 0, or -1 if |sig| can't be checked (it is then marked
+ *         SPGP_SIG_UNSUPPORTED)
+ */
+uint8_t spgp_sig_hash_share(spgp_sig_md_t shared[2], spgp_packet_t *sig) {
+	spgp_signature_pkt_t *s = sig->c.signature;
+  int form;
+
+	s->status = SPGP_SIG_UNSUPPORTED;
+  if (s->type != SIG_TYPE_BINARY && s->type != SIG_TYPE_TEXT) return -1;
+  if (spgp_gcrypt_hash_algo(s->hashAlgo) == 0) return -1;
+  s->status = SPGP_SIG_UNCHECKED;
+  form = s->type == SIG_TYPE_TEXT;
+  if (NULL == shared[form] && gcry_md_open(&shared[form], 0, 0) != 0)
+  	RAISE(GCRY_ERROR);
+  if (gcry_md_enable(shared[form], spgp_gcrypt_hash_algo(s->hashAlgo)))
+  	RAISE(GCRY_ERROR);
+  return 0;
+}
+
+/**
+ * Find the key that made |sig| and get it ready to verify with.
+ *
+ * |keys| is searched first, then the keychain.  The key's gcrypt context is
+ * built here and kept in the key, so later signatures by the same key reuse
+ * it.
+ *
+ * @return The key, or NULL if |sig| can't be checked (its status says why)
+ */
+spgp_packet_t *spgp_sig_prepare(spgp_packet_t *sig, spgp_packet_t *keys) {
+	spgp_signature_pkt_t *s = sig->c.signature;
+	spgp_packet_t *key;
+  const spgp_ecc_curve_t *curve;
+
+	if (!s->hasIssuer ||
+      (key = spgp_signing_key(keys, s->issuer)) == NULL) {
+  	s->status = SPGP_SIG_NO_KEY;
+    return NULL;
+  }
+  if (key->c.pub->asymAlgo != s->asymAlgo &&
+      !(key->c.pub->asymAlgo == ASYM_ALGO_RSA &&
+        s->asymAlgo == ASYM_ALGO_RSA_SIGN)) {
+  	s->status = SPGP_SIG_BAD;
+    return NULL;
+  }
+  if (s->asymAlgo != ASYM_ALGO_RSA && s->asymAlgo != ASYM_ALGO_RSA_SIGN &&
+      s->asymAlgo != ASYM_ALGO_DSA && s->asymAlgo != ASYM_ALGO_EDDSA) {
+  	s->status = SPGP_SIG_UNSUPPORTED;
+    return NULL;
+  }
+  // Ed25519 is the only EdDSA curve
+  if (s->asymAlgo == ASYM_ALGO_EDDSA &&
+      ((curve = spgp_ecc_curve(key->c.pub->mpiHead->data)) == NULL ||
+       curve->id != SPGP_CURVE_ED25519)) {
+  	s->status = SPGP_SIG_UNSUPPORTED;
+    return NULL;
+  }
+  spgp_prepare_verify_key(key->c.pub);
+  return key;
+}
+
+/**
+ * Finish the hash of |sig| and check it with |key|.
+ *
+ * |md| must already hold the signed data; the signature's hashed fields and
+ * trailer are added to it, so it can't be used afterwards except to close
+ * it.  Only reads |key|, so several threads can verify with one key.
+ *
+ * @return Status, which is also stored in |sig|
+ */
+spgp_sig_status_t spgp_sig_finish(spgp_packet_t *sig, spgp_packet_t *key,
+                                  spgp_sig_md_t md) {
+	spgp_signature_pkt_t *s = sig->c.signature;
+  gcry_sexp_t sexp_data = NULL;
+  gcry_sexp_t sexp_sig = NULL;
+  uint8_t trailer[6];
+  uint8_t *digest;
+  gcry_error_t rc;
+
+	/* RFC 4880 - 5.2.4
+   V4 signatures also hash in a final trailer of six octets: the
+   version of the Signature packet, i.e., 0x04; 0xFF; and a four-octet,
+   big-endian number that is the length of the hashed data from the
+   Signature packet (note that this number does not include these final
+   six octets).*/
+  gcry_md_write(md, s->hashed, s->hashedLen);
+  trailer[0] = s->version;
+  trailer[1] = 0xFF;
+  spgp_put_be32(trailer+2, s->hashedLen);
+  gcry_md_write(md, trailer, sizeof(trailer));
+  gcry_md_final(md);
+  digest = gcry_md_read(md, spgp_gcrypt_hash_algo(s->hashAlgo));
+
+	// The packet carries the first two bytes of the hash, so a mismatch is
+  // caught without a public-key operation.
+  if (((digest[0] << 8) | digest[1]) != s->hashTest) {
+  	Serial.printf("Hash test mismatch\n");
+  	s->status = SPGP_SIG_BAD;
+    return s->status;
+  }
+
+	sexp_data = spgp_sig_data_sexp(s, key->c.pub, digest);
+  sexp_sig = spgp_sig_value_sexp(s);
+  if (NULL == sexp_data || NULL == sexp_sig) {
+  	if (sexp_data) gcry_sexp_release(sexp_data);
+    if (sexp_sig) gcry_sexp_release(sexp_sig);
+    RAISE(GCRY_ERROR);
+  }
+  rc = gcry_pk_verify(sexp_sig, sexp_data, key->c.pub->verifyKey);
+  gcry_sexp_release(sexp_data);
+  gcry_sexp_release(sexp_sig);
+
+	s->status = rc == 0 ? SPGP_SIG_GOOD : SPGP_SIG_BAD;
+  return s->status;
+}
+
+/**
+ * Check |sig| against the data already hashed into |md|.
+ *
+ * |md| is copied, not finished, so the caller can check other signatures
+ * made with the same hash algorithm against it.
+ *
+ * @return Status, which is also stored in |sig|
+ */
+spgp_sig_status_t spgp_check_signature(spgp_packet_t *sig,
+                                       spgp_packet_t *keys,
+                                       spgp_sig_md_t md) {
+	spgp_packet_t *key;
+  spgp_sig_md_t copy;
+  spgp_sig_status_t status;
+
+	if ((key = spgp_sig_prepare(sig, keys)) == NULL)
+  	return sig->c.signature->status;
+  copy = spgp_sig_hash_copy(md);
+  status = spgp_sig_finish(sig, key, copy);
+  spgp_sig_hash_close(copy);
+  return status;
+}
+
+/**
+ * Start hashing literal data for the one-pass signature |onepass|.
+ *
+ * The hash is kept until spgp_onepass_take() hands it to the signature
+ * packet that closes the one-pass signature.  Unsupported signatures, and
+ * any past SPGP_ONEPASS_MAX, are left for the signature packet to report.
+ */
+void spgp_onepass_begin(spgp_onepass_pkt_t *onepass) {
+	spgp_onepass_hash_t *op;
+  int algo;
+
+	algo = spgp_gcrypt_hash_algo(onepass->hashAlgo);
+	if (algo == 0 || (onepass->type != SIG_TYPE_BINARY &&
+                    onepass->type != SIG_TYPE_TEXT))
+  	return;
+  if (onepass_count == SPGP_ONEPASS_MAX) {
+  	Serial.printf("Too many one-pass signatures\n");
+    return;
+  }
+
+	op = &onepass_hashes[onepass_count];
+  memset(op, 0, sizeof(*op));
+  if (gcry_md_open(&op->md, algo, 0) != 0) RAISE(GCRY_ERROR);
+  op->type = onepass->type;
+  op->hashAlgo = onepass->hashAlgo;
+  op->asymAlgo = onepass->asymAlgo;
+  memcpy(op->keyid, onepass->keyid, sizeof(op->keyid));
+  onepass_count++;
+}
+
+/**
+ * Hash the next piece of literal data into every open one-pass signature.
+ */
+void spgp_onepass_hash(const uint8_t *data, size_t len) {
+	uint32_t i;
+
+	for (i = 0; i < onepass_count; i++) {
+  	spgp_sig_hash_update(onepass_hashes[i].md, onepass_hashes[i].type,
+                         data, len, &onepass_hashes[i].last);
+  }
+}
+
+/**
+ * Remove and return the one-pass hash that signature |sig| closes.
+ *
+ * One-pass signatures nest, so the most recent match is the right one.
+ *
+ * @return Hash of the literal data, which the caller must close, or NULL
+ *         if |sig| didn't follow a matching one-pass packet
+ */
+spgp_sig_md_t spgp_onepass_take(spgp_signature_pkt_t *sig) {
+	spgp_onepass_hash_t *op;
+  spgp_sig_md_t md;
+  uint32_t i;
+
+	for (i = onepass_count; i-- > 0;) {
+  	op = &onepass_hashes[i];
+    if (op->type != sig->type || op->hashAlgo != sig->hashAlgo ||
+        op->asymAlgo != sig->asymAlgo)
+    	continue;
+    if (sig->hasIssuer && memcmp(op->keyid, sig->issuer, 8) != 0) continue;
+    md = op->md;
+    memmove(op, op + 1, (onepass_count - i - 1) * sizeof(*op));
+    onepass_count--;
+    return md;
+  }
+  return NULL;
+}
+
+/**
+ * Drop any one-pass hashes left on this thread by the last decode.
+ */
+void spgp_onepass_reset(void) {
+	while (onepass_count) gcry_md_close(onepass_hashes[--onepass_count].md);
+}
+
+/**
+ * Free the gcrypt public key built for |pub|, if any.
+ */
+void spgp_sig_key_release(spgp_public_pkt_t *pub) {
+	if (NULL == pub->verifyKey) return;
+  gcry_sexp_release(pub->verifyKey);
+  pub->verifyKey = NULL;
+}
+
+#else
+
+/* Without libgcrypt no signature can be checked.  Each one is marked
+   SPGP_SIG_UNSUPPORTED as it is looked at, and no hash is ever opened, so
+   nothing is left to pass one to the functions below. */
+
+spgp_sig_md_t spgp_sig_hash_open(spgp_packet_t *sig) {
+	sig->c.signature->status = SPGP_SIG_UNSUPPORTED;
+  return NULL;
+}
+
+void spgp_sig_hash_write(spgp_sig_md_t md, const void *data, size_t len) {
+	(void)md; (void)data; (void)len;
+}
+
+spgp_sig_md_t spgp_sig_hash_copy(spgp_sig_md_t md) {
+	(void)md;
+  return NULL;
+}
+
+void spgp_sig_hash_close(spgp_sig_md_t md) {
+	(void)md;
+}
+
+void spgp_sig_hash_data(spgp_sig_md_t md, uint8_t sig_type,
+                        const uint8_t *data, size_t len) {
+	(void)md; (void)sig_type; (void)data; (void)len;
+}
+
+void spgp_sig_hash_update(spgp_sig_md_t md, uint8_t sig_type,
+                          const uint8_t *data, size_t len, uint8_t *last) {
+	(void)md; (void)sig_type; (void)data; (void)len; (void)last;
+}
+
+uint8_t spgp_sig_hash_share(spgp_sig_md_t shared[2], spgp_packet_t *sig) {
+	(void)shared;
+  sig->c.signature->status = SPGP_SIG_UNSUPPORTED;
+  return -1;
+}
+
+spgp_packet_t *spgp_sig_prepare(spgp_packet_t *sig, spgp_packet_t *keys) {
+	(void)keys;
+  sig->c.signature->status = SPGP_SIG_UNSUPPORTED;
+  return NULL;
+}
+
+spgp_sig_status_t spgp_sig_finish(spgp_packet_t *sig, spgp_packet_t *key,
+                                  spgp_sig_md_t md) {
+	(void)key; (void)md;
+  sig->c.signature->status = SPGP_SIG_UNSUPPORTED;
+  return SPGP_SIG_UNSUPPORTED;
+}
+
+spgp_sig_status_t spgp_check_signature(spgp_packet_t *sig,
+                                       spgp_packet_t *keys,
+                                       spgp_sig_md_t md) {
+	(void)keys; (void)md;
+  sig->c.signature->status = SPGP_SIG_UNSUPPORTED;
+  return SPGP_SIG_UNSUPPORTED;
+}
+
+void spgp_sig_key_release(spgp_public_pkt_t *pub) {
+	(void)pub;
+}
+
+void spgp_onepass_begin(spgp_onepass_pkt_t *onepass) {
+	(void)onepass;
+}
+
+void spgp_onepass_hash(const uint8_t *data, size_t len) {
+	(void)data; (void)len;
+}
+
+spgp_sig_md_t spgp_onepass_take(spgp_signature_pkt_t *sig) {
+	sig->status = SPGP_SIG_UNSUPPORTED;
+  return NULL;
+}
+
+void spgp_onepass_reset(void) {
+}
+
+#endif /* HAVE_GCRYPT */
+
+
+/**********************************************************************
+**
+** Static function definitions
+**
+***********************************************************************/
+#pragma mark Static Function Definitions
+
+#ifdef HAVE_GCRYPT
+
+/**
+ * Map an OpenPGP hash algorithm to gcrypt's.  0 if unsupported.
+ */
+static int spgp_gcrypt_hash_algo(uint8_t algo) {
+	switch (algo) {
+  	case HASH_ALGO_SHA1:      return GCRY_MD_SHA1;
+    case HASH_ALGO_RIPEMD160: return GCRY_MD_RMD160;
+    case HASH_ALGO_SHA224:    return GCRY_MD_SHA224;
+    case HASH_ALGO_SHA256:    return GCRY_MD_SHA256;
+    case HASH_ALGO_SHA384:    return GCRY_MD_SHA384;
+    case HASH_ALGO_SHA512:    return GCRY_MD_SHA512;
+    default:                  return 0;
+  }
+}
+
+/**
+ * Find the public or secret (sub)key with key ID |keyid| in |keys|, or
+ * failing that, in the keychain.
+ */
+static spgp_packet_t *spgp_signing_key(spgp_packet_t *keys, uint8_t *keyid) {
+	spgp_packet_t *cur;
+
+	for (cur = keys; cur != NULL; cur = cur->next) {
+  	switch (cur->header->type) {
+    	case PKT_TYPE_PUBLIC_KEY:
+      case PKT_TYPE_PUBLIC_SUBKEY:
+      case PKT_TYPE_SECRET_KEY:
+      case PKT_TYPE_SECRET_SUBKEY:
+      	if (memcmp(spgp_key_fingerprint(cur)+12, keyid, 8) == 0) return cur;
+        break;
+      default:
+      	break;
+    }
+  }
+  if ((cur = spgp_keychain_public_key_with_id(keyid)) != NULL) return cur;
+  return spgp_keystore_attached_key(keyid);
+}
+
+/**
+ * Build the gcrypt public key for |pub|, unless it already has one.
+ */
+static void spgp_prepare_verify_key(spgp_public_pkt_t *pub) {
+	gcry_mpi_t mpis[SPGP_MAX_PUBLIC_MPIS];
+  // Built here, as the packet is packed and its member may be unaligned
+  gcry_sexp_t key = NULL;
+  spgp_mpi_t *cur;
+  uint8_t count;
+  gcry_error_t rc;
+  int i;
+
+	if (pub->verifyKey) return;
+
+	// The point is used as it is, and needs no MPI
+	if (pub->asymAlgo == ASYM_ALGO_EDDSA) {
+  	cur = pub->mpiHead->next;
+    if (gcry_sexp_build(&key, NULL,
+                        "(public-key (ecc (curve Ed25519) (flags eddsa) "
+                        "(q %b)))", (int)cur->count, cur->data + 2) != 0)
+      RAISE(GCRY_ERROR);
+    pub->verifyKey = key;
+    return;
+  }
+
+	count = spgp_public_mpi_count(pub->asymAlgo);
+  memset(mpis, 0, sizeof(mpis));
+  for (cur = pub->mpiHead, i = 0; cur != NULL && i < count;
+       cur = cur->next, i++) {
+  	if (gcry_mpi_scan(&mpis[i], GCRYMPI_FMT_PGP, cur->data, cur->count+2,
+                      NULL) != 0)
+    	break;
+  }
+
+	if (i < count)
+  	rc = GPG_ERR_BAD_MPI;
+  else if (pub->asymAlgo == ASYM_ALGO_DSA)
+  	rc = gcry_sexp_build(&key, NULL,
+                         "(public-key (dsa (p %m) (q %m) (g %m) (y %m)))",
+                         mpis[0], mpis[1], mpis[2], mpis[3]);
+  else
+  	rc = gcry_sexp_build(&key, NULL,
+                         "(public-key (rsa (n %m) (e %m)))",
+                         mpis[0], mpis[1]);
+
+	for (i = 0; i < SPGP_MAX_PUBLIC_MPIS; i++) gcry_mpi_release(mpis[i]);
+  if (rc != 0) RAISE(GCRY_ERROR);
+  pub->verifyKey = key;
+}
+
+/**
+ * Wrap |digest| for gcry_pk_verify(): PKCS#1 encoded for RSA, and cut to
+ * the size of q for DSA.
+ */
+static gcry_sexp_t spgp_sig_data_sexp(spgp_signature_pkt_t *sig,
+                                      spgp_public_pkt_t *pub,
+                                      const uint8_t *digest) {
+	int algo = spgp_gcrypt_hash_algo(sig->hashAlgo);
+  size_t dlen = gcry_md_get_algo_dlen(algo);
+  gcry_sexp_t sexp = NULL;
+  gcry_mpi_t value = NULL;
+  size_t qlen;
+
+	// Ed25519 signs the digest itself, hashing it again with SHA-512
+	if (sig->asymAlgo == ASYM_ALGO_EDDSA) {
+  	if (gcry_sexp_build(&sexp, NULL,
+                        "(data (flags eddsa) (hash-algo sha512) (value %b))",
+                        (int)dlen, digest) != 0)
+    	return NULL;
+    return sexp;
+  }
+
+	if (sig->asymAlgo != ASYM_ALGO_DSA) {
+  	if (gcry_sexp_build(&sexp, NULL, "(data (flags pkcs1) (hash %s %b))",
+                        gcry_md_algo_name(algo), (int)dlen, digest) != 0)
+    	return NULL;
+    return sexp;
+  }
+
+	qlen = (pub->mpiHead->next->bits + 7) / 8;
+  if (dlen > qlen) dlen = qlen;
+  if (gcry_mpi_scan(&value, GCRYMPI_FMT_USG, digest, dlen, NULL) != 0)
+  	return NULL;
+  if (gcry_sexp_build(&sexp, NULL, "(data (flags raw) (value %m))", value))
+  	sexp = NULL;
+  gcry_mpi_release(value);
+  return sexp;
+}
+
+/**
+ * Wrap the signature MPIs of |sig| for gcry_pk_verify().
+ */
+static gcry_sexp_t spgp_sig_value_sexp(spgp_signature_pkt_t *sig) {
+	gcry_mpi_t r = NULL, s = NULL;
+  gcry_sexp_t sexp = NULL;
+  spgp_mpi_t *m = sig->mpiHead;
+  uint8_t rs[64];
+
+	// EdDSA's r and s are 32 byte strings, which lose their leading zeros
+  // as MPIs
+	if (sig->asymAlgo == ASYM_ALGO_EDDSA) {
+  	if (NULL == m || NULL == m->next || m->count > 32 || m->next->count > 32)
+    	return NULL;
+    memset(rs, 0, sizeof(rs));
+    memcpy(rs + 32 - m->count, m->data + 2, m->count);
+    memcpy(rs + 64 - m->next->count, m->next->data + 2, m->next->count);
+    if (gcry_sexp_build(&sexp, NULL, "(sig-val (eddsa (r %b) (s %b)))",
+                        32, rs, 32, rs + 32) != 0)
+    	return NULL;
+    return sexp;
+  }
+
+	if (NULL == m ||
+      gcry_mpi_scan(&r, GCRYMPI_FMT_PGP, m->data, m->count+2, NULL) != 0)
+  	return NULL;
+
+	if (sig->asymAlgo == ASYM_ALGO_DSA) {
+  	if (NULL == m->next ||
+        gcry_mpi_scan(&s, GCRYMPI_FMT_PGP, m->next->data, m->next->count+2,
+                      NULL) != 0 ||
+        gcry_sexp_build(&sexp, NULL, "(sig-val (dsa (r %m) (s %m)))", r, s))
+    	sexp = NULL;
+  }
+  else if (gcry_sexp_build(&sexp, NULL, "(sig-val (rsa (s %m)))", r)) {
+  	sexp = NULL;
+  }
+  gcry_mpi_release(r);
+  gcry_mpi_release(s);
+  return sexp;
+}
+
+#endif /* HAVE_GCRYPT */
+
+/**
+ * Finish signatures from |arg|'s pool until none are left.
+ */
+static void *spgp_verify_worker(void *arg) {
+	spgp_verify_pool_t *pool = arg;
+  spgp_verify_job_t * volatile job;
+
+	if (setjmp(exception)) {
+  	Serial.printf("Exception (0x%x)\n",_spgp_err);
+    job->err = _spgp_err;
+  }
+
+	while (1) {
+  	pthread_mutex_lock(&pool->mtx);
+    job = pool->next < pool->count ? &pool->jobs[pool->next++] : NULL;
+    pthread_mutex_unlock(&pool->mtx);
+    if (NULL == job) break;
+    if (job->md) spgp_sig_finish(job->sig, job->key, job->md);
+  }
+  return NULL;
+}
@@ -0,0 +1,73 @@
+/*
+ *  verify.h
+ *  libsimplepgp
+ *
+ *  Signature verification.
+ *
+ *  Copyright 2011 Trevor Bentley
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _VERIFY_H
+
+#include "packet_private.h"
+
+// Signatures are checked with libgcrypt.  Built without it, no hash is ever
+// opened and every signature is SPGP_SIG_UNSUPPORTED.
+#ifdef HAVE_GCRYPT
+typedef gcry_md_hd_t spgp_sig_md_t;
+#else
+typedef void *spgp_sig_md_t;
+#endif
+
+spgp_sig_md_t spgp_sig_hash_open(spgp_packet_t *sig);
+
+void spgp_sig_hash_write(spgp_sig_md_t md, const void *data, size_t len);
+
+spgp_sig_md_t spgp_sig_hash_copy(spgp_sig_md_t md);
+
+void spgp_sig_hash_close(spgp_sig_md_t md);
+
+void spgp_sig_hash_data(spgp_sig_md_t md, uint8_t sig_type,
+                        const uint8_t *data, size_t len);
+
+void spgp_sig_hash_update(spgp_sig_md_t md, uint8_t sig_type,
+                          const uint8_t *data, size_t len, uint8_t *last);
+
+uint8_t spgp_sig_hash_share(spgp_sig_md_t shared[2], spgp_packet_t *sig);
+
+spgp_packet_t *spgp_sig_prepare(spgp_packet_t *sig, spgp_packet_t *keys);
+
+spgp_sig_status_t spgp_sig_finish(spgp_packet_t *sig, spgp_packet_t *key,
+                                  spgp_sig_md_t md);
+
+spgp_sig_status_t spgp_check_signature(spgp_packet_t *sig,
+                                       spgp_packet_t *keys,
+                                       spgp_sig_md_t md);
+
+void spgp_sig_key_release(spgp_public_pkt_t *pub);
+
+uint32_t spgp_sig_status_error(spgp_sig_status_t status);
+
+void spgp_onepass_begin(spgp_onepass_pkt_t *onepass);
+
+void spgp_onepass_hash(const uint8_t *data, size_t len);
+
+spgp_sig_md_t spgp_onepass_take(spgp_signature_pkt_t *sig);
+
+void spgp_onepass_reset(void);
+
+#define _VERIFY_H
+#endif